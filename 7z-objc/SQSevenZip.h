@@ -5,22 +5,22 @@
 //  Created by Qoyllur on 11/5/10.
 //  Copyright 2010 Qoyllur. All rights reserved.
 //
+// Read-only file system on a 7z archive, the delegate for GMUserFileSystem
+// like ArchiveFileSystem. The work is done by the C code in sevenzipfs.c.
+//
 
 #import <Cocoa/Cocoa.h>
+#import "MinimalFileSystem.h"
+#import "sevenzipfs.h"
 
-struct sq_seven_zip_implementation;
-
-@interface SQSevenZip : NSObject {
+@interface SQSevenZip : MinimalFileSystem {
 
-	struct sq_seven_zip_implementation *impl;
-	
-	NSString *fileName;
+	sevenzip_fs_t fs;
 	
 }
 
-@property (retain, nonatomic) NSString* fileName;
-
--(SQSevenZip*)initWithFile:(NSString*)aFileName;
+// nil if the file is not a 7z archive this code can read
+- (id)initWithPath:(NSString*)archivePath mountPoint:(NSString*)mountPoint;
 	-(void)dealloc;
 
 @end
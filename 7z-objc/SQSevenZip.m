@@ -6,105 +6,178 @@
 //  Copyright 2010 Qoyllur. All rights reserved.
 //
 
+#import <sys/xattr.h>
+#import <sys/stat.h>
 #import "SQSevenZip.h"
+#import <MacFUSE/MacFUSE.h>
 
-#import "../7z/Archive/7z/7zIn.h"
-#include "../7z/Archive/7z/7zAlloc.h"
-#include "../7z/7zCrc.h"
-#include "../7z/7zFile.h"
+// collects the entries sz_readdir() lists, buf is the SQSevenZip
+struct sq_listing {
+	SQSevenZip *fileSystem;
+	NSString *path;
+	NSMutableArray *entries;
+};
+
+static int
+sq_fill_dir(void *buf, const char *name, const struct stat *st, off_t offset) {
+	struct sq_listing *listing = buf;
+	(void) offset;
+	if (strcmp(".", name) && strcmp("..", name)) {
+		NSString *entry = [NSString stringWithUTF8String:name];
+		[listing->entries addObject:entry];
+		[listing->fileSystem cacheAttributes:[listing->fileSystem attributesWithStat:st]
+								ofItemAtPath:[listing->path stringByAppendingPathComponent:entry]];
+	}
+	return 0;
+}
 
+@implementation SQSevenZip
 
-struct sq_seven_zip_implementation {
+- (id)initWithPath:(NSString *)archivePath mountPoint:(NSString *)mtpt {
 	
-	CFileInStream archiveStream;
-	CLookToRead lookStream;
-	CSzArEx db;
-	ISzAlloc allocImp;
-	ISzAlloc allocTempImp;
+	if (self = [super initWithPath:archivePath mountPoint:mtpt]) {
+		sevenzip_fs_options options;
+		sz_default_options(&options);
+		// decoded solid blocks kept for reads of the other files in them
+		NSInteger cacheMegabytes = [[NSUserDefaults standardUserDefaults] integerForKey:@"SevenZipCacheMegabytes"];
+		if (cacheMegabytes > 0)
+			options.foldercache = (size_t)cacheMegabytes << 20;
+		// decoder states for going back in larger blocks, 0 turns them off
+		if ([[NSUserDefaults standardUserDefaults] objectForKey:@"SevenZipCheckpointMegabytes"])
+			options.checkpointmem = (size_t)MAX([[NSUserDefaults standardUserDefaults] integerForKey:@"SevenZipCheckpointMegabytes"], 0) << 20;
+		int res = sz_init_with_options(&fs, [archivePath fileSystemRepresentation], &options);
+		if (res) {
+			NSLog(@"could not open %@ as 7z archive: %s", archivePath, strerror(-res));
+			[self release];
+			self = nil;
+		}
+	}
 	
-};
+	return self;
+}
 
-@implementation SQSevenZip
+- (void)dealloc {
+	sz_free(&fs);
+	[super dealloc];
+}
 
-@synthesize fileName;
+#pragma mark Directory Contents
 
--(SQSevenZip*)initWithFile:(NSString*)aFileName {
+- (NSArray *)contentsOfDirectoryAtPath:(NSString *)path error:(NSError **)error {
 	
-	self = [super init];
+	struct sq_listing listing;
+	listing.fileSystem = self;
+	listing.path = path;
+	listing.entries = [[[NSMutableArray alloc] init] autorelease];
 	
-	if (self) {
+	// the listing comes with the attributes, keep them for the lookups that
+	// usually follow it
+	int res = sz_readdir(&fs, [path fileSystemRepresentation], &listing, sq_fill_dir, 0);
+	if (error)
+		*error = [NSError errorWithPOSIXCode:-res];
 	
-		impl = malloc(sizeof(struct sq_seven_zip_implementation));
-		
-		if (impl) {
-		
-			[self setFileName:aFileName];
-		
-			if (!InFile_Open(&impl->archiveStream.file, [[self fileName] fileSystemRepresentation])) {
-				
-				FileInStream_CreateVTable(&impl->archiveStream);
-				LookToRead_CreateVTable(&impl->lookStream, False);
-				
-				impl->lookStream.realStream = &impl->archiveStream.s;
-				LookToRead_Init(&impl->lookStream);
-				
-				impl->allocImp.Alloc = SzAlloc;
-				impl->allocImp.Free = SzFree;
-				
-				impl->allocTempImp.Alloc = SzAllocTemp;
-				impl->allocTempImp.Free = SzFreeTemp;
-				
-				CrcGenerateTable();
-
-				SzArEx_Init(&impl->db);
-				
-				SRes res = SzArEx_Open(&impl->db, &impl->lookStream.s, &impl->allocImp, &impl->allocTempImp);
-				if (res != SZ_OK) {
-					SzArEx_Free(&impl->db, &impl->allocImp);
-					File_Close(&impl->archiveStream.file);
-					free(impl);
-					impl = NULL;
-					[self release];
-					self = nil;
-				} else {
-					UInt32 i;
-					for (i = 0; i < impl->db.db.NumFiles; i++) {
-						
-						CSzFileItem *f = impl->db.db.Files + i;
-						NSLog(@"{%s}", f->Name);
-					}
-				}
-				
-			}
-			else {
-				NSLog(@"could not open file %@", [self fileName]);
-				free(impl);
-				impl = NULL;
-				[self release];
-				self = nil;
-			}
-		} else {
-			[self release];
-			self = nil;
-		}
-		
-	}
+	if (res)
+		return nil;
+	return listing.entries;
+}
 
-	return self;
+#pragma mark Getting and Setting Attributes
+
+- (NSDictionary *)attributesOfItemAtPath:(NSString *)path
+                                userData:(id)userData
+                                   error:(NSError **)error {
+	
+	NSDictionary *attrs = [self cachedAttributesOfItemAtPath:path];
+	if (attrs) {
+		if (error)
+			*error = [NSError errorWithPOSIXCode:0];
+		return attrs;
+	}
 	
+	struct stat st;
+	int res = sz_getattr(&fs, [path fileSystemRepresentation], &st);
+	if (error)
+		*error = [NSError errorWithPOSIXCode:-res];
+	if (res)
+		return nil;
+	attrs = [self attributesWithStat:&st];
+	[self cacheAttributes:attrs ofItemAtPath:path];
+	
+	return attrs;
+}
+
+- (NSDictionary *)attributesOfFileSystemForPath:(NSString *)path
+                                          error:(NSError **)error {
+	return [NSDictionary dictionary];  // Default file system attributes.
 }
 
--(void)dealloc {
-	if (impl) {
-		NSLog(@"SzArEx_Free");
-		SzArEx_Free(&impl->db, &impl->allocImp);
-		NSLog(@"File_Close");
-		File_Close(&impl->archiveStream.file);
-		free(impl);
+- (BOOL)setAttributes:(NSDictionary *)attributes 
+         ofItemAtPath:(NSString *)path
+             userData:(id)userData
+                error:(NSError **)error {
+	return NO; 
+}
+
+#pragma mark File Contents
+
+- (BOOL)openFileAtPath:(NSString *)path 
+                  mode:(int)mode
+              userData:(id *)userData
+                 error:(NSError **)error {
+	
+	int res = sz_open(&fs, [path fileSystemRepresentation], mode);
+	
+	if (res) {
+		if (error)
+			*error = [NSError errorWithPOSIXCode:-res];
+		return NO;
 	}
 	
-	[super dealloc];
+	return YES;
+}
+
+- (void)releaseFileAtPath:(NSString *)path userData:(id)userData {
+	sz_release(&fs, [path fileSystemRepresentation]);
+}
+
+- (int)readFileAtPath:(NSString *)path 
+             userData:(id)userData
+               buffer:(char *)buffer 
+                 size:(size_t)size 
+               offset:(off_t)offset
+                error:(NSError **)error {
 	
+	int res = sz_read(&fs, [path fileSystemRepresentation], buffer, size, offset);
+	if (error)
+		*error = [NSError errorWithPOSIXCode:res < 0 ? -res : 0];
+	return res;
+}
+
+#pragma mark Extended Attributes (Optional)
+
+- (NSArray *)extendedAttributesOfItemAtPath:(NSString *)path error:(NSError **)error {
+	return [NSArray array];  // No extended attributes.
+}
+
+- (NSData *)valueOfExtendedAttribute:(NSString *)name 
+                        ofItemAtPath:(NSString *)path
+                            position:(off_t)position
+                               error:(NSError **)error {
+	if (error)
+		*error = [NSError errorWithPOSIXCode:ENOATTR];
+	return nil;
+}
+
+#pragma mark FinderInfo and ResourceFork (Optional)
+
+- (NSDictionary *)finderAttributesAtPath:(NSString *)path 
+                                   error:(NSError **)error {
+	return [NSDictionary dictionary];
+}
+
+- (NSDictionary *)resourceAttributesAtPath:(NSString *)path
+                                     error:(NSError **)error {
+	return [NSDictionary dictionary];
 }
 
 @end
@@ -0,0 +1,1446 @@
+/*
+ *  sevenzipfs.c
+ *  avfsmac
+ *
+ *  Read-only file system on a 7z archive, see sevenzipfs.h.
+ *
+ */
+
+#include "sevenzipfs.h"
+
+#include "../7z/Archive/7z/7zIn.h"
+#include "../7z/Archive/7z/7zDecode.h"
+#include "../7z/Archive/7z/7zExtract.h"
+#include "../7z/Archive/7z/7zAlloc.h"
+#include "../7z/7zCrc.h"
+#include "../7z/7zFile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define NTFS_EPOCH_DELTA 116444736000000000ULL /* 1601 to 1970 in 100ns */
+#define FOLDER_CACHE_MEM ( 64 * 1024 * 1024 )
+#define FOLDER_STREAMS 4 /* decoders kept for folders not cached as a whole */
+#define ARCHIVE_READERS 8 /* idle archive readers kept open */
+#define CHECKPOINT_MEM ( 64 * 1024 * 1024 )
+#define CHECKPOINT_SPAN ( 1024 * 1024 ) /* initial distance of the
+					       checkpoints in a folder */
+
+  /**********/
+ /* macros */
+/**********/
+#ifdef NDEBUG
+#   define log(format, ...)
+#else
+#   define log(format, ...) \
+{ \
+	FILE *FH = fopen( "/tmp/sevenzipfs.log", "a" ); \
+	if( FH ) { \
+		fprintf( FH, "l. %4d: " format "\n", __LINE__, ##__VA_ARGS__ ); \
+		fclose( FH ); \
+	} \
+}
+#endif
+
+/* the archive as the 7z decoder sees it */
+struct sevenzip_db {
+	CFileInStream archiveStream;
+	CLookToRead lookStream;
+	CSzArEx db;
+	ISzAlloc allocImp;
+	ISzAlloc allocTempImp;
+	struct szfolder **slots; /* the cache entry of each folder, or NULL */
+	struct szcheckpoints *checkpoints; /* per folder */
+	char *path; /* the archive file, opened again for readers */
+};
+
+/* the archive opened once more, for decoding a folder in parallel with
+   others */
+struct szreader {
+	CFileInStream archiveStream;
+	CLookToRead lookStream;
+	struct szreader *next; /* next idle reader */
+};
+
+/* a decoded folder, see the folder cache */
+struct szfolder {
+	UInt32 index;
+	Byte *data;
+	size_t size;
+	int refs; /* readers using data */
+	int ready; /* true once data is decoded */
+	Byte *checked; /* per item from the first one of the folder on, true
+			  once its CRC has matched */
+	struct szfolder *prev; /* more recently used folder */
+	struct szfolder *next; /* less recently used folder */
+};
+
+/* a folder decoded incrementally, see folder streams */
+struct szstream {
+	CSzFolderStream folder;
+	struct szstream *next; /* less recently used stream */
+};
+
+/* decoder states saved in a streamed folder, see folder checkpoints */
+struct szcheckpoints {
+	CSzFolderCheckpoint *items; /* sorted by outPos */
+	size_t count;
+	size_t size; /* number of items allocated */
+	UInt64 span; /* distance of the checkpoints, 0 before the first */
+};
+
+/* the (parent, name) index used while the tree is built */
+struct buildhash {
+	SZNODE **buckets;
+	size_t size; /* a power of two */
+	UInt64 *offsets; /* of each item's data in its folder */
+};
+
+static pthread_once_t crconce = PTHREAD_ONCE_INIT;
+
+  /**********************/
+ /* internal functions */
+/**********************/
+
+static void
+crc_init( void )
+{
+	CrcGenerateTable();
+}
+
+static int
+sz_errno( SRes res )
+{
+	switch( res ) {
+		case SZ_OK:
+			return 0;
+		case SZ_ERROR_MEM:
+			return -ENOMEM;
+		case SZ_ERROR_UNSUPPORTED:
+			return -ENOTSUP;
+		case SZ_ERROR_NO_ARCHIVE:
+			return -EINVAL;
+		default:
+			/* damaged data, failed reads */
+			return -EIO;
+	}
+}
+
+static unsigned int
+build_hash( const SZNODE *parent, const char *name, size_t len )
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261U ^ ( unsigned int )( ( size_t )parent
+			>> 4 );
+	size_t i;
+
+	for( i = 0; i < len; i++ ) {
+		hash ^= ( unsigned char )name[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static SZNODE *
+build_find( struct buildhash *h, const SZNODE *parent, const char *name,
+		size_t len )
+{
+	SZNODE *node = h->buckets[build_hash( parent, name, len ) &
+			( h->size - 1 )];
+
+	while( node ) {
+		if( node->parent == parent && strncmp( node->name, name,
+					len ) == 0 && node->name[len] == '\0' ) {
+			return node;
+		}
+		node = node->hashnext;
+	}
+	return NULL;
+}
+
+/*
+ * creates the child name of parent; name points into the archive's file
+ * names if it ends there, else it is copied
+ */
+static SZNODE *
+node_new( sevenzip_fs_t *fs, struct buildhash *h, SZNODE *parent,
+		const char *name, size_t len )
+{
+	SZNODE *node = calloc( 1, sizeof( SZNODE ) );
+	size_t bucket;
+
+	if( node == NULL ) {
+		return NULL;
+	}
+	if( name[len] == '\0' ) {
+		node->name = name;
+	} else {
+		if( ( node->namebuf = malloc( len + 1 ) ) == NULL ) {
+			free( node );
+			return NULL;
+		}
+		memcpy( node->namebuf, name, len );
+		node->namebuf[len] = '\0';
+		node->name = node->namebuf;
+	}
+	if( parent->nchildren == parent->childsize ) {
+		size_t size = parent->childsize ? parent->childsize * 2 : 4;
+		SZNODE **children = realloc( parent->children,
+				size * sizeof( SZNODE * ) );
+		if( children == NULL ) {
+			free( node->namebuf );
+			free( node );
+			return NULL;
+		}
+		parent->children = children;
+		parent->childsize = size;
+	}
+	parent->children[parent->nchildren++] = node;
+	node->parent = parent;
+	node->file = -1;
+	node->folder = -1;
+	node->mode = S_IFDIR | 0555;
+	node->nlink = 2;
+	node->mtime = fs->archivestat.st_mtime;
+	node->ino = ++fs->nodecount;
+	bucket = build_hash( parent, node->name, len ) & ( h->size - 1 );
+	node->hashnext = h->buckets[bucket];
+	h->buckets[bucket] = node;
+	return node;
+}
+
+/* takes the attributes of item index of the archive into node */
+static void
+node_set_item( sevenzip_fs_t *fs, struct buildhash *h, SZNODE *node,
+		UInt32 index )
+{
+	const CSzFileItem *item = fs->db->db.db.Files + index;
+
+	node->file = index;
+	node->folder = fs->db->db.FileIndexToFolderIndexMap[index];
+	if( node->folder == ( UInt32 )-1 || ! item->HasStream ) {
+		node->folder = -1;
+	}
+	node->folderoffset = h->offsets[index];
+	if( item->IsDir ) {
+		node->mode = S_IFDIR | 0555;
+		node->size = 0;
+	} else {
+		node->mode = S_IFREG | 0444;
+		node->nlink = 1;
+		node->size = item->Size;
+	}
+	if( item->MTimeDefined ) {
+		UInt64 ft = ( ( UInt64 )item->MTime.High << 32 ) |
+			item->MTime.Low;
+		if( ft >= NTFS_EPOCH_DELTA ) {
+			ft -= NTFS_EPOCH_DELTA;
+			node->mtime = ( time_t )( ft / 10000000 );
+			node->mtimensec = ( long )( ft % 10000000 ) * 100;
+		} else {
+			node->mtime = 0;
+			node->mtimensec = 0;
+		}
+	}
+}
+
+/*
+ * adds item index of the archive to the tree, with the directories its
+ * path implies; items whose path runs through a file, names with ".."
+ * and anti-items are left out
+ */
+static int
+add_item( sevenzip_fs_t *fs, struct buildhash *h, UInt32 index )
+{
+	const CSzFileItem *item = fs->db->db.db.Files + index;
+	SZNODE *node = fs->root;
+	const char *p = item->Name;
+
+	if( item->IsAnti || ! p ) {
+		return 0;
+	}
+	while( *p ) {
+		const char *end = strchr( p, '/' );
+		size_t len = end ? ( size_t )( end - p ) : strlen( p );
+		SZNODE *child;
+		if( len == 0 || ( len == 1 && p[0] == '.' ) ) {
+			p += end ? len + 1 : len;
+			continue;
+		}
+		if( len == 2 && p[0] == '.' && p[1] == '.' ) {
+			log( "skipping '%s'", item->Name );
+			return 0;
+		}
+		if( ! S_ISDIR( node->mode ) ) {
+			log( "'%s' is inside a file", item->Name );
+			return 0;
+		}
+		if( ( child = build_find( h, node, p, len ) ) == NULL
+				&& ( child = node_new( fs, h, node, p,
+						len ) ) == NULL ) {
+			return -ENOMEM;
+		}
+		node = child;
+		p += end ? len + 1 : len;
+	}
+	if( node == fs->root ) {
+		return 0;
+	}
+	if( S_ISDIR( node->mode ) && node->nchildren && ! item->IsDir ) {
+		log( "file '%s' would hide a directory", item->Name );
+		return 0;
+	}
+	/* a later item with the same path replaces the earlier one */
+	node_set_item( fs, h, node, index );
+	return 0;
+}
+
+static int
+node_cmp( const void *a, const void *b )
+{
+	return strcmp( ( *( SZNODE * const * )a )->name,
+			( *( SZNODE * const * )b )->name );
+}
+
+/* sorts the children of node and all below, counts the links of
+   directories */
+static void
+sort_children( SZNODE *node )
+{
+	size_t i;
+
+	qsort( node->children, node->nchildren, sizeof( SZNODE * ), node_cmp );
+	for( i = 0; i < node->nchildren; i++ ) {
+		if( S_ISDIR( node->children[i]->mode ) ) {
+			node->nlink++;
+			sort_children( node->children[i] );
+		}
+	}
+}
+
+static int
+build_tree( sevenzip_fs_t *fs )
+{
+	const CSzArEx *db = &fs->db->db;
+	struct buildhash h;
+	UInt64 offset = 0;
+	UInt32 i;
+	int ret = 0;
+
+	h.size = 64;
+	while( h.size < ( size_t )db->db.NumFiles * 2 ) {
+		h.size *= 2;
+	}
+	h.buckets = calloc( h.size, sizeof( SZNODE * ) );
+	h.offsets = malloc( ( db->db.NumFiles + 1 ) * sizeof( UInt64 ) );
+	if( h.buckets == NULL || h.offsets == NULL ) {
+		free( h.buckets );
+		free( h.offsets );
+		return -ENOMEM;
+	}
+	/* the items of a folder follow each other */
+	for( i = 0; i < db->db.NumFiles; i++ ) {
+		UInt32 folder = db->FileIndexToFolderIndexMap[i];
+		if( folder != ( UInt32 )-1
+				&& db->FolderStartFileIndex[folder] == i ) {
+			offset = 0;
+		}
+		h.offsets[i] = offset;
+		if( folder != ( UInt32 )-1 && db->db.Files[i].HasStream ) {
+			offset += db->db.Files[i].Size;
+		}
+	}
+	for( i = 0; i < db->db.NumFiles && ret == 0; i++ ) {
+		ret = add_item( fs, &h, i );
+	}
+	free( h.buckets );
+	free( h.offsets );
+	sort_children( fs->root );
+	return ret;
+}
+
+static void
+free_nodes( SZNODE *node )
+{
+	size_t i;
+
+	for( i = 0; i < node->nchildren; i++ ) {
+		free_nodes( node->children[i] );
+	}
+	free( node->children );
+	free( node->namebuf );
+	free( node );
+}
+
+/* compares name with the len bytes at comp, in the order of strcmp() */
+static int
+name_cmp( const char *name, const char *comp, size_t len )
+{
+	int cmp = strncmp( name, comp, len );
+
+	if( cmp == 0 && name[len] != '\0' ) {
+		return 1;
+	}
+	return cmp;
+}
+
+static SZNODE *
+get_node_for_path( sevenzip_fs_t *fs, const char *path )
+{
+	SZNODE *node = fs->root;
+
+	while( node && *path ) {
+		const char *end = strchr( path, '/' );
+		size_t len = end ? ( size_t )( end - path ) : strlen( path );
+		size_t lo = 0, hi = node->nchildren;
+		SZNODE *found = NULL;
+		if( len == 0 || ( len == 1 && path[0] == '.' ) ) {
+			path += end ? len + 1 : len;
+			continue;
+		}
+		while( lo < hi ) {
+			size_t mid = lo + ( hi - lo ) / 2;
+			int cmp = name_cmp( node->children[mid]->name, path, len );
+			if( cmp == 0 ) {
+				found = node->children[mid];
+				break;
+			}
+			if( cmp < 0 ) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		node = found;
+		path += end ? len + 1 : len;
+	}
+	return node;
+}
+
+static void
+node_stat( sevenzip_fs_t *fs, const SZNODE *node, struct stat *stbuf )
+{
+	memset( stbuf, 0, sizeof( struct stat ) );
+	stbuf->st_size = node->size;
+	stbuf->st_blocks = ( node->size + 511 ) / 512;
+	stbuf->st_ino = node->ino;
+#ifdef __APPLE__
+	stbuf->st_atimespec.tv_sec = node->mtime;
+	stbuf->st_atimespec.tv_nsec = node->mtimensec;
+	stbuf->st_mtimespec.tv_sec = node->mtime;
+	stbuf->st_mtimespec.tv_nsec = node->mtimensec;
+	stbuf->st_ctimespec.tv_sec = node->mtime;
+	stbuf->st_ctimespec.tv_nsec = node->mtimensec;
+#else
+	stbuf->st_atim.tv_sec = node->mtime;
+	stbuf->st_atim.tv_nsec = node->mtimensec;
+	stbuf->st_mtim.tv_sec = node->mtime;
+	stbuf->st_mtim.tv_nsec = node->mtimensec;
+	stbuf->st_ctim.tv_sec = node->mtime;
+	stbuf->st_ctim.tv_nsec = node->mtimensec;
+#endif
+	stbuf->st_mode = node->mode;
+	stbuf->st_nlink = node->nlink;
+	stbuf->st_uid = fs->archivestat.st_uid;
+	stbuf->st_gid = fs->archivestat.st_gid;
+}
+
+  /*******************/
+ /* archive readers */
+/*******************/
+
+/*
+ * The stream the header was read through is shared, so decoding through it
+ * is serialized by fs->streamlock. Folders are decoded through readers
+ * instead, each opening the archive file on its own; idle ones are kept in
+ * fs->readers under fs->lock.
+ */
+
+static void
+reader_free( struct szreader *r )
+{
+	File_Close( &r->archiveStream.file );
+	free( r );
+}
+
+/*
+ * an idle reader or a newly opened one; the file is opened by name again,
+ * so that fails with ESTALE when it is not the mounted one any more
+ * @return NULL on errors, with 0-errno in ret
+ */
+static struct szreader *
+reader_get( sevenzip_fs_t *fs, int *ret )
+{
+	struct szreader *r;
+	struct stat st;
+
+	pthread_mutex_lock( &fs->lock );
+	if( ( r = fs->readers ) != NULL ) {
+		fs->readers = r->next;
+		fs->nreaders--;
+	}
+	pthread_mutex_unlock( &fs->lock );
+	if( r ) {
+		return r;
+	}
+	if( ( r = calloc( 1, sizeof( struct szreader ) ) ) == NULL ) {
+		*ret = -ENOMEM;
+		return NULL;
+	}
+	if( ( *ret = InFile_Open( &r->archiveStream.file, fs->db->path ) )
+			!= 0 ) {
+		*ret = 0 - *ret;
+		free( r );
+		return NULL;
+	}
+	if( fstat( fileno( r->archiveStream.file.file ), &st ) == -1
+			|| st.st_dev != fs->archivestat.st_dev
+			|| st.st_ino != fs->archivestat.st_ino
+			|| st.st_size != fs->archivestat.st_size ) {
+		log( "'%s' is not the mounted archive any more",
+				fs->db->path );
+		reader_free( r );
+		*ret = -ESTALE;
+		return NULL;
+	}
+	FileInStream_CreateVTable( &r->archiveStream );
+	LookToRead_CreateVTable( &r->lookStream, False );
+	r->lookStream.realStream = &r->archiveStream.s;
+	LookToRead_Init( &r->lookStream );
+	return r;
+}
+
+static void
+reader_put( sevenzip_fs_t *fs, struct szreader *r )
+{
+	pthread_mutex_lock( &fs->lock );
+	if( fs->nreaders < ARCHIVE_READERS ) {
+		r->next = fs->readers;
+		fs->readers = r;
+		fs->nreaders++;
+		r = NULL;
+	}
+	pthread_mutex_unlock( &fs->lock );
+	if( r ) {
+		reader_free( r );
+	}
+}
+
+  /****************/
+ /* folder cache */
+/****************/
+
+/*
+ * Decoded folders are kept, most recently used first, until they take more
+ * than options.foldercache bytes; the most recently used one stays even if
+ * it is larger on its own. Readers hold a reference while they copy out of
+ * a folder. A folder being decoded is in the cache already but not ready,
+ * readers of it wait for the decoder instead of decoding it once more.
+ * Everything here is protected by fs->lock.
+ */
+
+static void
+folder_unlink( sevenzip_fs_t *fs, struct szfolder *f )
+{
+	if( f->prev ) {
+		f->prev->next = f->next;
+	} else {
+		fs->folders = f->next;
+	}
+	if( f->next ) {
+		f->next->prev = f->prev;
+	} else {
+		fs->folderstail = f->prev;
+	}
+	f->prev = f->next = NULL;
+}
+
+static void
+folder_push( sevenzip_fs_t *fs, struct szfolder *f )
+{
+	f->prev = NULL;
+	f->next = fs->folders;
+	if( fs->folders ) {
+		fs->folders->prev = f;
+	} else {
+		fs->folderstail = f;
+	}
+	fs->folders = f;
+}
+
+/* removes f from the cache and frees it */
+static void
+folder_drop( sevenzip_fs_t *fs, struct szfolder *f )
+{
+	folder_unlink( fs, f );
+	fs->db->slots[f->index] = NULL;
+	if( f->ready ) {
+		fs->foldermem -= f->size;
+		fs->nfolders--;
+	}
+	IAlloc_Free( &fs->db->allocImp, f->data );
+	free( f->checked );
+	free( f );
+}
+
+/* evicts unused folders, least recently used first, until the cache is
+   within its limit */
+static void
+folders_shrink( sevenzip_fs_t *fs )
+{
+	struct szfolder *f = fs->folderstail;
+
+	while( f && f != fs->folders
+			&& fs->foldermem > fs->options.foldercache ) {
+		struct szfolder *prev = f->prev;
+		if( f->ready && ! f->refs ) {
+			folder_drop( fs, f );
+		}
+		f = prev;
+	}
+}
+
+/* decodes folder index of the archive read through in into newly
+   allocated memory, the way SzAr_Extract() does */
+static int
+decode_folder( sevenzip_fs_t *fs, ILookInStream *in, UInt32 index,
+		Byte **data, size_t *size )
+{
+	struct sevenzip_db *db = fs->db;
+	CSzFolder *folder = db->db.db.Folders + index;
+	UInt64 unpackSize = SzFolder_GetUnpackSize( folder );
+	UInt64 startOffset = SzArEx_GetFolderStreamPos( &db->db, index, 0 );
+	SRes res;
+
+	*data = NULL;
+	*size = ( size_t )unpackSize;
+	if( *size != unpackSize ) {
+		return -ENOMEM;
+	}
+	if( *size && ( *data = IAlloc_Alloc( &db->allocImp, *size ) ) == NULL ) {
+		return -ENOMEM;
+	}
+	res = LookInStream_SeekTo( in, startOffset );
+	if( res == SZ_OK ) {
+		res = SzDecode( db->db.db.PackSizes +
+				db->db.FolderStartPackStreamIndex[index], folder,
+				in, startOffset, *data, *size, &db->allocTempImp );
+	}
+	if( res == SZ_OK && folder->UnpackCRCDefined
+			&& CrcCalc( *data, *size ) != folder->UnpackCRC ) {
+		res = SZ_ERROR_CRC;
+	}
+	if( res != SZ_OK ) {
+		log( "decoding folder %u: error %d", ( unsigned int )index, res );
+		IAlloc_Free( &db->allocImp, *data );
+		*data = NULL;
+		return sz_errno( res );
+	}
+	return 0;
+}
+
+/* decodes folder index through a reader, or through the shared stream
+   when no reader can be opened */
+static int
+folder_decode( sevenzip_fs_t *fs, UInt32 index, Byte **data, size_t *size )
+{
+	struct szreader *r;
+	int ret;
+
+	if( ( r = reader_get( fs, &ret ) ) != NULL ) {
+		ret = decode_folder( fs, &r->lookStream.s, index, data, size );
+		reader_put( fs, r );
+		return ret;
+	}
+	pthread_mutex_lock( &fs->streamlock );
+	ret = decode_folder( fs, &fs->db->lookStream.s, index, data, size );
+	pthread_mutex_unlock( &fs->streamlock );
+	return ret;
+}
+
+/*
+ * the decoded folder index with a reference for the caller, decoded now if
+ * it is not in the cache; only reads, not prefetching, count as hits and
+ * misses
+ * @return NULL on errors, with 0-errno in ret
+ */
+static struct szfolder *
+folder_get( sevenzip_fs_t *fs, UInt32 index, int read, int *ret )
+{
+	const CSzArEx *db = &fs->db->db;
+	struct szfolder *f;
+	size_t nitems;
+
+	pthread_mutex_lock( &fs->lock );
+	while( ( f = fs->db->slots[index] ) != NULL && ! f->ready ) {
+		pthread_cond_wait( &fs->decoded, &fs->lock );
+	}
+	if( f ) {
+		if( read ) {
+			fs->hits++;
+		}
+		f->refs++;
+		folder_unlink( fs, f );
+		folder_push( fs, f );
+		pthread_mutex_unlock( &fs->lock );
+		return f;
+	}
+	if( read ) {
+		fs->misses++;
+	}
+	nitems = ( index + 1 < db->db.NumFolders ?
+			db->FolderStartFileIndex[index + 1] :
+			db->db.NumFiles ) - db->FolderStartFileIndex[index];
+	if( ( f = calloc( 1, sizeof( struct szfolder ) ) ) == NULL
+			|| ( f->checked = calloc( nitems + 1, 1 ) ) == NULL ) {
+		free( f );
+		pthread_mutex_unlock( &fs->lock );
+		*ret = -ENOMEM;
+		return NULL;
+	}
+	f->index = index;
+	f->refs = 1;
+	fs->db->slots[index] = f;
+	folder_push( fs, f );
+	pthread_mutex_unlock( &fs->lock );
+
+	*ret = folder_decode( fs, index, &f->data, &f->size );
+
+	pthread_mutex_lock( &fs->lock );
+	if( *ret != 0 ) {
+		folder_drop( fs, f );
+		f = NULL;
+	} else {
+		f->ready = 1;
+		fs->foldermem += f->size;
+		fs->nfolders++;
+		folders_shrink( fs );
+	}
+	pthread_cond_broadcast( &fs->decoded );
+	pthread_mutex_unlock( &fs->lock );
+	return f;
+}
+
+static void
+folder_put( sevenzip_fs_t *fs, struct szfolder *f )
+{
+	pthread_mutex_lock( &fs->lock );
+	f->refs--;
+	folders_shrink( fs );
+	pthread_mutex_unlock( &fs->lock );
+}
+
+/* checks the CRC of node's data in f once for each decoding of f */
+static int
+check_item( sevenzip_fs_t *fs, struct szfolder *f, const SZNODE *node )
+{
+	const CSzArEx *db = &fs->db->db;
+	const CSzFileItem *item = db->db.Files + node->file;
+	size_t i = node->file - db->FolderStartFileIndex[f->index];
+	int checked;
+
+	if( ! item->FileCRCDefined ) {
+		return 0;
+	}
+	pthread_mutex_lock( &fs->lock );
+	checked = f->checked[i];
+	pthread_mutex_unlock( &fs->lock );
+	if( checked ) {
+		return 0;
+	}
+	if( CrcCalc( f->data + node->folderoffset, node->size )
+			!= item->FileCRC ) {
+		log( "CRC error in item %lld", ( long long )node->file );
+		return -EIO;
+	}
+	pthread_mutex_lock( &fs->lock );
+	f->checked[i] = 1;
+	pthread_mutex_unlock( &fs->lock );
+	return 0;
+}
+
+  /**********************/
+ /* folder checkpoints */
+/**********************/
+
+/*
+ * A stream that has to go back before its window resumes from the last
+ * checkpoint of its folder instead of the folder start. Streams save one
+ * at every multiple of the folder's span they decode through; when all
+ * checkpoints take more than options.checkpointmem, the span of the folder
+ * adding one doubles and those at odd multiples of the old span are
+ * dropped. Under fs->streamlock.
+ */
+
+static void
+checkpoint_drop( sevenzip_fs_t *fs, CSzFolderCheckpoint *cp )
+{
+	fs->checkpointmem -= SzFolderCheckpoint_Size( cp );
+	fs->ncheckpoints--;
+	SzFolderCheckpoint_Free( cp, &fs->db->allocImp );
+}
+
+static void
+checkpoints_free( sevenzip_fs_t *fs, struct szcheckpoints *c )
+{
+	size_t i;
+
+	for( i = 0; i < c->count; i++ ) {
+		checkpoint_drop( fs, c->items + i );
+	}
+	free( c->items );
+	memset( c, 0, sizeof( struct szcheckpoints ) );
+}
+
+/* @return the index of the first checkpoint after pos */
+static size_t
+checkpoint_after( const struct szcheckpoints *c, UInt64 pos )
+{
+	size_t lo = 0;
+	size_t hi = c->count;
+
+	while( lo < hi ) {
+		size_t mid = lo + ( hi - lo ) / 2;
+		if( c->items[mid].outPos <= pos ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static int
+checkpoint_at( const struct szcheckpoints *c, UInt64 pos )
+{
+	size_t i = checkpoint_after( c, pos );
+
+	return i > 0 && c->items[i - 1].outPos == pos;
+}
+
+/* keeps the checkpoints at even multiples of the span and doubles it */
+static void
+checkpoints_thin( sevenzip_fs_t *fs, struct szcheckpoints *c )
+{
+	size_t kept = 0;
+	size_t i;
+
+	for( i = 0; i < c->count; i++ ) {
+		if( ( c->items[i].outPos / c->span ) % 2 == 0 ) {
+			c->items[kept++] = c->items[i];
+		} else {
+			checkpoint_drop( fs, c->items + i );
+		}
+	}
+	c->count = kept;
+	c->span *= 2;
+}
+
+/*
+ * saves the state of s, which is at a multiple of the span; failing only
+ * costs later reads time, so errors are just logged
+ */
+static void
+checkpoint_add( sevenzip_fs_t *fs, struct szcheckpoints *c,
+		const CSzFolderStream *s )
+{
+	CSzFolderCheckpoint cp;
+	size_t i;
+	SRes res;
+
+	if( c->count == c->size ) {
+		size_t size = c->size ? c->size * 2 : 16;
+		CSzFolderCheckpoint *items = realloc( c->items,
+				size * sizeof( CSzFolderCheckpoint ) );
+		if( items == NULL ) {
+			log( "no memory for checkpoints" );
+			return;
+		}
+		c->items = items;
+		c->size = size;
+	}
+	if( ( res = SzFolderStream_Save( s, &cp, &fs->db->allocImp ) )
+			!= SZ_OK ) {
+		log( "saving folder %u at %llu: error %d", s->folderIndex,
+				( unsigned long long )s->outPos, res );
+		return;
+	}
+	i = checkpoint_after( c, cp.outPos );
+	memmove( c->items + i + 1, c->items + i,
+			( c->count - i ) * sizeof( CSzFolderCheckpoint ) );
+	c->items[i] = cp;
+	c->count++;
+	fs->ncheckpoints++;
+	fs->checkpointmem += SzFolderCheckpoint_Size( &cp );
+	/* the one at the folder start is kept by thinning */
+	while( fs->checkpointmem > fs->options.checkpointmem
+			&& c->count > 1 ) {
+		checkpoints_thin( fs, c );
+	}
+	if( fs->checkpointmem > fs->options.checkpointmem ) {
+		while( c->count > 0 ) {
+			checkpoint_drop( fs, c->items + --c->count );
+		}
+	}
+}
+
+/*
+ * gets s ready to read pos up to limit, which is at most a window after
+ * it: resumes from the last checkpoint up to pos when that is ahead of s or
+ * s has gone past pos, then saves the missing checkpoints up to limit
+ */
+static SRes
+stream_seek( sevenzip_fs_t *fs, CSzFolderStream *s, UInt64 pos,
+		UInt64 limit )
+{
+	struct szcheckpoints *c = fs->db->checkpoints + s->folderIndex;
+	size_t i = checkpoint_after( c, pos );
+	UInt64 next;
+
+	if( i > 0 && ( c->items[i - 1].outPos > s->outPos
+				|| pos < SzFolderStream_WindowStart( s ) ) ) {
+		SzFolderStream_Restore( s, c->items + i - 1 );
+	}
+	if( c->span == 0 ) {
+		c->span = s->dec.dicBufSize > CHECKPOINT_SPAN ?
+			s->dec.dicBufSize : CHECKPOINT_SPAN;
+	}
+	/* the first multiple of the span not before s */
+	next = ( s->outPos + c->span - 1 ) / c->span * c->span;
+	while( next <= limit && next < s->unpackSize ) {
+		if( ! checkpoint_at( c, next ) ) {
+			RINOK( SzFolderStream_DecodeTo( s, &fs->db->lookStream.s,
+						next ) );
+			checkpoint_add( fs, c, s );
+		}
+		/* the span may have doubled */
+		next = ( next / c->span + 1 ) * c->span;
+	}
+	return SZ_OK;
+}
+
+  /******************/
+ /* folder streams */
+/******************/
+
+/*
+ * Folders larger than the whole cache are not decoded into memory at once.
+ * A stream decodes such a folder from its start up to the end of what was
+ * read, keeping a window of the size of the LZMA dictionary, so a reader
+ * going through a file continues where the last read stopped; one going
+ * back resumes from a checkpoint. The streams are kept, most recently used
+ * first, under fs->streamlock.
+ */
+
+/* whether folder index is read through a stream */
+static int
+folder_streamed( sevenzip_fs_t *fs, UInt32 index )
+{
+	UInt64 size = SzFolder_GetUnpackSize( fs->db->db.db.Folders + index );
+
+	return size > fs->options.foldercache || ( UInt64 )( size_t )size != size;
+}
+
+static void
+stream_free( sevenzip_fs_t *fs, struct szstream *s )
+{
+	SzFolderStream_Free( &s->folder, &fs->db->allocImp );
+	free( s );
+}
+
+/*
+ * a stream for reading folder index at pos: one that has not passed pos
+ * yet, else a new one or the least recently used one
+ * @return NULL on errors, with 0-errno in ret
+ */
+static struct szstream *
+stream_get( sevenzip_fs_t *fs, UInt32 index, UInt64 pos, int *ret )
+{
+	struct szstream **link;
+	struct szstream *s;
+	SRes res;
+
+	for( link = &fs->streams; *link; link = &( *link )->next ) {
+		s = *link;
+		if( s->folder.folderIndex == index
+				&& SzFolderStream_WindowStart( &s->folder ) <= pos ) {
+			*link = s->next;
+			fs->nstreams--;
+			return s;
+		}
+	}
+	if( fs->nstreams >= FOLDER_STREAMS ) {
+		/* give up the least recently used one */
+		for( link = &fs->streams; ( *link )->next;
+				link = &( *link )->next );
+		s = *link;
+		*link = NULL;
+		fs->nstreams--;
+		if( s->folder.folderIndex == index ) {
+			return s;
+		}
+		stream_free( fs, s );
+	}
+	if( ( s = malloc( sizeof( struct szstream ) ) ) == NULL ) {
+		*ret = -ENOMEM;
+		return NULL;
+	}
+	SzFolderStream_Construct( &s->folder );
+	res = SzFolderStream_Open( &s->folder, &fs->db->db, index,
+			&fs->db->allocImp );
+	if( res != SZ_OK ) {
+		stream_free( fs, s );
+		*ret = sz_errno( res );
+		return NULL;
+	}
+	return s;
+}
+
+/*
+ * reads size bytes from offset of node's data through a stream
+ * @return bytes read, 0-errno on errors; -ENOTSUP if the folder can only
+ * be decoded as a whole
+ */
+static int
+stream_read( sevenzip_fs_t *fs, const SZNODE *node, char *buf, size_t size,
+		off_t offset )
+{
+	UInt64 pos = node->folderoffset + offset;
+	struct szstream *s;
+	size_t processed;
+	SRes res = SZ_OK;
+	int ret;
+
+	pthread_mutex_lock( &fs->streamlock );
+	if( ( s = stream_get( fs, ( UInt32 )node->folder, pos,
+					&ret ) ) == NULL ) {
+		pthread_mutex_unlock( &fs->streamlock );
+		return ret;
+	}
+	if( fs->options.checkpointmem && SzFolderStream_CanSave( &s->folder ) ) {
+		UInt64 window = s->folder.dec.dicBufSize;
+		res = stream_seek( fs, &s->folder, pos,
+				pos + ( size < window ? size : window ) );
+	}
+	if( res == SZ_OK ) {
+		res = SzFolderStream_Read( &s->folder, &fs->db->lookStream.s,
+				pos, ( Byte * )buf, size, &processed );
+	}
+	if( res != SZ_OK ) {
+		log( "reading item %lld: error %d", ( long long )node->file,
+				res );
+		stream_free( fs, s );
+		pthread_mutex_unlock( &fs->streamlock );
+		return sz_errno( res );
+	}
+	s->next = fs->streams;
+	fs->streams = s;
+	fs->nstreams++;
+	pthread_mutex_unlock( &fs->streamlock );
+	return processed;
+}
+
+  /***************/
+ /* prefetching */
+/***************/
+
+/*
+ * sz_prefetch() hands the folders to decode to worker threads, each taking
+ * the next one until none are left. Every decoding worker uses a reader of
+ * its own, so independent folders decode in parallel.
+ */
+
+struct szprefetch {
+	sevenzip_fs_t *fs;
+	UInt32 *folders;
+	size_t count;
+	size_t next; /* first folder not taken by a worker */
+	int ret; /* 0-errno of the first failure, else 0 */
+	pthread_mutex_t lock; /* protects next and ret */
+};
+
+/* marks the folders holding data of node and the nodes below it */
+static void
+prefetch_mark( const SZNODE *node, Byte *marks )
+{
+	size_t i;
+
+	if( node->folder != -1 ) {
+		marks[node->folder] = 1;
+	}
+	for( i = 0; i < node->nchildren; i++ ) {
+		prefetch_mark( node->children[i], marks );
+	}
+}
+
+static void *
+prefetch_worker( void *arg )
+{
+	struct szprefetch *p = arg;
+	struct szfolder *f;
+	UInt32 index;
+	int ret;
+
+	for( ;; ) {
+		pthread_mutex_lock( &p->lock );
+		if( p->next == p->count ) {
+			pthread_mutex_unlock( &p->lock );
+			break;
+		}
+		index = p->folders[p->next++];
+		pthread_mutex_unlock( &p->lock );
+		if( ( f = folder_get( p->fs, index, 0, &ret ) ) != NULL ) {
+			folder_put( p->fs, f );
+		} else {
+			pthread_mutex_lock( &p->lock );
+			if( p->ret == 0 ) {
+				p->ret = ret;
+			}
+			pthread_mutex_unlock( &p->lock );
+		}
+	}
+	return NULL;
+}
+
+  /*****************/
+ /* API functions */
+/*****************/
+
+void
+sz_default_options( sevenzip_fs_options *options )
+{
+	options->foldercache = FOLDER_CACHE_MEM;
+	options->checkpointmem = CHECKPOINT_MEM;
+	options->threads = 0;
+}
+
+int
+sz_init( sevenzip_fs_t *fs, const char *archiveFile )
+{
+	sevenzip_fs_options options;
+
+	sz_default_options( &options );
+	return sz_init_with_options( fs, archiveFile, &options );
+}
+
+int
+sz_init_with_options( sevenzip_fs_t *fs, const char *archiveFile,
+		const sevenzip_fs_options *options )
+{
+	struct sevenzip_db *db;
+	SRes res;
+	int ret;
+
+	memset( fs, 0, sizeof( sevenzip_fs_t ) );
+	fs->options = *options;
+	if( stat( archiveFile, &fs->archivestat ) == -1 ) {
+		return 0 - errno;
+	}
+	if( ( db = calloc( 1, sizeof( struct sevenzip_db ) ) ) == NULL ) {
+		return -ENOMEM;
+	}
+	if( ( ret = InFile_Open( &db->archiveStream.file, archiveFile ) )
+			!= 0 ) {
+		/* the errno of fopen() */
+		ret = 0 - ret;
+		log( "could not open '%s'", archiveFile );
+		free( db );
+		return ret;
+	}
+	FileInStream_CreateVTable( &db->archiveStream );
+	LookToRead_CreateVTable( &db->lookStream, False );
+	db->lookStream.realStream = &db->archiveStream.s;
+	LookToRead_Init( &db->lookStream );
+	db->allocImp.Alloc = SzAlloc;
+	db->allocImp.Free = SzFree;
+	db->allocTempImp.Alloc = SzAllocTemp;
+	db->allocTempImp.Free = SzFreeTemp;
+	pthread_once( &crconce, crc_init );
+	SzArEx_Init( &db->db );
+	res = SzArEx_Open( &db->db, &db->lookStream.s, &db->allocImp,
+			&db->allocTempImp );
+	if( res != SZ_OK ) {
+		log( "'%s' is not a readable 7z archive: error %d",
+				archiveFile, res );
+		SzArEx_Free( &db->db, &db->allocImp );
+		File_Close( &db->archiveStream.file );
+		free( db );
+		return sz_errno( res );
+	}
+	fs->db = db;
+	if( ( db->path = strdup( archiveFile ) ) == NULL
+			|| ( db->slots = calloc( db->db.db.NumFolders + 1,
+				sizeof( struct szfolder * ) ) ) == NULL
+			|| ( db->checkpoints = calloc( db->db.db.NumFolders + 1,
+				sizeof( struct szcheckpoints ) ) ) == NULL
+			|| ( fs->root = calloc( 1, sizeof( SZNODE ) ) ) == NULL ) {
+		sz_free( fs );
+		return -ENOMEM;
+	}
+	fs->root->name = "";
+	fs->root->file = -1;
+	fs->root->folder = -1;
+	fs->root->mode = S_IFDIR | 0555;
+	fs->root->nlink = 2;
+	fs->root->mtime = fs->archivestat.st_mtime;
+	fs->root->ino = ++fs->nodecount;
+	if( ( ret = build_tree( fs ) ) != 0 ) {
+		sz_free( fs );
+		return ret;
+	}
+	pthread_mutex_init( &fs->lock, NULL );
+	pthread_cond_init( &fs->decoded, NULL );
+	pthread_mutex_init( &fs->streamlock, NULL );
+	return 0;
+}
+
+int
+sz_free( sevenzip_fs_t *fs )
+{
+	if( fs->root ) {
+		free_nodes( fs->root );
+		fs->root = NULL;
+		while( fs->folders ) {
+			folder_drop( fs, fs->folders );
+		}
+		while( fs->streams ) {
+			struct szstream *s = fs->streams;
+			fs->streams = s->next;
+			stream_free( fs, s );
+		}
+		while( fs->readers ) {
+			struct szreader *r = fs->readers;
+			fs->readers = r->next;
+			reader_free( r );
+		}
+		fs->nreaders = 0;
+		pthread_mutex_destroy( &fs->lock );
+		pthread_cond_destroy( &fs->decoded );
+		pthread_mutex_destroy( &fs->streamlock );
+	}
+	if( fs->db ) {
+		if( fs->db->checkpoints ) {
+			UInt32 i;
+			for( i = 0; i < fs->db->db.db.NumFolders; i++ ) {
+				checkpoints_free( fs, fs->db->checkpoints + i );
+			}
+			free( fs->db->checkpoints );
+		}
+		free( fs->db->slots );
+		free( fs->db->path );
+		SzArEx_Free( &fs->db->db, &fs->db->allocImp );
+		File_Close( &fs->db->archiveStream.file );
+		free( fs->db );
+		fs->db = NULL;
+	}
+	return 0;
+}
+
+int
+sz_getattr( sevenzip_fs_t *fs, const char *path, struct stat *stbuf )
+{
+	SZNODE *node = get_node_for_path( fs, path );
+
+	if( ! node ) {
+		return -ENOENT;
+	}
+	node_stat( fs, node, stbuf );
+	return 0;
+}
+
+/*
+ * readdir cookies: 1 and 2 continue after "." and "..", larger ones after
+ * the child at cookie - 3; the tree never changes
+ */
+int
+sz_readdir( sevenzip_fs_t *fs, const char *path, void *buf,
+		sz_fill_dir_t filler, off_t offset )
+{
+	SZNODE *node = get_node_for_path( fs, path );
+	struct stat st;
+	size_t i;
+
+	if( ! node ) {
+		return -ENOENT;
+	}
+	if( ! S_ISDIR( node->mode ) ) {
+		return -ENOTDIR;
+	}
+	node_stat( fs, node, &st );
+	if( offset < 1 && filler( buf, ".", &st, 1 ) ) {
+		return 0;
+	}
+	node_stat( fs, node->parent ? node->parent : node, &st );
+	if( offset < 2 && filler( buf, "..", &st, 2 ) ) {
+		return 0;
+	}
+	for( i = offset < 3 ? 0 : ( size_t )offset - 2; i < node->nchildren;
+			i++ ) {
+		node_stat( fs, node->children[i], &st );
+		if( filler( buf, node->children[i]->name, &st,
+					( off_t )i + 3 ) ) {
+			break;
+		}
+	}
+	return 0;
+}
+
+int
+sz_open( sevenzip_fs_t *fs, const char *path, int flags )
+{
+	if( ! get_node_for_path( fs, path ) ) {
+		return -ENOENT;
+	}
+	if( ( flags & O_ACCMODE ) != O_RDONLY || ( flags & O_TRUNC ) ) {
+		return -EROFS;
+	}
+	return 0;
+}
+
+int
+sz_release( sevenzip_fs_t *fs, const char *path )
+{
+	/* the decoded folder stays in the cache for the next reader */
+	( void )fs;
+	( void )path;
+	return 0;
+}
+
+int
+sz_read( sevenzip_fs_t *fs, const char *path, char *buf, size_t size,
+		off_t offset )
+{
+	SZNODE *node = get_node_for_path( fs, path );
+	struct szfolder *f;
+	int ret;
+
+	if( ! node ) {
+		return -ENOENT;
+	}
+	if( S_ISDIR( node->mode ) ) {
+		return -EISDIR;
+	}
+	if( offset < 0 ) {
+		return -EINVAL;
+	}
+	if( offset >= node->size ) {
+		return 0;
+	}
+	if( ( int64_t )size > node->size - offset ) {
+		size = node->size - offset;
+	}
+	if( size > INT_MAX ) {
+		size = INT_MAX;
+	}
+	if( node->folder == -1 ) {
+		return -EIO;
+	}
+	if( folder_streamed( fs, ( UInt32 )node->folder )
+			&& ( ret = stream_read( fs, node, buf, size,
+					offset ) ) != -ENOTSUP ) {
+		return ret;
+	}
+	/* filters like BCJ need the whole folder */
+	if( ( f = folder_get( fs, ( UInt32 )node->folder, 1, &ret ) )
+			== NULL ) {
+		return ret;
+	}
+	if( ( UInt64 )node->folderoffset + node->size > f->size ) {
+		log( "item %lld lies outside its folder", ( long long )node->file );
+		ret = -EIO;
+	} else if( ( ret = check_item( fs, f, node ) ) == 0 ) {
+		memcpy( buf, f->data + node->folderoffset + offset, size );
+		ret = size;
+	}
+	folder_put( fs, f );
+	return ret;
+}
+
+void
+sz_cache_status( sevenzip_fs_t *fs, sz_cache_stats *stats )
+{
+	pthread_mutex_lock( &fs->lock );
+	stats->hits = fs->hits;
+	stats->misses = fs->misses;
+	stats->folders = fs->nfolders;
+	stats->memory = fs->foldermem;
+	pthread_mutex_unlock( &fs->lock );
+	pthread_mutex_lock( &fs->streamlock );
+	stats->checkpoints = fs->ncheckpoints;
+	stats->checkpointmem = fs->checkpointmem;
+	pthread_mutex_unlock( &fs->streamlock );
+}
+
+int
+sz_prefetch( sevenzip_fs_t *fs, const char *path )
+{
+	SZNODE *node = get_node_for_path( fs, path );
+	UInt32 nfolders = fs->db->db.db.NumFolders;
+	struct szprefetch p;
+	pthread_t *threads;
+	Byte *marks;
+	UInt64 total = 0;
+	UInt32 i;
+	int nthreads = fs->options.threads;
+	int started = 0;
+
+	if( ! node ) {
+		return -ENOENT;
+	}
+	memset( &p, 0, sizeof( p ) );
+	p.fs = fs;
+	if( ( marks = calloc( nfolders + 1, 1 ) ) == NULL
+			|| ( p.folders = malloc( ( nfolders + 1 ) *
+					sizeof( UInt32 ) ) ) == NULL ) {
+		free( marks );
+		return -ENOMEM;
+	}
+	prefetch_mark( node, marks );
+	/* in archive order, as far as they fit into the cache together */
+	for( i = 0; i < nfolders; i++ ) {
+		UInt64 size = SzFolder_GetUnpackSize( fs->db->db.db.Folders + i );
+		if( marks[i] && ! folder_streamed( fs, i ) ) {
+			if( total + size > fs->options.foldercache ) {
+				break;
+			}
+			total += size;
+			p.folders[p.count++] = i;
+		}
+	}
+	free( marks );
+	if( nthreads <= 0 ) {
+		nthreads = sysconf( _SC_NPROCESSORS_ONLN );
+		if( nthreads <= 0 ) {
+			nthreads = 1;
+		}
+	}
+	if( ( size_t )nthreads > p.count ) {
+		nthreads = p.count ? ( int )p.count : 1;
+	}
+	pthread_mutex_init( &p.lock, NULL );
+	/* the caller is one of the workers */
+	if( nthreads > 1 && ( threads = malloc( ( nthreads - 1 ) *
+					sizeof( pthread_t ) ) ) != NULL ) {
+		while( started < nthreads - 1 && pthread_create(
+					&threads[started], NULL,
+					prefetch_worker, &p ) == 0 ) {
+			started++;
+		}
+	} else {
+		threads = NULL;
+	}
+	prefetch_worker( &p );
+	for( i = 0; i < ( UInt32 )started; i++ ) {
+		pthread_join( threads[i], NULL );
+	}
+	free( threads );
+	pthread_mutex_destroy( &p.lock );
+	free( p.folders );
+	return p.ret;
+}
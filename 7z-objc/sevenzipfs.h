@@ -0,0 +1,133 @@
+/*
+ *  sevenzipfs.h
+ *  avfsmac
+ *
+ *  Read-only file system on a 7z archive, the part of SQSevenZip that does
+ *  not need Cocoa. The whole directory tree is built from the archive's
+ *  header database when mounting, member data is decoded a folder (solid
+ *  block) at a time and the decoded folders are cached; folders larger
+ *  than the cache are decoded incrementally as they are read, resuming from
+ *  saved decoder states when a read goes back. The calls mirror
+ *  ar_getattr(), ar_readdir() and ar_read() of archivefs and return 0 or
+ *  0-errno the same way.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+/*******************/
+/* data structures */
+/*******************/
+
+typedef struct sznode {
+	struct sznode *parent;
+	struct sznode **children; /* for directories, sorted by name */
+	size_t nchildren; /* number of nodes in children */
+	size_t childsize; /* number of nodes allocated in children */
+	const char *name; /* last component of the path */
+	char *namebuf; /* name, when it could not point into the archive's
+			  file names */
+	int64_t file; /* index of the item in the archive, -1 for directories
+			 only implied by the paths of others */
+	int64_t folder; /* index of the folder holding the data, -1 for
+			   none */
+	int64_t folderoffset; /* where the data starts in the decoded
+				 folder */
+	int64_t size;
+	int64_t ino;
+	time_t mtime;
+	long mtimensec;
+	mode_t mode;
+	unsigned int nlink;
+	struct sznode *hashnext; /* next node in the same bucket while the
+				    tree is built */
+} SZNODE;
+
+typedef struct {
+	size_t foldercache; /* memory for decoded folders kept for later
+			       reads, in bytes; the folder read last is kept
+			       even if it is larger */
+	size_t checkpointmem; /* memory for decoder states that reads going
+				 back in folders larger than the cache resume
+				 from, 0 for none */
+	int threads; /* workers decoding folders in sz_prefetch(), 0 for
+			one per processor */
+} sevenzip_fs_options;
+
+/* counters of the decoded folder cache, see sz_cache_status() */
+typedef struct {
+	size_t hits; /* reads that found their folder decoded */
+	size_t misses; /* reads that decoded their folder */
+	size_t folders; /* folders in the cache */
+	size_t memory; /* bytes used by them */
+	size_t checkpoints; /* decoder states saved in streamed folders */
+	size_t checkpointmem; /* bytes used by them */
+} sz_cache_stats;
+
+struct sevenzip_db;
+struct szfolder;
+struct szstream;
+struct szreader;
+
+typedef struct {
+	struct sevenzip_db *db; /* the opened archive and its header database */
+	SZNODE *root;
+	size_t nodecount; /* number of nodes in the tree */
+	struct stat archivestat; /* the archive file, for the owner and the
+				    times of directories it does not list */
+	struct szfolder *folders; /* decoded folders, most recently used
+				     first */
+	struct szfolder *folderstail; /* least recently used */
+	size_t nfolders; /* number of decoded folders */
+	size_t foldermem; /* bytes of decoded data in folders */
+	size_t hits; /* see sz_cache_stats */
+	size_t misses;
+	struct szreader *readers; /* idle archive readers */
+	int nreaders; /* number of readers in readers */
+	pthread_mutex_t lock; /* protects the folder cache and readers */
+	pthread_cond_t decoded; /* signalled when a folder has been decoded
+				   or failed to */
+	struct szstream *streams; /* decoders of folders larger than the
+				     cache, most recently used first */
+	int nstreams; /* number of decoders in streams */
+	size_t ncheckpoints; /* see sz_cache_stats */
+	size_t checkpointmem;
+	pthread_mutex_t streamlock; /* serializes decoding, the archive is
+				       read through a single stream; protects
+				       streams and the checkpoints */
+	sevenzip_fs_options options;
+} sevenzip_fs_t;
+
+/* offset is the cookie to pass to sz_readdir() to continue after name;
+   returning non-zero stops the listing before name */
+typedef int (*sz_fill_dir_t)( void *buf, const char *name,
+		const struct stat *st, off_t offset );
+
+/*************/
+/* functions */
+/*************/
+
+void sz_default_options( sevenzip_fs_options *options );
+/* opens the archive and reads its tree
+   @return 0 on success, 0-errno else */
+int sz_init( sevenzip_fs_t *fs, const char *archiveFile );
+int sz_init_with_options( sevenzip_fs_t *fs, const char *archiveFile,
+		const sevenzip_fs_options *options );
+int sz_free( sevenzip_fs_t *fs );
+int sz_getattr( sevenzip_fs_t *fs, const char *path, struct stat *stbuf );
+/* lists the entries with the attributes sz_getattr() returns for them */
+int sz_readdir( sevenzip_fs_t *fs, const char *path, void *buf,
+		sz_fill_dir_t filler, off_t offset );
+/* fails with EROFS for flags that allow writing */
+int sz_open( sevenzip_fs_t *fs, const char *path, int flags );
+int sz_release( sevenzip_fs_t *fs, const char *path );
+/* @return bytes read, 0-errno on errors */
+int sz_read( sevenzip_fs_t *fs, const char *path, char *buf, size_t size,
+		off_t offset );
+void sz_cache_status( sevenzip_fs_t *fs, sz_cache_stats *stats );
+/* decodes the folders holding the files at and below path into the cache,
+   as many as fit, in options.threads threads at once
+   @return 0, or 0-errno of the first folder that failed */
+int sz_prefetch( sevenzip_fs_t *fs, const char *path );
@@ -0,0 +1,248 @@
+/*
+ *  sztest.c
+ *  avfsmac
+ *
+ *  Command-line check of the 7z file system core, run by "make check":
+ *  mounts a 7z archive and compares every file and directory below a
+ *  source directory with what the mount returns for it. The options pick
+ *  the path through the core that is checked: the folder cache, streamed
+ *  folders read backwards from their checkpoints, readers sharing folders
+ *  in several threads, or a prefetch in a pool of workers first.
+ *
+ */
+
+#include "sevenzipfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define CHUNK 65536
+#define MAX_READERS 64
+
+static sevenzip_fs_t fs;
+static const char *srcroot;
+static int backwards; /* read the files chunk by chunk from their end */
+static int failures;
+static pthread_mutex_t failurelock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+fail( const char *path, const char *what )
+{
+	pthread_mutex_lock( &failurelock );
+	fprintf( stderr, "%s: %s\n", path, what );
+	failures++;
+	pthread_mutex_unlock( &failurelock );
+}
+
+/* compares the data of the regular file srcpath, size bytes long, with
+   path in fs */
+static void
+compare_data( const char *path, const char *srcpath, off_t size )
+{
+	char *want;
+	char *got;
+	off_t chunks = ( size + CHUNK - 1 ) / CHUNK;
+	off_t i;
+	int fh;
+
+	if( ( fh = open( srcpath, O_RDONLY ) ) == -1 ) {
+		fail( srcpath, strerror( errno ) );
+		return;
+	}
+	if( ( want = malloc( CHUNK ) ) == NULL
+			|| ( got = malloc( CHUNK ) ) == NULL ) {
+		free( want );
+		close( fh );
+		fail( path, "out of memory" );
+		return;
+	}
+	/* one read past the end, which has to return nothing */
+	for( i = 0; i <= chunks; i++ ) {
+		off_t offset = ( backwards ? chunks - i : i ) * CHUNK;
+		ssize_t len = pread( fh, want, CHUNK, offset );
+		int ret;
+		if( len == -1 ) {
+			fail( srcpath, strerror( errno ) );
+			break;
+		}
+		if( ( ret = sz_read( &fs, path, got, CHUNK, offset ) ) < 0 ) {
+			fail( path, strerror( 0 - ret ) );
+			break;
+		}
+		if( ret != len || memcmp( want, got, len ) != 0 ) {
+			fail( path, "data differs" );
+			break;
+		}
+	}
+	free( want );
+	free( got );
+	close( fh );
+}
+
+static int
+count_entry( void *buf, const char *name, const struct stat *st,
+		off_t offset )
+{
+	if( strcmp( name, "." ) != 0 && strcmp( name, ".." ) != 0 ) {
+		( *( size_t * )buf )++;
+	}
+	return 0;
+}
+
+/* compares everything below srcdir with the directory path in fs */
+static void
+compare_tree( const char *path, const char *srcdir )
+{
+	DIR *dir;
+	struct dirent *de;
+	size_t want = 0;
+	size_t got = 0;
+	int ret;
+
+	if( ( dir = opendir( srcdir ) ) == NULL ) {
+		fail( srcdir, strerror( errno ) );
+		return;
+	}
+	while( ( de = readdir( dir ) ) != NULL ) {
+		char mountpath[PATH_MAX];
+		char srcpath[PATH_MAX];
+		struct stat wantst;
+		struct stat gotst;
+
+		if( strcmp( de->d_name, "." ) == 0
+				|| strcmp( de->d_name, ".." ) == 0 ) {
+			continue;
+		}
+		want++;
+		snprintf( mountpath, sizeof( mountpath ), "%s/%s",
+				strcmp( path, "/" ) == 0 ? "" : path,
+				de->d_name );
+		snprintf( srcpath, sizeof( srcpath ), "%s/%s", srcdir,
+				de->d_name );
+		if( lstat( srcpath, &wantst ) == -1 ) {
+			fail( srcpath, strerror( errno ) );
+			continue;
+		}
+		if( ( ret = sz_getattr( &fs, mountpath, &gotst ) ) != 0 ) {
+			fail( mountpath, strerror( 0 - ret ) );
+			continue;
+		}
+		if( ( gotst.st_mode & S_IFMT ) != ( wantst.st_mode & S_IFMT ) ) {
+			fail( mountpath, "type differs" );
+		} else if( S_ISDIR( wantst.st_mode ) ) {
+			compare_tree( mountpath, srcpath );
+		} else if( S_ISREG( wantst.st_mode ) ) {
+			if( gotst.st_size != wantst.st_size ) {
+				fail( mountpath, "size differs" );
+			} else if( ( ret = sz_open( &fs, mountpath,
+							O_RDONLY ) ) != 0 ) {
+				fail( mountpath, strerror( 0 - ret ) );
+			} else {
+				compare_data( mountpath, srcpath,
+						wantst.st_size );
+				sz_release( &fs, mountpath );
+			}
+		}
+	}
+	closedir( dir );
+	if( ( ret = sz_readdir( &fs, path, &got, count_entry, 0 ) ) != 0 ) {
+		fail( path, strerror( 0 - ret ) );
+	} else if( got != want ) {
+		fail( path, "number of entries differs" );
+	}
+}
+
+static void *
+reader( void *data )
+{
+	compare_tree( "/", srcroot );
+	return NULL;
+}
+
+static void
+usage( const char *name )
+{
+	fprintf( stderr, "usage: %s [-b] [-p] [-c foldercache] "
+			"[-k checkpointmem] [-t threads] [-r readers] "
+			"archive srcdir\n"
+			"  -b  read the files backwards\n"
+			"  -p  prefetch all folders first\n"
+			"  -r  compare in this many threads at once\n",
+			name );
+}
+
+int
+main( int argc, char **argv )
+{
+	sevenzip_fs_options options;
+	pthread_t readers[MAX_READERS];
+	sz_cache_stats stats;
+	int nreaders = 1;
+	int prefetch = 0;
+	int opt;
+	int ret;
+	int i;
+
+	sz_default_options( &options );
+	while( ( opt = getopt( argc, argv, "bpc:k:t:r:" ) ) != -1 ) {
+		switch( opt ) {
+		case 'b':
+			backwards = 1;
+			break;
+		case 'p':
+			prefetch = 1;
+			break;
+		case 'c':
+			options.foldercache = strtoul( optarg, NULL, 0 );
+			break;
+		case 'k':
+			options.checkpointmem = strtoul( optarg, NULL, 0 );
+			break;
+		case 't':
+			options.threads = atoi( optarg );
+			break;
+		case 'r':
+			nreaders = atoi( optarg );
+			break;
+		default:
+			usage( argv[0] );
+			return 2;
+		}
+	}
+	if( argc - optind != 2 || nreaders < 1 || nreaders > MAX_READERS ) {
+		usage( argv[0] );
+		return 2;
+	}
+	srcroot = argv[optind + 1];
+	if( ( ret = sz_init_with_options( &fs, argv[optind],
+					&options ) ) != 0 ) {
+		fprintf( stderr, "%s: could not be mounted: %s\n",
+				argv[optind], strerror( 0 - ret ) );
+		return 1;
+	}
+	if( prefetch && ( ret = sz_prefetch( &fs, "/" ) ) != 0 ) {
+		fail( "/", strerror( 0 - ret ) );
+	}
+	for( i = 0; i < nreaders; i++ ) {
+		if( ( ret = pthread_create( &readers[i], NULL, reader,
+						NULL ) ) != 0 ) {
+			fail( "reader", strerror( ret ) );
+			break;
+		}
+	}
+	while( i-- > 0 ) {
+		pthread_join( readers[i], NULL );
+	}
+	sz_cache_status( &fs, &stats );
+	sz_free( &fs );
+	printf( "%s: %s (hits %zu, misses %zu, checkpoints %zu)\n",
+			argv[optind], failures ? "FAILED" : "ok", stats.hits,
+			stats.misses, stats.checkpoints );
+	return failures ? 1 : 0;
+}
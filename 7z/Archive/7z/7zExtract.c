@@ -1,93 +1,391 @@
-/* 7zExtract.c -- Extracting from 7z archive
-2008-11-23 : Igor Pavlov : Public domain */
-
-#include "../../7zCrc.h"
-#include "7zDecode.h"
-#include "7zExtract.h"
-
-SRes SzAr_Extract(
-    const CSzArEx *p,
-    ILookInStream *inStream,
-    UInt32 fileIndex,
-    UInt32 *blockIndex,
-    Byte **outBuffer,
-    size_t *outBufferSize,
-    size_t *offset,
-    size_t *outSizeProcessed,
-    ISzAlloc *allocMain,
-    ISzAlloc *allocTemp)
-{
-  UInt32 folderIndex = p->FileIndexToFolderIndexMap[fileIndex];
-  SRes res = SZ_OK;
-  *offset = 0;
-  *outSizeProcessed = 0;
-  if (folderIndex == (UInt32)-1)
-  {
-    IAlloc_Free(allocMain, *outBuffer);
-    *blockIndex = folderIndex;
-    *outBuffer = 0;
-    *outBufferSize = 0;
-    return SZ_OK;
-  }
-
-  if (*outBuffer == 0 || *blockIndex != folderIndex)
-  {
-    CSzFolder *folder = p->db.Folders + folderIndex;
-    UInt64 unpackSizeSpec = SzFolder_GetUnpackSize(folder);
-    size_t unpackSize = (size_t)unpackSizeSpec;
-    UInt64 startOffset = SzArEx_GetFolderStreamPos(p, folderIndex, 0);
-
-    if (unpackSize != unpackSizeSpec)
-      return SZ_ERROR_MEM;
-    *blockIndex = folderIndex;
-    IAlloc_Free(allocMain, *outBuffer);
-    *outBuffer = 0;
-    
-    RINOK(LookInStream_SeekTo(inStream, startOffset));
-    
-    if (res == SZ_OK)
-    {
-      *outBufferSize = unpackSize;
-      if (unpackSize != 0)
-      {
-        *outBuffer = (Byte *)IAlloc_Alloc(allocMain, unpackSize);
-        if (*outBuffer == 0)
-          res = SZ_ERROR_MEM;
-      }
-      if (res == SZ_OK)
-      {
-        res = SzDecode(p->db.PackSizes +
-          p->FolderStartPackStreamIndex[folderIndex], folder,
-          inStream, startOffset,
-          *outBuffer, unpackSize, allocTemp);
-        if (res == SZ_OK)
-        {
-          if (folder->UnpackCRCDefined)
-          {
-            if (CrcCalc(*outBuffer, unpackSize) != folder->UnpackCRC)
-              res = SZ_ERROR_CRC;
-          }
-        }
-      }
-    }
-  }
-  if (res == SZ_OK)
-  {
-    UInt32 i;
-    CSzFileItem *fileItem = p->db.Files + fileIndex;
-    *offset = 0;
-    for (i = p->FolderStartFileIndex[folderIndex]; i < fileIndex; i++)
-      *offset += (UInt32)p->db.Files[i].Size;
-    *outSizeProcessed = (size_t)fileItem->Size;
-    if (*offset + *outSizeProcessed > *outBufferSize)
-      return SZ_ERROR_FAIL;
-    {
-      if (fileItem->FileCRCDefined)
-      {
-        if (CrcCalc(*outBuffer + *offset, *outSizeProcessed) != fileItem->FileCRC)
-          res = SZ_ERROR_CRC;
-      }
-    }
-  }
-  return res;
-}
+/* 7zExtract.c -- Extracting from 7z archive
+2008-11-23 : Igor Pavlov : Public domain */
+
+#include <string.h>
+
+#include "../../7zCrc.h"
+#include "7zDecode.h"
+#include "7zExtract.h"
+
+SRes SzAr_Extract(
+    const CSzArEx *p,
+    ILookInStream *inStream,
+    UInt32 fileIndex,
+    UInt32 *blockIndex,
+    Byte **outBuffer,
+    size_t *outBufferSize,
+    size_t *offset,
+    size_t *outSizeProcessed,
+    ISzAlloc *allocMain,
+    ISzAlloc *allocTemp)
+{
+  UInt32 folderIndex = p->FileIndexToFolderIndexMap[fileIndex];
+  SRes res = SZ_OK;
+  *offset = 0;
+  *outSizeProcessed = 0;
+  if (folderIndex == (UInt32)-1)
+  {
+    IAlloc_Free(allocMain, *outBuffer);
+    *blockIndex = folderIndex;
+    *outBuffer = 0;
+    *outBufferSize = 0;
+    return SZ_OK;
+  }
+
+  if (*outBuffer == 0 || *blockIndex != folderIndex)
+  {
+    CSzFolder *folder = p->db.Folders + folderIndex;
+    UInt64 unpackSizeSpec = SzFolder_GetUnpackSize(folder);
+    size_t unpackSize = (size_t)unpackSizeSpec;
+    UInt64 startOffset = SzArEx_GetFolderStreamPos(p, folderIndex, 0);
+
+    if (unpackSize != unpackSizeSpec)
+      return SZ_ERROR_MEM;
+    *blockIndex = folderIndex;
+    IAlloc_Free(allocMain, *outBuffer);
+    *outBuffer = 0;
+    
+    RINOK(LookInStream_SeekTo(inStream, startOffset));
+    
+    if (res == SZ_OK)
+    {
+      *outBufferSize = unpackSize;
+      if (unpackSize != 0)
+      {
+        *outBuffer = (Byte *)IAlloc_Alloc(allocMain, unpackSize);
+        if (*outBuffer == 0)
+          res = SZ_ERROR_MEM;
+      }
+      if (res == SZ_OK)
+      {
+        res = SzDecode(p->db.PackSizes +
+          p->FolderStartPackStreamIndex[folderIndex], folder,
+          inStream, startOffset,
+          *outBuffer, unpackSize, allocTemp);
+        if (res == SZ_OK)
+        {
+          if (folder->UnpackCRCDefined)
+          {
+            if (CrcCalc(*outBuffer, unpackSize) != folder->UnpackCRC)
+              res = SZ_ERROR_CRC;
+          }
+        }
+      }
+    }
+  }
+  if (res == SZ_OK)
+  {
+    UInt32 i;
+    CSzFileItem *fileItem = p->db.Files + fileIndex;
+    *offset = 0;
+    for (i = p->FolderStartFileIndex[folderIndex]; i < fileIndex; i++)
+      *offset += (UInt32)p->db.Files[i].Size;
+    *outSizeProcessed = (size_t)fileItem->Size;
+    if (*offset + *outSizeProcessed > *outBufferSize)
+      return SZ_ERROR_FAIL;
+    {
+      if (fileItem->FileCRCDefined)
+      {
+        if (CrcCalc(*outBuffer + *offset, *outSizeProcessed) != fileItem->FileCRC)
+          res = SZ_ERROR_CRC;
+      }
+    }
+  }
+  return res;
+}
+
+#define k_Copy 0
+#define k_LZMA 0x30101
+
+void SzFolderStream_Construct(CSzFolderStream *p)
+{
+  LzmaDec_Construct(&p->dec);
+  p->db = 0;
+}
+
+static void SzFolderStream_FirstFile(CSzFolderStream *p, UInt32 fileIndex, UInt64 start)
+{
+  const CSzArEx *db = p->db;
+  while (fileIndex < db->db.NumFiles &&
+      db->FileIndexToFolderIndexMap[fileIndex] == p->folderIndex &&
+      !db->db.Files[fileIndex].HasStream)
+    fileIndex++;
+  p->fileIndex = fileIndex;
+  p->fileEnd = start;
+  if (fileIndex < db->db.NumFiles && db->FileIndexToFolderIndexMap[fileIndex] == p->folderIndex)
+    p->fileEnd += db->db.Files[fileIndex].Size;
+  p->fileCrc = CRC_INIT_VAL;
+}
+
+static void SzFolderStream_Restart(CSzFolderStream *p)
+{
+  if (p->methodID == k_LZMA)
+  {
+    LzmaDec_Init(&p->dec);
+    p->dec.dicPos = 0;
+  }
+  p->packPos = 0;
+  p->outPos = 0;
+  p->crc = CRC_INIT_VAL;
+  SzFolderStream_FirstFile(p, p->db->FolderStartFileIndex[p->folderIndex], 0);
+}
+
+SRes SzFolderStream_Open(CSzFolderStream *p, const CSzArEx *db, UInt32 folderIndex, ISzAlloc *alloc)
+{
+  CSzFolder *folder = db->db.Folders + folderIndex;
+  CSzCoderInfo *coder = folder->Coders;
+  if (folder->NumCoders != 1 || folder->NumPackStreams != 1 ||
+      coder->NumInStreams != 1 || coder->NumOutStreams != 1 ||
+      (coder->MethodID != k_Copy && coder->MethodID != k_LZMA))
+    return SZ_ERROR_UNSUPPORTED;
+  p->db = db;
+  p->folderIndex = folderIndex;
+  p->methodID = coder->MethodID;
+  p->unpackSize = SzFolder_GetUnpackSize(folder);
+  p->packStart = SzArEx_GetFolderStreamPos(db, folderIndex, 0);
+  p->packSize = db->db.PackSizes[db->FolderStartPackStreamIndex[folderIndex]];
+  p->error = SZ_OK;
+  if (p->methodID == k_LZMA)
+  {
+    CLzmaProps props;
+    SizeT dicBufSize;
+    RINOK(LzmaProps_Decode(&props, coder->Props.data, (unsigned)coder->Props.size));
+    dicBufSize = props.dicSize;
+    /* back references never reach before the folder start */
+    if (dicBufSize > p->unpackSize)
+      dicBufSize = (SizeT)p->unpackSize;
+    if (dicBufSize == 0)
+      dicBufSize = 1;
+    RINOK(LzmaDec_AllocateProbs(&p->dec, coder->Props.data, (unsigned)coder->Props.size, alloc));
+    p->dec.dic = (Byte *)IAlloc_Alloc(alloc, dicBufSize);
+    if (p->dec.dic == 0)
+    {
+      LzmaDec_FreeProbs(&p->dec, alloc);
+      return SZ_ERROR_MEM;
+    }
+    p->dec.dicBufSize = dicBufSize;
+  }
+  SzFolderStream_Restart(p);
+  return SZ_OK;
+}
+
+static int SzFolderStream_InFolder(const CSzFolderStream *p)
+{
+  return p->fileIndex < p->db->db.NumFiles &&
+      p->db->FileIndexToFolderIndexMap[p->fileIndex] == p->folderIndex;
+}
+
+/* updates the CRCs with the size bytes decoded at data, at outPos */
+static SRes SzFolderStream_Check(CSzFolderStream *p, const Byte *data, size_t size)
+{
+  CSzFolder *folder = p->db->db.Folders + p->folderIndex;
+  UInt64 pos = p->outPos;
+  UInt64 end = pos + size;
+  p->crc = CrcUpdate(p->crc, data, size);
+  while (SzFolderStream_InFolder(p) && p->fileEnd <= end)
+  {
+    const CSzFileItem *file = p->db->db.Files + p->fileIndex;
+    size_t cur = (size_t)(p->fileEnd - pos);
+    p->fileCrc = CrcUpdate(p->fileCrc, data, cur);
+    data += cur;
+    pos += cur;
+    if (file->FileCRCDefined && CRC_GET_DIGEST(p->fileCrc) != file->FileCRC)
+      return SZ_ERROR_CRC;
+    SzFolderStream_FirstFile(p, p->fileIndex + 1, p->fileEnd);
+  }
+  if (SzFolderStream_InFolder(p))
+    p->fileCrc = CrcUpdate(p->fileCrc, data, (size_t)(end - pos));
+  if (end == p->unpackSize && folder->UnpackCRCDefined &&
+      CRC_GET_DIGEST(p->crc) != folder->UnpackCRC)
+    return SZ_ERROR_CRC;
+  return SZ_OK;
+}
+
+static SRes SzFolderStream_Decode(CSzFolderStream *p, ILookInStream *inStream, UInt64 target)
+{
+  RINOK(LookInStream_SeekTo(inStream, p->packStart + p->packPos));
+  while (p->outPos < target)
+  {
+    Byte *inBuf = NULL;
+    size_t lookahead = (1 << 18);
+    SizeT dicPos, dicLimit, inProcessed;
+    ELzmaStatus status;
+    SRes res;
+    if (p->dec.dicPos == p->dec.dicBufSize)
+      p->dec.dicPos = 0;
+    dicPos = p->dec.dicPos;
+    dicLimit = p->dec.dicBufSize;
+    if (target - p->outPos < dicLimit - dicPos)
+      dicLimit = dicPos + (SizeT)(target - p->outPos);
+    if (lookahead > p->packSize - p->packPos)
+      lookahead = (size_t)(p->packSize - p->packPos);
+    RINOK(inStream->Look((void *)inStream, (void **)&inBuf, &lookahead));
+    inProcessed = (SizeT)lookahead;
+    res = LzmaDec_DecodeToDic(&p->dec, dicLimit, inBuf, &inProcessed, LZMA_FINISH_ANY, &status);
+    RINOK(res);
+    RINOK(inStream->Skip((void *)inStream, inProcessed));
+    p->packPos += inProcessed;
+    if (p->dec.dicPos == dicPos)
+    {
+      /* no progress: the input ended or the stream ended early */
+      if (inProcessed == 0 || status == LZMA_STATUS_FINISHED_WITH_MARK)
+        return SZ_ERROR_DATA;
+      continue;
+    }
+    RINOK(SzFolderStream_Check(p, p->dec.dic + dicPos, p->dec.dicPos - dicPos));
+    p->outPos += p->dec.dicPos - dicPos;
+  }
+  return SZ_OK;
+}
+
+SRes SzFolderStream_DecodeTo(CSzFolderStream *p, ILookInStream *inStream, UInt64 target)
+{
+  SRes res;
+  if (p->error != SZ_OK)
+    return p->error;
+  if (p->methodID != k_LZMA)
+    return SZ_ERROR_UNSUPPORTED;
+  if (target > p->unpackSize)
+    return SZ_ERROR_PARAM;
+  res = SzFolderStream_Decode(p, inStream, target);
+  if (res != SZ_OK)
+    p->error = res;
+  return res;
+}
+
+int SzFolderStream_CanSave(const CSzFolderStream *p)
+{
+  return p->methodID == k_LZMA;
+}
+
+UInt64 SzFolderStream_WindowStart(const CSzFolderStream *p)
+{
+  if (p->methodID != k_LZMA)
+    return 0;
+  return p->outPos > p->dec.dicBufSize ? p->outPos - p->dec.dicBufSize : 0;
+}
+
+SRes SzFolderStream_Read(CSzFolderStream *p, ILookInStream *inStream,
+    UInt64 pos, Byte *buf, size_t size, size_t *processed)
+{
+  *processed = 0;
+  if (p->error != SZ_OK)
+    return p->error;
+  if (pos >= p->unpackSize)
+    return SZ_OK;
+  if (size > p->unpackSize - pos)
+    size = (size_t)(p->unpackSize - pos);
+  if (p->methodID == k_Copy)
+  {
+    RINOK(LookInStream_SeekTo(inStream, p->packStart + pos));
+    RINOK(LookInStream_Read(inStream, buf, size));
+    *processed = size;
+    return SZ_OK;
+  }
+  if (pos < SzFolderStream_WindowStart(p))
+    SzFolderStream_Restart(p);
+  while (*processed < size)
+  {
+    UInt64 cur = pos + *processed;
+    size_t rem = size - *processed;
+    if (cur < p->outPos)
+    {
+      /* the byte at folder position x is at dic[x % dicBufSize] */
+      size_t start = (size_t)(cur % p->dec.dicBufSize);
+      size_t len = p->dec.dicBufSize - start;
+      if (len > p->outPos - cur)
+        len = (size_t)(p->outPos - cur);
+      if (len > rem)
+        len = rem;
+      memcpy(buf + *processed, p->dec.dic + start, len);
+      *processed += len;
+    }
+    else
+    {
+      UInt64 target = cur + (rem < p->dec.dicBufSize ? rem : p->dec.dicBufSize);
+      SRes res;
+      /* skipping to cur decodes through the window, one window at a time */
+      if (cur > p->outPos)
+        target = p->outPos + (cur - p->outPos < p->dec.dicBufSize ? cur - p->outPos : p->dec.dicBufSize);
+      res = SzFolderStream_Decode(p, inStream, target);
+      if (res != SZ_OK)
+      {
+        p->error = res;
+        return res;
+      }
+    }
+  }
+  return SZ_OK;
+}
+
+void SzFolderStream_Free(CSzFolderStream *p, ISzAlloc *alloc)
+{
+  if (p->db != 0 && p->methodID == k_LZMA)
+  {
+    LzmaDec_FreeProbs(&p->dec, alloc);
+    IAlloc_Free(alloc, p->dec.dic);
+    p->dec.dic = 0;
+  }
+  p->db = 0;
+}
+
+SRes SzFolderStream_Save(const CSzFolderStream *p, CSzFolderCheckpoint *cp, ISzAlloc *alloc)
+{
+  size_t probsSize;
+  if (p->methodID != k_LZMA)
+    return SZ_ERROR_UNSUPPORTED;
+  if (p->error != SZ_OK)
+    return p->error;
+  probsSize = p->dec.numProbs * sizeof(CLzmaProb);
+  /* before the first wrap only the start of the window is used */
+  cp->dicSize = p->outPos < p->dec.dicBufSize ? (size_t)p->outPos : p->dec.dicBufSize;
+  cp->dec = p->dec;
+  cp->dec.probs = (CLzmaProb *)IAlloc_Alloc(alloc, probsSize);
+  cp->dec.dic = (Byte *)IAlloc_Alloc(alloc, cp->dicSize ? cp->dicSize : 1);
+  if (cp->dec.probs == 0 || cp->dec.dic == 0)
+  {
+    SzFolderCheckpoint_Free(cp, alloc);
+    return SZ_ERROR_MEM;
+  }
+  memcpy(cp->dec.probs, p->dec.probs, probsSize);
+  memcpy(cp->dec.dic, p->dec.dic, cp->dicSize);
+  cp->outPos = p->outPos;
+  cp->packPos = p->packPos;
+  cp->crc = p->crc;
+  cp->fileIndex = p->fileIndex;
+  cp->fileEnd = p->fileEnd;
+  cp->fileCrc = p->fileCrc;
+  return SZ_OK;
+}
+
+void SzFolderStream_Restore(CSzFolderStream *p, const CSzFolderCheckpoint *cp)
+{
+  CLzmaProb *probs = p->dec.probs;
+  Byte *dic = p->dec.dic;
+  SizeT dicBufSize = p->dec.dicBufSize;
+  p->dec = cp->dec;
+  p->dec.probs = probs;
+  p->dec.dic = dic;
+  p->dec.dicBufSize = dicBufSize;
+  memcpy(probs, cp->dec.probs, p->dec.numProbs * sizeof(CLzmaProb));
+  memcpy(dic, cp->dec.dic, cp->dicSize);
+  p->outPos = cp->outPos;
+  p->packPos = cp->packPos;
+  p->crc = cp->crc;
+  p->fileIndex = cp->fileIndex;
+  p->fileEnd = cp->fileEnd;
+  p->fileCrc = cp->fileCrc;
+}
+
+size_t SzFolderCheckpoint_Size(const CSzFolderCheckpoint *cp)
+{
+  return cp->dec.numProbs * sizeof(CLzmaProb) + cp->dicSize;
+}
+
+void SzFolderCheckpoint_Free(CSzFolderCheckpoint *cp, ISzAlloc *alloc)
+{
+  IAlloc_Free(alloc, cp->dec.probs);
+  IAlloc_Free(alloc, cp->dec.dic);
+  cp->dec.probs = 0;
+  cp->dec.dic = 0;
+}
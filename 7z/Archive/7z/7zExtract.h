@@ -1,41 +1,118 @@
-/* 7zExtract.h -- Extracting from 7z archive
-2008-11-23 : Igor Pavlov : Public domain */
-
-#ifndef __7Z_EXTRACT_H
-#define __7Z_EXTRACT_H
-
-#include "7zIn.h"
-
-/*
-  SzExtract extracts file from archive
-
-  *outBuffer must be 0 before first call for each new archive.
-
-  Extracting cache:
-    If you need to decompress more than one file, you can send
-    these values from previous call:
-      *blockIndex,
-      *outBuffer,
-      *outBufferSize
-    You can consider "*outBuffer" as cache of solid block. If your archive is solid,
-    it will increase decompression speed.
-  
-    If you use external function, you can declare these 3 cache variables
-    (blockIndex, outBuffer, outBufferSize) as static in that external function.
-    
-    Free *outBuffer and set *outBuffer to 0, if you want to flush cache.
-*/
-
-SRes SzAr_Extract(
-    const CSzArEx *db,
-    ILookInStream *inStream,
-    UInt32 fileIndex,         /* index of file */
-    UInt32 *blockIndex,       /* index of solid block */
-    Byte **outBuffer,         /* pointer to pointer to output buffer (allocated with allocMain) */
-    size_t *outBufferSize,    /* buffer size for output buffer */
-    size_t *offset,           /* offset of stream for required file in *outBuffer */
-    size_t *outSizeProcessed, /* size of file in *outBuffer */
-    ISzAlloc *allocMain,
-    ISzAlloc *allocTemp);
-
-#endif
+/* 7zExtract.h -- Extracting from 7z archive
+2008-11-23 : Igor Pavlov : Public domain */
+
+#ifndef __7Z_EXTRACT_H
+#define __7Z_EXTRACT_H
+
+#include "7zIn.h"
+#include "../../LzmaDec.h"
+
+/*
+  SzExtract extracts file from archive
+
+  *outBuffer must be 0 before first call for each new archive.
+
+  Extracting cache:
+    If you need to decompress more than one file, you can send
+    these values from previous call:
+      *blockIndex,
+      *outBuffer,
+      *outBufferSize
+    You can consider "*outBuffer" as cache of solid block. If your archive is solid,
+    it will increase decompression speed.
+  
+    If you use external function, you can declare these 3 cache variables
+    (blockIndex, outBuffer, outBufferSize) as static in that external function.
+    
+    Free *outBuffer and set *outBuffer to 0, if you want to flush cache.
+*/
+
+SRes SzAr_Extract(
+    const CSzArEx *db,
+    ILookInStream *inStream,
+    UInt32 fileIndex,         /* index of file */
+    UInt32 *blockIndex,       /* index of solid block */
+    Byte **outBuffer,         /* pointer to pointer to output buffer (allocated with allocMain) */
+    size_t *outBufferSize,    /* buffer size for output buffer */
+    size_t *offset,           /* offset of stream for required file in *outBuffer */
+    size_t *outSizeProcessed, /* size of file in *outBuffer */
+    ISzAlloc *allocMain,
+    ISzAlloc *allocTemp);
+
+/*
+  CSzFolderStream decodes one folder incrementally instead of into a buffer
+  for the whole folder. It keeps a window with the last decoded bytes, as
+  large as the LZMA dictionary (or the folder, if that is smaller), so its
+  memory does not depend on the folder size.
+
+  SzFolderStream_Read returns the unpacked folder data at any position:
+  bytes still in the window are copied, later bytes are decoded up to
+  the end of the requested range and no further, and earlier bytes make
+  the decoder start again at the beginning of the folder.
+  The stream seeks inStream before it reads from it, so several streams
+  can share one inStream if their calls are serialized.
+
+  Only folders with a single LZMA or Copy coder are supported, Open returns
+  SZ_ERROR_UNSUPPORTED for others. CRCs of the folder and of the files in it
+  are checked while the data is decoded from the folder start on; once a
+  check failed, all reads return SZ_ERROR_CRC.
+*/
+
+typedef struct
+{
+  const CSzArEx *db;
+  UInt32 folderIndex;
+  UInt64 methodID;
+  CLzmaDec dec;
+  UInt64 unpackSize;
+  UInt64 packStart;   /* position of the packed stream in the archive */
+  UInt64 packSize;
+  UInt64 packPos;     /* packed bytes consumed */
+  UInt64 outPos;      /* unpacked bytes decoded */
+  UInt32 crc;         /* of the unpacked bytes decoded */
+  UInt32 fileIndex;   /* file whose data is decoded next */
+  UInt64 fileEnd;     /* position in the folder where it ends */
+  UInt32 fileCrc;
+  SRes error;
+} CSzFolderStream;
+
+void SzFolderStream_Construct(CSzFolderStream *p);
+SRes SzFolderStream_Open(CSzFolderStream *p, const CSzArEx *db, UInt32 folderIndex, ISzAlloc *alloc);
+SRes SzFolderStream_Read(CSzFolderStream *p, ILookInStream *inStream,
+    UInt64 pos, Byte *buf, size_t size, size_t *processed);
+/* decodes until p->outPos is target, which must not be less than it */
+SRes SzFolderStream_DecodeTo(CSzFolderStream *p, ILookInStream *inStream, UInt64 target);
+/* whether checkpoints of p can be made, see below */
+int SzFolderStream_CanSave(const CSzFolderStream *p);
+/* first position still in the window */
+UInt64 SzFolderStream_WindowStart(const CSzFolderStream *p);
+void SzFolderStream_Free(CSzFolderStream *p, ISzAlloc *alloc);
+
+/*
+  CSzFolderCheckpoint is a copy of the decoder state of an LZMA folder
+  stream at outPos: probabilities, range coder, window and CRCs.
+  SzFolderStream_Restore puts any stream of the same folder back into that
+  state, so decoding continues from outPos instead of the folder start.
+  Checkpoints of Copy folders cannot be made, Save returns
+  SZ_ERROR_UNSUPPORTED.
+*/
+
+typedef struct
+{
+  UInt64 outPos;
+  UInt64 packPos;
+  CLzmaDec dec;       /* probs and dic point to copies owned by the checkpoint */
+  size_t dicSize;     /* bytes of the window in dec.dic */
+  UInt32 crc;
+  UInt32 fileIndex;
+  UInt64 fileEnd;
+  UInt32 fileCrc;
+} CSzFolderCheckpoint;
+
+SRes SzFolderStream_Save(const CSzFolderStream *p, CSzFolderCheckpoint *cp, ISzAlloc *alloc);
+void SzFolderStream_Restore(CSzFolderStream *p, const CSzFolderCheckpoint *cp);
+/* memory the checkpoint uses */
+size_t SzFolderCheckpoint_Size(const CSzFolderCheckpoint *cp);
+void SzFolderCheckpoint_Free(CSzFolderCheckpoint *cp, ISzAlloc *alloc);
+
+#endif
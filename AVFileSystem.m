@@ -72,42 +72,24 @@
                                 userData:(id)userData
                                    error:(NSError **)error {
 
+	// every virt_lstat() resolves the whole path inside the archive again
+	NSDictionary *attrs = [self cachedAttributesOfItemAtPath:path];
+	if (attrs) {
+		if (error)
+			*error = [NSError errorWithPOSIXCode:0];
+		return attrs;
+	}
+	
     int res;
 
-	uid_t uid = getuid();
-	gid_t gid = getgid();
-	
 	struct stat st;
     res = virt_lstat([[self makeAbsolutePath:path] fileSystemRepresentation], &st);
 	if (error)
 		*error = [NSError errorWithPOSIXCode:res == -1 ? errno : res];
 	if (res)
 		return nil;
-	NSMutableDictionary *attrs = [[[NSMutableDictionary alloc] init] autorelease];
-	
-	NSObject *fileType = NSFileTypeUnknown;
-	if (S_ISCHR(st.st_mode))
-		fileType = NSFileTypeCharacterSpecial;
-	if (S_ISDIR(st.st_mode))
-		fileType = NSFileTypeDirectory;
-	if (S_ISBLK(st.st_mode))
-		fileType = NSFileTypeBlockSpecial;
-	if (S_ISREG(st.st_mode))
-		fileType = NSFileTypeRegular;
-	if (S_ISLNK(st.st_mode))
-		fileType = NSFileTypeSymbolicLink;
-	if (S_ISSOCK(st.st_mode))
-		fileType = NSFileTypeSocket;
-	
-	[attrs setObject:fileType forKey:NSFileType];
-	[attrs setObject:[NSNumber numberWithUnsignedLongLong:st.st_size] forKey:NSFileSize];
-	[attrs setObject:[NSDate dateWithTimespec:(&st.st_mtimespec)] forKey:NSFileModificationDate];
-	[attrs setObject:[NSNumber numberWithUnsignedLong:st.st_nlink] forKey:NSFileReferenceCount];
-	[attrs setObject:[NSNumber numberWithUnsignedLong:(st.st_mode & 07777)] forKey:NSFilePosixPermissions];
-	[attrs setObject:[NSNumber numberWithUnsignedLong:uid/*st.st_uid*/] forKey:NSFileOwnerAccountID];
-	[attrs setObject:[NSNumber numberWithUnsignedLong:gid/*st.st_gid*/] forKey:NSFileGroupOwnerAccountID];
-	[attrs setObject:[NSNumber numberWithUnsignedLongLong:st.st_ino] forKey:NSFileSystemFileNumber];
-	[attrs setObject:[NSDate dateWithTimespec:(&st.st_mtimespec)] forKey:NSFileCreationDate];
+	attrs = [self attributesWithStat:&st];
+	[self cacheAttributes:attrs ofItemAtPath:path];
 	
 	return attrs;
 }
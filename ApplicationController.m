@@ -20,9 +20,6 @@
 	userFileSystems = [[NSMutableArray alloc] init];
 	avfs = nil;
 	
-	SQSevenZip *sz = [[SQSevenZip alloc] initWithFile:@"/Users/urijgagarin/Projects/avfsmac.7z"];
-	[sz release];
-	
 	[super awakeFromNib];
 	
 	return self;
@@ -134,7 +131,17 @@
 	
 	NSString* mountPath = [[NSString stringWithFormat:@"/Volumes/%@", fileName] stringByStandardizingPath];
 	avfs = nil;
-	if ([fullPath hasSuffix:@".tar.bz2"]) {
+	if ([[fullPath lowercaseString] hasSuffix:@".7z"]) {
+		// reads the header database at the end instead of scanning
+		avfs = [[[SQSevenZip alloc] initWithPath:fullPath mountPoint:mountPath] autorelease];
+		NSLog(@"giving 7z plugin a chance");
+		if (![self tryMount:fileName at:mountPath])
+		{
+			NSLog(@"7z plugin failed");
+			avfs = nil;
+		}
+	}
+	if (!avfs && [fullPath hasSuffix:@".tar.bz2"]) {
 		avfs = [[[AVFileSystem alloc] initWithPath:fullPath mountPoint:mountPath] autorelease];
 		NSLog(@"giving avfs plugin a chance");
 		if (![self tryMount:fileName at:mountPath])
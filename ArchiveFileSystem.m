@@ -23,7 +23,19 @@
 - (ArchiveFileSystem*)initWithPath:(NSString *)archivePath mountPoint:(NSString *)mtpt {
 	
 	if (self = [super initWithPath:archivePath mountPoint:mtpt]) {
-		ar_init(&fs, [archivePath fileSystemRepresentation], [mountPoint fileSystemRepresentation]);
+		NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+		archive_fs_options options;
+		// decoded data shared by all mounted archives, off unless set
+		NSString *spillDir = [defaults stringForKey:@"BlockCacheSpillDirectory"];
+		ar_block_cache((size_t)[defaults integerForKey:@"BlockCacheMegabytes"] << 20,
+				[spillDir fileSystemRepresentation],
+				(off_t)[defaults integerForKey:@"BlockCacheSpillMegabytes"] << 20);
+		ar_default_options(&options);
+		// decode compressed archives up front instead of on every read
+		options.materialize = [defaults boolForKey:@"MaterializeOnMount"];
+		// answer the first lookups while the rest of the archive is read
+		options.background = 1;
+		ar_init_with_options(&fs, [archivePath fileSystemRepresentation], [mountPoint fileSystemRepresentation], &options);
 	}
 	
 	return self;
@@ -40,11 +52,18 @@
 	
 	NSMutableArray *dirList = [[[NSMutableArray alloc] init] autorelease];
 	
-	int res = ar_readdir(&fs, [path fileSystemRepresentation], NULL,
-						 ^ int (const char* name, struct stat* st) {
-							 (void) st;
-							 if (strcmp(".", name) && strcmp("..", name))
-								 [dirList addObject:[NSString stringWithUTF8String:name]];
+	// the listing comes with the attributes, keep them for the lookups that
+	// usually follow it
+	int res = ar_readdir_plus(&fs, [path fileSystemRepresentation], NULL,
+						 ^ int (const char* name, struct stat* st, off_t offset) {
+							 (void) offset;
+							 if (strcmp(".", name) && strcmp("..", name)) {
+								 NSString *entry = [NSString stringWithUTF8String:name];
+								 [dirList addObject:entry];
+								 if (st)
+									 [self cacheAttributes:[self attributesWithStat:st]
+											  ofItemAtPath:[path stringByAppendingPathComponent:entry]];
+							 }
 							 return 0;
 						 }, 0);
 	*error = [NSError errorWithPOSIXCode:-res];
@@ -60,44 +79,23 @@
                                 userData:(id)userData
                                    error:(NSError **)error {
 	
+	NSDictionary *attrs = [self cachedAttributesOfItemAtPath:path];
+	if (attrs) {
+		if (error)
+			*error = [NSError errorWithPOSIXCode:0];
+		return attrs;
+	}
+	
     int res;
 	
-	uid_t uid = getuid();
-	gid_t gid = getgid();
-
 	struct stat st;
 	res = ar_getattr(&fs, [path fileSystemRepresentation], &st);
 	if (error)
 		*error = [NSError errorWithPOSIXCode:-res];
 	if (res)
 		return nil;
-	NSMutableDictionary *attrs = [[[NSMutableDictionary alloc] init] autorelease];
-	
-	NSObject *fileType = NSFileTypeUnknown;
-	if (S_ISCHR(st.st_mode))
-		fileType = NSFileTypeCharacterSpecial;
-	if (S_ISDIR(st.st_mode)) {
-		fileType = NSFileTypeDirectory;
-	}
-	if (S_ISBLK(st.st_mode))
-		fileType = NSFileTypeBlockSpecial;
-	if (S_ISREG(st.st_mode)) {
-		fileType = NSFileTypeRegular;
-	}
-	if (S_ISLNK(st.st_mode))
-		fileType = NSFileTypeSymbolicLink;
-	if (S_ISSOCK(st.st_mode))
-		fileType = NSFileTypeSocket;
-
-	[attrs setObject:fileType forKey:NSFileType];
-	[attrs setObject:[NSNumber numberWithUnsignedLongLong:st.st_size] forKey:NSFileSize];
-	[attrs setObject:[NSDate dateWithTimespec:(&st.st_mtimespec)] forKey:NSFileModificationDate];
-	[attrs setObject:[NSNumber numberWithUnsignedLong:st.st_nlink] forKey:NSFileReferenceCount];
-	[attrs setObject:[NSNumber numberWithUnsignedLong:(st.st_mode & 07777)] forKey:NSFilePosixPermissions];
-	[attrs setObject:[NSNumber numberWithUnsignedLong:uid/*st.st_uid*/] forKey:NSFileOwnerAccountID];
-	[attrs setObject:[NSNumber numberWithUnsignedLong:gid/*st.st_gid*/] forKey:NSFileGroupOwnerAccountID];
-	[attrs setObject:[NSNumber numberWithUnsignedLongLong:st.st_ino] forKey:NSFileSystemFileNumber];
-	[attrs setObject:[NSDate dateWithTimespec:(&st.st_mtimespec)] forKey:NSFileCreationDate];
+	attrs = [self attributesWithStat:&st];
+	[self cacheAttributes:attrs ofItemAtPath:path];
 	
 	return attrs;
 }
@@ -14,6 +14,7 @@
 	NSString *baseFilePath;
 	NSNumber *fileSystemNumber;
 	NSString *mountPoint;
+	NSCache *attributeCache; // item attributes by path, the archives are read-only
 	
 }
 
@@ -24,6 +25,10 @@
 - (id)initWithPath: (NSString*)aPath mountPoint:(NSString*)mtpt;
 - (NSString*)canonizedArchivePath:(NSString*)path;
 
+- (NSDictionary*)attributesWithStat:(const struct stat*)st;
+- (NSDictionary*)cachedAttributesOfItemAtPath:(NSString*)path;
+- (void)cacheAttributes:(NSDictionary*)attrs ofItemAtPath:(NSString*)path;
+
 @end
 
 // Category on NSError to  simplify creating an NSError based on posix errno.
@@ -6,8 +6,12 @@
 //  Copyright 2010 Quyllur. All rights reserved.
 //
 
+#import <sys/stat.h>
 #import "MinimalFileSystem.h"
 
+// enough for the entries of a few large directories
+#define ATTRIBUTE_CACHE_LIMIT 200000
+
 @implementation NSError (POSIX)
 + (NSError *)errorWithPOSIXCode:(int) code {
 	return [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:nil];
@@ -26,6 +30,8 @@
 		
 		[self setBaseFilePath:aPath];
 		[self setMountPoint:mtpt];
+		attributeCache = [[NSCache alloc] init];
+		[attributeCache setCountLimit:ATTRIBUTE_CACHE_LIMIT];
 		
 	}
 	
@@ -33,10 +39,62 @@
 	
 }
 
+- (void)dealloc {
+	[attributeCache release];
+	[baseFilePath release];
+	[fileSystemNumber release];
+	[mountPoint release];
+	[super dealloc];
+}
+
 - (NSString*)canonizedArchivePath:(NSString*)path {
 	return [[path copy] autorelease];
 }
 
+#pragma mark Attributes
+
+- (NSDictionary*)attributesWithStat:(const struct stat*)st {
+	
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+	
+	NSMutableDictionary *attrs = [[[NSMutableDictionary alloc] init] autorelease];
+	
+	NSObject *fileType = NSFileTypeUnknown;
+	if (S_ISCHR(st->st_mode))
+		fileType = NSFileTypeCharacterSpecial;
+	if (S_ISDIR(st->st_mode))
+		fileType = NSFileTypeDirectory;
+	if (S_ISBLK(st->st_mode))
+		fileType = NSFileTypeBlockSpecial;
+	if (S_ISREG(st->st_mode))
+		fileType = NSFileTypeRegular;
+	if (S_ISLNK(st->st_mode))
+		fileType = NSFileTypeSymbolicLink;
+	if (S_ISSOCK(st->st_mode))
+		fileType = NSFileTypeSocket;
+	
+	[attrs setObject:fileType forKey:NSFileType];
+	[attrs setObject:[NSNumber numberWithUnsignedLongLong:st->st_size] forKey:NSFileSize];
+	[attrs setObject:[NSDate dateWithTimespec:(&st->st_mtimespec)] forKey:NSFileModificationDate];
+	[attrs setObject:[NSNumber numberWithUnsignedLong:st->st_nlink] forKey:NSFileReferenceCount];
+	[attrs setObject:[NSNumber numberWithUnsignedLong:(st->st_mode & 07777)] forKey:NSFilePosixPermissions];
+	[attrs setObject:[NSNumber numberWithUnsignedLong:uid/*st->st_uid*/] forKey:NSFileOwnerAccountID];
+	[attrs setObject:[NSNumber numberWithUnsignedLong:gid/*st->st_gid*/] forKey:NSFileGroupOwnerAccountID];
+	[attrs setObject:[NSNumber numberWithUnsignedLongLong:st->st_ino] forKey:NSFileSystemFileNumber];
+	[attrs setObject:[NSDate dateWithTimespec:(&st->st_mtimespec)] forKey:NSFileCreationDate];
+	
+	return attrs;
+}
+
+- (NSDictionary*)cachedAttributesOfItemAtPath:(NSString*)path {
+	return [attributeCache objectForKey:path];
+}
+
+- (void)cacheAttributes:(NSDictionary*)attrs ofItemAtPath:(NSString*)path {
+	[attributeCache setObject:attrs forKey:path];
+}
+
 
 @end
 
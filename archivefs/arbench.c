@@ -0,0 +1,567 @@
+/*
+ *  arbench.c
+ *  ArchiveFS
+ *
+ *  Command-line benchmark of the read-ahead, run by "make bench": reads
+ *  members of an archive sequentially in small chunks, as FUSE hands them
+ *  to ar_read(), once without read-ahead and once with it, and prints the
+ *  throughput of both runs. With -g it writes a tar of that many empty
+ *  members to archive instead, mounts it and times random ar_getattr()
+ *  calls on them; with -m it reports the time and the peak memory the
+ *  mount of such a tar takes. -s writes a tar for up to that many readers,
+ *  each reading its own member while a writer copies large members through
+ *  a writable mount, and prints the throughput of 1, 2, 4 ... readers.
+ *
+ */
+
+#include "archivemount.h"
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define CHUNK 4096
+/* the reader works for -w milliseconds after every WORKSPAN bytes */
+#define WORKSPAN ( 128 * 1024 )
+/* generated tars have this many members per directory */
+#define DIRSIZE 1000
+#define GETATTRS 1000000
+/* -s: members of the readers, and the large members the writer copies */
+#define STRESSMEMBER ( 4 * 1024 * 1024 )
+#define STRESSLARGE ( 32 * 1024 * 1024 )
+#define STRESSCOPIES 4
+
+static double
+now( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the path of member i of a generated tar, without the leading / */
+static void
+member_path( char *buf, size_t size, long i )
+{
+	snprintf( buf, size, "d%ld/f%ld", i / DIRSIZE, i % DIRSIZE );
+}
+
+/* opens a new ustar archive at path, NULL on errors */
+static struct archive *
+tar_open( const char *path )
+{
+	struct archive *a = archive_write_new();
+
+	archive_write_set_format_ustar( a );
+	if( archive_write_open_filename( a, path ) != ARCHIVE_OK ) {
+		fprintf( stderr, "%s: %s\n", path, archive_error_string( a ) );
+		archive_write_finish( a );
+		return NULL;
+	}
+	return a;
+}
+
+/*
+ * adds a member of type to a, a regular file gets size bytes
+ * @return 0 on success, -1 on errors
+ */
+static int
+tar_add( struct archive *a, const char *name, mode_t type, off_t size )
+{
+	static char buf[CHUNK];
+	struct archive_entry *entry = archive_entry_new();
+	off_t done;
+	int ret = 0;
+
+	archive_entry_set_pathname( entry, name );
+	archive_entry_set_filetype( entry, type );
+	archive_entry_set_perm( entry, type == AE_IFDIR ? 0755 : 0644 );
+	archive_entry_set_size( entry, type == AE_IFREG ? size : 0 );
+	if( archive_write_header( a, entry ) != ARCHIVE_OK ) {
+		ret = -1;
+	}
+	memset( buf, 'x', sizeof( buf ) );
+	for( done = 0; type == AE_IFREG && done < size && ret == 0;
+			done += CHUNK ) {
+		size_t len = size - done < CHUNK ? size - done : CHUNK;
+		if( archive_write_data( a, buf, len ) != ( ssize_t )len ) {
+			ret = -1;
+		}
+	}
+	archive_entry_free( entry );
+	return ret;
+}
+
+/* finishes a, ret is that of the tar_add() calls */
+static int
+tar_close( struct archive *a, const char *path, int ret )
+{
+	if( ret != 0 || archive_write_close( a ) != ARCHIVE_OK ) {
+		fprintf( stderr, "%s: %s\n", path, archive_error_string( a ) );
+		ret = -1;
+	}
+	archive_write_finish( a );
+	return ret;
+}
+
+/*
+ * writes a tar of members empty files in directories of DIRSIZE to path
+ * @return 0 on success, -1 on errors
+ */
+static int
+make_archive( const char *path, long members )
+{
+	struct archive *a;
+	char name[64];
+	long i;
+	int ret = 0;
+
+	if( ( a = tar_open( path ) ) == NULL ) {
+		return -1;
+	}
+	for( i = 0; i < members && ret == 0; i++ ) {
+		if( i % DIRSIZE == 0 ) {
+			snprintf( name, sizeof( name ), "d%ld/", i / DIRSIZE );
+			ret = tar_add( a, name, AE_IFDIR, 0 );
+		}
+		member_path( name, sizeof( name ), i );
+		if( ret == 0 ) {
+			ret = tar_add( a, name, AE_IFREG, 0 );
+		}
+	}
+	return tar_close( a, path, ret );
+}
+
+/*
+ * mounts archive and returns the seconds that took, or -1 if it could not
+ * be mounted
+ */
+static double
+mount_archive( archive_fs_t *fs, const char *archive, int writable )
+{
+	archive_fs_options options;
+	double start;
+
+	ar_default_options( &options );
+	options.snapshot = 0;
+	options.readonly = ! writable;
+	memset( fs, 0, sizeof( archive_fs_t ) );
+	start = now();
+	if( ar_init_with_options( fs, archive, "/", &options ) != 0 ) {
+		fprintf( stderr, "%s: could not be mounted\n", archive );
+		return -1;
+	}
+	return now() - start;
+}
+
+/*
+ * writes a tar of members empty files to archive, mounts it and times
+ * GETATTRS ar_getattr() calls on members picked at random
+ */
+static int
+bench_getattr( const char *archive, long members )
+{
+	archive_fs_t fs;
+	struct stat st;
+	char **paths;
+	char name[64];
+	double secs, start;
+	long i;
+	int ret = 0;
+
+	if( members < 1 || make_archive( archive, members ) != 0 ) {
+		return 1;
+	}
+	if( ( paths = malloc( members * sizeof( char * ) ) ) == NULL ) {
+		fprintf( stderr, "%s\n", strerror( ENOMEM ) );
+		return 1;
+	}
+	for( i = 0; i < members; i++ ) {
+		name[0] = '/';
+		member_path( name + 1, sizeof( name ) - 1, i );
+		if( ( paths[i] = strdup( name ) ) == NULL ) {
+			fprintf( stderr, "%s\n", strerror( ENOMEM ) );
+			members = i;
+			ret = 1;
+		}
+	}
+	if( ret == 0 && ( secs = mount_archive( &fs, archive, 0 ) ) < 0 ) {
+		ret = 1;
+	}
+	if( ret == 0 ) {
+		printf( "%s, %ld members: mounted in %.2f s\n", archive,
+				members, secs );
+		srandom( 1 );
+		start = now();
+		for( i = 0; i < GETATTRS && ret == 0; i++ ) {
+			const char *path = paths[random() % members];
+			int err = ar_getattr( &fs, path, &st );
+			if( err != 0 ) {
+				fprintf( stderr, "%s: %s\n", path,
+						strerror( 0 - err ) );
+				ret = 1;
+			}
+		}
+		secs = now() - start;
+		ar_free( &fs );
+		if( ret == 0 ) {
+			printf( "%s, %d random getattrs: %.2f s, %.0f ns each\n",
+					archive, GETATTRS, secs,
+					secs * 1e9 / GETATTRS );
+		}
+	}
+	for( i = 0; i < members; i++ ) {
+		free( paths[i] );
+	}
+	free( paths );
+	return ret;
+}
+
+/* the peak resident memory of the process in MB */
+static double
+peak_rss( void )
+{
+	struct rusage usage;
+
+	getrusage( RUSAGE_SELF, &usage );
+#ifdef __APPLE__
+	/* bytes */
+	return usage.ru_maxrss / ( 1024.0 * 1024 );
+#else
+	/* kilobytes */
+	return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+/*
+ * writes a tar of members empty files to archive and reports the time and
+ * the peak memory its mount takes
+ */
+static int
+bench_mount( const char *archive, long members )
+{
+	archive_fs_t fs;
+	double before;
+	double secs;
+
+	if( members < 1 || make_archive( archive, members ) != 0 ) {
+		return 1;
+	}
+	before = peak_rss();
+	if( ( secs = mount_archive( &fs, archive, 0 ) ) < 0 ) {
+		return 1;
+	}
+	printf( "%s, %ld members: mounted in %.2f s, peak RSS %.1f MB "
+			"(%.1f MB before)\n", archive, members, secs,
+			peak_rss(), before );
+	ar_free( &fs );
+	return 0;
+}
+
+/* a reader of -s */
+struct stress {
+	archive_fs_t *fs;
+	char path[64];
+	pthread_mutex_t *mutex;
+	int *stop; /* set under mutex once the writer is done */
+	off_t bytes; /* read so far */
+	int error; /* 0-errno of a failed read, else 0 */
+	pthread_t thread;
+};
+
+/* reads its member over and over until the writer is done */
+static void *
+stress_reader( void *arg )
+{
+	struct stress *reader = arg;
+	char buf[CHUNK];
+	off_t offset = 0;
+	int stop = 0;
+	int len;
+
+	while( ! stop ) {
+		if( ( len = ar_read( reader->fs, reader->path, buf, CHUNK,
+						offset ) ) < 0 ) {
+			reader->error = len;
+			break;
+		}
+		reader->bytes += len;
+		offset = len == CHUNK ? offset + len : 0;
+		pthread_mutex_lock( reader->mutex );
+		stop = *reader->stop;
+		pthread_mutex_unlock( reader->mutex );
+	}
+	return NULL;
+}
+
+/*
+ * copies from to the new file to through fs, like cp on the mount
+ * @return 0 on success, 0-errno on errors
+ */
+static int
+copy_member( archive_fs_t *fs, const char *from, const char *to )
+{
+	static char buf[WORKSPAN];
+	off_t offset = 0;
+	int len;
+	int ret;
+
+	if( ( ret = ar_create( fs, to, 0644 ) ) != 0
+			|| ( ret = ar_open( fs, to, O_WRONLY ) ) != 0 ) {
+		return ret;
+	}
+	while( ( len = ar_read( fs, from, buf, sizeof( buf ),
+					offset ) ) > 0 ) {
+		if( ( ret = ar_write( fs, to, buf, len, offset ) ) < 0 ) {
+			break;
+		}
+		offset += len;
+		ret = 0;
+	}
+	if( len < 0 ) {
+		ret = len;
+	}
+	len = ar_release( fs, to );
+	return ret ? ret : len;
+}
+
+/*
+ * mounts archive writable, starts readers and copies the STRESSCOPIES
+ * large members to new files meanwhile
+ * @return 0 on success, 1 on errors
+ */
+static int
+stress_run( const char *archive, struct stress *readers, int nreaders )
+{
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	archive_fs_t fs;
+	off_t bytes = 0;
+	double start, secs;
+	char path[64];
+	int stop = 0;
+	int ret = 0;
+	int i;
+
+	if( mount_archive( &fs, archive, 1 ) < 0 ) {
+		return 1;
+	}
+	start = now();
+	for( i = 0; i < nreaders; i++ ) {
+		readers[i].fs = &fs;
+		snprintf( readers[i].path, sizeof( readers[i].path ),
+				"/r%d", i );
+		readers[i].mutex = &mutex;
+		readers[i].stop = &stop;
+		readers[i].bytes = 0;
+		readers[i].error = 0;
+		if( pthread_create( &readers[i].thread, NULL, stress_reader,
+					&readers[i] ) != 0 ) {
+			fprintf( stderr, "%s\n", strerror( errno ) );
+			nreaders = i;
+			ret = 1;
+			break;
+		}
+	}
+	for( i = 0; i < STRESSCOPIES && ret == 0; i++ ) {
+		char to[64];
+		int err;
+		snprintf( path, sizeof( path ), "/large%d", i );
+		snprintf( to, sizeof( to ), "/copy%d", i );
+		if( ( err = copy_member( &fs, path, to ) ) != 0 ) {
+			fprintf( stderr, "%s: %s\n", to,
+					strerror( 0 - err ) );
+			ret = 1;
+		}
+	}
+	secs = now() - start;
+	pthread_mutex_lock( &mutex );
+	stop = 1;
+	pthread_mutex_unlock( &mutex );
+	for( i = 0; i < nreaders; i++ ) {
+		pthread_join( readers[i].thread, NULL );
+		if( readers[i].error ) {
+			fprintf( stderr, "%s: %s\n", readers[i].path,
+					strerror( 0 - readers[i].error ) );
+			ret = 1;
+		}
+		bytes += readers[i].bytes;
+	}
+	ar_free( &fs );
+	if( ret == 0 ) {
+		printf( "%s, %d readers: %.1f MB/s, %.1f MB/s each, "
+				"%d copies of %d MB in %.2f s\n", archive,
+				nreaders, bytes / secs / ( 1024 * 1024 ),
+				bytes / secs / ( 1024 * 1024 ) / nreaders,
+				STRESSCOPIES, STRESSLARGE / ( 1024 * 1024 ),
+				secs );
+	}
+	return ret;
+}
+
+/*
+ * writes a tar with a member for each of up to nreaders readers and the
+ * large members, then runs 1, 2, 4 ... nreaders readers against the writer
+ */
+static int
+bench_stress( const char *archive, int nreaders )
+{
+	struct stress *readers;
+	struct archive *a;
+	char name[64];
+	int ret = 0;
+	int i;
+
+	if( nreaders < 1 || ( a = tar_open( archive ) ) == NULL ) {
+		return 1;
+	}
+	for( i = 0; i < nreaders && ret == 0; i++ ) {
+		snprintf( name, sizeof( name ), "r%d", i );
+		ret = tar_add( a, name, AE_IFREG, STRESSMEMBER );
+	}
+	for( i = 0; i < STRESSCOPIES && ret == 0; i++ ) {
+		snprintf( name, sizeof( name ), "large%d", i );
+		ret = tar_add( a, name, AE_IFREG, STRESSLARGE );
+	}
+	if( tar_close( a, archive, ret ) != 0 ) {
+		return 1;
+	}
+	if( ( readers = calloc( nreaders, sizeof( struct stress ) ) ) == NULL ) {
+		fprintf( stderr, "%s\n", strerror( ENOMEM ) );
+		return 1;
+	}
+	for( i = 1; ret == 0; i *= 2 ) {
+		if( i > nreaders ) {
+			i = nreaders;
+		}
+		ret = stress_run( archive, readers, i );
+		if( i == nreaders ) {
+			break;
+		}
+	}
+	free( readers );
+	return ret;
+}
+
+/*
+ * mounts archive, reads the members in paths and returns the seconds that
+ * took, or -1 on errors; *total is set to the bytes read
+ */
+static double
+run( const char *archive, char **paths, int npaths, int readahead,
+		int work, off_t *total )
+{
+	static char buf[CHUNK];
+	archive_fs_options options;
+	archive_fs_t fs;
+	double start;
+	double ret;
+	int i;
+
+	ar_default_options( &options );
+	options.snapshot = 0;
+	if( ! readahead ) {
+		options.readahead = 0;
+	}
+	memset( &fs, 0, sizeof( archive_fs_t ) );
+	if( ar_init_with_options( &fs, archive, "/", &options ) != 0 ) {
+		fprintf( stderr, "%s: could not be mounted\n", archive );
+		return -1;
+	}
+	*total = 0;
+	start = now();
+	for( i = 0; i < npaths; i++ ) {
+		off_t offset = 0;
+		int len;
+		while( ( len = ar_read( &fs, paths[i], buf, CHUNK,
+						offset ) ) > 0 ) {
+			offset += len;
+			if( work && offset % WORKSPAN == 0 ) {
+				usleep( work * 1000 );
+			}
+		}
+		if( len < 0 ) {
+			fprintf( stderr, "%s: %s\n", paths[i],
+					strerror( 0 - len ) );
+			ar_free( &fs );
+			return -1;
+		}
+		*total += offset;
+	}
+	ret = now() - start;
+	ar_free( &fs );
+	return ret;
+}
+
+int
+main( int argc, char **argv )
+{
+	long getattr = 0;
+	long mount = 0;
+	int stress = 0;
+	int work = 0;
+	int readahead;
+	int opt;
+
+	while( ( opt = getopt( argc, argv, "w:g:m:s:" ) ) != -1 ) {
+		switch( opt ) {
+		case 'w':
+			work = atoi( optarg );
+			break;
+		case 'g':
+			getattr = atol( optarg );
+			break;
+		case 'm':
+			mount = atol( optarg );
+			break;
+		case 's':
+			stress = atoi( optarg );
+			break;
+		default:
+			argc = 0;
+		}
+	}
+	if( getattr && argc - optind == 1 ) {
+		return bench_getattr( argv[optind], getattr );
+	}
+	if( mount && argc - optind == 1 ) {
+		return bench_mount( argv[optind], mount );
+	}
+	if( stress && argc - optind == 1 ) {
+		return bench_stress( argv[optind], stress );
+	}
+	if( getattr || mount || stress || argc - optind < 2 ) {
+		fprintf( stderr, "usage: %s [-w ms] archive member...\n"
+				"       %s -g members archive\n"
+				"       %s -m members archive\n"
+				"       %s -s readers archive\n"
+				"  -g  write a tar of empty members to archive "
+				"and time random getattrs\n"
+				"  -m  write such a tar and report the time and "
+				"memory of its mount\n"
+				"  -s  write a tar for readers and a writer, "
+				"time them together\n",
+				argv[0], argv[0], argv[0], argv[0] );
+		return 2;
+	}
+	for( readahead = 0; readahead <= 1; readahead++ ) {
+		off_t total;
+		double secs = run( argv[optind], argv + optind + 1,
+				argc - optind - 1, readahead, work, &total );
+		if( secs < 0 ) {
+			return 1;
+		}
+		printf( "%s, read-ahead %s: %.2f s, %.1f MB/s\n",
+				argv[optind], readahead ? "on" : "off", secs,
+				total / secs / ( 1024 * 1024 ) );
+	}
+	return 0;
+}
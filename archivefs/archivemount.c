@@ -1,3 +1,6 @@
+/* For pthread_rwlock_t and copy_file_range(), before any system header */
+#define _GNU_SOURCE
+
 /*
 
    Copyright (c) 2005 Andre Landwehr <andrel@cybernoia.de>
@@ -10,11 +13,30 @@
 */
 
 #include "archivemount.h"
-
-/* For pthread_rwlock_t */
-#define _GNU_SOURCE
+#include "gzindex.h"
+#include "pzwriter.h"
+#include "blockcache.h"
+#include "snapshot.h"
 
 #define MAXBUF 4096
+#define STREAMBUF 10240
+#define STREAM_CACHE_SLOTS 4
+#define STREAM_CACHE_MEM ( 64 * 1024 * 1024 )
+#define GZINDEX_SPAN ( 8 * 1024 * 1024 )
+#define INDEX_BATCH 256
+#define NODE_SLAB 1024
+#define NAME_CHUNK 65536
+#define COPYBUF ( 1024 * 1024 )
+#define WRITEBUF ( 256 * 1024 )
+#define READAHEAD_STREAMS 2
+#define READAHEAD_SIZE ( 4 * 1024 * 1024 )
+#define READAHEAD_CHUNK ( 128 * 1024 )
+#define READAHEAD_AFTER 2 /* sequential reads before the worker starts */
+#define READAHEAD_TRACK 8 /* readers watched for sequential reads */
+#define READAHEAD_IDLE 2 /* seconds without reads before a worker may be
+			    taken over by another reader */
+#define SNAPSHOT_GZDATA 1 /* snapshot flag: the data offsets are into the
+			     decompressed data of a gzip archive */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,6 +46,9 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/param.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -91,434 +116,2683 @@ static void
 init_node( NODE *node )
 {
 	node->parent = NULL;
-	node->prev = NULL;
-	node->next = NULL;
-	node->child = NULL;
+	node->children = NULL;
+	node->nchildren = 0;
+	node->childsize = 0;
 	node->name = NULL;
 	node->location = NULL;
+	node->overlay = NULL;
 	node->namechanged = 0;
 	node->entry = NULL;
+	memset( &node->st, 0, sizeof( nodestat_t ) );
 	node->modified = 0;
+	node->dataoffset = -1;
+	node->cacheoffset = -1;
+	node->hashnext = NULL;
+	node->hash = 0;
+	node->busy = 0;
+	node->opens = 0;
+	node->fd = -1;
+	node->writebuf = NULL;
+	node->written = 0;
+	node->target = NULL;
+	node->referrers = NULL;
+	node->refnext = NULL;
 }
 
-static void
-remove_child( NODE *node )
+  /**************************/
+ /* copy-on-write overlays */
+/**************************/
+
+/*
+ * The first write into a member of the archive does not copy its data. The
+ * temp file at node->location starts out as a hole of the member's size and
+ * only receives what is written; the overlay lists those ranges. Reads take
+ * the written ranges from the temp file and the rest from the archive, and
+ * save() merges the two once. Files created after mounting have no overlay,
+ * their temp file holds all of the data.
+ */
+struct extent {
+	off_t start;
+	off_t end; /* first byte after the range */
+};
+
+struct overlay {
+	struct extent *extents; /* written ranges, sorted and disjoint */
+	size_t count; /* number of ranges in extents */
+	size_t size; /* number of ranges allocated */
+	off_t keep; /* the original data before keep is visible where it was
+		       not written; truncating lowers it */
+	off_t original; /* size of the member in the archive */
+};
+
+static struct overlay *
+overlay_new( off_t size )
 {
-	if( node->prev ) {
-		node->prev->next = node->next;
-		//log( "removed '%s' from parent '%s' (prev was: '%s', next was '%s')", node->name, node->parent->name, node->prev->name, node->next?node->next->name:"NULL" );
-	} else {
-		if( node->parent ) {
-			node->parent->child = node->next;
-			//log( "removed '%s' from parent '%s' (was first child, next was '%s')", node->name, node->parent->name, node->next?node->next->name:"NULL" );
-		}
-	}
-	if( node->next ) {
-		node->next->prev = node->prev;
+	struct overlay *overlay;
+
+	if( ( overlay = calloc( 1, sizeof( struct overlay ) ) ) == NULL ) {
+		return NULL;
 	}
+	overlay->keep = size;
+	overlay->original = size;
+	return overlay;
 }
 
 static void
-insert_as_child( NODE *node, NODE *parent )
+overlay_free( struct overlay *overlay )
 {
-	node->parent = parent;
-	if( ! parent->child ) {
-		parent->child = node;
-		node->prev = NULL;
-		node->next = NULL;
-	} else {
-		/* find last child of parent, insert node behind it */
-		NODE *b = parent->child;
-		while( b->next ) {
-			b = b->next;
+	if( overlay ) {
+		free( overlay->extents );
+		free( overlay );
+	}
+}
+
+/* @return the index of the first range ending after pos */
+static size_t
+overlay_find( const struct overlay *overlay, off_t pos )
+{
+	size_t lo = 0, hi = overlay->count;
+
+	while( lo < hi ) {
+		size_t mid = lo + ( hi - lo ) / 2;
+		if( overlay->extents[mid].end > pos ) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
 		}
-		b->next = node;
-		node->prev = b;
-		node->next = NULL;
 	}
-	//log( "inserted '%s' as child of '%s', between '%s' and '%s'", node->name, parent->name, node->prev?node->prev->name:"NULL", node->next?node->next->name:"NULL" );
+	return lo;
 }
 
-/*
- * inserts "node" into tree starting at "root" according to the path
- * specified in node->name
- * @return 0 on success, 0-errno else (ENOENT or ENOTDIR)
- */
+/* records that start to end was written, joining touching ranges */
 static int
-insert_by_path( NODE *root, NODE *node )
+overlay_add( struct overlay *overlay, off_t start, off_t end )
 {
-	char *temp;
-	NODE *cur = root;
-	char *key = node->name;
+	struct extent *ext;
+	size_t i, j;
 
-	key++;
-	while( ( temp = strchr( key, '/' ) ) ) {
-		size_t namlen = temp - key;
-		char nam[namlen + 1];
-		NODE *last = cur;
-
-		strncpy( nam, key, namlen );
-		nam[namlen] = '\0';
-		if( strcmp( strrchr( cur->name, '/' ) + 1, nam ) != 0 ) {
-			cur = cur->child;
-			while( cur && strcmp( strrchr( cur->name, '/' ) + 1,
-						nam ) != 0 )
-			{
-				cur = cur->next;
-			}
+	if( start >= end ) {
+		return 0;
+	}
+	i = start > 0 ? overlay_find( overlay, start - 1 ) : 0;
+	for( j = i; j < overlay->count && overlay->extents[j].start <= end;
+			j++ ) {
+		;
+	}
+	if( i < j ) {
+		/* replace ranges i to j - 1 by their union with start-end */
+		ext = &overlay->extents[i];
+		if( ext->start < start ) {
+			start = ext->start;
 		}
-		if( ! cur ) {
-			/* parent path not found, create a temporary one */
-			NODE *tempnode;
-			if( ( tempnode = malloc( sizeof( NODE ) ) ) == NULL ) {
-			        log( "Out of memory" );
-				return -ENOMEM;
-			}
-			init_node( tempnode );
-			if( ( tempnode->name = malloc(
-			        strlen( last->name ) + namlen + 1 ) ) == NULL ) {
-			        log( "Out of memory" );
-				return -ENOMEM;
-			}
-			if( last != root ) {
-				sprintf( tempnode->name, "%s/%s", last->name, nam );
-			} else {
-				sprintf( tempnode->name, "/%s", nam );
-			}
-			if( (tempnode->entry = archive_entry_clone( root->entry )) == NULL ) {
-			        log( "Out of memory" );
-				return -ENOMEM;
-			}
-			/* insert it recursively */
-			insert_by_path( root, tempnode );
-			/* now inserting node should work, correct cur for it */
-			cur = tempnode;
-		}
-		/* iterate */
-		key = temp + 1;
-	}
-	if( S_ISDIR( archive_entry_mode( cur->entry ) ) || cur == root ) {
-		/* check if a child of this name already exists */
-		NODE *tempnode;
-		int found = 0;
-		tempnode = cur->child;
-		while( tempnode ) {
-			if( strcmp( strrchr( tempnode->name, '/' ) + 1,
-						strrchr( node->name, '/' ) + 1 )
-					== 0 )
-			{
-				/* this is a dupe due to a temporarily inserted
-				   node, just update the entry */
-				archive_entry_free( node->entry );
-				if( (node->entry = archive_entry_clone(
-						tempnode->entry )) == NULL) {
-			                log( "Out of memory" );
-				        return -ENOMEM;
-				}
-				found = 1;
-				break;
-			}
-			tempnode = tempnode->next;
+		if( overlay->extents[j - 1].end > end ) {
+			end = overlay->extents[j - 1].end;
 		}
-		if( ! found ) {
-			insert_as_child( node, cur );
+		ext->start = start;
+		ext->end = end;
+		memmove( ext + 1, &overlay->extents[j],
+				( overlay->count - j ) * sizeof( struct extent ) );
+		overlay->count -= j - i - 1;
+		return 0;
+	}
+	if( overlay->count == overlay->size ) {
+		size_t size = overlay->size ? overlay->size * 2 : 16;
+		if( ( ext = realloc( overlay->extents,
+						size * sizeof( struct extent ) ) ) == NULL ) {
+			return -ENOMEM;
 		}
-	} else {
-		return -ENOTDIR;
-	}
+		overlay->extents = ext;
+		overlay->size = size;
+	}
+	ext = &overlay->extents[i];
+	memmove( ext + 1, ext, ( overlay->count - i ) * sizeof( struct extent ) );
+	ext->start = start;
+	ext->end = end;
+	overlay->count++;
 	return 0;
 }
 
-static int
-build_tree( archive_fs_t *fs, const char *mtpt )
+static void
+overlay_truncate( struct overlay *overlay, off_t size )
 {
-	struct archive *archive;
-	struct archive_entry *entry;
-	struct stat st;
-	int format;
-	int compression;
+	size_t i;
 
-	/* open archive */
-	if( (archive = archive_read_new()) == NULL ) {
-	        log( "Out of memory" );
-		return -ENOMEM;
-	}
-	if( archive_read_support_compression_all( archive ) != ARCHIVE_OK ) {
-		fprintf( stderr, "%s\n", archive_error_string( archive ) );
-		return archive_errno( archive );
-	}
-	if( archive_read_support_format_all( archive ) != ARCHIVE_OK ) {
-		fprintf( stderr, "%s\n", archive_error_string( archive ) );
-		return archive_errno( archive );
-	}
-	if( archive_read_open_fd( archive, fs->archiveFd, 10240 ) != ARCHIVE_OK ) {
-		fprintf( stderr, "%s\n", archive_error_string( archive ) );
-		return archive_errno( archive );
-	}
-	/* check if format or compression prohibits writability */
-	format = archive_format( archive );
-	compression = archive_compression( archive );
-	if( format & ARCHIVE_FORMAT_ISO9660
-			|| format & ARCHIVE_FORMAT_ISO9660_ROCKRIDGE
-			|| format & ARCHIVE_FORMAT_ZIP
-			|| compression == ARCHIVE_COMPRESSION_COMPRESS )
-	{
-		fs->archiveWriteable = 0;
-	}
-	/* create root node */
-	if( (fs->root = malloc( sizeof( NODE ) ) ) == NULL ) {
-	        log( "Out of memory" );
-		return -ENOMEM;
+	if( overlay->keep > size ) {
+		overlay->keep = size;
 	}
-	init_node( fs->root );
-	fs->root->name = strdup( "/" );
-	/* fill root->entry */
-	if( (fs->root->entry = archive_entry_new()) == NULL ) {
-	        log( "Out of memory" );
-		return -ENOMEM;
+	i = overlay_find( overlay, size );
+	if( i < overlay->count && overlay->extents[i].start < size ) {
+		overlay->extents[i++].end = size;
 	}
-	if( fstat( fs->archiveFd, &st ) != 0 ) {
-		perror( "Error stat'ing archiveFile" );
-		return errno;
+	overlay->count = i;
+}
+
+/*
+ * copies the bytes of orig that were neither written nor truncated away
+ * into buf; both hold len bytes from offset
+ */
+static void
+overlay_merge( const struct overlay *overlay, char *buf, const char *orig,
+		off_t offset, size_t len )
+{
+	off_t pos = offset;
+	off_t end = offset + len;
+	size_t i;
+
+	if( end > overlay->keep ) {
+		end = overlay->keep;
 	}
-	archive_entry_set_gid( fs->root->entry, getgid() );
-	archive_entry_set_uid( fs->root->entry, getuid() );
-	archive_entry_set_mode( fs->root->entry, st.st_mtime );
-	archive_entry_set_pathname( fs->root->entry, "/" );
-	archive_entry_set_size( fs->root->entry, st.st_size );
-	archive_entry_set_mode( fs->root->entry, 0777 );
-	archive_entry_set_filetype( fs->root->entry, AE_IFDIR );
-	/* read all entries in archive, create node for each */
-	while( archive_read_next_header( archive, &entry ) == ARCHIVE_OK ) {
-		NODE *cur;
-		const char *name;
-		/* find name of node */
-		name = archive_entry_pathname( entry );
-		if( strncmp( name, "./\0", 3 ) == 0 ) {
-			/* special case: the directory "./" must be skipped! */
-			continue;
+	for( i = overlay_find( overlay, pos ); pos < end; i++ ) {
+		off_t next = end;
+		if( i < overlay->count && overlay->extents[i].start < next ) {
+			next = overlay->extents[i].start;
 		}
-		/* create node and clone the entry */
-		if( (cur = malloc( sizeof( NODE ) ) ) == NULL ) {
-	                log( "Out of memory" );
-		        return -ENOMEM;
-		}
-		init_node( cur );
-		if( (cur->entry = archive_entry_clone( entry )) == NULL ) {
-		        log( "Out of memory" );
-			return -ENOMEM;
-		}
-		/* normalize the name to start with "/" */
-		if( strncmp( name, "./", 2 ) == 0 ) {
-			/* remove the "." of "./" */
-			cur->name = strdup( name + 1 );
-		} else if( name[0] != '/' ) {
-			/* prepend a '/' to name */
-		        if( (cur->name = malloc( strlen( name ) + 2 ) ) == NULL ) {
-			        log( "Out of memory" );
-				return -ENOMEM;
-			}
-			sprintf( cur->name, "/%s", name );
-		} else {
-			/* just set the name */
-			cur->name = strdup( name );
+		if( pos < next ) {
+			memcpy( buf + ( pos - offset ), orig + ( pos - offset ),
+					next - pos );
 		}
-		/* remove trailing '/' for directories */
-		if( cur->name[strlen(cur->name)-1] == '/' ) {
-			cur->name[strlen(cur->name)-1] = '\0';
+		if( i == overlay->count ) {
+			break;
 		}
-		/* references */
-		if( insert_by_path( fs->root, cur ) != 0 ) {
-			log( "ERROR: could not insert %s into tree",
-					cur->name );
-			return -ENOENT;
+		pos = overlay->extents[i].end;
+	}
+}
+
+  /*****************/
+ /* write buffers */
+/*****************/
+
+/*
+ * While a file is open its temp file stays open in node->fd, and writes
+ * smaller than WRITEBUF that continue each other are collected in a
+ * writebuf before they go to disk. Size and mtime of the entry are kept up
+ * to date in memory; the temp file is only stat'ed again on the last
+ * release. The writebuf and fd are guarded by the node lock.
+ */
+struct writebuf {
+	off_t offset; /* where data goes in the file */
+	size_t len; /* bytes collected in data */
+	char data[WRITEBUF];
+};
+
+/* writes out what is collected in the writebuf of node */
+static int
+node_flush( NODE *node )
+{
+	struct writebuf *wb = node->writebuf;
+	size_t done = 0;
+	ssize_t n;
+
+	if( ! wb || ! wb->len ) {
+		return 0;
+	}
+	while( done < wb->len ) {
+		if( ( n = pwrite( node->fd, wb->data + done, wb->len - done,
+						wb->offset + done ) ) == -1 ) {
+			log( "ERROR writing changes to temporary location "
+					"%s: %s", node->location,
+					strerror( errno ) );
+			return 0 - errno;
 		}
-		archive_read_data_skip( archive );
+		done += n;
+	}
+	wb->len = 0;
+	if( node->overlay ) {
+		return overlay_add( node->overlay, wb->offset,
+				wb->offset + done );
 	}
-	/* close archive */
-	archive_read_finish( archive );
-	lseek( fs->archiveFd, 0, SEEK_SET );
 	return 0;
 }
 
-static NODE *
-find_modified_node( NODE *start )
+/* gives up the temp file descriptor and the writebuf of node */
+static int
+node_close( NODE *node )
 {
-	NODE *ret = NULL;
-	NODE *run = start;
+	int ret = node_flush( node );
 
-	while( run ) {
-		if( run->modified ) {
-			ret = run;
-			break;
-		}
-		if( run->child ) {
-			if( ( ret = find_modified_node( run->child ) ) ) {
-				break;
-			}
-		}
-		run = run->next;
+	free( node->writebuf );
+	node->writebuf = NULL;
+	if( node->fd != -1 ) {
+		close( node->fd );
+		node->fd = -1;
 	}
 	return ret;
 }
 
-static void
-correct_hardlinks_to_node( const NODE *start, const char *old_name,
-		const char *new_name )
-{
-	const NODE *run = start;
-
-	while( run ) {
-		const char *tmp;
-		if( ( tmp = archive_entry_hardlink( run->entry ) ) ) {
-			if( strcmp( tmp, old_name ) == 0 ) {
-				/* the node in "run" is a hardlink to "node",
-				 * correct the path */
-				//log( "correcting hardlink '%s' from '%s' to '%s'", run->name, old_name, new_name);
-				archive_entry_set_hardlink(
-						run->entry, new_name );
+  /*******************/
+ /* node allocation */
+/*******************/
+
+/*
+ * NODEs come from slabs of NODE_SLAB, their names from chunks of NAME_CHUNK
+ * bytes; each distinct last path component is stored only once. Neither is
+ * returned to the system before ar_free().
+ */
+struct nodeslab {
+	struct nodeslab *next;
+	NODE nodes[NODE_SLAB];
+};
+
+struct namechunk {
+	struct namechunk *next;
+	size_t size; /* bytes available in data */
+	size_t used; /* bytes used in data */
+	char data[];
+};
+
+static NODE *
+node_new( archive_fs_t *fs )
+{
+	NODE *node;
+
+	if( fs->freenodes ) {
+		node = fs->freenodes;
+		fs->freenodes = node->hashnext;
+	} else {
+		if( ! fs->nodeslabs || fs->slabused == NODE_SLAB ) {
+			struct nodeslab *slab = malloc( sizeof( struct nodeslab ) );
+			if( slab == NULL ) {
+				log( "Out of memory" );
+				return NULL;
 			}
+			slab->next = fs->nodeslabs;
+			fs->nodeslabs = slab;
+			fs->slabused = 0;
 		}
-		if( run->child ) {
-			correct_hardlinks_to_node( run->child, old_name, new_name );
-		}
-		run = run->next;
+		node = &fs->nodeslabs->nodes[fs->slabused++];
 	}
+	init_node( node );
+	return node;
 }
 
-static NODE *
-get_node_for_path( NODE *start, const char *path )
+/*
+ * takes link off the referrers of its target
+ */
+static void
+link_detach( NODE *link )
 {
-	NODE *ret = NULL;
-	NODE *run = start;
+	NODE **ref;
 
-	while( run ) {
-		if( strcmp( path, run->name ) == 0 ) {
-			ret = run;
+	if( ! link->target ) {
+		return;
+	}
+	for( ref = &link->target->referrers; *ref; ref = &( *ref )->refnext ) {
+		if( *ref == link ) {
+			*ref = link->refnext;
 			break;
 		}
-		if( run->child && strncmp( path, run->name,
-					strlen( run->name ) ) == 0 )
-		{
-			if( ( ret = get_node_for_path( run->child, path ) ) ) {
-				break;
-			}
-		}
-		run = run->next;
 	}
-	return ret;
+	link->target = NULL;
+	link->refnext = NULL;
 }
 
-static NODE *
-get_node_for_entry( NODE *start, struct archive_entry *entry )
+/*
+ * detaches all links pointing to node, they go back to looking up their
+ * target by name
+ */
+static void
+link_forget_referrers( NODE *node )
 {
-	NODE *ret = NULL;
-	NODE *run = start;
-	const char *path = archive_entry_pathname( entry );
+	while( node->referrers ) {
+		NODE *link = node->referrers;
+		node->referrers = link->refnext;
+		link->target = NULL;
+		link->refnext = NULL;
+	}
+}
 
-	if( *path == '/' ) {
-		path++;
+/*
+ * releases a node that is not in the tree any more
+ */
+static void
+node_free( archive_fs_t *fs, NODE *node )
+{
+	link_detach( node );
+	link_forget_referrers( node );
+	free( node->children );
+	node->children = NULL;
+	node_close( node );
+	overlay_free( node->overlay );
+	node->overlay = NULL;
+	/* the callers removed and freed it */
+	node->location = NULL;
+	if( node->entry ) {
+		archive_entry_free( node->entry );
+		node->entry = NULL;
 	}
-	while( run ) {
-		const char *name = archive_entry_pathname( run->entry );
-		if( *name == '/' ) {
-			name++;
-		}
-		if( strcmp( path, name ) == 0 ) {
-			ret = run;
-			break;
+	node->hashnext = fs->freenodes;
+	fs->freenodes = node;
+}
+
+static unsigned int
+hash_bytes( unsigned int hash, const char *s, size_t len )
+{
+	/* FNV-1a */
+	while( len-- ) {
+		hash ^= ( unsigned char )*s++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * returns the stored copy of the first len bytes of name, adding it if it
+ * has not been seen before; a new mapped name is taken as is instead of
+ * being copied, it has to stay valid until ar_free()
+ */
+static const char *
+name_store( archive_fs_t *fs, const char *name, size_t len, int mapped )
+{
+	struct namechunk *chunk = fs->namechunks;
+	size_t slot;
+	char *copy;
+
+	if( fs->namecount * 2 >= fs->namessize ) {
+		/* keep the set at most half full */
+		size_t size = fs->namessize ? fs->namessize * 2 : 4096;
+		const char **names = calloc( size, sizeof( char * ) );
+		size_t i;
+		if( names == NULL ) {
+			log( "Out of memory" );
+			return NULL;
 		}
-		if( run->child ) {
-			if( ( ret = get_node_for_entry( run->child, entry ) ) )
-			{
-				break;
+		for( i = 0; i < fs->namessize; i++ ) {
+			if( fs->names[i] ) {
+				const char *n = fs->names[i];
+				slot = hash_bytes( 2166136261U, n, strlen( n ) ) &
+					( size - 1 );
+				while( names[slot] ) {
+					slot = ( slot + 1 ) & ( size - 1 );
+				}
+				names[slot] = n;
 			}
 		}
-		run = run->next;
-	}
-	return ret;
+		free( fs->names );
+		fs->names = names;
+		fs->namessize = size;
+	}
+	slot = hash_bytes( 2166136261U, name, len ) & ( fs->namessize - 1 );
+	while( fs->names[slot] ) {
+		if( strncmp( fs->names[slot], name, len ) == 0
+				&& fs->names[slot][len] == '\0' ) {
+			return fs->names[slot];
+		}
+		slot = ( slot + 1 ) & ( fs->namessize - 1 );
+	}
+	if( mapped ) {
+		fs->names[slot] = name;
+		fs->namecount++;
+		return name;
+	}
+	if( ! chunk || chunk->size - chunk->used < len + 1 ) {
+		size_t size = len + 1 > NAME_CHUNK ? len + 1 : NAME_CHUNK;
+		if( ( chunk = malloc( sizeof( struct namechunk ) + size ) ) == NULL ) {
+			log( "Out of memory" );
+			return NULL;
+		}
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->next = fs->namechunks;
+		fs->namechunks = chunk;
+	}
+	copy = chunk->data + chunk->used;
+	memcpy( copy, name, len );
+	copy[len] = '\0';
+	chunk->used += len + 1;
+	fs->names[slot] = copy;
+	fs->namecount++;
+	return copy;
 }
 
-static int
-rename_recursively( archive_fs_t *fs, NODE *start, const char *from, const char *to )
+static const char *
+name_intern( archive_fs_t *fs, const char *name, size_t len )
 {
-	char *individualName;
-	char *newName;
-	int ret = 0;
-	NODE *node = start;
+	return name_store( fs, name, len, 0 );
+}
 
-	while( node ) {
-		if( node->child ) {
-			/* recurse */
-			ret = rename_recursively( fs, node->child, from, to );
-		}
-		/* change node name */
-		individualName = node->name + strlen( from );
-		if( *to != '/' ) {
-		        if( ( newName = ( char * )malloc( strlen( to ) +
-			        strlen( individualName ) + 2 ) ) == NULL ) {
-			        log( "Out of memory" );
-				return -ENOMEM;
+static void
+free_nodes( archive_fs_t *fs )
+{
+	size_t used = fs->slabused;
+
+	while( fs->nodeslabs ) {
+		struct nodeslab *slab = fs->nodeslabs;
+		size_t i;
+		for( i = 0; i < used; i++ ) {
+			NODE *node = &slab->nodes[i];
+			free( node->children );
+			node_close( node );
+			overlay_free( node->overlay );
+			if( node->location ) {
+				/* a change that was not saved */
+				if( node->entry && S_ISDIR( archive_entry_mode(
+								node->entry ) ) ) {
+					rmdir( node->location );
+				} else {
+					unlink( node->location );
+				}
+				free( node->location );
 			}
-			sprintf( newName, "/%s%s", to, individualName );
-		} else {
-		        if( ( newName = ( char * )malloc( strlen( to ) +
-			        strlen( individualName ) + 1 ) ) == NULL ) {
-			  log( "Out of memory" );
-			  return -ENOMEM;
+			if( node->entry ) {
+				archive_entry_free( node->entry );
 			}
-			sprintf( newName, "%s%s", to, individualName );
 		}
-		correct_hardlinks_to_node( fs->root, node->name, newName );
-		free( node->name );
-		node->name = newName;
-		node->namechanged = 1;
-		/* iterate */
-		node = node->next;
-	}
-	return ret;
+		fs->nodeslabs = slab->next;
+		free( slab );
+		/* all but the newest slab are full */
+		used = NODE_SLAB;
+	}
+	while( fs->namechunks ) {
+		struct namechunk *chunk = fs->namechunks;
+		fs->namechunks = chunk->next;
+		free( chunk );
+	}
+	free( fs->names );
+	fs->names = NULL;
+	fs->namessize = fs->namecount = 0;
+	fs->freenodes = NULL;
+	fs->slabused = 0;
 }
 
+/*
+ * writes the full path of node to buf
+ * @return 0 on success, -ENAMETOOLONG if it does not fit into size bytes
+ */
 static int
-get_temp_file_name( const char *path, char **location )
+node_path( const NODE *node, char *buf, size_t size )
 {
-	char *tmppath;
-	char *tmp;
-	int fh;
+	const NODE *n;
+	size_t len = 0;
 
-	/* create name for temp file */
-	tmp = tmppath = strdup( path );
-	do if( *tmp == '/' ) *tmp = '_'; while( *( tmp++ ) );
-	if ( ( *location = ( char * )malloc(
-			strlen( P_tmpdir ) +
-			strlen( "_archivemount" ) +
-			strlen( tmppath ) + 8 ) ) == NULL ) {
-	        log( "Out of memory" );
-		return -ENOMEM;
+	if( ! node->parent ) {
+		if( size < 2 ) {
+			return -ENAMETOOLONG;
+		}
+		strcpy( buf, "/" );
+		return 0;
 	}
-	sprintf( *location, "%s/archivemount%s_XXXXXX", P_tmpdir, tmppath );
-	free( tmppath );
-	if( ( fh = mkstemp( *location ) == -1 ) ) {
-		log( "Could not create temp file name %s: %s",
-				*location, strerror( errno ) );
-		free( *location );
-		return 0 - errno;
+	for( n = node; n->parent; n = n->parent ) {
+		len += strlen( n->name ) + 1;
+	}
+	if( len + 1 > size ) {
+		return -ENAMETOOLONG;
+	}
+	buf[len] = '\0';
+	for( n = node; n->parent; n = n->parent ) {
+		size_t namelen = strlen( n->name );
+		len -= namelen;
+		memcpy( buf + len, n->name, namelen );
+		buf[--len] = '/';
 	}
-	close( fh );
-	unlink( *location );
 	return 0;
 }
 
-/**
- * Updates given nodes node->entry by stat'ing node->location. Does not update
- * the name!
+/*
+ * turns the pathname of an archive entry into the path of its node: always
+ * starting with "/", without a trailing "/"; *buf is grown as needed
+ * @return 0 on success, -ENOMEM else
  */
 static int
-update_entry_stat( NODE *node )
+normalize_path( const char *name, char **buf, size_t *size )
 {
-	struct stat st;
-	struct passwd *pwd;
-	struct group *grp;
+	size_t len;
+
+	if( strncmp( name, "./", 2 ) == 0 ) {
+		/* remove the "." of "./" */
+		name++;
+	}
+	len = strlen( name ) + ( name[0] != '/' ) + 1;
+	if( len > *size ) {
+		char *newbuf = realloc( *buf, len );
+		if( newbuf == NULL ) {
+			log( "Out of memory" );
+			return -ENOMEM;
+		}
+		*buf = newbuf;
+		*size = len;
+	}
+	if( name[0] != '/' ) {
+		/* prepend a '/' to name */
+		sprintf( *buf, "/%s", name );
+	} else {
+		strcpy( *buf, name );
+	}
+	/* remove trailing '/' for directories */
+	len = strlen( *buf );
+	if( len > 1 && ( *buf )[len - 1] == '/' ) {
+		( *buf )[len - 1] = '\0';
+	}
+	return 0;
+}
+
+  /***************/
+ /* header data */
+/***************/
+
+/* copies the header fields kept for read-only mounts */
+static int
+nodestat_from_entry( archive_fs_t *fs, nodestat_t *st,
+		struct archive_entry *entry )
+{
+	const char *link;
+
+	st->size = archive_entry_size( entry );
+	st->ino = archive_entry_ino( entry );
+	st->atime = archive_entry_atime( entry );
+	st->mtime = archive_entry_mtime( entry );
+	st->ctime = archive_entry_ctime( entry );
+	st->atimensec = archive_entry_atime_nsec( entry );
+	st->mtimensec = archive_entry_mtime_nsec( entry );
+	st->ctimensec = archive_entry_ctime_nsec( entry );
+	st->mode = archive_entry_mode( entry );
+	st->uid = archive_entry_uid( entry );
+	st->gid = archive_entry_gid( entry );
+	st->nlink = archive_entry_nlink( entry );
+	st->dev = archive_entry_dev( entry );
+	st->rdev = archive_entry_rdev( entry );
+	st->hardlink = st->symlink = NULL;
+	if( ( link = archive_entry_hardlink( entry ) ) &&
+			( st->hardlink = name_intern( fs, link,
+					strlen( link ) ) ) == NULL ) {
+		return -ENOMEM;
+	}
+	if( ( link = archive_entry_symlink( entry ) ) &&
+			( st->symlink = name_intern( fs, link,
+					strlen( link ) ) ) == NULL ) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static mode_t
+node_mode( const NODE *node )
+{
+	return node->entry ? archive_entry_mode( node->entry ) : node->st.mode;
+}
+
+static int64_t
+node_size( const NODE *node )
+{
+	return node->entry ? archive_entry_size( node->entry ) : node->st.size;
+}
+
+static const char *
+node_hardlink( const NODE *node )
+{
+	return node->entry ? archive_entry_hardlink( node->entry ) :
+		node->st.hardlink;
+}
+
+static const char *
+node_symlink( const NODE *node )
+{
+	return node->entry ? archive_entry_symlink( node->entry ) :
+		node->st.symlink;
+}
+
+static void
+node_stat( const NODE *node, struct stat *stbuf )
+{
+	if( node->entry ) {
+		memcpy( stbuf, archive_entry_stat( node->entry ),
+				sizeof( struct stat ) );
+		return;
+	}
+	memset( stbuf, 0, sizeof( struct stat ) );
+	stbuf->st_size = node->st.size;
+	stbuf->st_ino = node->st.ino;
+#ifdef __APPLE__
+	stbuf->st_atimespec.tv_sec = node->st.atime;
+	stbuf->st_atimespec.tv_nsec = node->st.atimensec;
+	stbuf->st_mtimespec.tv_sec = node->st.mtime;
+	stbuf->st_mtimespec.tv_nsec = node->st.mtimensec;
+	stbuf->st_ctimespec.tv_sec = node->st.ctime;
+	stbuf->st_ctimespec.tv_nsec = node->st.ctimensec;
+#else
+	stbuf->st_atim.tv_sec = node->st.atime;
+	stbuf->st_atim.tv_nsec = node->st.atimensec;
+	stbuf->st_mtim.tv_sec = node->st.mtime;
+	stbuf->st_mtim.tv_nsec = node->st.mtimensec;
+	stbuf->st_ctim.tv_sec = node->st.ctime;
+	stbuf->st_ctim.tv_nsec = node->st.ctimensec;
+#endif
+	stbuf->st_mode = node->st.mode;
+	stbuf->st_uid = node->st.uid;
+	stbuf->st_gid = node->st.gid;
+	stbuf->st_nlink = node->st.nlink;
+	stbuf->st_dev = node->st.dev;
+	stbuf->st_rdev = node->st.rdev;
+}
+
+  /**************/
+ /* node locks */
+/**************/
+
+/*
+ * Writers into a file hold fs->lock shared only, so the tree cannot change
+ * under them but readers of other files carry on while the original data is
+ * copied to the temp file. The per file state is guarded by one of
+ * NODE_LOCKS mutexes picked by the address of the NODE, and a NODE is marked
+ * busy while a writer works on it so writers of the same file take turns.
+ */
+static struct nodelock *
+node_lock( archive_fs_t *fs, const NODE *node )
+{
+	struct nodelock *lock;
+
+	lock = &fs->nodelocks[( ( uintptr_t )node / sizeof( NODE ) ) %
+		NODE_LOCKS];
+	pthread_mutex_lock( &lock->mutex );
+	return lock;
+}
+
+static void
+node_unlock( struct nodelock *lock )
+{
+	pthread_mutex_unlock( &lock->mutex );
+}
+
+/* waits until no other writer works on node, then claims it */
+static void
+node_acquire( archive_fs_t *fs, NODE *node )
+{
+	struct nodelock *lock;
+
+	lock = node_lock( fs, node );
+	while( node->busy ) {
+		pthread_cond_wait( &lock->released, &lock->mutex );
+	}
+	node->busy = 1;
+	node_unlock( lock );
+}
+
+static void
+node_release( archive_fs_t *fs, NODE *node )
+{
+	struct nodelock *lock;
+
+	lock = node_lock( fs, node );
+	node->busy = 0;
+	pthread_cond_broadcast( &lock->released );
+	node_unlock( lock );
+}
+
+  /*******************/
+ /* path hash index */
+/*******************/
+
+#define NODEHASH_INITIAL_SIZE 1024
+
+static unsigned int
+path_hash( const char *path )
+{
+	return hash_bytes( 2166136261U, path, strlen( path ) );
+}
+
+/*
+ * hash of the full path of node, continued from the hash of its parent
+ */
+static unsigned int
+node_hash( const NODE *node )
+{
+	unsigned int hash;
+
+	if( ! node->parent ) {
+		return path_hash( "/" );
+	}
+	hash = node->parent->parent ? node->parent->hash : 2166136261U;
+	hash = hash_bytes( hash, "/", 1 );
+	return hash_bytes( hash, node->name, strlen( node->name ) );
+}
+
+/*
+ * true if path is the full path of node
+ */
+static int
+node_has_path( const NODE *node, const char *path )
+{
+	size_t end = strlen( path );
+
+	if( ! node->parent ) {
+		return strcmp( path, "/" ) == 0;
+	}
+	for( ; node->parent; node = node->parent ) {
+		size_t namelen = strlen( node->name );
+		if( namelen + 1 > end ) {
+			return 0;
+		}
+		end -= namelen;
+		if( memcmp( path + end, node->name, namelen ) != 0
+				|| path[--end] != '/' ) {
+			return 0;
+		}
+	}
+	return end == 0;
+}
+
+static int
+hash_resize( archive_fs_t *fs, size_t newsize )
+{
+	NODE **newhash;
+	size_t i;
+
+	if( ( newhash = calloc( newsize, sizeof( NODE * ) ) ) == NULL ) {
+		log( "Out of memory" );
+		return -ENOMEM;
+	}
+	for( i = 0; i < fs->nodehashsize; i++ ) {
+		NODE *node = fs->nodehash[i];
+		while( node ) {
+			NODE *next = node->hashnext;
+			size_t bucket = node->hash % newsize;
+			node->hashnext = newhash[bucket];
+			newhash[bucket] = node;
+			node = next;
+		}
+	}
+	free( fs->nodehash );
+	fs->nodehash = newhash;
+	fs->nodehashsize = newsize;
+	return 0;
+}
+
+/*
+ * adds node to the path hash index under its current name and parent
+ */
+static int
+hash_insert( archive_fs_t *fs, NODE *node )
+{
+	size_t bucket;
+
+	if( fs->nodecount >= fs->nodehashsize ) {
+		/* keep the load factor below 1; on failure just live with
+		   longer chains */
+		hash_resize( fs, fs->nodehashsize ?
+				fs->nodehashsize * 2 : NODEHASH_INITIAL_SIZE );
+		if( ! fs->nodehashsize ) {
+			return -ENOMEM;
+		}
+	}
+	node->hash = node_hash( node );
+	bucket = node->hash % fs->nodehashsize;
+	node->hashnext = fs->nodehash[bucket];
+	fs->nodehash[bucket] = node;
+	fs->nodecount++;
+	return 0;
+}
+
+/*
+ * removes node from the path hash index; uses the hash recorded by
+ * hash_insert(), so the node may already have been moved
+ */
+static void
+hash_remove( archive_fs_t *fs, NODE *node )
+{
+	NODE **link;
+
+	if( ! fs->nodehashsize ) {
+		return;
+	}
+	link = &fs->nodehash[node->hash % fs->nodehashsize];
+	while( *link ) {
+		if( *link == node ) {
+			*link = node->hashnext;
+			node->hashnext = NULL;
+			fs->nodecount--;
+			return;
+		}
+		link = &( *link )->hashnext;
+	}
+}
+
+static NODE *
+get_node_for_path( archive_fs_t *fs, const char *path )
+{
+	NODE *node;
+	unsigned int hash;
+
+	if( ! fs->nodehashsize ) {
+		return NULL;
+	}
+	hash = path_hash( path );
+	node = fs->nodehash[hash % fs->nodehashsize];
+	while( node ) {
+		if( node->hash == hash && node_has_path( node, path ) ) {
+			break;
+		}
+		node = node->hashnext;
+	}
+	return node;
+}
+
+  /****************/
+ /* link targets */
+/****************/
+
+/*
+ * Hardlinks and symlinks keep a pointer to the node they point to, and
+ * every node the list of links pointing to it. Both only change under the
+ * write lock of the tree; a link without target looks its name up again.
+ */
+
+/*
+ * finds the node the name of link leads to; hardlinks are named like the
+ * members of the archive, symlinks by their full path
+ */
+static NODE *
+link_lookup( archive_fs_t *fs, const NODE *link )
+{
+	const char *name;
+	char *path = NULL;
+	size_t size = 0;
+	NODE *target = NULL;
+
+	if( ( name = node_hardlink( link ) ) ) {
+		if( normalize_path( name, &path, &size ) == 0 ) {
+			target = get_node_for_path( fs, path );
+		}
+		free( path );
+	} else if( ( name = node_symlink( link ) ) ) {
+		target = get_node_for_path( fs, name );
+	}
+	return target;
+}
+
+/* points link to the node its name leads to now */
+static void
+link_resolve( archive_fs_t *fs, NODE *link )
+{
+	NODE *target;
+
+	link_detach( link );
+	if( ( target = link_lookup( fs, link ) ) != NULL ) {
+		link->target = target;
+		link->refnext = target->referrers;
+		target->referrers = link;
+	}
+}
+
+/* resolves the links in the tree that have no target yet */
+static void
+resolve_links( archive_fs_t *fs )
+{
+	size_t i;
+
+	for( i = 0; i < fs->nodehashsize; i++ ) {
+		NODE *node;
+		for( node = fs->nodehash[i]; node; node = node->hashnext ) {
+			if( ! node->target && ( node_hardlink( node ) ||
+						node_symlink( node ) ) ) {
+				link_resolve( fs, node );
+			}
+		}
+	}
+}
+
+/*
+ * node was moved to path: hardlinks to it are renamed along, symlinks
+ * keep their name and lose their target
+ */
+static void
+retarget_referrers( NODE *node, const char *path )
+{
+	NODE **ref = &node->referrers;
+
+	while( *ref ) {
+		NODE *link = *ref;
+		const char *name = archive_entry_hardlink( link->entry );
+		if( name ) {
+			/* keep to the relative names most archives use */
+			archive_entry_set_hardlink( link->entry,
+					name[0] != '/' ? path + 1 : path );
+			ref = &link->refnext;
+		} else {
+			*ref = link->refnext;
+			link->target = NULL;
+			link->refnext = NULL;
+		}
+	}
+}
+
+/*
+ * follows hardlinks, and symlinks too if symlinks is true, from *node to
+ * the node holding the data
+ * @return 0 on success, -ENOENT for a link to nowhere, -ELOOP if there are
+ * too many links on the way
+ */
+static int
+follow_links( archive_fs_t *fs, NODE **node, int symlinks )
+{
+	int depth;
+
+	for( depth = 0; depth <= MAXSYMLINKS; depth++ ) {
+		NODE *link = *node;
+		if( ! node_hardlink( link ) &&
+				( ! symlinks || ! node_symlink( link ) ) ) {
+			return 0;
+		}
+		if( ( *node = link->target ) == NULL &&
+				( *node = link_lookup( fs, link ) ) == NULL ) {
+			return -ENOENT;
+		}
+	}
+	return -ELOOP;
+}
+
+  /****************/
+ /* stream cache */
+/****************/
+
+/*
+ * A reader positioned inside the data of one member. Reads of members that
+ * cannot be accessed in place keep their reader here, so a sequential read
+ * continues where the previous one stopped instead of decoding the archive
+ * from its beginning again.
+ */
+struct ar_stream {
+	struct ar_stream *next; /* next less recently used stream */
+	NODE *node; /* member the stream is positioned in */
+	struct archive *archive; /* NULL when reading directly from gz */
+	gzreader_t *gz; /* decompressor of an indexed gzip archive, or NULL */
+	off_t position; /* offset of the next byte in the member data */
+	size_t cost; /* estimated memory used by the decoder */
+	int fd; /* archive file, read with pread() */
+	off_t srcpos; /* read position in the archive file */
+	char srcbuf[STREAMBUF];
+};
+
+static ssize_t
+stream_read_cb( struct archive *archive, void *data, const void **buf )
+{
+	struct ar_stream *stream = data;
+	ssize_t len;
+
+	( void )archive;
+	*buf = stream->srcbuf;
+	if( stream->gz ) {
+		return gzreader_read( stream->gz, stream->srcbuf, STREAMBUF );
+	}
+	len = pread( stream->fd, stream->srcbuf, STREAMBUF, stream->srcpos );
+	if( len > 0 ) {
+		stream->srcpos += len;
+	}
+	return len;
+}
+
+static off_t
+stream_skip_cb( struct archive *archive, void *data, off_t request )
+{
+	struct ar_stream *stream = data;
+
+	( void )archive;
+	if( stream->gz ) {
+		/* jumps ahead using the checkpoint index if possible */
+		off_t start = gzreader_tell( stream->gz );
+		if( gzreader_seek( stream->gz, start + request ) != 0 ) {
+			return 0;
+		}
+		return gzreader_tell( stream->gz ) - start;
+	}
+	stream->srcpos += request;
+	return request;
+}
+
+#if ARCHIVE_VERSION_NUMBER >= 3000000
+/* lets formats like zip and 7z read their central directory; only
+   registered for streams reading the archive file directly */
+static int64_t
+stream_seek_cb( struct archive *archive, void *data, int64_t request,
+		int whence )
+{
+	struct ar_stream *stream = data;
+	struct stat st;
+
+	( void )archive;
+	switch( whence ) {
+		case SEEK_SET:
+			stream->srcpos = request;
+			break;
+		case SEEK_CUR:
+			stream->srcpos += request;
+			break;
+		case SEEK_END:
+			if( fstat( stream->fd, &st ) == -1 ) {
+				return ARCHIVE_FATAL;
+			}
+			stream->srcpos = st.st_size + request;
+			break;
+		default:
+			return ARCHIVE_FATAL;
+	}
+	return stream->srcpos;
+}
+#endif
+
+/*
+ * rough upper bound of what the decoders of stream keep allocated
+ */
+static size_t
+stream_cost( struct ar_stream *stream )
+{
+	size_t cost = sizeof( struct ar_stream );
+
+	if( stream->gz ) {
+		/* buffers of the reader plus inflate state */
+		cost += 2 * GZ_WINSIZE + 64 * 1024;
+	}
+	if( ! stream->archive ) {
+		return cost;
+	}
+	switch( archive_compression( stream->archive ) ) {
+		case ARCHIVE_COMPRESSION_NONE:
+			return cost;
+		case ARCHIVE_COMPRESSION_GZIP:
+			return cost + 64 * 1024;
+		case ARCHIVE_COMPRESSION_BZIP2:
+			return cost + 4 * 1024 * 1024;
+		default:
+			return cost + 16 * 1024 * 1024;
+	}
+}
+
+static void
+stream_close( struct ar_stream *stream )
+{
+	if( stream->archive ) {
+		archive_read_finish( stream->archive );
+	}
+	if( stream->gz ) {
+		gzreader_free( stream->gz );
+	}
+	free( stream );
+}
+
+/*
+ * creates a reader at the start of the archive; gzip archives with a
+ * checkpoint index are decompressed by gz, libarchive then only sees the
+ * uncompressed data
+ * @return 0 on success, 0-errno else
+ */
+static int
+stream_new( archive_fs_t *fs, NODE *node, struct ar_stream **result )
+{
+	struct ar_stream *stream;
+
+	if( ( stream = malloc( sizeof( struct ar_stream ) ) ) == NULL ) {
+		log( "Out of memory" );
+		return -ENOMEM;
+	}
+	stream->next = NULL;
+	stream->node = node;
+	stream->archive = NULL;
+	stream->gz = NULL;
+	stream->position = 0;
+	stream->cost = 0;
+	stream->fd = fs->archiveFd;
+	stream->srcpos = 0;
+	if( fs->gzindex && ( stream->gz = gzreader_new( fs->archiveFd,
+					fs->gzindex ) ) == NULL )
+	{
+		log( "Out of memory" );
+		free( stream );
+		return -ENOMEM;
+	}
+	*result = stream;
+	return 0;
+}
+
+/*
+ * starts libarchive on the data of stream
+ * @return 0 on success, 0-errno else
+ */
+static int
+stream_open_archive( struct ar_stream *stream )
+{
+	if( (stream->archive = archive_read_new()) == NULL ) {
+		log( "Out of memory" );
+		return -ENOMEM;
+	}
+	if( archive_read_support_compression_all( stream->archive ) != ARCHIVE_OK ) {
+		log( "%s", archive_error_string( stream->archive ) );
+	}
+	if( archive_read_support_format_all( stream->archive ) != ARCHIVE_OK ) {
+		log( "%s", archive_error_string( stream->archive ) );
+	}
+#if ARCHIVE_VERSION_NUMBER >= 3000000
+	/* the decompressed data of gzip archives has no known end */
+	if( ! stream->gz ) {
+		archive_read_set_seek_callback( stream->archive,
+				stream_seek_cb );
+	}
+#endif
+	if( archive_read_open2( stream->archive, stream, NULL, stream_read_cb,
+				stream_skip_cb, NULL ) != ARCHIVE_OK ) {
+		log( "%s", archive_error_string( stream->archive ) );
+		return archive_errno( stream->archive ) > 0 ?
+			0 - archive_errno( stream->archive ) : -EIO;
+	}
+	return 0;
+}
+
+/*
+ * opens a new reader on the archive and positions it at the start of the
+ * data of node
+ * @return 0 on success, 0-errno else
+ */
+static int
+stream_open( archive_fs_t *fs, NODE *node, struct ar_stream **result )
+{
+	struct ar_stream *stream;
+	struct archive_entry *entry;
+	/* nodes without entry are matched by their normalized path */
+	const char *realpath = node->entry ?
+		archive_entry_pathname( node->entry ) : NULL;
+	char path[PATH_MAX];
+	char *name = NULL;
+	size_t namesize = 0;
+	int ret;
+
+	if( ! realpath && ( ret = node_path( node, path, sizeof( path ) ) ) != 0 ) {
+		return ret;
+	}
+	if( ( ret = stream_new( fs, node, &stream ) ) != 0 ) {
+		return ret;
+	}
+	if( stream->gz && node->dataoffset >= 0 ) {
+		/* the data is stored as is in the compressed archive, no need
+		   to parse headers */
+		stream->position = 0 - node->dataoffset;
+		stream->cost = stream_cost( stream );
+		*result = stream;
+		return 0;
+	}
+	if( ( ret = stream_open_archive( stream ) ) != 0 ) {
+		stream_close( stream );
+		return ret;
+	}
+	/* search for file to read */
+	while( ( ret = archive_read_next_header( stream->archive, &entry ) )
+			== ARCHIVE_OK )
+	{
+		if( realpath ?
+				strcmp( realpath, archive_entry_pathname( entry ) ) == 0 :
+				normalize_path( archive_entry_pathname( entry ),
+					&name, &namesize ) == 0
+				&& strcmp( path, name ) == 0 )
+		{
+			free( name );
+			stream->cost = stream_cost( stream );
+			*result = stream;
+			return 0;
+		}
+		archive_read_data_skip( stream->archive );
+	}
+	free( name );
+	log( "ar_read: '%s' not found in archive: %s",
+			realpath ? realpath : path,
+			archive_error_string( stream->archive ) );
+	ret = archive_errno( stream->archive ) > 0 ?
+		0 - archive_errno( stream->archive ) : -EIO;
+	stream_close( stream );
+	return ret;
+}
+
+/*
+ * takes the most recently used stream positioned in node at or before
+ * offset out of the cache
+ * @return the stream or NULL when none is cached
+ */
+static struct ar_stream *
+stream_cache_get( archive_fs_t *fs, NODE *node, off_t offset )
+{
+	struct ar_stream **link;
+	struct ar_stream *stream = NULL;
+
+	pthread_mutex_lock( &fs->streamlock );
+	for( link = &fs->streams; *link; link = &( *link )->next ) {
+		if( ( *link )->node == node && ( *link )->position <= offset ) {
+			stream = *link;
+			*link = stream->next;
+			stream->next = NULL;
+			fs->nstreams--;
+			fs->streammem -= stream->cost;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &fs->streamlock );
+	return stream;
+}
+
+/*
+ * returns a stream to the cache as the most recently used one and closes
+ * the least recently used streams exceeding the configured limits
+ */
+static void
+stream_cache_put( archive_fs_t *fs, struct ar_stream *stream )
+{
+	struct ar_stream **link;
+	struct ar_stream *evicted = NULL;
+	int count = 0;
+	size_t mem = 0;
+
+	pthread_mutex_lock( &fs->streamlock );
+	stream->next = fs->streams;
+	fs->streams = stream;
+	fs->nstreams++;
+	fs->streammem += stream->cost;
+	/* the first streams within the limits stay, the rest is evicted */
+	for( link = &fs->streams; *link; link = &( *link )->next ) {
+		if( count + 1 > fs->options.streamcache ||
+				mem + ( *link )->cost > fs->options.streamcachemem )
+		{
+			evicted = *link;
+			*link = NULL;
+			fs->nstreams = count;
+			fs->streammem = mem;
+			break;
+		}
+		count++;
+		mem += ( *link )->cost;
+	}
+	pthread_mutex_unlock( &fs->streamlock );
+	while( evicted ) {
+		struct ar_stream *next = evicted->next;
+		stream_close( evicted );
+		evicted = next;
+	}
+}
+
+/*
+ * closes the cached streams of node, or all cached streams if node is NULL
+ */
+static void
+stream_cache_evict( archive_fs_t *fs, NODE *node )
+{
+	struct ar_stream **link;
+
+	pthread_mutex_lock( &fs->streamlock );
+	link = &fs->streams;
+	while( *link ) {
+		struct ar_stream *stream = *link;
+		if( node == NULL || stream->node == node ) {
+			*link = stream->next;
+			fs->nstreams--;
+			fs->streammem -= stream->cost;
+			stream_close( stream );
+		} else {
+			link = &stream->next;
+		}
+	}
+	pthread_mutex_unlock( &fs->streamlock );
+}
+
+/*
+ * reads from stream, which is positioned in the data of its member at or
+ * before offset; the stream is of no further use if it fails or ends up
+ * before offset, the end of the member
+ */
+static int
+stream_read_at( struct ar_stream *stream, char *buf, size_t size,
+		off_t offset )
+{
+	void *trash;
+	int ret = 0;
+
+	if( ! stream->archive ) {
+		/* plain data in an indexed gzip archive */
+		if( ( ret = gzreader_seek( stream->gz,
+						stream->node->dataoffset + offset ) ) == 0 )
+		{
+			ret = gzreader_read( stream->gz, buf, size );
+		}
+		if( ret < 0 ) {
+			log( "ar_read: %s", strerror( 0 - ret ) );
+		} else {
+			stream->position = gzreader_tell( stream->gz ) -
+				stream->node->dataoffset;
+		}
+		return ret;
+	}
+	if( ( trash = malloc( MAXBUF ) ) == NULL ) {
+		log( "Out of memory" );
+		return -ENOMEM;
+	}
+	/* skip to offset */
+	while( stream->position < offset ) {
+		int skip = offset - stream->position > MAXBUF ?
+			MAXBUF : offset - stream->position;
+		ret = archive_read_data( stream->archive, trash, skip );
+		if( ret <= 0 ) {
+			break;
+		}
+		stream->position += ret;
+	}
+	free( trash );
+	if( stream->position == offset ) {
+		/* read data */
+		ret = archive_read_data( stream->archive, buf, size );
+	}
+	if( ret < 0 ) {
+		log( "ar_read: %s",
+			archive_error_string( stream->archive ) );
+		ret = archive_errno( stream->archive ) > 0 ?
+			0 - archive_errno( stream->archive ) : -EIO;
+	} else if( stream->position == offset ) {
+		stream->position += ret;
+	}
+	return ret;
+}
+
+  /**************/
+ /* read-ahead */
+/**************/
+
+/*
+ * The last few members read are tracked here. Once one is read
+ * sequentially, a worker thread with a stream of its own decodes ahead of
+ * the reader into a ring buffer, and reads of the member are copied from
+ * there. The worker does not touch the tree, so it needs none of its locks.
+ */
+struct ar_readahead {
+	struct ar_readahead *next; /* next less recently read member */
+	NODE *node;
+	off_t expect; /* offset a sequential read would continue at */
+	int hits; /* reads in a row that continued the one before */
+	time_t used; /* time of the last read */
+	int refs; /* the list and the readers using the buffer */
+	int running; /* true while worker runs */
+	int starting; /* true while a reader opens the stream for worker */
+	pthread_t worker;
+	struct ar_stream *stream; /* used by worker only */
+	off_t end; /* end of the member for streams that do not stop there
+		      by themselves, else -1 */
+	/* the rest is protected by mutex */
+	pthread_mutex_t mutex;
+	pthread_cond_t filled; /* signalled when worker has decoded more */
+	pthread_cond_t drained; /* signalled when there is room in ring */
+	char *ring; /* member data from start on, at offset % depth */
+	size_t depth; /* size of ring */
+	off_t start; /* offset of the first byte in ring */
+	size_t fill; /* bytes decoded from start on */
+	int eof; /* true when the member ends at start + fill */
+	int error; /* 0-errno if worker failed, else 0 */
+	int stop; /* asks worker to quit */
+};
+
+static void *
+readahead_worker( void *data )
+{
+	struct ar_readahead *ra = data;
+	int ret;
+
+	pthread_mutex_lock( &ra->mutex );
+	while( ! ra->stop ) {
+		off_t pos = ra->start + ra->fill;
+		size_t at = pos % ra->depth;
+		size_t len = ra->depth - ra->fill;
+		if( ra->fill == ra->depth || ra->eof || ra->error ) {
+			pthread_cond_wait( &ra->drained, &ra->mutex );
+			continue;
+		}
+		if( len > ra->depth - at ) {
+			/* up to the end of the ring first */
+			len = ra->depth - at;
+		}
+		if( len > READAHEAD_CHUNK ) {
+			len = READAHEAD_CHUNK;
+		}
+		if( ra->end >= 0 && ( off_t )len > ra->end - pos ) {
+			len = ra->end > pos ? ra->end - pos : 0;
+		}
+		/* the reader does not look past start + fill */
+		pthread_mutex_unlock( &ra->mutex );
+		ret = len ? stream_read_at( ra->stream, ra->ring + at, len,
+				pos ) : 0;
+		pthread_mutex_lock( &ra->mutex );
+		if( ret < 0 ) {
+			ra->error = ret;
+		} else if( ret == 0 ) {
+			ra->eof = 1;
+		} else {
+			ra->fill += ret;
+		}
+		pthread_cond_broadcast( &ra->filled );
+	}
+	pthread_mutex_unlock( &ra->mutex );
+	return NULL;
+}
+
+/* drops a reference to ra; call with fs->ralock held */
+static void
+readahead_unref( archive_fs_t *fs, struct ar_readahead *ra )
+{
+	( void )fs;
+	if( --ra->refs > 0 ) {
+		return;
+	}
+	pthread_mutex_destroy( &ra->mutex );
+	pthread_cond_destroy( &ra->filled );
+	pthread_cond_destroy( &ra->drained );
+	free( ra->ring );
+	free( ra );
+}
+
+/*
+ * stops the worker of ra, which has been taken off the list, and drops the
+ * reference of the list; the stream goes back to the stream cache
+ */
+static void
+readahead_retire( archive_fs_t *fs, struct ar_readahead *ra )
+{
+	if( ra->running ) {
+		pthread_mutex_lock( &ra->mutex );
+		ra->stop = 1;
+		pthread_cond_broadcast( &ra->drained );
+		/* readers waiting for data fall back to stream_read() */
+		pthread_cond_broadcast( &ra->filled );
+		pthread_mutex_unlock( &ra->mutex );
+		pthread_join( ra->worker, NULL );
+		ra->running = 0;
+		if( ra->error ) {
+			stream_close( ra->stream );
+		} else {
+			stream_cache_put( fs, ra->stream );
+		}
+		ra->stream = NULL;
+	}
+	pthread_mutex_lock( &fs->ralock );
+	readahead_unref( fs, ra );
+	pthread_mutex_unlock( &fs->ralock );
+}
+
+/*
+ * stops the read-ahead of node, or of all members if node is NULL
+ */
+static void
+readahead_stop( archive_fs_t *fs, NODE *node )
+{
+	struct ar_readahead **link;
+	struct ar_readahead *stopped = NULL;
+
+	pthread_mutex_lock( &fs->ralock );
+	link = &fs->readaheads;
+	while( *link ) {
+		struct ar_readahead *ra = *link;
+		if( node == NULL || ra->node == node ) {
+			*link = ra->next;
+			ra->next = stopped;
+			stopped = ra;
+		} else {
+			link = &ra->next;
+		}
+	}
+	pthread_mutex_unlock( &fs->ralock );
+	while( stopped ) {
+		struct ar_readahead *next = stopped->next;
+		readahead_retire( fs, stopped );
+		stopped = next;
+	}
+}
+
+/*
+ * starts the worker of ra at offset; ra->starting has been set under
+ * fs->ralock, which is not held here: opening the stream can mean decoding
+ * the archive up to the member, and other readers go on meanwhile
+ * @return 0 when the worker runs, 0-errno else
+ */
+static int
+readahead_start( archive_fs_t *fs, struct ar_readahead *ra, off_t offset,
+		int64_t filesize )
+{
+	struct ar_readahead *listed;
+	struct ar_stream *stream = NULL;
+	char *ring;
+	int ret = 0;
+
+	if( ( ring = malloc( fs->options.readaheadsize ) ) == NULL ) {
+		ret = -ENOMEM;
+	} else if( ( stream = stream_cache_get( fs, ra->node, offset ) )
+			== NULL ) {
+		ret = stream_open( fs, ra->node, &stream );
+	}
+	pthread_mutex_lock( &fs->ralock );
+	ra->starting = 0;
+	listed = fs->readaheads;
+	while( listed && listed != ra ) {
+		listed = listed->next;
+	}
+	if( ret == 0 && ! listed ) {
+		/* stopped while the stream was opened */
+		ret = -ECANCELED;
+	}
+	if( ret == 0 ) {
+		ra->ring = ring;
+		ra->stream = stream;
+		ra->depth = fs->options.readaheadsize;
+		ra->start = offset;
+		ra->fill = 0;
+		ra->eof = ra->error = ra->stop = 0;
+		ra->end = ra->node->dataoffset >= 0 ? filesize : -1;
+		if( ( ret = pthread_create( &ra->worker, NULL,
+						readahead_worker, ra ) ) != 0 ) {
+			ra->ring = NULL;
+			ra->stream = NULL;
+			ret = 0 - ret;
+		} else {
+			ra->running = 1;
+		}
+	}
+	if( ret != 0 ) {
+		ra->hits = 0;
+	}
+	pthread_mutex_unlock( &fs->ralock );
+	if( ret != 0 ) {
+		if( stream ) {
+			stream_cache_put( fs, stream );
+		}
+		free( ring );
+	}
+	return ret;
+}
+
+/*
+ * copies what the worker of ra decodes at offset, waiting for it as needed
+ * @return bytes copied, fewer than size at the end of the member or when
+ * *miss is set, or 0-errno if the worker failed; *miss is set to 1 when
+ * offset is not where ra is reading or ra was stopped
+ */
+static int
+readahead_copy( struct ar_readahead *ra, char *buf, size_t size,
+		off_t offset, int *miss )
+{
+	size_t done = 0;
+	int ret = 0;
+
+	*miss = 0;
+	pthread_mutex_lock( &ra->mutex );
+	while( done < size ) {
+		off_t end = ra->start + ( off_t )ra->fill;
+		size_t at = offset % ra->depth;
+		size_t len = size - done;
+		size_t part;
+		if( ra->stop || offset < ra->start || offset > end ) {
+			/* a jump, the worker cannot go back */
+			*miss = 1;
+			break;
+		}
+		if( offset == end ) {
+			if( ra->error ) {
+				ret = ra->error;
+				break;
+			}
+			if( ra->eof ) {
+				break;
+			}
+			pthread_cond_wait( &ra->filled, &ra->mutex );
+			continue;
+		}
+		if( ( off_t )len > end - offset ) {
+			len = end - offset;
+		}
+		part = len < ra->depth - at ? len : ra->depth - at;
+		memcpy( buf + done, ra->ring + at, part );
+		memcpy( buf + done + part, ra->ring, len - part );
+		/* what was read makes room for the worker */
+		ra->fill = end - ( offset + len );
+		ra->start = offset + len;
+		pthread_cond_signal( &ra->drained );
+		offset += len;
+		done += len;
+	}
+	pthread_mutex_unlock( &ra->mutex );
+	return done ? ( int )done : ret;
+}
+
+/*
+ * true if a read of node at offset continues the reads ra follows; call
+ * with fs->ralock held
+ */
+static int
+readahead_match( struct ar_readahead *ra, NODE *node, off_t offset )
+{
+	int match;
+
+	if( ra->node != node ) {
+		return 0;
+	}
+	if( ! ra->running ) {
+		return offset == ra->expect;
+	}
+	pthread_mutex_lock( &ra->mutex );
+	match = offset >= ra->start && offset <= ra->start + ( off_t )ra->fill;
+	pthread_mutex_unlock( &ra->mutex );
+	return match;
+}
+
+/*
+ * serves a read of the original data of node from a read-ahead, once the
+ * reader reads sequentially; call with fs->lock held. Readers are told
+ * apart by where they read, so each sequential reader of a member can get
+ * a worker of its own.
+ * @return bytes read, 0-errno on errors; *served is set to 1 when that is
+ * the whole result, else the rest is left to stream_read()
+ */
+static int
+readahead_read( archive_fs_t *fs, NODE *node, char *buf, size_t size,
+		off_t offset, int64_t filesize, int *served )
+{
+	struct ar_readahead **link;
+	struct ar_readahead **idle = NULL;
+	struct ar_readahead *ra = NULL;
+	struct ar_readahead *retire = NULL;
+	time_t now = time( NULL );
+	int running = 0;
+	int count = 0;
+	int start = 0;
+	int serve;
+	int miss;
+	int ret;
+
+	*served = 0;
+	if( fs->options.readahead <= 0 || fs->options.readaheadsize == 0 ) {
+		return 0;
+	}
+	pthread_mutex_lock( &fs->ralock );
+	for( link = &fs->readaheads; *link; link = &( *link )->next ) {
+		if( readahead_match( *link, node, offset ) ) {
+			/* to the front */
+			ra = *link;
+			*link = ra->next;
+			break;
+		}
+	}
+	if( ! ra ) {
+		if( ( ra = calloc( 1, sizeof( struct ar_readahead ) ) ) == NULL ) {
+			pthread_mutex_unlock( &fs->ralock );
+			return 0;
+		}
+		ra->node = node;
+		ra->refs = 1;
+		pthread_mutex_init( &ra->mutex, NULL );
+		pthread_cond_init( &ra->filled, NULL );
+		pthread_cond_init( &ra->drained, NULL );
+	} else if( ! ra->running ) {
+		ra->hits++;
+	}
+	ra->expect = offset + size;
+	ra->used = now;
+	ra->next = fs->readaheads;
+	fs->readaheads = ra;
+	/* only the most recent readers are followed */
+	for( link = &ra->next; *link; ) {
+		struct ar_readahead *other = *link;
+		if( ++count >= READAHEAD_TRACK ) {
+			*link = other->next;
+			other->next = retire;
+			retire = other;
+			continue;
+		}
+		if( other->starting ) {
+			running++;
+		} else if( other->running ) {
+			running++;
+			if( now - other->used >= READAHEAD_IDLE ) {
+				/* the least recently read idle worker */
+				idle = link;
+			}
+		}
+		link = &other->next;
+	}
+	if( ! ra->running && ! ra->starting
+			&& ra->hits >= READAHEAD_AFTER ) {
+		/* a worker busy for another reader is left alone, taking
+		   it over costs that reader its decoder */
+		if( running >= fs->options.readahead && idle ) {
+			struct ar_readahead *other = *idle;
+			*idle = other->next;
+			other->next = retire;
+			retire = other;
+			running--;
+		}
+		if( running < fs->options.readahead ) {
+			/* the slot is taken until readahead_start() is done */
+			ra->starting = start = 1;
+		}
+	}
+	if( ( serve = ra->running ) || start ) {
+		ra->refs++;
+	}
+	pthread_mutex_unlock( &fs->ralock );
+	while( retire ) {
+		struct ar_readahead *next = retire->next;
+		readahead_retire( fs, retire );
+		retire = next;
+	}
+	if( start ) {
+		serve = readahead_start( fs, ra, offset, filesize ) == 0;
+	}
+	if( ! serve ) {
+		if( start ) {
+			pthread_mutex_lock( &fs->ralock );
+			readahead_unref( fs, ra );
+			pthread_mutex_unlock( &fs->ralock );
+		}
+		return 0;
+	}
+	/* a miss means another reader at the same place was faster, or the
+	   worker was stopped; stream_read() does the rest */
+	ret = readahead_copy( ra, buf, size, offset, &miss );
+	*served = ! miss;
+	pthread_mutex_lock( &fs->ralock );
+	readahead_unref( fs, ra );
+	pthread_mutex_unlock( &fs->ralock );
+	return ret;
+}
+
+  /********/
+ /* tree */
+/********/
+
+/*
+ * finds the position of the child called name in the sorted children of
+ * parent, or where it would have to be inserted
+ */
+static size_t
+child_index( const NODE *parent, const char *name )
+{
+	size_t lo = 0;
+	size_t hi = parent->nchildren;
+
+	/* nodes mostly arrive in order while the tree is built */
+	if( hi > 0 && strcmp( parent->children[hi - 1]->name, name ) < 0 ) {
+		return hi;
+	}
+	while( lo < hi ) {
+		size_t mid = lo + ( hi - lo ) / 2;
+		if( strcmp( parent->children[mid]->name, name ) < 0 ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static void
+remove_child( archive_fs_t *fs, NODE *node )
+{
+	NODE *parent = node->parent;
+
+	hash_remove( fs, node );
+	if( parent ) {
+		size_t i = child_index( parent, node->name );
+		if( i < parent->nchildren && parent->children[i] == node ) {
+			parent->nchildren--;
+			memmove( parent->children + i, parent->children + i + 1,
+					( parent->nchildren - i ) *
+					sizeof( NODE * ) );
+		}
+	}
+}
+
+static int
+insert_as_child( NODE *node, NODE *parent )
+{
+	size_t i;
+
+	if( parent->nchildren == parent->childsize ) {
+		size_t size = parent->childsize ? parent->childsize * 2 : 4;
+		NODE **children = realloc( parent->children,
+				size * sizeof( NODE * ) );
+		if( children == NULL ) {
+			return -ENOMEM;
+		}
+		parent->children = children;
+		parent->childsize = size;
+	}
+	i = child_index( parent, node->name );
+	memmove( parent->children + i + 1, parent->children + i,
+			( parent->nchildren - i ) * sizeof( NODE * ) );
+	parent->children[i] = node;
+	parent->nchildren++;
+	node->parent = parent;
+	return 0;
+}
+
+/*
+ * inserts "node" into the tree of "fs" under "path"; missing parent
+ * directories are created on the fly
+ * @return 0 on success, 0-errno else (ENOENT or ENOTDIR)
+ */
+static int
+insert_by_path( archive_fs_t *fs, NODE *node, const char *path )
+{
+	NODE *parent;
+	NODE *tempnode;
+	const char *slash = strrchr( path, '/' );
+	const char *name = slash ? slash + 1 : path;
+	size_t namlen = slash ? slash - path : 0;
+
+	if( namlen == 0 ) {
+		parent = fs->root;
+	} else {
+		char nam[namlen + 1];
+
+		strncpy( nam, path, namlen );
+		nam[namlen] = '\0';
+		parent = get_node_for_path( fs, nam );
+		if( ! parent ) {
+			/* parent path not found, create a temporary one */
+			int ret;
+			if( ( parent = node_new( fs ) ) == NULL ) {
+				return -ENOMEM;
+			}
+			if( fs->options.readonly ) {
+				if( nodestat_from_entry( fs, &parent->st,
+						fs->root->entry ) != 0 ) {
+					log( "Out of memory" );
+					return -ENOMEM;
+				}
+			} else if( (parent->entry = archive_entry_clone( fs->root->entry )) == NULL ) {
+			        log( "Out of memory" );
+				return -ENOMEM;
+			}
+			/* insert it recursively */
+			if( ( ret = insert_by_path( fs, parent, nam ) ) != 0 ) {
+				return ret;
+			}
+		}
+	}
+	if( ! S_ISDIR( node_mode( parent ) ) && parent != fs->root ) {
+		return -ENOTDIR;
+	}
+	if( ( node->name = name_intern( fs, name, strlen( name ) ) ) == NULL ) {
+		return -ENOMEM;
+	}
+	/* check if a node of this name already exists */
+	if( ( tempnode = get_node_for_path( fs, path ) ) ) {
+		/* this is a dupe due to a temporarily inserted
+		   node, just update the entry */
+		if( node->entry ) {
+			archive_entry_free( node->entry );
+			node->entry = NULL;
+		}
+		if( ! tempnode->entry ) {
+			node->st = tempnode->st;
+		} else if( (node->entry = archive_entry_clone(
+				tempnode->entry )) == NULL) {
+			log( "Out of memory" );
+			return -ENOMEM;
+		}
+		return 0;
+	}
+	node->parent = parent;
+	if( hash_insert( fs, node ) != 0 ) {
+		log( "Out of memory" );
+		return -ENOMEM;
+	}
+	if( insert_as_child( node, parent ) != 0 ) {
+		hash_remove( fs, node );
+		log( "Out of memory" );
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * inserts the node of a member of the archive under path. A node there
+ * already is a directory made up for the members below it, or a member
+ * that is in the archive twice: it takes the header and data of this
+ * member, which comes later, unless that turns a directory with children
+ * into a file.
+ */
+static int
+insert_member( archive_fs_t *fs, NODE *node, const char *path )
+{
+	NODE *old = get_node_for_path( fs, path );
+
+	if( ! old ) {
+		return insert_by_path( fs, node, path );
+	}
+	if( old->nchildren && ! S_ISDIR( node_mode( node ) ) ) {
+		return 0;
+	}
+	if( old->entry ) {
+		archive_entry_free( old->entry );
+	}
+	old->entry = node->entry;
+	old->st = node->st;
+	old->dataoffset = node->dataoffset;
+	old->cacheoffset = node->cacheoffset;
+	node->entry = NULL;
+	return 0;
+}
+
+static int
+is_gzip( int fd )
+{
+	unsigned char magic[2];
+
+	return pread( fd, magic, 2, 0 ) == 2
+		&& magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+/*
+ * creates the unlinked temporary file materialize_entry() copies member
+ * data to
+ */
+static int
+open_cache_file( archive_fs_t *fs )
+{
+	char *location;
+
+	if( ( location = malloc( strlen( P_tmpdir ) +
+			strlen( "/archivemount_cache_XXXXXX" ) + 1 ) ) == NULL ) {
+		log( "Out of memory" );
+		return -ENOMEM;
+	}
+	sprintf( location, "%s/archivemount_cache_XXXXXX", P_tmpdir );
+	if( ( fs->cacheFd = mkstemp( location ) ) == -1 ) {
+		int err = errno;
+		free( location );
+		return 0 - err;
+	}
+	unlink( location );
+	free( location );
+	fs->cachesize = 0;
+	return 0;
+}
+
+/*
+ * copies the data of the current entry of archive to the cache file and
+ * records its offset there in node; holes of sparse entries stay holes
+ */
+static int
+materialize_entry( archive_fs_t *fs, struct archive *archive,
+		struct archive_entry *entry, NODE *node )
+{
+	const void *buf;
+	size_t len;
+	off_t offset;
+	off_t base = fs->cachesize;
+	int ret;
+
+	while( ( ret = archive_read_data_block( archive, &buf, &len,
+					&offset ) ) == ARCHIVE_OK )
+	{
+		if( pwrite( fs->cacheFd, buf, len, base + offset ) != ( ssize_t )len ) {
+			ret = errno ? 0 - errno : -EIO;
+			log( "Could not write '%s' to cache file: %s",
+					archive_entry_pathname( entry ),
+					strerror( 0 - ret ) );
+			return ret;
+		}
+	}
+	if( ret != ARCHIVE_EOF ) {
+		log( "Could not decode '%s': %s",
+				archive_entry_pathname( entry ),
+				archive_error_string( archive ) );
+		return archive_errno( archive ) > 0 ?
+			0 - archive_errno( archive ) : -EIO;
+	}
+	node->cacheoffset = base;
+	/* keep members block aligned */
+	fs->cachesize = ( base + archive_entry_size( entry ) + 4095 ) &
+		~( off_t )4095;
+	return 0;
+}
+
+  /******************/
+ /* tree snapshots */
+/******************/
+
+/*
+ * adds records for everything below node to writer, parents first; parent
+ * is the index of the record of node
+ */
+static void
+snapshot_children( snapwriter_t *writer, const NODE *node, int64_t parent )
+{
+	size_t i;
+
+	for( i = 0; i < node->nchildren; i++ ) {
+		const NODE *child = node->children[i];
+		snapnode_t rec;
+		int64_t index;
+		memset( &rec, 0, sizeof( rec ) );
+		rec.parent = parent;
+		rec.name = snapshot_add_string( writer, child->name );
+		rec.hardlink = snapshot_add_string( writer, child->st.hardlink );
+		rec.symlink = snapshot_add_string( writer, child->st.symlink );
+		rec.size = child->st.size;
+		rec.ino = child->st.ino;
+		rec.atime = child->st.atime;
+		rec.mtime = child->st.mtime;
+		rec.ctime = child->st.ctime;
+		rec.atimensec = child->st.atimensec;
+		rec.mtimensec = child->st.mtimensec;
+		rec.ctimensec = child->st.ctimensec;
+		rec.dev = child->st.dev;
+		rec.rdev = child->st.rdev;
+		rec.dataoffset = child->dataoffset;
+		rec.mode = child->st.mode;
+		rec.uid = child->st.uid;
+		rec.gid = child->st.gid;
+		rec.nlink = child->st.nlink;
+		if( ( index = snapshot_add_node( writer, &rec ) ) == -1 ) {
+			/* snapshot_save() reports it */
+			return;
+		}
+		snapshot_children( writer, child, index );
+	}
+}
+
+/*
+ * saves the tree of a read-only mount to path; st is the stat of the
+ * archive it was read from
+ * @return 0 on success, 0-errno else
+ */
+static int
+save_snapshot( archive_fs_t *fs, const char *path, const struct stat *st )
+{
+	snapwriter_t *writer;
+	int ret;
+
+	if( ( writer = snapshot_writer_new() ) == NULL ) {
+		return -ENOMEM;
+	}
+	snapshot_children( writer, fs->root, -1 );
+	ret = snapshot_save( writer, path, st,
+			fs->gzindex ? SNAPSHOT_GZDATA : 0 );
+	snapshot_writer_free( writer );
+	return ret;
+}
+
+/*
+ * builds the tree below fs->root from the snapshot at path, if it was taken
+ * of the archive as it is now; the names stay in the mapped file
+ * @return 0 on success, -ENOENT if there is no such snapshot, 0-errno else
+ */
+static int
+load_snapshot( archive_fs_t *fs, const char *path, const struct stat *st )
+{
+	snapshot_t *snapshot;
+	NODE **nodes = NULL;
+	int64_t i;
+	int ret = 0;
+
+	if( ( snapshot = snapshot_load( path, st,
+				fs->gzindex ? SNAPSHOT_GZDATA : 0 ) ) == NULL ) {
+		return -ENOENT;
+	}
+	if( snapshot->count && ( nodes = malloc( snapshot->count *
+					sizeof( NODE * ) ) ) == NULL ) {
+		log( "Out of memory" );
+		snapshot_free( snapshot );
+		return -ENOMEM;
+	}
+	fs->snapshot = snapshot;
+	/* size the path hash index once */
+	if( fs->nodehashsize < fs->nodecount + snapshot->count ) {
+		hash_resize( fs, fs->nodecount + snapshot->count );
+	}
+	for( i = 0; i < snapshot->count; i++ ) {
+		const snapnode_t *rec = snapshot->nodes + i;
+		const char *name = snapshot->strings + rec->name;
+		NODE *node;
+		if( ( node = node_new( fs ) ) == NULL ) {
+			ret = -ENOMEM;
+			break;
+		}
+		if( ( node->name = name_store( fs, name, strlen( name ),
+						1 ) ) == NULL ) {
+			ret = -ENOMEM;
+			break;
+		}
+		if( rec->hardlink >= 0 ) {
+			name = snapshot->strings + rec->hardlink;
+			if( ( node->st.hardlink = name_store( fs, name,
+						strlen( name ), 1 ) ) == NULL ) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+		if( rec->symlink >= 0 ) {
+			name = snapshot->strings + rec->symlink;
+			if( ( node->st.symlink = name_store( fs, name,
+						strlen( name ), 1 ) ) == NULL ) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+		node->st.size = rec->size;
+		node->st.ino = rec->ino;
+		node->st.atime = rec->atime;
+		node->st.mtime = rec->mtime;
+		node->st.ctime = rec->ctime;
+		node->st.atimensec = rec->atimensec;
+		node->st.mtimensec = rec->mtimensec;
+		node->st.ctimensec = rec->ctimensec;
+		node->st.mode = rec->mode;
+		node->st.uid = rec->uid;
+		node->st.gid = rec->gid;
+		node->st.nlink = rec->nlink;
+		node->st.dev = rec->dev;
+		node->st.rdev = rec->rdev;
+		node->dataoffset = rec->dataoffset;
+		node->parent = rec->parent < 0 ? fs->root : nodes[rec->parent];
+		if( hash_insert( fs, node ) != 0 ) {
+			ret = -ENOMEM;
+			break;
+		}
+		if( insert_as_child( node, node->parent ) != 0 ) {
+			hash_remove( fs, node );
+			ret = -ENOMEM;
+			break;
+		}
+		nodes[i] = node;
+	}
+	free( nodes );
+	if( ret != 0 ) {
+		log( "Out of memory" );
+		return ret;
+	}
+	resolve_links( fs );
+	return 0;
+}
+
+  /***************/
+ /* header scan */
+/***************/
+
+/* state of the header scan started by build_tree() */
+struct ar_indexer {
+	archive_fs_t *fs;
+	struct ar_stream *source; /* archive positioned at the first header */
+	char *indexfile; /* where to save a new gzip index, or NULL */
+	char *snapfile; /* where to save a snapshot of the tree, or NULL */
+	struct stat st; /* of the archive file */
+};
+
+/*
+ * reads the remaining headers of the archive and adds a node for each
+ * entry; the archive is closed afterwards. With a background indexer the
+ * nodes are published one by one under fs->lock and waiters are woken.
+ * @return 0 on success, 0-errno else
+ */
+static int
+index_entries( struct ar_indexer *indexer )
+{
+	archive_fs_t *fs = indexer->fs;
+	struct archive *archive = indexer->source->archive;
+	struct archive_entry *entry;
+	int background = fs->indexing;
+	int materialize = fs->cacheFd != -1;
+	size_t published = 0;
+	char *path = NULL;
+	size_t pathsize = 0;
+	int format;
+	int status;
+	int ret = 0;
+
+	/* read all entries in archive, create node for each */
+	while( ( status = archive_read_next_header( archive, &entry ) )
+			== ARCHIVE_OK ) {
+		NODE *cur;
+		const char *name;
+		/* find name of node */
+		name = archive_entry_pathname( entry );
+		if( strncmp( name, "./\0", 3 ) == 0 ) {
+			/* special case: the directory "./" must be skipped! */
+			continue;
+		}
+		/* create node; read-only mounts only keep what stat()
+		   needs, others clone the entry */
+		if( (cur = node_new( fs ) ) == NULL ) {
+		        ret = -ENOMEM;
+			break;
+		}
+		if( fs->options.readonly ) {
+			if( nodestat_from_entry( fs, &cur->st, entry ) != 0 ) {
+				log( "Out of memory" );
+				ret = -ENOMEM;
+				break;
+			}
+		} else if( (cur->entry = archive_entry_clone( entry )) == NULL ) {
+		        log( "Out of memory" );
+			ret = -ENOMEM;
+			break;
+		}
+		if( ( ret = normalize_path( name, &path, &pathsize ) ) != 0 ) {
+			break;
+		}
+		/* get past the data; the node is not visible yet, so this
+		   does not hold up readers */
+		format = archive_format( archive );
+		if( materialize
+				&& S_ISREG( archive_entry_mode( entry ) )
+				&& ! archive_entry_hardlink( entry ) )
+		{
+			/* decode the data right away in materialize mode; after
+			   a failure this member and the rest are read from the
+			   archive */
+			if( materialize_entry( fs, archive, entry, cur ) != 0 ) {
+				log( "Materializing stopped at '%s'", name );
+				cur->cacheoffset = -1;
+				materialize = 0;
+				pthread_mutex_lock( &fs->indexlock );
+				fs->cachestopped = 1;
+				pthread_mutex_unlock( &fs->indexlock );
+			}
+		} else if( archive_compression( archive ) == ARCHIVE_COMPRESSION_NONE
+				&& ( ( format & ARCHIVE_FORMAT_BASE_MASK ) ==
+					ARCHIVE_FORMAT_TAR
+				|| ( format & ARCHIVE_FORMAT_BASE_MASK ) ==
+					ARCHIVE_FORMAT_CPIO )
+				&& S_ISREG( archive_entry_mode( entry ) )
+				&& ! archive_entry_hardlink( entry ) )
+		{
+			/* remember where the data of stored regular files
+			   starts, so reads can go to the archive file
+			   directly */
+			int64_t dataoffset = archive_position_uncompressed( archive );
+			int64_t datalen;
+			archive_read_data_skip( archive );
+			/* sparse members store less data than their size,
+			   those have to go through libarchive */
+			datalen = archive_position_uncompressed( archive ) -
+				dataoffset;
+			if( datalen >= archive_entry_size( entry )
+					&& datalen - archive_entry_size( entry ) < 512 )
+			{
+				cur->dataoffset = dataoffset;
+			}
+		} else {
+			archive_read_data_skip( archive );
+		}
+		/* references */
+		if( background ) {
+			pthread_rwlock_wrlock( &fs->lock );
+		}
+		ret = insert_member( fs, cur, path );
+		if( background ) {
+			pthread_rwlock_unlock( &fs->lock );
+		}
+		if( ret != 0 ) {
+			log( "ERROR: could not insert %s into tree",
+					path );
+			ret = -ENOENT;
+			break;
+		}
+		/* wake waiters every INDEX_BATCH nodes, so they do not
+		   retry their lookup after each one */
+		if( background && ++published % INDEX_BATCH == 0 ) {
+			int stop;
+			pthread_mutex_lock( &fs->indexlock );
+			if( fs->indexwaiters ) {
+				pthread_cond_broadcast( &fs->indexcond );
+			}
+			stop = fs->indexstop;
+			pthread_mutex_unlock( &fs->indexlock );
+			if( stop ) {
+				break;
+			}
+		}
+	}
+	free( path );
+	/* links may name members that came after them */
+	if( background ) {
+		pthread_rwlock_wrlock( &fs->lock );
+	}
+	resolve_links( fs );
+	if( background ) {
+		pthread_rwlock_unlock( &fs->lock );
+	}
+	/* close archive */
+	stream_close( indexer->source );
+	if( fs->cacheFd != -1 ) {
+		/* sparse members may end in a hole */
+		if( ftruncate( fs->cacheFd, fs->cachesize ) == -1 ) {
+			log( "Could not size cache file: %s", strerror( errno ) );
+		}
+	}
+	if( fs->gzindex ) {
+		/* no further checkpoints are added from here on */
+		fs->gzindex->complete = 1;
+	}
+	if( indexer->indexfile ) {
+		int err;
+		if( ret == 0 && ( err = gzindex_save( fs->gzindex,
+					indexer->indexfile, indexer->st.st_size,
+					indexer->st.st_mtime ) ) != 0 ) {
+			log( "Could not save gzip index %s: %s",
+					indexer->indexfile, strerror( 0 - err ) );
+		}
+		free( indexer->indexfile );
+	}
+	if( indexer->snapfile ) {
+		int err;
+		/* only a complete tree is worth keeping */
+		if( ret == 0 && status == ARCHIVE_EOF ) {
+			if( background ) {
+				pthread_rwlock_rdlock( &fs->lock );
+			}
+			err = save_snapshot( fs, indexer->snapfile,
+					&indexer->st );
+			if( background ) {
+				pthread_rwlock_unlock( &fs->lock );
+			}
+			if( err != 0 ) {
+				log( "Could not save snapshot %s: %s",
+						indexer->snapfile,
+						strerror( 0 - err ) );
+			}
+		}
+		free( indexer->snapfile );
+	}
+	free( indexer );
+	if( background ) {
+		pthread_mutex_lock( &fs->indexlock );
+		fs->indexing = 0;
+		pthread_cond_broadcast( &fs->indexcond );
+		pthread_mutex_unlock( &fs->indexlock );
+	}
+	return ret;
+}
+
+static void *
+indexer_thread( void *data )
+{
+	index_entries( data );
+	return NULL;
+}
+
+/*
+ * blocks until the background indexer has published path or has reached
+ * the end of the archive; must be called without fs->lock held
+ */
+static void
+wait_for_path( archive_fs_t *fs, const char *path )
+{
+	if( ! fs->background ) {
+		return;
+	}
+	pthread_mutex_lock( &fs->indexlock );
+	while( fs->indexing ) {
+		NODE *node;
+		pthread_rwlock_rdlock( &fs->lock );
+		node = get_node_for_path( fs, path );
+		pthread_rwlock_unlock( &fs->lock );
+		if( node ) {
+			break;
+		}
+		fs->indexwaiters++;
+		pthread_cond_wait( &fs->indexcond, &fs->indexlock );
+		fs->indexwaiters--;
+	}
+	pthread_mutex_unlock( &fs->indexlock );
+}
+
+/* whether the indexer gave up materializing the member data */
+static int
+cache_stopped( archive_fs_t *fs )
+{
+	int stopped;
+
+	pthread_mutex_lock( &fs->indexlock );
+	stopped = fs->cachestopped;
+	pthread_mutex_unlock( &fs->indexlock );
+	return stopped;
+}
+
+/*
+ * blocks until the background indexer has finished
+ */
+static void
+wait_for_index( archive_fs_t *fs )
+{
+	if( ! fs->background ) {
+		return;
+	}
+	pthread_mutex_lock( &fs->indexlock );
+	while( fs->indexing ) {
+		fs->indexwaiters++;
+		pthread_cond_wait( &fs->indexcond, &fs->indexlock );
+		fs->indexwaiters--;
+	}
+	pthread_mutex_unlock( &fs->indexlock );
+}
+
+static int
+build_tree( archive_fs_t *fs, const char *mtpt )
+{
+	struct archive *archive;
+	struct ar_stream *source;
+	struct ar_indexer *indexer;
+	struct stat st;
+	char *indexfile = NULL;
+	char *snapfile = NULL;
+	int format;
+	int compression;
+	int ret;
+
+	if( fstat( fs->archiveFd, &st ) != 0 ) {
+		perror( "Error stat'ing archiveFile" );
+		return errno;
+	}
+	/* gzip archives get a checkpoint index for random access, reuse
+	   the one saved next to the archive if it is still valid */
+	if( fs->options.gzindexspan > 0 && is_gzip( fs->archiveFd ) ) {
+		if( ( indexfile = malloc( strlen( fs->archiveFile ) +
+				strlen( ".gzindex" ) + 1 ) ) == NULL ) {
+			log( "Out of memory" );
+			return -ENOMEM;
+		}
+		sprintf( indexfile, "%s.gzindex", fs->archiveFile );
+		if( ( fs->gzindex = gzindex_load( indexfile, st.st_size,
+						st.st_mtime ) ) ) {
+			free( indexfile );
+			indexfile = NULL;
+		} else if( ( fs->gzindex = gzindex_new(
+					fs->options.gzindexspan ) ) == NULL ) {
+			log( "Out of memory" );
+			free( indexfile );
+			return -ENOMEM;
+		}
+	}
+	/* create root node */
+	if( (fs->root = node_new( fs ) ) == NULL ) {
+		return -ENOMEM;
+	}
+	if( ( fs->root->name = name_intern( fs, "/", 1 ) ) == NULL ) {
+		return -ENOMEM;
+	}
+	if( hash_insert( fs, fs->root ) != 0 ) {
+		return -ENOMEM;
+	}
+	/* fill root->entry */
+	if( (fs->root->entry = archive_entry_new()) == NULL ) {
+	        log( "Out of memory" );
+		return -ENOMEM;
+	}
+	archive_entry_set_gid( fs->root->entry, getgid() );
+	archive_entry_set_uid( fs->root->entry, getuid() );
+	archive_entry_set_mode( fs->root->entry, st.st_mtime );
+	archive_entry_set_pathname( fs->root->entry, "/" );
+	archive_entry_set_size( fs->root->entry, st.st_size );
+	archive_entry_set_mode( fs->root->entry, 0777 );
+	archive_entry_set_filetype( fs->root->entry, AE_IFDIR );
+	/* read-only mounts of an archive mounted before start from the
+	   snapshot of its tree; it is only valid with the gzip index it was
+	   taken with, so not while a new one is built */
+	if( fs->options.snapshot && fs->options.readonly
+			&& ! fs->options.materialize ) {
+		if( ( snapfile = malloc( strlen( fs->archiveFile ) +
+				strlen( ".snapshot" ) + 1 ) ) == NULL ) {
+			log( "Out of memory" );
+			free( indexfile );
+			return -ENOMEM;
+		}
+		sprintf( snapfile, "%s.snapshot", fs->archiveFile );
+		if( ! indexfile && ( ret = load_snapshot( fs, snapfile,
+						&st ) ) != -ENOENT ) {
+			/* no indexer needed */
+			free( snapfile );
+			fs->background = fs->indexing = 0;
+			return ret;
+		}
+	}
+	/* open archive */
+	if( ( ret = stream_new( fs, NULL, &source ) ) != 0 ) {
+		free( indexfile );
+		free( snapfile );
+		return ret;
+	}
+	if( ( ret = stream_open_archive( source ) ) != 0 ) {
+		fprintf( stderr, "%s\n", source->archive ?
+				archive_error_string( source->archive ) :
+				strerror( 0 - ret ) );
+		stream_close( source );
+		free( indexfile );
+		free( snapfile );
+		return ret;
+	}
+	archive = source->archive;
+	/* member data is only worth a local copy if it has to be decoded */
+	if( fs->options.materialize && ( fs->gzindex ||
+				archive_compression( archive ) !=
+				ARCHIVE_COMPRESSION_NONE ) )
+	{
+		if( ( ret = open_cache_file( fs ) ) != 0 ) {
+			log( "Could not create cache file: %s",
+					strerror( 0 - ret ) );
+		}
+	}
+	/* check if format or compression prohibits writability */
+	format = archive_format( archive );
+	compression = archive_compression( archive );
+	if( format & ARCHIVE_FORMAT_ISO9660
+			|| format & ARCHIVE_FORMAT_ISO9660_ROCKRIDGE
+			|| format & ARCHIVE_FORMAT_ZIP
+			|| compression == ARCHIVE_COMPRESSION_COMPRESS )
+	{
+		fs->archiveWriteable = 0;
+	}
+	/* the entries are read by index_entries() */
+	if( ( indexer = malloc( sizeof( struct ar_indexer ) ) ) == NULL ) {
+	        log( "Out of memory" );
+		stream_close( source );
+		free( indexfile );
+		free( snapfile );
+		return -ENOMEM;
+	}
+	indexer->fs = fs;
+	indexer->source = source;
+	indexer->indexfile = indexfile;
+	indexer->snapfile = snapfile;
+	indexer->st = st;
+	if( fs->indexing ) {
+		if( pthread_create( &fs->indexer, NULL, indexer_thread,
+					indexer ) == 0 ) {
+			return 0;
+		}
+		log( "Could not start indexer thread, indexing now" );
+		fs->indexing = 0;
+		fs->background = 0;
+	}
+	return index_entries( indexer );
+}
+
+/*
+ * data offsets recorded by build_tree() refer to the archive file as it was
+ * mounted; forget them once the archive has been rewritten
+ */
+static void
+forget_data_offsets( archive_fs_t *fs )
+{
+	size_t i;
+
+	for( i = 0; i < fs->nodehashsize; i++ ) {
+		NODE *node;
+		for( node = fs->nodehash[i]; node; node = node->hashnext ) {
+			node->dataoffset = -1;
+		}
+	}
+}
+
+/*
+ * updates all nodes below parent after parent was moved to "to": their
+ * paths hash differently now, and hardlinks to them have to follow
+ */
+static int
+rename_recursively( archive_fs_t *fs, NODE *parent, const char *to )
+{
+	char newName[PATH_MAX];
+	int ret = 0;
+	size_t i;
+
+	for( i = 0; i < parent->nchildren; i++ ) {
+		NODE *node = parent->children[i];
+		if( node_path( node, newName, sizeof( newName ) ) != 0 ) {
+			log( "Path of '%s' below '%s' too long", node->name,
+					to );
+			ret = -ENAMETOOLONG;
+			continue;
+		}
+		retarget_referrers( node, newName );
+		hash_remove( fs, node );
+		node->namechanged = 1;
+		hash_insert( fs, node );
+		if( node->nchildren ) {
+			/* recurse, the hashes below depend on this one */
+			ret = rename_recursively( fs, node, to );
+		}
+	}
+	return ret;
+}
+
+static int
+get_temp_file_name( const char *path, char **location )
+{
+	char *tmppath;
+	char *tmp;
+	int fh;
+
+	/* create name for temp file */
+	tmp = tmppath = strdup( path );
+	do if( *tmp == '/' ) *tmp = '_'; while( *( tmp++ ) );
+	if ( ( *location = ( char * )malloc(
+			strlen( P_tmpdir ) +
+			strlen( "_archivemount" ) +
+			strlen( tmppath ) + 8 ) ) == NULL ) {
+	        log( "Out of memory" );
+		return -ENOMEM;
+	}
+	sprintf( *location, "%s/archivemount%s_XXXXXX", P_tmpdir, tmppath );
+	free( tmppath );
+	if( ( fh = mkstemp( *location ) ) == -1 ) {
+		log( "Could not create temp file name %s: %s",
+				*location, strerror( errno ) );
+		free( *location );
+		return 0 - errno;
+	}
+	close( fh );
+	unlink( *location );
+	return 0;
+}
+
+/**
+ * Updates given nodes node->entry by stat'ing node->location. Does not update
+ * the name!
+ */
+static int
+update_entry_stat( NODE *node )
+{
+	struct stat st;
+	struct passwd pwbuf, *pwd;
+	struct group grbuf, *grp;
+	char buf[MAXBUF];
 
 	if( lstat( node->location, &st ) != 0 ) {
 		return 0 - errno;
@@ -530,154 +2804,603 @@ update_entry_stat( NODE *node )
 	archive_entry_set_mode( node->entry, st.st_mode );
 	archive_entry_set_rdevmajor( node->entry, st.st_dev );
 	archive_entry_set_rdevminor( node->entry, st.st_dev );
-	pwd = getpwuid( st.st_uid );
-	if( pwd ) {
+	/* writers of different files may get here at the same time */
+	if( getpwuid_r( st.st_uid, &pwbuf, buf, sizeof( buf ), &pwd ) == 0
+			&& pwd ) {
 		archive_entry_set_uname( node->entry, strdup( pwd->pw_name ) );
 	}
-	grp = getgrgid( st.st_gid );
-	if( grp ) {
+	if( getgrgid_r( st.st_gid, &grbuf, buf, sizeof( buf ), &grp ) == 0
+			&& grp ) {
 		archive_entry_set_gname( node->entry, strdup( grp->gr_name ) );
 	}
 	return 0;
 }
 
+  /********/
+ /* save */
+/********/
+
+/*
+ * maps the member names of the archive as it was mounted to the nodes; the
+ * headers of the nodes keep those names until the archive is saved, also
+ * when the node was renamed
+ */
+typedef struct {
+	NODE **slots; /* open addressing, at most half full */
+	size_t size; /* number of slots, a power of two */
+} entryindex_t;
+
+static unsigned int
+entry_key_hash( const char *path )
+{
+	if( *path == '/' ) {
+		path++;
+	}
+	return path_hash( path );
+}
+
+static int
+entry_key_equal( const char *a, const char *b )
+{
+	if( *a == '/' ) {
+		a++;
+	}
+	if( *b == '/' ) {
+		b++;
+	}
+	return strcmp( a, b ) == 0;
+}
+
+/* adds node and the nodes below it, a name seen before keeps its node */
+static void
+entry_index_add( entryindex_t *index, NODE *node )
+{
+	const char *name = archive_entry_pathname( node->entry );
+	size_t slot = entry_key_hash( name ) & ( index->size - 1 );
+	size_t i;
+
+	while( index->slots[slot] ) {
+		if( entry_key_equal( archive_entry_pathname(
+					index->slots[slot]->entry ), name ) ) {
+			break;
+		}
+		slot = ( slot + 1 ) & ( index->size - 1 );
+	}
+	if( ! index->slots[slot] ) {
+		index->slots[slot] = node;
+	}
+	for( i = 0; i < node->nchildren; i++ ) {
+		entry_index_add( index, node->children[i] );
+	}
+}
+
+static int
+entry_index_build( archive_fs_t *fs, entryindex_t *index )
+{
+	index->size = NODEHASH_INITIAL_SIZE;
+	while( index->size < 2 * ( fs->nodecount + 1 ) ) {
+		index->size *= 2;
+	}
+	if( ( index->slots = calloc( index->size, sizeof( NODE * ) ) ) == NULL ) {
+		log( "Out of memory" );
+		return -ENOMEM;
+	}
+	entry_index_add( index, fs->root );
+	return 0;
+}
+
+static NODE *
+entry_index_lookup( const entryindex_t *index, struct archive_entry *entry )
+{
+	const char *name = archive_entry_pathname( entry );
+	size_t slot = entry_key_hash( name ) & ( index->size - 1 );
+
+	while( index->slots[slot] ) {
+		if( entry_key_equal( archive_entry_pathname(
+					index->slots[slot]->entry ), name ) ) {
+			return index->slots[slot];
+		}
+		slot = ( slot + 1 ) & ( index->size - 1 );
+	}
+	return NULL;
+}
+
+static int
+string_equal( const char *a, const char *b )
+{
+	if( a == NULL || b == NULL ) {
+		return a == b;
+	}
+	return strcmp( a, b ) == 0;
+}
+
+/*
+ * true if the member of the old archive can be copied as it is: node was
+ * neither written to (or is in the new archive already) nor renamed, and
+ * its header still says the same
+ */
+static int
+entry_unchanged( const NODE *node, struct archive_entry *entry )
+{
+	struct archive_entry *cur = node->entry;
+
+	return ( ! node->modified || node->written ) && ! node->namechanged
+		&& archive_entry_mode( cur ) == archive_entry_mode( entry )
+		&& archive_entry_uid( cur ) == archive_entry_uid( entry )
+		&& archive_entry_gid( cur ) == archive_entry_gid( entry )
+		&& archive_entry_size( cur ) == archive_entry_size( entry )
+		&& archive_entry_mtime( cur ) == archive_entry_mtime( entry )
+		&& archive_entry_mtime_nsec( cur ) ==
+			archive_entry_mtime_nsec( entry )
+		&& archive_entry_rdev( cur ) == archive_entry_rdev( entry )
+		&& string_equal( archive_entry_uname( cur ),
+				archive_entry_uname( entry ) )
+		&& string_equal( archive_entry_gname( cur ),
+				archive_entry_gname( entry ) )
+		&& string_equal( archive_entry_hardlink( cur ),
+				archive_entry_hardlink( entry ) )
+		&& string_equal( archive_entry_symlink( cur ),
+				archive_entry_symlink( entry ) );
+}
+
+/* true for archives whose members can be copied byte for byte */
+static int
+save_copies_members( struct archive *archive )
+{
+	return archive_compression( archive ) == ARCHIVE_COMPRESSION_NONE
+		&& ( archive_format( archive ) & ARCHIVE_FORMAT_BASE_MASK ) ==
+			ARCHIVE_FORMAT_TAR;
+}
+
+/*
+ * copies len bytes at offset of in to the current position of out, inside
+ * the kernel where the system offers that
+ */
+static int
+copy_range( int in, off_t offset, int out, off_t len )
+{
+	char *buf;
+
+#ifdef __linux__
+	while( len > 0 ) {
+		ssize_t n = copy_file_range( in, &offset, out, NULL,
+				len > SSIZE_MAX ? SSIZE_MAX : ( size_t )len, 0 );
+		if( n <= 0 ) {
+			/* not supported between these files, copy below */
+			break;
+		}
+		len -= n;
+	}
+	if( len == 0 ) {
+		return 0;
+	}
+#endif
+	if( ( buf = malloc( COPYBUF ) ) == NULL ) {
+		log( "Out of memory" );
+		return -ENOMEM;
+	}
+	while( len > 0 ) {
+		ssize_t n = pread( in, buf, len > COPYBUF ? COPYBUF : len,
+				offset );
+		if( n <= 0 ) {
+			free( buf );
+			return n == 0 ? -EIO : 0 - errno;
+		}
+		if( write( out, buf, n ) != n ) {
+			free( buf );
+			return -EIO;
+		}
+		offset += n;
+		len -= n;
+	}
+	free( buf );
+	return 0;
+}
+
+/* counts what save() has written, see ar_save_progress() */
+static void
+save_progress( archive_fs_t *fs, off_t bytes, size_t members )
+{
+	pthread_mutex_lock( &fs->savemutex );
+	fs->savestatus.bytes += bytes;
+	fs->savestatus.members += members;
+	pthread_mutex_unlock( &fs->savemutex );
+}
+
+/*
+ * write a new or modified file to the new archive; used from save(). For a
+ * member with an overlay, oldarc is positioned at its original data.
+ */
+static void
+write_new_modded_file( NODE *node, struct archive_entry *wentry,
+		struct archive *newarc, struct archive *oldarc )
+{
+	if( node->location ) {
+		struct stat st;
+		int fh = 0;
+		off_t offset = 0;
+		void *buf;
+		char *orig = NULL;
+		ssize_t len = 0;
+		/* copy stat info */
+		if( node_flush( node ) < 0 ) {
+			return;
+		}
+		if( lstat( node->location, &st ) != 0 ) {
+			log( "Could not lstat temporary file %s: %s",
+					node->location,
+					strerror( errno ) );
+			return;
+		}
+		archive_entry_copy_stat( wentry, &st );
+		/* open temporary file */
+		fh = open( node->location, O_RDONLY );
+		if( fh == -1 ) {
+			log( "Fatal error opening modified file %s at "
+					"location %s, giving up",
+					archive_entry_pathname( wentry ),
+					node->location );
+			return;
+		}
+		/* write header */
+		archive_write_header( newarc, wentry );
+		if( node->overlay && ! oldarc ) {
+			log( "WARNING: original data of %s not found, the parts "
+					"that were not written are lost",
+					archive_entry_pathname( wentry ) );
+		}
+		if( S_ISREG( st.st_mode ) ) {
+			/* regular file, copy data */
+		        if( ( buf = malloc( COPYBUF ) ) == NULL
+					|| ( node->overlay && ( orig =
+						malloc( COPYBUF ) ) == NULL ) ) {
+			        log( "Out of memory" );
+				free( buf );
+				close( fh );
+				return;
+			}
+			while( ( len = pread( fh, buf, ( size_t )COPYBUF,
+							offset ) ) > 0 )
+			{
+				if( orig && oldarc
+						&& offset < node->overlay->keep ) {
+					/* fill in what was not written, the
+					   chunks follow each other */
+					size_t want = node->overlay->keep -
+						offset < len ?
+						( size_t )( node->overlay->keep -
+							offset ) :
+						( size_t )len;
+					size_t have = 0;
+					ssize_t got;
+					while( have < want && ( got =
+							archive_read_data(
+								oldarc,
+								orig + have,
+								want - have ) )
+							> 0 ) {
+						have += got;
+					}
+					overlay_merge( node->overlay, buf, orig,
+							offset, have );
+				}
+				archive_write_data( newarc, buf, len );
+				offset += len;
+			}
+			free( orig );
+			free( buf );
+		}
+		if( len == -1 ) {
+			log( "Error reading temporary file %s for file %s: %s",
+					node->location,
+					archive_entry_pathname( wentry ),
+					strerror( errno ) );
+			close( fh );
+			return;
+		}
+		/* clean up, the temp file goes once the new archive is in
+		   place */
+		close( fh );
+	} else {
+		/* no data, only write header (e.g. when node is a link!) */
+		/* FIXME: hardlinks are saved, symlinks not. why??? */
+		//log( "writing header for file %s", archive_entry_pathname( wentry ) );
+		archive_write_header( newarc, wentry );
+	}
+	/* mark file as written */
+	node->written = 1;
+}
+
+/* writes the nodes below node that were added since the archive was read */
+static void
+write_modified_nodes( archive_fs_t *fs, NODE *node, struct archive *newarc )
+{
+	struct nodelock *lock;
+	struct archive_entry *wentry;
+	size_t i;
+
+	if( node->modified && ! node->written ) {
+		/* readers may be caching stat data in the entry */
+		lock = node_lock( fs, node );
+		wentry = archive_entry_clone( node->entry );
+		node_unlock( lock );
+		if( wentry ) {
+			write_new_modded_file( node, wentry, newarc, NULL );
+			archive_entry_free( wentry );
+			save_progress( fs, 0, 1 );
+		} else {
+			log( "Out of memory" );
+		}
+	}
+	for( i = 0; i < node->nchildren; i++ ) {
+		write_modified_nodes( fs, node->children[i], newarc );
+	}
+}
+
+/*
+ * when nothing but new files has to be saved into an uncompressed tar
+ * archive, they are written behind the members already in the file and the
+ * rest of it is left alone; only used with nobackup, as there is no old
+ * archive to keep. Returns 1 if the archive has to be rewritten instead.
+ */
+static int
+save_appended( archive_fs_t *fs, const char *archiveFile,
+		const entryindex_t *index )
+{
+	struct archive *oldarc;
+	struct archive *newarc;
+	struct archive_entry *entry;
+	off_t end = 0;
+	int fd;
+	int ret;
+
+	if( ( oldarc = archive_read_new() ) == NULL ) {
+		log( "Out of memory" );
+		return -ENOMEM;
+	}
+	archive_read_support_compression_all( oldarc );
+	archive_read_support_format_all( oldarc );
+	if( archive_read_open_filename( oldarc, archiveFile, 10240 )
+			!= ARCHIVE_OK ) {
+		archive_read_finish( oldarc );
+		return 1;
+	}
+	while( ( ret = archive_read_next_header( oldarc, &entry ) )
+			== ARCHIVE_OK ) {
+		NODE *node = entry_index_lookup( index, entry );
+		const char *name = archive_entry_pathname( entry );
+		if( ! save_copies_members( oldarc ) ) {
+			break;
+		}
+		/* the member for the top directory has no node of its own
+		   and is left where it is */
+		if( ! node && strcmp( name, "." ) && strcmp( name, "./" ) ) {
+			break;
+		}
+		if( node && ! entry_unchanged( node, entry ) ) {
+			break;
+		}
+		archive_read_data_skip( oldarc );
+		end = archive_position_uncompressed( oldarc );
+	}
+	if( ret != ARCHIVE_EOF || end == 0 ) {
+		archive_read_finish( oldarc );
+		return 1;
+	}
+	if( ( newarc = archive_write_new() ) == NULL ) {
+		log( "Out of memory" );
+		archive_read_finish( oldarc );
+		return -ENOMEM;
+	}
+	archive_read_finish( oldarc );
+	/* the format save() writes tar archives in */
+	archive_write_set_compression_none( newarc );
+	archive_write_set_format_ustar( newarc );
+	archive_write_set_bytes_per_block( newarc, 0 );
+	/* overwrite the end of archive marker */
+	if( ( fd = open( archiveFile, O_WRONLY ) ) == -1
+			|| lseek( fd, end, SEEK_SET ) == -1 ) {
+		ret = 0 - errno;
+		log( "Could not open archive file %s for appending: %s",
+				archiveFile, strerror( errno ) );
+		if( fd != -1 ) {
+			close( fd );
+		}
+		archive_write_finish( newarc );
+		return ret;
+	}
+	if( archive_write_open_fd( newarc, fd ) != ARCHIVE_OK ) {
+		log( "%s", archive_error_string( newarc ) );
+		ret = archive_errno( newarc );
+		archive_write_finish( newarc );
+		close( fd );
+		return ret;
+	}
+	readahead_stop( fs, NULL );
+	stream_cache_evict( fs, NULL );
+	write_modified_nodes( fs, fs->root, newarc );
+	archive_write_finish( newarc );
+	/* the old end of archive marker may have been longer */
+	if( ftruncate( fd, lseek( fd, 0, SEEK_CUR ) ) == -1 ) {
+		log( "Could not truncate archive file %s: %s",
+				archiveFile, strerror( errno ) );
+	}
+	close( fd );
+	/* the members that were there stay where they were */
+	return 0;
+}
+
+/* where save() writes the new archive */
+struct saveout {
+	archive_fs_t *fs;
+	int fd;
+	pzwriter_t *pz; /* compresses the output, or NULL */
+};
+
+/* hands what libarchive writes to the file or the parallel compressor */
+static ssize_t
+save_write_cb( struct archive *archive, void *data, const void *buf,
+		size_t len )
+{
+	struct saveout *out = data;
+	ssize_t ret = len;
+
+	if( out->pz ) {
+		ret = pzwriter_write( out->pz, buf, len );
+	} else {
+		const char *p = buf;
+		size_t left = len;
+		while( left ) {
+			ssize_t n = write( out->fd, p, left );
+			if( n == -1 ) {
+				ret = 0 - errno;
+				break;
+			}
+			p += n;
+			left -= n;
+		}
+	}
+	if( ret < 0 ) {
+		archive_set_error( archive, 0 - ret, "%s", strerror( 0 - ret ) );
+		return -1;
+	}
+	save_progress( out->fs, ret, 0 );
+	return ret;
+}
+
+/* copies the unchanged members between start and end of the old archive */
+static int
+save_copy_run( archive_fs_t *fs, int oldfd, int out, off_t start, off_t end )
+{
+	int ret;
+
+	if( ( ret = copy_range( oldfd, start, out, end - start ) ) != 0 ) {
+		log( "Could not copy members to the new archive: %s",
+				strerror( 0 - ret ) );
+		return ret;
+	}
+	save_progress( fs, end - start, 0 );
+	return 0;
+}
+
+/* writes out the writebufs below node, so the temp files are complete */
+static int
+save_flush_nodes( archive_fs_t *fs, NODE *node )
+{
+	struct nodelock *lock;
+	size_t i;
+	int ret;
+
+	lock = node_lock( fs, node );
+	ret = node_flush( node );
+	node_unlock( lock );
+	for( i = 0; ret == 0 && i < node->nchildren; i++ ) {
+		ret = save_flush_nodes( fs, node->children[i] );
+	}
+	return ret;
+}
+
 /*
- * write a new or modified file to the new archive; used from save()
+ * clears the written marks below node; once the new archive is in place
+ * (committed) the written nodes also give up their temp files, unless they
+ * are still being written through an open descriptor
+ * @return the number of nodes that stay modified
  */
-static void
-write_new_modded_file( NODE *node, struct archive_entry *wentry,
-		struct archive *newarc )
+static size_t
+save_finish_nodes( archive_fs_t *fs, NODE *node, int committed )
 {
-	if( node->location ) {
-		struct stat st;
-		int fh = 0;
-		off_t offset = 0;
-		void *buf;
-		ssize_t len = 0;
-		/* copy stat info */
-		if( lstat( node->location, &st ) != 0 ) {
-			log( "Could not lstat temporary file %s: %s",
-					node->location,
-					strerror( errno ) );
-			return;
-		}
-		archive_entry_copy_stat( wentry, &st );
-		/* open temporary file */
-		fh = open( node->location, O_RDONLY );
-		if( fh == -1 ) {
-			log( "Fatal error opening modified file %s at "
-					"location %s, giving up",
-					node->name, node->location );
-			return;
-		}
-		/* write header */
-		archive_write_header( newarc, wentry );
-		if( S_ISREG( st.st_mode ) ) {
-			/* regular file, copy data */
-		        if( ( buf = malloc( MAXBUF ) ) == NULL ) {
-			        log( "Out of memory" );
-				return;
-			}
-			while( ( len = pread( fh, buf, ( size_t )MAXBUF,
-							offset ) ) > 0 )
-			{
-				archive_write_data( newarc, buf, len );
-				offset += len;
-			}
-			free( buf );
-		}
-		if( len == -1 ) {
-			log( "Error reading temporary file %s for file %s: %s",
-					node->location,
-					node->name,
-					strerror( errno ) );
-			close( fh );
-			return;
-		}
-		/* clean up */
-		close( fh );
-		if( S_ISDIR( st.st_mode ) ) {
-			if( rmdir( node->location ) == -1 ) {
-				log( "WARNING: rmdir '%s' failed: %s",
-						node->location, strerror( errno ) );
-			}
-		} else {
-			if( unlink( node->location ) == -1 ) {
+	size_t modified = 0;
+	size_t i;
+
+	if( node->written && committed && node->fd == -1 ) {
+		if( node->location ) {
+			if( S_ISDIR( archive_entry_mode( node->entry ) ) ) {
+				if( rmdir( node->location ) == -1 ) {
+					log( "WARNING: rmdir '%s' failed: %s",
+							node->location,
+							strerror( errno ) );
+				}
+			} else if( unlink( node->location ) == -1 ) {
 				log( "WARNING: unlinking '%s' failed: %s",
 						node->location, strerror( errno ) );
 			}
+			free( node->location );
+			node->location = NULL;
+		}
+		overlay_free( node->overlay );
+		node->overlay = NULL;
+		node->modified = 0;
+	}
+	if( node->namechanged && committed ) {
+		/* the new archive has the member under its new name, which
+		   the next save looks it up by */
+		char path[PATH_MAX];
+		if( node_path( node, path, sizeof( path ) ) == 0 ) {
+			archive_entry_set_pathname( node->entry,
+					*archive_entry_pathname( node->entry )
+					== '/' ? path : path + 1 );
+			node->namechanged = 0;
 		}
-	} else {
-		/* no data, only write header (e.g. when node is a link!) */
-		/* FIXME: hardlinks are saved, symlinks not. why??? */
-		//log( "writing header for file %s", archive_entry_pathname( wentry ) );
-		archive_write_header( newarc, wentry );
 	}
-	/* mark file as written */
-	node->modified = 0;
+	node->written = 0;
+	if( node->modified ) {
+		modified++;
+	}
+	for( i = 0; i < node->nchildren; i++ ) {
+		modified += save_finish_nodes( fs, node->children[i],
+				committed );
+	}
+	return modified;
 }
 
+/*
+ * writes the new archive to fd, reading the members that are kept from the
+ * archive file at archiveFile; the tree is left alone apart from the
+ * written marks
+ */
 static int
-save( archive_fs_t *fs, const char *archiveFile )
+save_write( archive_fs_t *fs, const char *archiveFile,
+		const entryindex_t *index, int fd )
 {
 	struct archive *oldarc;
 	struct archive *newarc;
 	struct archive_entry *entry;
-	int tempfile;
+	struct saveout out;
+	struct nodelock *lock;
+	int oldfd;
 	int format;
 	int compression;
-	char *oldfilename;
+	int pztype = 0;
+	int copy = 0;
+	int ret;
+	off_t runstart = 0, runend = 0;
 	NODE *node;
 
-	oldfilename = malloc( strlen( archiveFile ) + 5 + 1 );
-	if( !oldfilename ) {
-		log( "Could not allocate memory for oldfilename" );
-		return 0 - ENOMEM;
-	}
-	/* unfortunately libarchive does not support modification of
-	 * compressed archives, so a new archive has to be written */
-	/* rename old archive */
-	sprintf( oldfilename, "%s.orig", archiveFile );
-	close( fs->archiveFd );
-	if( rename( archiveFile, oldfilename ) < 0 ) {
-		int err = errno;
-		char *buf = NULL;
-		char *unknown = "<unknown>";
-		if( getcwd( buf, 0 ) == NULL ) {
-			/* getcwd failed, set buf to sth. reasonable */
-			buf = unknown;
-		}
-		log( "Could not rename old archive file (%s/%s): %s",
-				buf, archiveFile, strerror( err ) );
-		free( buf );
-		fs->archiveFd = open( fs->archiveFile, O_RDONLY );
-		return 0 - err;
+	/* a descriptor of its own, the readers' one keeps its offset */
+	if( ( oldfd = open( archiveFile, O_RDONLY ) ) == -1 ) {
+		ret = 0 - errno;
+		log( "Could not open archive file %s: %s", archiveFile,
+				strerror( errno ) );
+		return ret;
 	}
-	fs->archiveFd = open( oldfilename, O_RDONLY );
-	free( oldfilename );
 	/* open old archive */
 	if( (oldarc = archive_read_new()) == NULL ) {
                 log( "Out of memory" );
+		close( oldfd );
 		return -ENOMEM;
 	}
-	if( archive_read_support_compression_all( oldarc ) != ARCHIVE_OK ) {
-		log( "%s", archive_error_string( oldarc ) );
-		return archive_errno( oldarc );
-	}
-	if( archive_read_support_format_all( oldarc ) != ARCHIVE_OK ) {
-		log( "%s", archive_error_string( oldarc ) );
-		return archive_errno( oldarc );
-	}
-	if( archive_read_open_fd( oldarc, fs->archiveFd, 10240 ) != ARCHIVE_OK ) {
+	archive_read_support_compression_all( oldarc );
+	archive_read_support_format_all( oldarc );
+	if( archive_read_open_fd( oldarc, oldfd, 10240 ) != ARCHIVE_OK ) {
 		log( "%s", archive_error_string( oldarc ) );
-		return archive_errno( oldarc );
+		ret = archive_errno( oldarc ) > 0 ? 0 - archive_errno( oldarc ) :
+			-EIO;
+		archive_read_finish( oldarc );
+		close( oldfd );
+		return ret;
 	}
-	format = archive_format( oldarc );
 	compression = archive_compression( oldarc );
 	/*
-	log( "format of old archive is %s (%d)",
-			archive_format_name( oldarc ),
-			format );
 	log( "compression of old archive is %s (%d)",
 			archive_compression_name( oldarc ),
 			compression );
@@ -685,14 +3408,27 @@ save( archive_fs_t *fs, const char *archiveFile )
 	/* open new archive */
 	if( (newarc = archive_write_new()) == NULL ) {
 	        log( "Out of memory" );
+		archive_read_finish( oldarc );
+		close( oldfd );
 		return -ENOMEM;
 	}
 	switch( compression ) {
 		case ARCHIVE_COMPRESSION_GZIP:
-			archive_write_set_compression_gzip( newarc );
+			if( fs->options.savethreads != 1 ) {
+				/* compressed by pzwriter */
+				pztype = PZ_GZIP;
+				archive_write_set_compression_none( newarc );
+			} else {
+				archive_write_set_compression_gzip( newarc );
+			}
 			break;
 		case ARCHIVE_COMPRESSION_BZIP2:
-			archive_write_set_compression_bzip2( newarc );
+			if( fs->options.savethreads != 1 ) {
+				pztype = PZ_BZIP2;
+				archive_write_set_compression_none( newarc );
+			} else {
+				archive_write_set_compression_bzip2( newarc );
+			}
 			break;
 		case ARCHIVE_COMPRESSION_COMPRESS:
 		case ARCHIVE_COMPRESSION_NONE:
@@ -700,6 +3436,7 @@ save( archive_fs_t *fs, const char *archiveFile )
 			archive_write_set_compression_none( newarc );
 			break;
 	}
+	format = archive_format( oldarc );
 #if 0
 	if( archive_write_set_format( newarc, format ) != ARCHIVE_OK ) {
 		return -ENOTSUP;
@@ -735,38 +3472,99 @@ save( archive_fs_t *fs, const char *archiveFile )
 		log( "writing archives of format %d (%s) is not "
 				"supported", format,
 				archive_format_name( oldarc ) );
+		archive_write_finish( newarc );
+		archive_read_finish( oldarc );
+		close( oldfd );
 		return -ENOTSUP;
 	}
-	tempfile = open( archiveFile,
-			O_WRONLY | O_CREAT | O_EXCL,
-			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH );
-	if( tempfile == -1 ) {
-		log( "could not open new archive file for writing" );
-		return 0 - errno;
+	if( compression == ARCHIVE_COMPRESSION_NONE ) {
+		/* unbuffered, so members copied as they are and members
+		   written by libarchive stay in order */
+		archive_write_set_bytes_per_block( newarc, 0 );
+	}
+	/* no padding after the end of the archive, as for files written
+	   with archive_write_open_fd() */
+	archive_write_set_bytes_in_last_block( newarc, 1 );
+	out.fs = fs;
+	out.fd = fd;
+	out.pz = NULL;
+	if( pztype && ( out.pz = pzwriter_new( fd, pztype,
+					fs->options.savethreads ) ) == NULL ) {
+		log( "Out of memory" );
+		archive_write_finish( newarc );
+		archive_read_finish( oldarc );
+		close( oldfd );
+		return -ENOMEM;
 	}
-	if( archive_write_open_fd( newarc, tempfile ) != ARCHIVE_OK ) {
+	if( archive_write_open( newarc, &out, NULL, save_write_cb, NULL )
+			!= ARCHIVE_OK ) {
 		log( "%s", archive_error_string( newarc ) );
-		return archive_errno( newarc );
+		ret = archive_errno( newarc ) > 0 ? 0 - archive_errno( newarc ) :
+			-EIO;
+		archive_write_finish( newarc );
+		archive_read_finish( oldarc );
+		if( out.pz ) {
+			pzwriter_close( out.pz );
+		}
+		close( oldfd );
+		return ret;
 	}
-	while( archive_read_next_header( oldarc, &entry ) == ARCHIVE_OK ) {
+	ret = 0;
+	for( ;; ) {
 		off_t offset;
 		const void *buf;
 		struct archive_entry *wentry;
 		size_t len;
 		const char *name;
+		int unchanged;
+		/* the member's headers start where the last one ended */
+		off_t start = archive_position_uncompressed( oldarc );
+		if( archive_read_next_header( oldarc, &entry ) != ARCHIVE_OK ) {
+			break;
+		}
+		/* members of uncompressed tar archives that did not change
+		   are copied as they are instead of going through libarchive;
+		   the format is known once the first header has been read */
+		copy = save_copies_members( oldarc );
 		/* find corresponding node */
 		name = archive_entry_pathname( entry );
-		node = get_node_for_entry( fs->root, entry );
+		node = entry_index_lookup( index, entry );
 		if( ! node ) {
 			log( "WARNING: no such node for '%s'", name );
 			archive_read_data_skip( oldarc );
 			continue;
 		}
+		save_progress( fs, 0, 1 );
+		/* readers may be caching stat data in the entry */
+		lock = node_lock( fs, node );
+		unchanged = entry_unchanged( node, entry );
+		node_unlock( lock );
+		if( copy && unchanged ) {
+			/* copied together with the unchanged members around
+			   it */
+			archive_read_data_skip( oldarc );
+			if( runend != start ) {
+				if( ( ret = save_copy_run( fs, oldfd, fd,
+							runstart, runend ) ) != 0 ) {
+					break;
+				}
+				runstart = start;
+			}
+			runend = archive_position_uncompressed( oldarc );
+			continue;
+		}
+		if( copy && ( ret = save_copy_run( fs, oldfd, fd, runstart,
+						runend ) ) != 0 ) {
+			break;
+		}
+		runstart = runend = 0;
 		/* create new entry, copy metadata */
 		if( (wentry = archive_entry_new()) == NULL ) {
 		        log( "Out of memory" );
-			return -ENOMEM;
+			ret = -ENOMEM;
+			break;
 		}
+		lock = node_lock( fs, node );
 		if( archive_entry_gname_w( node->entry ) ) {
 			archive_entry_copy_gname_w( wentry,
 					archive_entry_gname_w( node->entry ) );
@@ -791,26 +3589,27 @@ save( archive_fs_t *fs, const char *archiveFile )
 			archive_entry_copy_uname_w( wentry,
 					archive_entry_uname_w( node->entry ) );
 		}
+		node_unlock( lock );
 		/* set correct name */
 		if( node->namechanged ) {
+			char path[PATH_MAX];
+			node_path( node, path, sizeof( path ) );
 			if( *name == '/' ) {
 				archive_entry_set_pathname(
-						wentry, node->name );
+						wentry, path );
 			} else {
 				archive_entry_set_pathname(
-						wentry, node->name + 1 );
+						wentry, path + 1 );
 			}
 		} else {
 			archive_entry_set_pathname( wentry, name );
 		}
 		/* write header and copy data */
-		if( node->modified ) {
+		if( node->modified && ! node->written ) {
 			/* file was modified */
-			write_new_modded_file( node, wentry, newarc );
+			write_new_modded_file( node, wentry, newarc, oldarc );
 		} else {
 			/* file was not modified */
-			archive_entry_copy_stat( wentry,
-					archive_entry_stat( node->entry ) );
 			archive_write_header( newarc, wentry );
 			while( archive_read_data_block( oldarc, &buf,
 						&len, &offset ) == ARCHIVE_OK )
@@ -818,27 +3617,160 @@ save( archive_fs_t *fs, const char *archiveFile )
 				archive_write_data( newarc, buf, len );
 			}
 		}
+		if( copy ) {
+			/* pad the member before anything is copied behind it,
+			   and get past the old data, so the next member starts
+			   at the current position */
+			archive_write_finish_entry( newarc );
+			archive_read_data_skip( oldarc );
+		}
 		/* clean up */
 		archive_entry_free( wentry );
 	} /* end: while read next header */
-	/* find new files to add (those do still have modified flag set */
-	while( ( node = find_modified_node( fs->root ) ) ) {
-		write_new_modded_file( node, node->entry, newarc );
+	if( ret == 0 && copy ) {
+		ret = save_copy_run( fs, oldfd, fd, runstart, runend );
+	}
+	if( ret == 0 ) {
+		/* find new files to add (those do still have modified flag set */
+		write_modified_nodes( fs, fs->root, newarc );
 	}
-	/* clean up, re-open the new archive for reading */
 	archive_read_finish( oldarc );
+	close( oldfd );
+	if( archive_write_close( newarc ) != ARCHIVE_OK && ret == 0 ) {
+		log( "%s", archive_error_string( newarc ) );
+		ret = archive_errno( newarc ) > 0 ? 0 - archive_errno( newarc ) :
+			-EIO;
+	}
 	archive_write_finish( newarc );
-	close( tempfile );
+	if( out.pz && ( compression = pzwriter_close( out.pz ) ) != 0
+			&& ret == 0 ) {
+		log( "Could not compress the new archive: %s",
+				strerror( 0 - compression ) );
+		ret = compression;
+	}
+	return ret;
+}
+
+/*
+ * puts the new archive at tempname in place of the old one, keeping that as
+ * .orig unless nobackup is set; called with the tree locked exclusively
+ */
+static int
+save_commit( archive_fs_t *fs, const char *archiveFile, const char *tempname )
+{
+	char *oldfilename;
+	int ret;
+
+	if( ! fs->options.nobackup ) {
+		if( ( oldfilename = malloc( strlen( archiveFile ) + 5 + 1 ) )
+				== NULL ) {
+			log( "Could not allocate memory for oldfilename" );
+			return -ENOMEM;
+		}
+		sprintf( oldfilename, "%s.orig", archiveFile );
+		/* the archive stays where it is until it is replaced */
+		if( ( unlink( oldfilename ) == -1 && errno != ENOENT )
+				|| link( archiveFile, oldfilename ) == -1 ) {
+			ret = 0 - errno;
+			log( "Could not keep old archive file as %s: %s",
+					oldfilename, strerror( errno ) );
+			free( oldfilename );
+			return ret;
+		}
+		free( oldfilename );
+	}
+	if( rename( tempname, archiveFile ) == -1 ) {
+		ret = 0 - errno;
+		log( "Could not move the new archive to %s: %s",
+				archiveFile, strerror( errno ) );
+		return ret;
+	}
+	/* cached decoders, checkpoints and offsets refer to the old file */
+	readahead_stop( fs, NULL );
+	stream_cache_evict( fs, NULL );
+	gzindex_free( fs->gzindex );
+	fs->gzindex = NULL;
 	close( fs->archiveFd );
 	fs->archiveFd = open( fs->archiveFile, O_RDONLY );
+	/* blocks of the old file stay in the cache until they age out */
+	if( fs->archiveFd == -1
+			|| fstat( fs->archiveFd, &fs->archivestat ) == -1 ) {
+		fs->archivestat.st_ino = 0;
+	}
+	forget_data_offsets( fs );
+	fs->archiveModified = save_finish_nodes( fs, fs->root, 1 ) > 0;
+	return 0;
+}
+
+/*
+ * writes the changes into archiveFile. The new archive is written next to
+ * it while the tree stays readable, and then renamed over it. The caller
+ * holds fs->changelock exclusively, so nothing changes meanwhile.
+ */
+static int
+save( archive_fs_t *fs, const char *archiveFile )
+{
+	entryindex_t index;
+	char *tempname;
+	int tempfile;
+	int ret;
+
+	if( ( ret = save_flush_nodes( fs, fs->root ) ) != 0 ) {
+		return ret;
+	}
+	/* member names of the mounted archive to nodes */
+	if( ( ret = entry_index_build( fs, &index ) ) != 0 ) {
+		return ret;
+	}
+	pthread_mutex_lock( &fs->savemutex );
+	fs->savestatus.bytes = 0;
+	fs->savestatus.members = 0;
+	fs->savestatus.total = fs->nodecount;
+	pthread_mutex_unlock( &fs->savemutex );
 	if( fs->options.nobackup ) {
-		if( remove( oldfilename ) < 0 ) {
-			log( "Could not remove .orig archive file (%s): %s",
-					oldfilename, strerror( errno ) );
-			return 0 - errno;
+		/* changes the archive file in place; the members already in
+		   it stay where they are, so readers go on while the new ones
+		   are appended */
+		ret = save_appended( fs, archiveFile, &index );
+		if( ret <= 0 ) {
+			pthread_rwlock_wrlock( &fs->lock );
+			fs->archiveModified = save_finish_nodes( fs, fs->root,
+					ret == 0 ) > 0;
+			pthread_rwlock_unlock( &fs->lock );
+			free( index.slots );
+			return ret;
 		}
 	}
-	return 0;
+	if( ( tempname = malloc( strlen( archiveFile ) + 7 + 1 ) ) == NULL ) {
+		log( "Out of memory" );
+		free( index.slots );
+		return -ENOMEM;
+	}
+	sprintf( tempname, "%s.XXXXXX", archiveFile );
+	if( ( tempfile = mkstemp( tempname ) ) == -1 ) {
+		ret = 0 - errno;
+		log( "could not open new archive file for writing" );
+		free( tempname );
+		free( index.slots );
+		return ret;
+	}
+	fchmod( tempfile, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH );
+	ret = save_write( fs, archiveFile, &index, tempfile );
+	free( index.slots );
+	if( close( tempfile ) == -1 && ret == 0 ) {
+		ret = 0 - errno;
+	}
+	pthread_rwlock_wrlock( &fs->lock );
+	if( ret == 0 ) {
+		ret = save_commit( fs, archiveFile, tempname );
+	}
+	if( ret != 0 ) {
+		save_finish_nodes( fs, fs->root, 0 );
+		unlink( tempname );
+	}
+	pthread_rwlock_unlock( &fs->lock );
+	free( tempname );
+	return ret;
 }
 
 
@@ -846,14 +3778,87 @@ save( archive_fs_t *fs, const char *archiveFile )
  /* API functions */
 /*****************/
 
+void ar_default_options( archive_fs_options *options )
+{
+	options->nobackup = 0;
+	options->readonly = 1;
+	options->streamcache = STREAM_CACHE_SLOTS;
+	options->streamcachemem = STREAM_CACHE_MEM;
+	options->gzindexspan = GZINDEX_SPAN;
+	options->materialize = 0;
+	options->background = 0;
+	options->savethreads = 0;
+	options->readahead = READAHEAD_STREAMS;
+	options->readaheadsize = READAHEAD_SIZE;
+	options->snapshot = 1;
+}
+
+int ar_block_cache( size_t memory, const char *spilldir, off_t spillsize )
+{
+	int ret = blockcache_configure( memory, spilldir, spillsize );
+
+	if( ret < 0 ) {
+		log( "Could not create a spill file in %s: %s", spilldir,
+				strerror( 0 - ret ) );
+	}
+	return ret;
+}
+
 int ar_init( archive_fs_t *fs, const char *archiveFile, const char *mtpt )
 {
+	archive_fs_options options;
+
+	ar_default_options( &options );
+	return ar_init_with_options( fs, archiveFile, mtpt, &options );
+}
+
+int ar_init_with_options( archive_fs_t *fs, const char *archiveFile,
+		const char *mtpt, const archive_fs_options *options )
+{
+	int i;
+
 	fs->archiveModified = 0;
 	fs->archiveWriteable = 0;
 	fs->mtpt = strdup(mtpt);
 	fs->archiveFile = strdup(archiveFile);
-	fs->options.nobackup = 0;
-	fs->options.readonly = 1;
+	fs->options = *options;
+	fs->root = NULL;
+	fs->nodehash = NULL;
+	fs->nodehashsize = 0;
+	fs->nodecount = 0;
+	fs->nodeslabs = NULL;
+	fs->slabused = 0;
+	fs->freenodes = NULL;
+	fs->namechunks = NULL;
+	fs->names = NULL;
+	fs->namessize = 0;
+	fs->namecount = 0;
+	fs->streams = NULL;
+	fs->nstreams = 0;
+	fs->streammem = 0;
+	pthread_mutex_init( &fs->streamlock, NULL );
+	fs->readaheads = NULL;
+	pthread_mutex_init( &fs->ralock, NULL );
+	for( i = 0; i < NODE_LOCKS; i++ ) {
+		pthread_mutex_init( &fs->nodelocks[i].mutex, NULL );
+		pthread_cond_init( &fs->nodelocks[i].released, NULL );
+	}
+	fs->gzindex = NULL;
+	fs->snapshot = NULL;
+	fs->cacheFd = -1;
+	fs->cachesize = 0;
+	fs->cachestopped = 0;
+	/* the tree can only grow behind the back of read-only mounts */
+	fs->background = fs->options.background && fs->options.readonly;
+	fs->indexing = fs->background;
+	fs->indexstop = 0;
+	fs->indexwaiters = 0;
+	pthread_mutex_init( &fs->indexlock, NULL );
+	pthread_cond_init( &fs->indexcond, NULL );
+	pthread_rwlock_init( &fs->changelock, NULL );
+	pthread_mutex_init( &fs->savemutex, NULL );
+	fs->saverjoinable = 0;
+	memset( &fs->savestatus, 0, sizeof( ar_save_status ) );
 
 	/* check if archive is writeable */
 	fs->archiveFd = open( archiveFile, O_RDWR );
@@ -867,144 +3872,360 @@ int ar_init( archive_fs_t *fs, const char *archiveFile, const char *mtpt )
 		perror( "opening archive failed" );
 		return EXIT_FAILURE;
 	}
-	build_tree( fs, fs->mtpt );
-	
-	/* Initialize the node tree lock */
-	pthread_rwlock_init(&fs->lock, NULL);
+	if( fstat( fs->archiveFd, &fs->archivestat ) == -1 ) {
+		fs->archivestat.st_ino = 0;
+	}
+	/* Initialize the node tree lock */
+	pthread_rwlock_init(&fs->lock, NULL);
+
+	build_tree( fs, fs->mtpt );
+
+	return EXIT_SUCCESS;
+}
+
+int ar_free( archive_fs_t *fs )
+{
+	int i;
+
+#if 0
+	/* save changes if modified */
+	if( archiveWriteable && !options.readonly && archiveModified ) {
+		if( save( fs->archiveFile ) != 0 ) {
+			fprintf( stderr, "Saving new archive failed\n" );
+		}
+	}
+#endif
+	
+	/* clean up */
+	ar_save_wait( fs );
+	pthread_rwlock_destroy( &fs->changelock );
+	pthread_mutex_destroy( &fs->savemutex );
+	if( fs->background ) {
+		pthread_mutex_lock( &fs->indexlock );
+		fs->indexstop = 1;
+		pthread_mutex_unlock( &fs->indexlock );
+		pthread_join( fs->indexer, NULL );
+	}
+	pthread_mutex_destroy( &fs->indexlock );
+	pthread_cond_destroy( &fs->indexcond );
+	readahead_stop( fs, NULL );
+	pthread_mutex_destroy( &fs->ralock );
+	stream_cache_evict( fs, NULL );
+	pthread_mutex_destroy( &fs->streamlock );
+	for( i = 0; i < NODE_LOCKS; i++ ) {
+		pthread_mutex_destroy( &fs->nodelocks[i].mutex );
+		pthread_cond_destroy( &fs->nodelocks[i].released );
+	}
+	gzindex_free( fs->gzindex );
+	if( fs->cacheFd != -1 ) {
+		close( fs->cacheFd );
+	}
+	close( fs->archiveFd );
+	
+	free( fs->nodehash );
+	free_nodes( fs );
+	/* after the names pointing into it */
+	snapshot_free( fs->snapshot );
+	free( fs->archiveFile );
+	free( fs->mtpt );
+	
+	return 0;
+}
+
+/*
+ * reads member data through a cached or new stream, see struct ar_stream
+ */
+static int
+stream_read( archive_fs_t *fs, NODE *node, char *buf, size_t size, off_t offset )
+{
+	struct ar_stream *stream;
+	int ret;
+
+	/* continue a previous read of this file if possible */
+	if( ( stream = stream_cache_get( fs, node, offset ) ) == NULL ) {
+		if( ( ret = stream_open( fs, node, &stream ) ) != 0 ) {
+			return ret;
+		}
+	}
+	ret = stream_read_at( stream, buf, size, offset );
+	if( ret < 0 || stream->position < offset ) {
+		/* broken, or beyond the end of the file */
+		stream_close( stream );
+	} else {
+		stream_cache_put( fs, stream );
+	}
+	return ret;
+}
+
+/*
+ * reads member data from its read-ahead, or else through stream_read()
+ */
+static int
+decode_read( archive_fs_t *fs, NODE *node, char *buf, size_t size,
+		off_t offset, int64_t filesize )
+{
+	int served;
+	int ret = readahead_read( fs, node, buf, size, offset, filesize,
+			&served );
+
+	if( ! served && ret >= 0 && ( size_t )ret < size ) {
+		/* the rest the read-ahead could not give */
+		int more = stream_read( fs, node, buf + ret, size - ret,
+				offset + ret );
+		if( more < 0 ) {
+			return ret ? ret : more;
+		}
+		ret += more;
+	}
+	return ret;
+}
+
+/*
+ * decode_read() through the block cache shared by the mounts of the
+ * process; blocks missing there are decoded whole and added
+ */
+static int
+cached_read( archive_fs_t *fs, NODE *node, char *buf, size_t size,
+		off_t offset, int64_t filesize )
+{
+	/* nodes without entry are named by their normalized path, as in
+	   stream_open() */
+	const char *member = node->entry ?
+		archive_entry_pathname( node->entry ) : NULL;
+	char path[PATH_MAX];
+	char *block = NULL;
+	size_t done = 0;
+	int ret;
+
+	if( ! member ) {
+		if( ( ret = node_path( node, path, sizeof( path ) ) ) != 0 ) {
+			return ret;
+		}
+		member = path;
+	}
+	while( done < size ) {
+		off_t pos = offset + done;
+		off_t index = pos / BLOCKCACHE_BLOCK;
+		size_t skip = pos % BLOCKCACHE_BLOCK;
+		size_t want = size - done;
+		ssize_t len = blockcache_read( &fs->archivestat, member, index,
+				skip, buf + done, want );
+		ssize_t end = BLOCKCACHE_BLOCK;
+		if( len < 0 ) {
+			if( ! block && ( block = malloc( BLOCKCACHE_BLOCK ) ) == NULL ) {
+				log( "Out of memory" );
+				return done ? ( int )done : -ENOMEM;
+			}
+			if( node->dataoffset >= 0 && filesize -
+					index * BLOCKCACHE_BLOCK < end ) {
+				/* data read in place does not end by itself */
+				end = filesize > index * BLOCKCACHE_BLOCK ?
+					filesize - index * BLOCKCACHE_BLOCK : 0;
+			}
+			len = 0;
+			ret = 0;
+			while( len < end && ( ret = decode_read( fs, node,
+						block + len, end - len,
+						index * BLOCKCACHE_BLOCK + len,
+						filesize ) ) > 0 ) {
+				len += ret;
+			}
+			if( ret < 0 ) {
+				free( block );
+				return done ? ( int )done : ret;
+			}
+			blockcache_put( &fs->archivestat, member, index,
+					block, len );
+			len = len > ( ssize_t )skip ? len - skip : 0;
+			if( ( size_t )len > want ) {
+				len = want;
+			}
+			memcpy( buf + done, block + skip, len );
+		}
+		done += len;
+		if( ( size_t )len < want
+				&& skip + len < BLOCKCACHE_BLOCK ) {
+			/* the end of the member */
+			break;
+		}
+	}
+	free( block );
+	return done;
+}
 
-	return EXIT_SUCCESS;
+/*
+ * reads the data of node as it is in the archive, filesize being its size
+ * there
+ */
+static int
+read_original( archive_fs_t *fs, NODE *node, const char *path, char *buf,
+		size_t size, off_t offset, int64_t filesize )
+{
+	int ret;
+
+	if( node->cacheoffset >= 0 ) {
+		/* the data was decoded at mount time */
+		if( offset >= filesize ) {
+			return 0;
+		}
+		if( ( int64_t )size > filesize - offset ) {
+			size = filesize - offset;
+		}
+		if( ( ret = pread( fs->cacheFd, buf, size,
+					node->cacheoffset + offset ) ) == -1 ) {
+			log( "Error reading '%s' from cache file: %s",
+					path, strerror( errno ) );
+			ret = 0 - errno;
+		}
+		return ret;
+	}
+	if( node->dataoffset >= 0 ) {
+		if( offset >= filesize ) {
+			return 0;
+		}
+		if( ( int64_t )size > filesize - offset ) {
+			size = filesize - offset;
+		}
+	}
+	if( node->dataoffset >= 0 && ! fs->gzindex ) {
+		/* the file is stored uncompressed, read it in place */
+		if( ( ret = pread( fs->archiveFd, buf, size,
+					node->dataoffset + offset ) ) == -1 ) {
+			log( "Error reading '%s' from archive: %s",
+					path, strerror( errno ) );
+			ret = 0 - errno;
+		}
+	} else if( fs->archivestat.st_ino && blockcache_enabled() ) {
+		ret = cached_read( fs, node, buf, size, offset, filesize );
+	} else {
+		ret = decode_read( fs, node, buf, size, offset, filesize );
+	}
+	return ret;
 }
 
-int ar_free( archive_fs_t *fs )
+/*
+ * reads a member that was written into, see struct overlay; keep and
+ * original are the overlay's when the read started
+ */
+static int
+read_overlay( archive_fs_t *fs, NODE *node, const char *path,
+		const char *location, char *buf, size_t size, off_t offset,
+		off_t keep, off_t original )
 {
-#if 0
-	/* save changes if modified */
-	if( archiveWriteable && !options.readonly && archiveModified ) {
-		if( save( fs->archiveFile ) != 0 ) {
-			fprintf( stderr, "Saving new archive failed\n" );
+	struct nodelock *lock;
+	char *orig = NULL;
+	size_t have = 0;
+	int ret;
+	int fh;
+
+	if( offset < keep ) {
+		/* keep only shrinks, so this covers whatever has to come
+		   from the archive */
+		size_t len = keep - offset < ( off_t )size ?
+			( size_t )( keep - offset ) : size;
+		if( ( orig = malloc( len ) ) == NULL ) {
+			log( "Out of memory" );
+			return -ENOMEM;
+		}
+		/* the data is decoded, and shared through the block cache,
+		   as it is in the archive; only len of it is used */
+		while( have < len ) {
+			ret = read_original( fs, node, path, orig + have,
+					len - have, offset + have, original );
+			if( ret < 0 ) {
+				free( orig );
+				return ret;
+			}
+			if( ret == 0 ) {
+				break;
+			}
+			have += ret;
 		}
 	}
-#endif
-	
-	/* clean up */
-	close( fs->archiveFd );
-	
-	free( fs->archiveFile );
-	free( fs->mtpt );
-	
-	return 0;
+	if( ( fh = open( location, O_RDONLY ) ) == -1 ) {
+		ret = 0 - errno;
+		log( "Fatal error opening modified file '%s' at "
+				"location '%s', giving up",
+				path, location );
+		free( orig );
+		return ret;
+	}
+	/* the written ranges, and zeros past keep, come from the temp file;
+	   writers record a range only after writing it */
+	lock = node_lock( fs, node );
+	if( ( ret = pread( fh, buf, size, offset ) ) == -1 ) {
+		ret = 0 - errno;
+		log( "Error reading temporary file '%s': %s",
+				location, strerror( errno ) );
+	} else {
+		overlay_merge( node->overlay, buf, orig, offset,
+				( size_t )ret < have ? ( size_t )ret : have );
+	}
+	node_unlock( lock );
+	close( fh );
+	free( orig );
+	return ret;
 }
 
 static int
 _ar_read( archive_fs_t *fs, const char *path, char *buf, size_t size, off_t offset )
 {
 	int ret = -1;
-	const char *realpath;
 	NODE *node;
+	struct nodelock *lock;
+	char *location;
+	off_t keep = 0;
+	off_t original = 0;
+	int64_t filesize;
 
 	//log( "read called, path: '%s'", path );
 	/* find node */
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( ! node ) {
 		return -ENOENT;
 	}
-	if( archive_entry_hardlink( node->entry ) ) {
-		/* file is a hardlink, recurse into it */
-		return _ar_read( fs, archive_entry_hardlink( node->entry ),
-				buf, size, offset );
+	if( ( ret = follow_links( fs, &node, 1 ) ) != 0 ) {
+		return ret;
 	}
-	if( archive_entry_symlink( node->entry ) ) {
-		/* file is a symlink, recurse into it */
-		return _ar_read( fs, archive_entry_symlink( node->entry ),
-				buf, size, offset );
+	/* a writer may be switching the node to a temp file */
+	lock = node_lock( fs, node );
+	if( ( ret = node_flush( node ) ) < 0 ) {
+		node_unlock( lock );
+		return ret;
 	}
-	if( node->modified ) {
+	location = node->modified ? node->location : NULL;
+	if( location && node->overlay ) {
+		keep = node->overlay->keep;
+		original = node->overlay->original;
+	}
+	filesize = node_size( node );
+	node_unlock( lock );
+	if( location && keep ) {
+		/* parts of the file were written */
+		ret = read_overlay( fs, node, path, location, buf, size,
+				offset, keep, original );
+	} else if( location ) {
 		/* the file is new or modified, read temporary file instead */
 		int fh;
-		fh = open( node->location, O_RDONLY );
+		fh = open( location, O_RDONLY );
 		if( fh == -1 ) {
 			log( "Fatal error opening modified file '%s' at "
 					"location '%s', giving up",
-					path, node->location );
+					path, location );
 			return 0 - errno;
 		}
 		/* copy data */
 		if( ( ret = pread( fh, buf, size, offset ) ) == -1 ) {
 			log( "Error reading temporary file '%s': %s",
-					node->location, strerror( errno ) );
+					location, strerror( errno ) );
 			close( fh );
 			ret = 0 - errno;
 		}
 		/* clean up */
 		close( fh );
 	} else {
-		struct archive *archive;
-		struct archive_entry *entry;
-		/* search file in archive */
-		realpath = archive_entry_pathname( node->entry );
-		if( (archive = archive_read_new()) == NULL ) {
-		        log( "Out of memory" );
-			return -ENOMEM;
-		}
-		if( archive_read_support_compression_all( archive ) != ARCHIVE_OK ) {
-			log( "%s", archive_error_string( archive ) );
-		}
-		if( archive_read_support_format_all( archive ) != ARCHIVE_OK ) {
-			log( "%s", archive_error_string( archive ) );
-		}
-		if( archive_read_open_fd( archive, fs->archiveFd, 10240 ) != ARCHIVE_OK ) {
-			log( "%s", archive_error_string( archive ) );
-		}
-		/* search for file to read */
-		while( archive_read_next_header( archive, &entry ) == ARCHIVE_OK ) {
-			const char *name;
-			name = archive_entry_pathname( entry );
-			if( strcmp( realpath, name ) == 0 ) {
-				void *trash;
-				if( ( trash = malloc( MAXBUF ) ) == NULL ) {
-				        log( "Out of memory" );
-					return -ENOMEM;
-				}
-				/* skip offset */
-				while( offset > 0 ) {
-					int skip = offset > MAXBUF ? MAXBUF : offset;
-					ret = archive_read_data(
-							archive, trash, skip );
-					if( ret == ARCHIVE_FATAL
-							|| ret == ARCHIVE_WARN
-							|| ret == ARCHIVE_RETRY )
-					{
-						log( "ar_read (skipping offset): %s",
-							archive_error_string( archive ) );
-						errno = archive_errno( archive );
-						ret = -1;
-						break;
-					}
-					offset -= skip;
-				}
-				free( trash );
-				if( offset ) {
-					/* there was an error */
-					break;
-				}
-				/* read data */
-				ret = archive_read_data( archive, buf, size );
-				if( ret == ARCHIVE_FATAL
-						|| ret == ARCHIVE_WARN
-						|| ret == ARCHIVE_RETRY )
-				{
-					log( "ar_read (reading data): %s",
-						archive_error_string( archive ) );
-					errno = archive_errno( archive );
-					ret = -1;
-				}
-				break;
-			}
-			archive_read_data_skip( archive );
-		}
-		/* close archive */
-		archive_read_finish( archive );
-		lseek( fs->archiveFd, 0, SEEK_SET );
+		ret = read_original( fs, node, path, buf, size, offset,
+				filesize );
 	}
 	return ret;
 }
@@ -1013,12 +4234,38 @@ int
 ar_read( archive_fs_t *fs, const char *path, char *buf, size_t size, off_t offset )
 {
 	int ret;
+	wait_for_path( fs, path );
+	if( fs->background && fs->gzindex && ( fs->cacheFd == -1
+				|| cache_stopped( fs ) ) ) {
+		/* the indexer is still adding checkpoints */
+		wait_for_index( fs );
+	}
 	pthread_rwlock_rdlock(&fs->lock);
 	ret = _ar_read( fs, path, buf, size, offset );
 	pthread_rwlock_unlock(&fs->lock);
 	return ret;
 }
 
+/* the attributes of node itself, links are not followed */
+static void
+getattr_node( archive_fs_t* fs, NODE *node, struct stat *stbuf )
+{
+	struct nodelock *lock;
+
+	if( node->entry ) {
+		/* archive_entry_stat() caches into the entry */
+		lock = node_lock( fs, node );
+		node_stat( node, stbuf );
+		node_unlock( lock );
+	} else {
+		node_stat( node, stbuf );
+	}
+
+	if( fs->options.readonly ) {
+		stbuf->st_mode = stbuf->st_mode & 0777555;
+	}
+}
+
 static int
 _ar_getattr( archive_fs_t* fs, const char *path, struct stat *stbuf )
 {
@@ -1026,23 +4273,14 @@ _ar_getattr( archive_fs_t* fs, const char *path, struct stat *stbuf )
 	int ret;
 
 	//log( "getattr called, path: '%s'", path );
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( ! node ) {
 		return -ENOENT;
 	}
-	if( archive_entry_hardlink( node->entry ) ) {
-		/* a hardlink, recurse into it */
-		ret = _ar_getattr( fs, archive_entry_hardlink(
-					node->entry ), stbuf );
+	if( ( ret = follow_links( fs, &node, 0 ) ) != 0 ) {
 		return ret;
 	}
-	memcpy( stbuf, archive_entry_stat( node->entry ),
-			sizeof( struct stat ) );
-
-	if( fs->options.readonly ) {
-		stbuf->st_mode = stbuf->st_mode & 0777555;
-	}
-
+	getattr_node( fs, node, stbuf );
 	return 0;
 }
 
@@ -1050,6 +4288,7 @@ int
 ar_getattr( archive_fs_t* fs, const char *path, struct stat *stbuf )
 {
 	int ret;
+	wait_for_path( fs, path );
 	pthread_rwlock_rdlock(&fs->lock);
 	ret = _ar_getattr( fs, path, stbuf );
 	pthread_rwlock_unlock(&fs->lock);
@@ -1059,7 +4298,8 @@ ar_getattr( archive_fs_t* fs, const char *path, struct stat *stbuf )
 /*
  * mkdir is nearly identical to mknod...
  */
-int ar_mkdir( archive_fs_t* fs, const char *path, mode_t mode )
+static int
+_ar_mkdir( archive_fs_t* fs, const char *path, mode_t mode )
 {
 	NODE *node;
 	char *location;
@@ -1071,7 +4311,7 @@ int ar_mkdir( archive_fs_t* fs, const char *path, mode_t mode )
 	}
 	pthread_rwlock_wrlock( &fs->lock );
 	/* check for existing node */
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( node ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -EEXIST;
@@ -1090,15 +4330,12 @@ int ar_mkdir( archive_fs_t* fs, const char *path, mode_t mode )
 		return 0 - errno;
 	}
 	/* build node */
-	if( ( node = ( NODE * )malloc( sizeof( NODE ) ) ) == NULL ) {
-	        log( "Out of memory" );
+	if( ( node = node_new( fs ) ) == NULL ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOMEM;
 	}
-	init_node( node );
 	node->location = location;
 	node->modified = 1;
-	node->name = strdup( path );
 	node->namechanged = 0;
 	/* build entry */
 	if( (node->entry = archive_entry_new()) == NULL ) {
@@ -1106,34 +4343,30 @@ int ar_mkdir( archive_fs_t* fs, const char *path, mode_t mode )
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOMEM;
 	}
-	if( fs->root->child &&
-			node->name[0] == '/' &&
-			archive_entry_pathname( fs->root->child->entry )[0] != '/' )
+	if( fs->root->nchildren &&
+			path[0] == '/' &&
+			archive_entry_pathname( fs->root->children[0]->entry )[0] != '/' )
 	{
-		archive_entry_set_pathname( node->entry, node->name + 1 );
+		archive_entry_set_pathname( node->entry, path + 1 );
 	} else {
-		archive_entry_set_pathname( node->entry, node->name );
+		archive_entry_set_pathname( node->entry, path );
 	}
 	if( ( tmp = update_entry_stat( node ) ) < 0 ) {
 		log( "mkdir: error stat'ing dir %s: %s", node->location,
 				strerror( 0 - tmp ) );
 		rmdir( location );
 		free( location );
-		free( node->name );
-		archive_entry_free( node->entry );
-		free( node );
+		node_free( fs, node );
 		pthread_rwlock_unlock( &fs->lock );
 		return tmp;
 	}
 	/* add node to tree */
-	if( insert_by_path( fs->root, node ) != 0 ) {
+	if( insert_by_path( fs, node, path ) != 0 ) {
 		log( "ERROR: could not insert %s into tree",
-				node->name );
+				path );
 		rmdir( location );
 		free( location );
-		free( node->name );
-		archive_entry_free( node->entry );
-		free( node );
+		node_free( fs, node );
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOENT;
 	}
@@ -1143,11 +4376,21 @@ int ar_mkdir( archive_fs_t* fs, const char *path, mode_t mode )
 	return 0;
 }
 
+int ar_mkdir( archive_fs_t* fs, const char *path, mode_t mode )
+{
+	int ret;
+	pthread_rwlock_rdlock( &fs->changelock );
+	ret = _ar_mkdir( fs, path, mode );
+	pthread_rwlock_unlock( &fs->changelock );
+	return ret;
+}
+
 /*
  * ar_rmdir is called for directories only and does not need to do any
  * recursive stuff
  */
-int ar_rmdir( archive_fs_t* fs, const char *path )
+static int
+_ar_rmdir( archive_fs_t* fs, const char *path )
 {
 	NODE *node;
 
@@ -1156,12 +4399,12 @@ int ar_rmdir( archive_fs_t* fs, const char *path )
 		return -EROFS;
 	}
 	pthread_rwlock_wrlock( &fs->lock );
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( ! node ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOENT;
 	}
-	if( node->child ) {
+	if( node->nchildren ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOTEMPTY;
 	}
@@ -1184,15 +4427,24 @@ int ar_rmdir( archive_fs_t* fs, const char *path )
 		}
 		free( node->location );
 	}
-	remove_child( node );
-	free( node->name );
-	free( node );
+	remove_child( fs, node );
+	node_free( fs, node );
 	fs->archiveModified = 1;
 	pthread_rwlock_unlock( &fs->lock );
 	return 0;
 }
 
-int ar_symlink( archive_fs_t* fs, const char *from, const char *to )
+int ar_rmdir( archive_fs_t* fs, const char *path )
+{
+	int ret;
+	pthread_rwlock_rdlock( &fs->changelock );
+	ret = _ar_rmdir( fs, path );
+	pthread_rwlock_unlock( &fs->changelock );
+	return ret;
+}
+
+static int
+_ar_symlink( archive_fs_t* fs, const char *from, const char *to )
 {
 	NODE *node;
 	struct stat st;
@@ -1206,19 +4458,16 @@ int ar_symlink( archive_fs_t* fs, const char *from, const char *to )
 	}
 	pthread_rwlock_wrlock( &fs->lock );
 	/* check for existing node */
-	node = get_node_for_path( fs->root, to );
+	node = get_node_for_path( fs, to );
 	if( node ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -EEXIST;
 	}
 	/* build node */
-	if( ( node = ( NODE * )malloc( sizeof( NODE ) ) ) == NULL ) {
-	        log( "Out of memory" );
+	if( ( node = node_new( fs ) ) == NULL ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOMEM;
 	}
-	init_node( node );
-	node->name = strdup( to );
 	node->modified = 1;
 	/* build stat info */
 	st.st_dev = 0;
@@ -1238,13 +4487,13 @@ int ar_symlink( archive_fs_t* fs, const char *from, const char *to )
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOMEM;
 	}
-	if( fs->root->child &&
-			node->name[0] == '/' &&
-			archive_entry_pathname( fs->root->child->entry )[0] != '/' )
+	if( fs->root->nchildren &&
+			to[0] == '/' &&
+			archive_entry_pathname( fs->root->children[0]->entry )[0] != '/' )
 	{
-		archive_entry_set_pathname( node->entry, node->name + 1 );
+		archive_entry_set_pathname( node->entry, to + 1 );
 	} else {
-		archive_entry_set_pathname( node->entry, node->name );
+		archive_entry_set_pathname( node->entry, to );
 	}
 	archive_entry_copy_stat( node->entry, &st );
 	archive_entry_set_symlink( node->entry, strdup( from ) );
@@ -1259,9 +4508,7 @@ int ar_symlink( archive_fs_t* fs, const char *from, const char *to )
 				errno == ERANGE )
 		{
 			log( "ERROR calling getpwuid: %s", strerror( errno ) );
-			free( node->name );
-			archive_entry_free( node->entry );
-			free( node );
+			node_free( fs, node );
 			pthread_rwlock_unlock( &fs->lock );
 			return 0 - errno;
 		}
@@ -1278,9 +4525,7 @@ int ar_symlink( archive_fs_t* fs, const char *from, const char *to )
 				errno == ERANGE )
 		{
 			log( "ERROR calling getgrgid: %s", strerror( errno ) );
-			free( node->name );
-			archive_entry_free( node->entry );
-			free( node );
+			node_free( fs, node );
 			pthread_rwlock_unlock( &fs->lock );
 			return 0 - errno;
 		}
@@ -1288,22 +4533,31 @@ int ar_symlink( archive_fs_t* fs, const char *from, const char *to )
 		   not be resolved into a name */
 	}
 	/* add node to tree */
-	if( insert_by_path( fs->root, node ) != 0 ) {
+	if( insert_by_path( fs, node, to ) != 0 ) {
 		log( "ERROR: could not insert symlink %s into tree",
-				node->name );
-		free( node->name );
-		archive_entry_free( node->entry );
-		free( node );
+				to );
+		node_free( fs, node );
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOENT;
 	}
+	link_resolve( fs, node );
 	/* clean up */
 	fs->archiveModified = 1;
 	pthread_rwlock_unlock( &fs->lock );
 	return 0;
 }
 
-int ar_link( archive_fs_t* fs, const char *from, const char *to )
+int ar_symlink( archive_fs_t* fs, const char *from, const char *to )
+{
+	int ret;
+	pthread_rwlock_rdlock( &fs->changelock );
+	ret = _ar_symlink( fs, from, to );
+	pthread_rwlock_unlock( &fs->changelock );
+	return ret;
+}
+
+static int
+_ar_link( archive_fs_t* fs, const char *from, const char *to )
 {
 	NODE *node;
 	NODE *fromnode;
@@ -1317,13 +4571,13 @@ int ar_link( archive_fs_t* fs, const char *from, const char *to )
 	}
 	pthread_rwlock_wrlock( &fs->lock );
 	/* find source node */
-	fromnode = get_node_for_path( fs->root, from );
+	fromnode = get_node_for_path( fs, from );
 	if( ! fromnode ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOENT;
 	}
 	/* check for existing target */
-	node = get_node_for_path( fs->root, to );
+	node = get_node_for_path( fs, to );
 	if( node ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -EEXIST;
@@ -1331,13 +4585,10 @@ int ar_link( archive_fs_t* fs, const char *from, const char *to )
 	/* extract originals stat info */
 	_ar_getattr( fs, from, &st );
 	/* build new node */
-	if( (node = ( NODE * )malloc( sizeof( NODE ) ) ) == NULL ) {
-	        log( "Out of memory" );
+	if( ( node = node_new( fs ) ) == NULL ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOMEM;
 	}
-	init_node( node );
-	node->name = strdup( to );
 	node->modified = 1;
 	/* build entry */
 	if( (node->entry = archive_entry_new()) == NULL ) {
@@ -1345,12 +4596,12 @@ int ar_link( archive_fs_t* fs, const char *from, const char *to )
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOMEM;
 	}
-	if( node->name[0] == '/' &&
+	if( to[0] == '/' &&
 			archive_entry_pathname( fromnode->entry )[0] != '/' )
 	{
-		archive_entry_set_pathname( node->entry, node->name + 1 );
+		archive_entry_set_pathname( node->entry, to + 1 );
 	} else {
-		archive_entry_set_pathname( node->entry, node->name );
+		archive_entry_set_pathname( node->entry, to );
 	}
 	archive_entry_copy_stat( node->entry, &st );
 	archive_entry_set_hardlink( node->entry, strdup( from ) );
@@ -1365,9 +4616,7 @@ int ar_link( archive_fs_t* fs, const char *from, const char *to )
 				errno == ERANGE )
 		{
 			log( "ERROR calling getpwuid: %s", strerror( errno ) );
-			free( node->name );
-			archive_entry_free( node->entry );
-			free( node );
+			node_free( fs, node );
 			pthread_rwlock_unlock( &fs->lock );
 			return 0 - errno;
 		}
@@ -1384,9 +4633,7 @@ int ar_link( archive_fs_t* fs, const char *from, const char *to )
 				errno == ERANGE )
 		{
 			log( "ERROR calling getgrgid: %s", strerror( errno ) );
-			free( node->name );
-			archive_entry_free( node->entry );
-			free( node );
+			node_free( fs, node );
 			pthread_rwlock_unlock( &fs->lock );
 			return 0 - errno;
 		}
@@ -1394,287 +4641,320 @@ int ar_link( archive_fs_t* fs, const char *from, const char *to )
 		   not be resolved into a name */
 	}
 	/* add node to tree */
-	if( insert_by_path( fs->root, node ) != 0 ) {
+	if( insert_by_path( fs, node, to ) != 0 ) {
 		log( "ERROR: could not insert hardlink %s into tree",
-				node->name );
-		free( node->name );
-		archive_entry_free( node->entry );
-		free( node );
+				to );
+		node_free( fs, node );
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOENT;
 	}
+	link_resolve( fs, node );
 	/* clean up */
 	fs->archiveModified = 1;
 	pthread_rwlock_unlock( &fs->lock );
 	return 0;
 }
 
-static int
-_ar_truncate( archive_fs_t* fs, const char *path, off_t size )
+int ar_link( archive_fs_t* fs, const char *from, const char *to )
 {
-	NODE *node;
-	char *location;
 	int ret;
-	int tmp;
+	pthread_rwlock_rdlock( &fs->changelock );
+	ret = _ar_link( fs, from, to );
+	pthread_rwlock_unlock( &fs->changelock );
+	return ret;
+}
+
+/*
+ * creates the temp file for the first write into a member of the archive;
+ * it has the size of the member but does not take up space for it
+ */
+static int
+overlay_open( NODE *node, const char *path, char **location,
+		struct overlay **overlay )
+{
+	int64_t size = archive_entry_size( node->entry );
 	int fh;
+	int tmp;
 
-	//log( "truncate called, path '%s'", path );
-	if( ! fs->archiveWriteable || fs->options.readonly ) {
-		return -EROFS;
+	if( ( tmp = get_temp_file_name( path, location ) ) < 0 ) {
+		return tmp;
 	}
-	node = get_node_for_path( fs->root, path );
-	if( ! node ) {
-		return -ENOENT;
+	if( ( fh = open( *location, O_WRONLY | O_CREAT | O_EXCL,
+			archive_entry_mode( node->entry ) ) ) == -1 )
+	{
+		tmp = 0 - errno;
+		log( "error opening temp file %s: %s",
+				*location, strerror( errno ) );
+		free( *location );
+		return tmp;
 	}
-	if( archive_entry_hardlink( node->entry ) ) {
-		/* file is a hardlink, recurse into it */
-		return _ar_truncate( fs, archive_entry_hardlink(
-					node->entry ), size );
+	if( ftruncate( fh, size ) == -1 ) {
+		tmp = 0 - errno;
+	} else if( ( *overlay = overlay_new( size ) ) == NULL ) {
+		tmp = -ENOMEM;
 	}
-	if( archive_entry_symlink( node->entry ) ) {
-		/* file is a symlink, recurse into it */
-		return _ar_truncate( fs, archive_entry_symlink(
-					node->entry ), size );
+	if( tmp < 0 ) {
+		log( "error preparing temp file %s: %s",
+				*location, strerror( 0 - tmp ) );
+		close( fh );
+		unlink( *location );
+		free( *location );
+		return tmp;
 	}
-	if( node->location ) {
+	return fh;
+}
+
+/*
+ * truncates the file in its temp location, which is created on the first
+ * change; the caller has claimed node with node_acquire()
+ */
+static int
+truncate_node( archive_fs_t* fs, NODE *node, const char *path, off_t size )
+{
+	struct nodelock *lock;
+	struct overlay *overlay = node->overlay;
+	char *location = node->location;
+	int ret;
+	int tmp;
+	int fh = node->fd;
+
+	if( fh == -1 && location ) {
 		/* open existing temp file */
-		location = node->location;
 		if( ( fh = open( location, O_WRONLY ) ) == -1 ) {
 			log( "error opening temp file %s: %s",
 					location, strerror( errno ) );
-			unlink( location );
-			return 0 - errno;
-		}
-	} else {
-		/* create new temp file */
-		char *tmpbuf = NULL;
-		int tmpoffset = 0;
-		int64_t tmpsize;
-		if( ( tmp = get_temp_file_name( path, &location ) < 0 ) ) {
-			return tmp;
-		}
-		if( ( fh = open( location, O_WRONLY | O_CREAT | O_EXCL,
-				archive_entry_mode( node->entry ) ) ) == -1 )
-		{
-			log( "error opening temp file %s: %s",
-					location, strerror( errno ) );
-			unlink( location );
 			return 0 - errno;
 		}
-		/* copy original file to temporary file */
-		tmpsize = archive_entry_size( node->entry );
-		if( ( tmpbuf = ( char * )malloc( MAXBUF ) ) == NULL ) {
-	                log( "Out of memory" );
-		        return -ENOMEM;
-		}
-		while( tmpsize ) {
-			int len = tmpsize > MAXBUF ? MAXBUF : tmpsize;
-			/* read */
-			if( ( tmp = _ar_read( fs, path, tmpbuf, len, tmpoffset ) )
-					< 0 )
-			{
-				log( "ERROR reading while copying %s to "
-						"temporary location %s: %s",
-						path, location,
-						strerror( 0 - tmp ) );
-				close( fh );
-				unlink( location );
-				free( tmpbuf );
-				return tmp;
-			}
-			/* write */
-			if( write( fh, tmpbuf, tmp ) == -1 ) {
-				tmp = 0 - errno;
-				log( "ERROR writing while copying %s to "
-					       "temporary location %s: %s",
-						path, location,
-						strerror( errno ) );
-				close( fh );
-				unlink( location );
-				free( tmpbuf );
-				return tmp;
-			}
-			tmpsize -= len;
-			tmpoffset += len;
-			if( tmpoffset >= size ) {
-				/* copied enough, exit the loop */
-				break;
-			}
+	} else if( fh == -1 && ( fh = overlay_open( node, path, &location,
+					&overlay ) ) < 0 ) {
+		return fh;
+	}
+	/* truncate temporary file, after what is still collected */
+	lock = node_lock( fs, node );
+	if( ( ret = node_flush( node ) ) < 0 ) {
+		node_unlock( lock );
+		if( fh != node->fd ) {
+			close( fh );
 		}
-		/* clean up */
-		free( tmpbuf );
-		lseek( fh, 0, SEEK_SET );
+		return ret;
 	}
-	/* truncate temporary file */
-	if( ( ret = truncate( location, size ) ) == -1 ) {
+	if( ( ret = ftruncate( fh, size ) ) == -1 ) {
 		tmp = 0 - errno;
+		node_unlock( lock );
 		log( "ERROR truncating %s (temporary location %s): %s",
 				path, location, strerror( errno ) );
-		close( fh );
-		unlink( location );
+		if( fh != node->fd ) {
+			close( fh );
+		}
+		if( ! node->location ) {
+			unlink( location );
+			free( location );
+			overlay_free( overlay );
+		}
 		return tmp;
 	}
 	/* record location, update entry */
+	if( overlay ) {
+		overlay_truncate( overlay, size );
+	}
 	node->location = location;
+	node->overlay = overlay;
 	node->modified = 1;
-	if( ( tmp = update_entry_stat( node ) ) < 0 ) {
-		log( "write: error stat'ing file %s: %s", node->location,
-				strerror( 0 - tmp ) );
+	tmp = update_entry_stat( node );
+	if( node->opens && node->fd == -1 ) {
+		/* keep the temp file open until the last release */
+		node->fd = fh;
+	}
+	node_unlock( lock );
+	/* clean up */
+	if( fh != node->fd ) {
 		close( fh );
-		unlink( location );
+	}
+	if( tmp < 0 ) {
+		log( "write: error stat'ing file %s: %s", location,
+				strerror( 0 - tmp ) );
 		return tmp;
 	}
-	/* clean up */
-	close( fh );
 	fs->archiveModified = 1;
 	return ret;
 }
 
-int ar_truncate( archive_fs_t* fs, const char *path, off_t size )
-{
-	int ret;
-	pthread_rwlock_wrlock( &fs->lock );
-	ret = _ar_truncate( fs, path, size );
-	pthread_rwlock_unlock( &fs->lock );
-	return ret;
-}
-
 static int
-_ar_write( archive_fs_t* fs, const char *path, const char *buf, size_t size,
-		off_t offset )
+_ar_truncate( archive_fs_t* fs, const char *path, off_t size )
 {
 	NODE *node;
-	char *location;
 	int ret;
-	int tmp;
-	int fh;
 
-	//log( "write called, path '%s'", path );
+	//log( "truncate called, path '%s'", path );
 	if( ! fs->archiveWriteable || fs->options.readonly ) {
 		return -EROFS;
 	}
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( ! node ) {
 		return -ENOENT;
 	}
-	if( S_ISLNK( archive_entry_mode( node->entry ) ) ) {
-		/* file is a symlink, recurse into it */
-		return _ar_write( fs, archive_entry_symlink( node->entry ),
-				buf, size, offset );
-	}
-	if( archive_entry_hardlink( node->entry ) ) {
-		/* file is a hardlink, recurse into it */
-		return _ar_write( fs, archive_entry_hardlink( node->entry ),
-				buf, size, offset );
-	}
-	if( archive_entry_symlink( node->entry ) ) {
-		/* file is a symlink, recurse into it */
-		return _ar_write( fs, archive_entry_symlink( node->entry ),
-				buf, size, offset );
+	if( ( ret = follow_links( fs, &node, 1 ) ) != 0 ) {
+		return ret;
 	}
-	if( node->location ) {
+	node_acquire( fs, node );
+	ret = truncate_node( fs, node, path, size );
+	node_release( fs, node );
+	return ret;
+}
+
+int ar_truncate( archive_fs_t* fs, const char *path, off_t size )
+{
+	int ret;
+	pthread_rwlock_rdlock( &fs->changelock );
+	/* readers of other files may go on while the data is copied */
+	pthread_rwlock_rdlock( &fs->lock );
+	ret = _ar_truncate( fs, path, size );
+	pthread_rwlock_unlock( &fs->lock );
+	pthread_rwlock_unlock( &fs->changelock );
+	return ret;
+}
+
+/*
+ * writes into the file in its temp location, which is created on the first
+ * change; the caller has claimed node with node_acquire()
+ */
+static int
+write_node( archive_fs_t* fs, NODE *node, const char *path, const char *buf,
+		size_t size, off_t offset )
+{
+	struct nodelock *lock;
+	struct overlay *overlay = node->overlay;
+	char *location = node->location;
+	int ret = 0;
+	int tmp = 0;
+	int fh = node->fd;
+
+	if( fh == -1 && location ) {
 		/* open existing temp file */
-		location = node->location;
 		if( ( fh = open( location, O_WRONLY ) ) == -1 ) {
 			log( "error opening temp file %s: %s",
 					location, strerror( errno ) );
-			unlink( location );
 			return 0 - errno;
 		}
-	} else {
-		/* create new temp file */
-		char *tmpbuf = NULL;
-		int tmpoffset = 0;
-		int64_t tmpsize;
-		if( ( tmp = get_temp_file_name( path, &location ) < 0 ) ) {
+	} else if( fh == -1 ) {
+		if( ( fh = overlay_open( node, path, &location,
+						&overlay ) ) < 0 ) {
+			return fh;
+		}
+		/* nothing is in the overlay yet, so readers still get the
+		   original data */
+		lock = node_lock( fs, node );
+		node->location = location;
+		node->overlay = overlay;
+		node->modified = 1;
+		tmp = update_entry_stat( node );
+		node_unlock( lock );
+		if( tmp < 0 ) {
+			log( "write: error stat'ing file %s: %s", location,
+					strerror( 0 - tmp ) );
+			close( fh );
 			return tmp;
 		}
-		if( ( fh = open( location, O_WRONLY | O_CREAT | O_EXCL,
-				archive_entry_mode( node->entry ) ) ) == -1 )
-		{
-			log( "error opening temp file %s: %s",
-					location, strerror( errno ) );
-			unlink( location );
-			return 0 - errno;
+	}
+	lock = node_lock( fs, node );
+	if( node->opens && node->fd == -1 ) {
+		/* keep the temp file open until the last release */
+		node->fd = fh;
+	}
+	if( node->fd != -1 && size < WRITEBUF ) {
+		/* collect small writes that continue each other */
+		struct writebuf *wb = node->writebuf;
+		if( ! wb && ( wb = node->writebuf =
+					malloc( sizeof( struct writebuf ) ) ) ) {
+			wb->len = 0;
 		}
-		/* copy original file to temporary file */
-		tmpsize = archive_entry_size( node->entry );
-		if( ( tmpbuf = ( char * )malloc( MAXBUF ) ) == NULL ) {
-	                log( "Out of memory" );
-		        return -ENOMEM;
+		if( ! wb ) {
+			tmp = -ENOMEM;
+		} else if( wb->len && ( wb->offset + ( off_t )wb->len != offset
+					|| wb->len + size > WRITEBUF ) ) {
+			tmp = node_flush( node );
 		}
-		while( tmpsize ) {
-			int len = tmpsize > MAXBUF ? MAXBUF : tmpsize;
-			/* read */
-			if( ( tmp = _ar_read( fs, path, tmpbuf, len, tmpoffset ) )
-					< 0 )
-			{
-				log( "ERROR reading while copying %s to "
-						"temporary location %s: %s",
-						path, location,
-						strerror( 0 - tmp ) );
-				close( fh );
-				unlink( location );
-				free( tmpbuf );
-				return tmp;
-			}
-			/* write */
-			if( write( fh, tmpbuf, len ) == -1 ) {
-				tmp = 0 - errno;
-				log( "ERROR writing while copying %s to "
-					       "temporary location %s: %s",
-						path, location,
-						strerror( errno ) );
-				close( fh );
-				unlink( location );
-				free( tmpbuf );
-				return tmp;
+		if( tmp == 0 ) {
+			if( ! wb->len ) {
+				wb->offset = offset;
 			}
-			tmpsize -= len;
-			tmpoffset += len;
+			memcpy( wb->data + wb->len, buf, size );
+			wb->len += size;
+			ret = size;
+		}
+	} else {
+		/* what is collected goes first, it may overlap */
+		tmp = node_flush( node );
+		node_unlock( lock );
+		if( tmp == 0 && ( ret = pwrite( fh, buf, size, offset ) ) == -1 ) {
+			tmp = 0 - errno;
+			log( "ERROR writing changes to %s (temporary "
+					"location %s): %s",
+					path, location, strerror( errno ) );
+		}
+		lock = node_lock( fs, node );
+		/* readers take the range from the temp file from now on */
+		if( tmp == 0 && overlay ) {
+			tmp = overlay_add( overlay, offset, offset + ret );
 		}
-		/* clean up */
-		free( tmpbuf );
-		lseek( fh, 0, SEEK_SET );
 	}
-	/* write changes to temporary file */
-	if( ( ret = pwrite( fh, buf, size, offset ) ) == -1 ) {
-		tmp = 0 - errno;
-		log( "ERROR writing changes to %s (temporary "
-				"location %s): %s",
-				path, location, strerror( errno ) );
-		close( fh );
-		unlink( location );
-		return tmp;
+	if( tmp == 0 ) {
+		/* the temp file is stat'ed again on release */
+		if( offset + ret > archive_entry_size( node->entry ) ) {
+			archive_entry_set_size( node->entry, offset + ret );
+		}
+		archive_entry_set_mtime( node->entry, time( NULL ), 0 );
 	}
-	/* record location, update entry */
-	node->location = location;
-	node->modified = 1;
-	if( ( tmp = update_entry_stat( node ) ) < 0 ) {
-		log( "write: error stat'ing file %s: %s", node->location,
-				strerror( 0 - tmp ) );
+	node_unlock( lock );
+	if( fh != node->fd ) {
 		close( fh );
-		unlink( location );
+	}
+	if( tmp < 0 ) {
 		return tmp;
 	}
-	/* clean up */
-	close( fh );
 	fs->archiveModified = 1;
 	return ret;
 }
 
+static int
+_ar_write( archive_fs_t* fs, const char *path, const char *buf, size_t size,
+		off_t offset )
+{
+	NODE *node;
+	int ret;
+
+	//log( "write called, path '%s'", path );
+	if( ! fs->archiveWriteable || fs->options.readonly ) {
+		return -EROFS;
+	}
+	node = get_node_for_path( fs, path );
+	if( ! node ) {
+		return -ENOENT;
+	}
+	if( ( ret = follow_links( fs, &node, 1 ) ) != 0 ) {
+		return ret;
+	}
+	node_acquire( fs, node );
+	ret = write_node( fs, node, path, buf, size, offset );
+	node_release( fs, node );
+	return ret;
+}
+
 int ar_write( archive_fs_t* fs, const char *path, const char *buf, size_t size,
 		off_t offset )
 {
 	int ret;
-	pthread_rwlock_wrlock(&fs->lock);
+	pthread_rwlock_rdlock( &fs->changelock );
+	/* readers of other files may go on while the data is copied */
+	pthread_rwlock_rdlock(&fs->lock);
 	ret = _ar_write( fs, path, buf, size, offset );
 	pthread_rwlock_unlock(&fs->lock);
+	pthread_rwlock_unlock( &fs->changelock );
 	return ret;
 }
 
-int
-ar_mknod( archive_fs_t* fs, const char *path, mode_t mode, dev_t rdev )
+static int
+_ar_mknod( archive_fs_t* fs, const char *path, mode_t mode, dev_t rdev )
 {
 	NODE *node;
 	char *location;
@@ -1686,7 +4966,7 @@ ar_mknod( archive_fs_t* fs, const char *path, mode_t mode, dev_t rdev )
 	}
 	pthread_rwlock_wrlock( &fs->lock );
 	/* check for existing node */
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( node ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -EEXIST;
@@ -1705,49 +4985,42 @@ ar_mknod( archive_fs_t* fs, const char *path, mode_t mode, dev_t rdev )
 		return 0 - errno;
 	}
 	/* build node */
-	if( ( node = ( NODE * )malloc( sizeof( NODE ) ) ) == NULL ) {
-	        log( "Out of memory" );
+	if( ( node = node_new( fs ) ) == NULL ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOMEM;
 	}
-	init_node( node );
 	node->location = location;
 	node->modified = 1;
-	node->name = strdup( path );
 	/* build entry */
 	if( (node->entry = archive_entry_new()) == NULL) {
 	        log( "Out of memory" );
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOMEM;
 	}
-	if( fs->root->child &&
-			node->name[0] == '/' &&
-			archive_entry_pathname( fs->root->child->entry )[0] != '/' )
+	if( fs->root->nchildren &&
+			path[0] == '/' &&
+			archive_entry_pathname( fs->root->children[0]->entry )[0] != '/' )
 	{
-		archive_entry_set_pathname( node->entry, node->name + 1 );
+		archive_entry_set_pathname( node->entry, path + 1 );
 	} else {
-		archive_entry_set_pathname( node->entry, node->name );
+		archive_entry_set_pathname( node->entry, path );
 	}
 	if( ( tmp = update_entry_stat( node ) ) < 0 ) {
 		log( "mknod: error stat'ing file %s: %s", node->location,
 				strerror( 0 - tmp ) );
 		unlink( location );
 		free( location );
-		free( node->name );
-		archive_entry_free( node->entry );
-		free( node );
+		node_free( fs, node );
 		pthread_rwlock_unlock( &fs->lock );
 		return tmp;
 	}
 	/* add node to tree */
-	if( insert_by_path( fs->root, node ) != 0 ) {
+	if( insert_by_path( fs, node, path ) != 0 ) {
 		log( "ERROR: could not insert %s into tree",
-				node->name );
+				path );
 		unlink( location );
 		free( location );
-		free( node->name );
-		archive_entry_free( node->entry );
-		free( node );
+		node_free( fs, node );
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOENT;
 	}
@@ -1757,16 +5030,29 @@ ar_mknod( archive_fs_t* fs, const char *path, mode_t mode, dev_t rdev )
 	return 0;
 }
 
-int ar_unlink( archive_fs_t* fs, const char *path )
+int ar_mknod( archive_fs_t* fs, const char *path, mode_t mode, dev_t rdev )
+{
+	int ret;
+	pthread_rwlock_rdlock( &fs->changelock );
+	ret = _ar_mknod( fs, path, mode, rdev );
+	pthread_rwlock_unlock( &fs->changelock );
+	return ret;
+}
+
+static int
+_ar_unlink( archive_fs_t* fs, const char *path )
 {
 	NODE *node;
+	NODE *link;
+	char linkpath[PATH_MAX];
+	int ret;
 
 	//log( "unlink called, %s", path );
 	if( ! fs->archiveWriteable || fs->options.readonly ) {
 		return -EROFS;
 	}
 	pthread_rwlock_wrlock( &fs->lock );
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( ! node ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOENT;
@@ -1775,6 +5061,24 @@ int ar_unlink( archive_fs_t* fs, const char *path )
 		pthread_rwlock_unlock( &fs->lock );
 		return -EISDIR;
 	}
+	for( link = node->referrers; link; link = link->refnext ) {
+		if( archive_entry_hardlink( link->entry ) ) {
+			break;
+		}
+	}
+	if( link && node_path( link, linkpath, sizeof( linkpath ) ) == 0 ) {
+		/* hardlinks keep the data: the node holding it takes the
+		   place of one of them, which goes instead */
+		remove_child( fs, link );
+		node_free( fs, link );
+		remove_child( fs, node );
+		node->namechanged = 1;
+		ret = insert_by_path( fs, node, linkpath );
+		retarget_referrers( node, linkpath );
+		fs->archiveModified = 1;
+		pthread_rwlock_unlock( &fs->lock );
+		return ret;
+	}
 	if( node->location ) {
 		/* remove temporary file */
 		if( unlink( node->location ) == -1 ) {
@@ -1786,34 +5090,40 @@ int ar_unlink( archive_fs_t* fs, const char *path )
 		}
 		free( node->location );
 	}
-	remove_child( node );
-	free( node->name );
-	free( node );
+	remove_child( fs, node );
+	readahead_stop( fs, node );
+	stream_cache_evict( fs, node );
+	node_free( fs, node );
 	fs->archiveModified = 1;
 	pthread_rwlock_unlock( &fs->lock );
 	return 0;
 }
 
+int ar_unlink( archive_fs_t* fs, const char *path )
+{
+	int ret;
+	pthread_rwlock_rdlock( &fs->changelock );
+	ret = _ar_unlink( fs, path );
+	pthread_rwlock_unlock( &fs->changelock );
+	return ret;
+}
+
 static int
 _ar_chmod( archive_fs_t* fs, const char *path, mode_t mode )
 {
 	NODE *node;
+	int ret;
 
 	//log( "chmod called, path '%s', mode: %o", path, mode );
 	if( ! fs->archiveWriteable || fs->options.readonly ) {
 		return -EROFS;
 	}
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( ! node ) {
 		return -ENOENT;
 	}
-	if( archive_entry_hardlink( node->entry ) ) {
-		/* file is a hardlink, recurse into it */
-		return _ar_chmod( fs, archive_entry_hardlink( node->entry ), mode );
-	}
-	if( archive_entry_symlink( node->entry ) ) {
-		/* file is a symlink, recurse into it */
-		return _ar_chmod( fs, archive_entry_symlink( node->entry ), mode );
+	if( ( ret = follow_links( fs, &node, 1 ) ) != 0 ) {
+		return ret;
 	}
 #ifdef __APPLE__
 	/* Make sure the full mode, including file type information, is used */
@@ -1827,9 +5137,11 @@ _ar_chmod( archive_fs_t* fs, const char *path, mode_t mode )
 int ar_chmod( archive_fs_t* fs, const char *path, mode_t mode )
 {
 	int ret;
+	pthread_rwlock_rdlock( &fs->changelock );
 	pthread_rwlock_wrlock( &fs->lock );
 	ret = _ar_chmod( fs, path, mode );
 	pthread_rwlock_unlock( &fs->lock );
+	pthread_rwlock_unlock( &fs->changelock );
 	return ret;
 }
 
@@ -1837,19 +5149,18 @@ static int
 _ar_chown( archive_fs_t* fs, const char *path, uid_t uid, gid_t gid )
 {
 	NODE *node;
+	int ret;
 
 	//log( "chown called, %s", path );
 	if( ! fs->archiveWriteable || fs->options.readonly ) {
 		return -EROFS;
 	}
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( ! node ) {
 		return -ENOENT;
 	}
-	if( archive_entry_hardlink( node->entry ) ) {
-		/* file is a hardlink, recurse into it */
-		return _ar_chown( fs, archive_entry_hardlink( node->entry ),
-				uid, gid );
+	if( ( ret = follow_links( fs, &node, 0 ) ) != 0 ) {
+		return ret;
 	}
 	/* changing ownership of symlinks is allowed, however */
 	archive_entry_set_uid( node->entry, uid );
@@ -1861,9 +5172,11 @@ _ar_chown( archive_fs_t* fs, const char *path, uid_t uid, gid_t gid )
 int ar_chown( archive_fs_t* fs, const char *path, uid_t uid, gid_t gid )
 {
 	int ret;
+	pthread_rwlock_rdlock( &fs->changelock );
 	pthread_rwlock_wrlock( &fs->lock );
 	ret = _ar_chown( fs, path, uid, gid );
 	pthread_rwlock_unlock( &fs->lock );
+	pthread_rwlock_unlock( &fs->changelock );
 	return ret;
 }
 
@@ -1871,22 +5184,18 @@ static int
 _ar_utime( archive_fs_t* fs, const char *path, struct utimbuf *buf )
 {
 	NODE *node;
+	int ret;
 
 	//log( "utime called, %s", path );
 	if( ! fs->archiveWriteable || fs->options.readonly ) {
 		return -EROFS;
 	}
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( ! node ) {
 		return -ENOENT;
 	}
-	if( archive_entry_hardlink( node->entry ) ) {
-		/* file is a hardlink, recurse into it */
-		return _ar_utime( fs, archive_entry_hardlink( node->entry ), buf );
-	}
-	if( archive_entry_symlink( node->entry ) ) {
-		/* file is a symlink, recurse into it */
-		return _ar_utime( fs, archive_entry_symlink( node->entry ), buf );
+	if( ( ret = follow_links( fs, &node, 1 ) ) != 0 ) {
+		return ret;
 	}
 	archive_entry_set_mtime( node->entry, buf->modtime, 0 );
 	archive_entry_set_atime( node->entry, buf->actime, 0 );
@@ -1897,9 +5206,11 @@ _ar_utime( archive_fs_t* fs, const char *path, struct utimbuf *buf )
 int ar_utime( archive_fs_t* fs, const char *path, struct utimbuf *buf )
 {
 	int ret;
+	pthread_rwlock_rdlock( &fs->changelock );
 	pthread_rwlock_wrlock( &fs->lock );
 	ret = _ar_utime( fs, path, buf );
 	pthread_rwlock_unlock( &fs->lock );
+	pthread_rwlock_unlock( &fs->changelock );
 	return ret;
 }
 
@@ -1924,66 +5235,118 @@ int ar_statfs( archive_fs_t* fs, const char *path, struct statvfs *stbuf )
 	return 0;
 }
 
-int ar_rename( archive_fs_t* fs, const char *from, const char *to )
+static int
+_ar_rename( archive_fs_t* fs, const char *from, const char *to )
 {
 	NODE *node;
 	int ret = 0;
-	char *old_name;
+	char *temp_name;
 
 	//log( "ar_rename called, from: '%s', to: '%s'", from, to );
 	if( ! fs->archiveWriteable || fs->options.readonly ) {
 		return -EROFS;
 	}
 	pthread_rwlock_wrlock(&fs->lock);
-	node = get_node_for_path( fs->root, from );
+	node = get_node_for_path( fs, from );
 	if( ! node ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOENT;
 	}
-	if( node->child ) {
-		/* it is a directory, recursive change of all nodes
-		 * below it is required */
-		ret = rename_recursively( fs, node->child, from, to );
-	}
 	/* meta data is changed in save() */
 	/* change node name */
 	if( *to != '/' ) {
-		char *temp_name;
 	        if( ( temp_name = malloc( strlen( to ) + 2 ) ) == NULL ) {
 	                log( "Out of memory" );
 			pthread_rwlock_unlock( &fs->lock );
 		        return -ENOMEM;
 		}
 		sprintf( temp_name, "/%s", to );
-		old_name = node->name;
-		node->name = temp_name;
 	} else {
-		char *temp_name;
 		if( ( temp_name = strdup( to ) ) == NULL ) {
 	                log( "Out of memory" );
 			pthread_rwlock_unlock( &fs->lock );
 		        return -ENOMEM;
 		}
-		old_name = node->name;
-		node->name = temp_name;
 	}
+	/* detach before the name changes, the parent finds its children
+	   by name */
+	remove_child( fs, node );
 	node->namechanged = 1;
-	remove_child( node );
-	ret = insert_by_path( fs->root, node );
-	correct_hardlinks_to_node( fs->root, old_name, node->name );
-	free( old_name );
+	ret = insert_by_path( fs, node, temp_name );
+	if( ret == 0 && node->nchildren ) {
+		/* it is a directory, recursive change of all nodes
+		 * below it is required */
+		ret = rename_recursively( fs, node, temp_name );
+	}
+	if( get_node_for_path( fs, temp_name ) == node ) {
+		retarget_referrers( node, temp_name );
+	} else {
+		/* a node of that name was there already */
+		link_forget_referrers( node );
+	}
+	free( temp_name );
 	fs->archiveModified = 1;
 	pthread_rwlock_unlock( &fs->lock );
 	return ret;
 }
 
+int ar_rename( archive_fs_t* fs, const char *from, const char *to )
+{
+	int ret;
+	pthread_rwlock_rdlock( &fs->changelock );
+	ret = _ar_rename( fs, from, to );
+	pthread_rwlock_unlock( &fs->changelock );
+	return ret;
+}
+
+/*
+ * the node writes into path end up in, following links like _ar_write()
+ */
+static NODE *
+get_data_node( archive_fs_t* fs, const char *path )
+{
+	NODE *node = get_node_for_path( fs, path );
+
+	if( node && follow_links( fs, &node, 1 ) != 0 ) {
+		return NULL;
+	}
+	return node;
+}
+
+static int
+_ar_fsync( archive_fs_t* fs, const char *path, int isdatasync )
+{
+	NODE *node;
+	struct nodelock *lock;
+	int ret = 0;
+
+	pthread_rwlock_rdlock( &fs->lock );
+	if( ( node = get_data_node( fs, path ) ) == NULL ) {
+		pthread_rwlock_unlock( &fs->lock );
+		return -ENOENT;
+	}
+	node_acquire( fs, node );
+	lock = node_lock( fs, node );
+	if( ( ret = node_flush( node ) ) == 0 && node->fd != -1 ) {
+		if( ( isdatasync ? fdatasync( node->fd ) :
+					fsync( node->fd ) ) == -1 ) {
+			ret = 0 - errno;
+		}
+	}
+	node_unlock( lock );
+	node_release( fs, node );
+	pthread_rwlock_unlock( &fs->lock );
+	return ret;
+}
+
 int ar_fsync( archive_fs_t* fs, const char *path, int isdatasync )
 {
-	/* Just a stub.  This method is optional and can safely be left
-	   unimplemented */
-	( void )path;
-	( void )isdatasync;
-	return 0;
+	int ret;
+	/* the write buffer is not flushed while a save reads the file */
+	pthread_rwlock_rdlock( &fs->changelock );
+	ret = _ar_fsync( fs, path, isdatasync );
+	pthread_rwlock_unlock( &fs->changelock );
+	return ret;
 }
 
 int ar_readlink( archive_fs_t* fs, const char *path, char *buf, size_t size )
@@ -1992,29 +5355,32 @@ int ar_readlink( archive_fs_t* fs, const char *path, char *buf, size_t size )
 	const char *tmp;
 
 	//log( "readlink called, path '%s'", path );
+	wait_for_path( fs, path );
 	pthread_rwlock_rdlock( &fs->lock );
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( ! node ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOENT;
 	}
-	if( ! S_ISLNK( archive_entry_mode( node->entry ) ) ) {
+	if( ! S_ISLNK( node_mode( node ) ) ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOLINK;
 	}
-	tmp = archive_entry_symlink( node->entry );
+	tmp = node_symlink( node );
 	snprintf( buf, size, "%s", tmp );
 	pthread_rwlock_unlock( &fs->lock );
 	return 0;
 }
 
-int ar_open( archive_fs_t* fs, const char *path, int flags )
+static int
+_ar_open( archive_fs_t* fs, const char *path, int flags )
 {
 	NODE *node;
 
 	//log( "open called, path '%s'", path );
+	wait_for_path( fs, path );
 	pthread_rwlock_rdlock( &fs->lock );
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( ! node ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOENT;
@@ -2025,54 +5391,214 @@ int ar_open( archive_fs_t* fs, const char *path, int flags )
 			return -EROFS;
 		}
 	}
-	/* no need to recurse into links since function doesn't do anything */
-	/* no need to save a handle here since archives are stream based */
+	/* no need to save a handle here since archives are stream based;
+	   the node counts the opens so writes can keep the temp file open */
+	if( ( node = get_data_node( fs, path ) ) != NULL ) {
+		struct nodelock *lock = node_lock( fs, node );
+		node->opens++;
+		node_unlock( lock );
+	}
 	//fi->fh = 0;
 	pthread_rwlock_unlock( &fs->lock );
 	return 0;
 }
 
+int ar_open( archive_fs_t* fs, const char *path, int flags )
+{
+	int writing = flags & ( O_WRONLY | O_RDWR );
+	int ret;
+	/* opening for reading changes nothing a save looks at, so readers
+	   are not held up by one */
+	if( writing ) {
+		pthread_rwlock_rdlock( &fs->changelock );
+	}
+	ret = _ar_open( fs, path, flags );
+	if( writing ) {
+		pthread_rwlock_unlock( &fs->changelock );
+	}
+	return ret;
+}
+
+static int
+_ar_release( archive_fs_t* fs, const char *path )
+{
+	NODE *node;
+	struct nodelock *lock;
+	int last;
+	int ret = 0;
+
+	pthread_rwlock_rdlock( &fs->lock );
+	if( ( node = get_data_node( fs, path ) ) == NULL ) {
+		pthread_rwlock_unlock( &fs->lock );
+		return 0;
+	}
+	/* let a write in progress finish */
+	node_acquire( fs, node );
+	lock = node_lock( fs, node );
+	last = node->opens > 0 && --node->opens == 0;
+	if( last && node->fd != -1 ) {
+		/* the size and mtime kept in memory are replaced by those
+		   of the temp file */
+		if( ( ret = node_close( node ) ) == 0 ) {
+			ret = update_entry_stat( node );
+		}
+	}
+	node_unlock( lock );
+	node_release( fs, node );
+	if( last ) {
+		/* nobody reads on */
+		readahead_stop( fs, node );
+	}
+	pthread_rwlock_unlock( &fs->lock );
+	return ret;
+}
+
 int ar_release( archive_fs_t* fs, const char *path )
 {
-	( void )fs;
-	( void )path;
-	return 0;
+	int ret;
+	/* the last release closes the temp file a save may be reading */
+	pthread_rwlock_rdlock( &fs->changelock );
+	ret = _ar_release( fs, path );
+	pthread_rwlock_unlock( &fs->changelock );
+	return ret;
 }
 
-int ar_readdir( archive_fs_t* fs, const char *path, void *buf, fill_dir_t filler,
-		off_t offset )
+/*
+ * readdir cookies: 1 and 2 continue after "." and "..", larger cookies hold
+ * the path hash of the last child returned in the upper bits and its index
+ * + 3 in the lower ones. The hash finds that child again when other children
+ * were inserted or removed in front of it since.
+ */
+#define COOKIE_INDEX_BITS 31
+
+static off_t
+readdir_cookie( const NODE *child, size_t i )
+{
+	return ( ( off_t )child->hash << COOKIE_INDEX_BITS ) | ( off_t )( i + 3 );
+}
+
+/* returns the index of the first child to list after cookie */
+static size_t
+readdir_resume( const NODE *node, off_t offset )
+{
+	unsigned int hash;
+	size_t i, d;
+
+	if( offset < 3 ) {
+		return 0;
+	}
+	hash = ( unsigned int )( offset >> COOKIE_INDEX_BITS );
+	i = ( size_t )( offset & ( ( ( off_t )1 << COOKIE_INDEX_BITS ) - 1 ) ) - 3;
+	if( i < node->nchildren && node->children[i]->hash == hash ) {
+		return i + 1;
+	}
+	/* the directory changed, look for the child around its old place */
+	if( i > node->nchildren ) {
+		i = node->nchildren;
+	}
+	for( d = 1; d <= i || i + d < node->nchildren; d++ ) {
+		if( i + d < node->nchildren &&
+				node->children[i + d]->hash == hash ) {
+			return i + d + 1;
+		}
+		if( d <= i && node->children[i - d]->hash == hash ) {
+			return i - d + 1;
+		}
+	}
+	/* it is gone; whatever followed it has moved up into its place */
+	return i;
+}
+
+/*
+ * lists node's children from cookie offset on; with plus set every child
+ * comes with the attributes ar_getattr() would return for it
+ */
+static int
+readdir_node( archive_fs_t* fs, const char *path, fill_dir_t filler,
+		off_t offset, int plus )
 {
 	NODE *node;
-	(void) offset;
+	size_t i;
 
 	//log( "readdir called, path: '%s'", path );
+	/* lists what has been indexed so far */
+	wait_for_path( fs, path );
 	pthread_rwlock_rdlock( &fs->lock );
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( ! node ) {
 		log( "path '%s' not found", path );
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOENT;
 	}
 
-        filler( ".", NULL );
-        filler( "..", NULL );
+	if( plus ) {
+		struct stat st;
+		getattr_node( fs, node, &st );
+		if( offset < 1 && filler( ".", &st, 1 ) ) {
+			pthread_rwlock_unlock( &fs->lock );
+			return 0;
+		}
+		getattr_node( fs, node->parent ? node->parent : node, &st );
+		if( offset < 2 && filler( "..", &st, 2 ) ) {
+			pthread_rwlock_unlock( &fs->lock );
+			return 0;
+		}
+	} else {
+		if( offset < 1 && filler( ".", NULL, 1 ) ) {
+			pthread_rwlock_unlock( &fs->lock );
+			return 0;
+		}
+		if( offset < 2 && filler( "..", NULL, 2 ) ) {
+			pthread_rwlock_unlock( &fs->lock );
+			return 0;
+		}
+	}
 
-	node = node->child;
-	while( node ) {
+	for( i = readdir_resume( node, offset ); i < node->nchildren; i++ ) {
+		NODE *child = node->children[i];
 		struct stat st;
-		char *name;
-		st.st_ino = archive_entry_ino( node->entry );
-		st.st_mode = archive_entry_mode( node->entry );
-		name = strrchr( node->name, '/' ) + 1;
-		if( filler( name, &st ) )
+		struct stat *stp = &st;
+		if( plus ) {
+			NODE *data = child;
+			if( follow_links( fs, &data, 0 ) == 0 ) {
+				getattr_node( fs, data, &st );
+			} else {
+				/* let the caller ask ar_getattr() */
+				stp = NULL;
+			}
+		} else if( child->entry ) {
+			/* a writer may be updating the entry */
+			struct nodelock *lock = node_lock( fs, child );
+			st.st_ino = archive_entry_ino( child->entry );
+			st.st_mode = archive_entry_mode( child->entry );
+			node_unlock( lock );
+		} else {
+			st.st_ino = child->st.ino;
+			st.st_mode = child->st.mode;
+		}
+		if( filler( child->name, stp, readdir_cookie( child, i ) ) )
 			break;
-		node = node->next;
 	}
 	pthread_rwlock_unlock( &fs->lock );
 	return 0;
 }
 
-int ar_create( archive_fs_t* fs, const char *path, mode_t mode )
+int ar_readdir( archive_fs_t* fs, const char *path, void *buf, fill_dir_t filler,
+		off_t offset )
+{
+	( void )buf;
+	return readdir_node( fs, path, filler, offset, 0 );
+}
+
+int ar_readdir_plus( archive_fs_t* fs, const char *path, void *buf,
+		fill_dir_t filler, off_t offset )
+{
+	( void )buf;
+	return readdir_node( fs, path, filler, offset, 1 );
+}
+
+static int
+_ar_create( archive_fs_t* fs, const char *path, mode_t mode )
 {
 	NODE *node;
 	char *location;
@@ -2087,7 +5613,7 @@ int ar_create( archive_fs_t* fs, const char *path, mode_t mode )
 	}
 	pthread_rwlock_wrlock( &fs->lock );
 	/* check for existing node */
-	node = get_node_for_path( fs->root, path );
+	node = get_node_for_path( fs, path );
 	if( node ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -EEXIST;
@@ -2106,49 +5632,42 @@ int ar_create( archive_fs_t* fs, const char *path, mode_t mode )
 		return 0 - errno;
 	}
 	/* build node */
-	if( ( node = ( NODE * )malloc( sizeof( NODE ) ) ) == NULL ) {
-	        log( "Out of memory" );
+	if( ( node = node_new( fs ) ) == NULL ) {
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOMEM;
 	}
-	init_node( node );
 	node->location = location;
 	node->modified = 1;
-	node->name = strdup( path );
 	/* build entry */
 	if( (node->entry = archive_entry_new()) == NULL ) {
 	        log( "Out of memory" );
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOMEM;
 	}
-	if( fs->root->child &&
-			node->name[0] == '/' &&
-			archive_entry_pathname( fs->root->child->entry )[0] != '/' )
+	if( fs->root->nchildren &&
+			path[0] == '/' &&
+			archive_entry_pathname( fs->root->children[0]->entry )[0] != '/' )
 	{
-		archive_entry_set_pathname( node->entry, node->name + 1 );
+		archive_entry_set_pathname( node->entry, path + 1 );
 	} else {
-		archive_entry_set_pathname( node->entry, node->name );
+		archive_entry_set_pathname( node->entry, path );
 	}
 	if( ( tmp = update_entry_stat( node ) ) < 0 ) {
 		log( "mknod: error stat'ing file %s: %s", node->location,
 				strerror( 0 - tmp ) );
 		unlink( location );
 		free( location );
-		free( node->name );
-		archive_entry_free( node->entry );
-		free( node );
+		node_free( fs, node );
 		pthread_rwlock_unlock( &fs->lock );
 		return tmp;
 	}
 	/* add node to tree */
-	if( insert_by_path( fs->root, node ) != 0 ) {
+	if( insert_by_path( fs, node, path ) != 0 ) {
 		log( "ERROR: could not insert %s into tree",
-				node->name );
+				path );
 		unlink( location );
 		free( location );
-		free( node->name );
-		archive_entry_free( node->entry );
-		free( node );
+		node_free( fs, node );
 		pthread_rwlock_unlock( &fs->lock );
 		return -ENOENT;
 	}
@@ -2158,6 +5677,116 @@ int ar_create( archive_fs_t* fs, const char *path, mode_t mode )
 	return 0;
 }
 
+int ar_create( archive_fs_t* fs, const char *path, mode_t mode )
+{
+	int ret;
+	pthread_rwlock_rdlock( &fs->changelock );
+	ret = _ar_create( fs, path, mode );
+	pthread_rwlock_unlock( &fs->changelock );
+	return ret;
+}
+
+static int
+save_changes( archive_fs_t* fs )
+{
+	int ret = 0;
+
+	pthread_rwlock_wrlock( &fs->changelock );
+	if( fs->archiveModified ) {
+		ret = save( fs, fs->archiveFile );
+	}
+	/* reported before changes may go on */
+	pthread_mutex_lock( &fs->savemutex );
+	fs->savestatus.result = ret;
+	fs->savestatus.running = 0;
+	pthread_mutex_unlock( &fs->savemutex );
+	pthread_rwlock_unlock( &fs->changelock );
+	return ret;
+}
+
+int ar_save( archive_fs_t* fs )
+{
+	if( ! fs->archiveWriteable || fs->options.readonly ) {
+		return -EROFS;
+	}
+	ar_save_wait( fs );
+	return save_changes( fs );
+}
+
+static void *
+saver_thread( void *data )
+{
+	save_changes( data );
+	return NULL;
+}
+
+/*
+ * saves on a thread of its own; see ar_save_progress() for how it goes and
+ * ar_save_wait() for the result
+ * @return 0 once the thread runs, -EBUSY if a save is running already
+ */
+int ar_save_start( archive_fs_t* fs )
+{
+	int ret;
+
+	if( ! fs->archiveWriteable || fs->options.readonly ) {
+		return -EROFS;
+	}
+	pthread_mutex_lock( &fs->savemutex );
+	if( fs->savestatus.running ) {
+		pthread_mutex_unlock( &fs->savemutex );
+		return -EBUSY;
+	}
+	if( fs->saverjoinable ) {
+		/* the last one has finished */
+		pthread_join( fs->saver, NULL );
+		fs->saverjoinable = 0;
+	}
+	memset( &fs->savestatus, 0, sizeof( ar_save_status ) );
+	fs->savestatus.running = 1;
+	if( ( ret = pthread_create( &fs->saver, NULL, saver_thread, fs ) )
+			!= 0 ) {
+		fs->savestatus.running = 0;
+		pthread_mutex_unlock( &fs->savemutex );
+		log( "Could not start the save thread: %s", strerror( ret ) );
+		return 0 - ret;
+	}
+	fs->saverjoinable = 1;
+	pthread_mutex_unlock( &fs->savemutex );
+	return 0;
+}
+
+void ar_save_progress( archive_fs_t* fs, ar_save_status *status )
+{
+	pthread_mutex_lock( &fs->savemutex );
+	*status = fs->savestatus;
+	pthread_mutex_unlock( &fs->savemutex );
+}
+
+/*
+ * waits for the save started by ar_save_start()
+ * @return its result, 0 if none was started
+ */
+int ar_save_wait( archive_fs_t* fs )
+{
+	pthread_t saver;
+	int joinable;
+	int ret;
+
+	pthread_mutex_lock( &fs->savemutex );
+	saver = fs->saver;
+	joinable = fs->saverjoinable;
+	fs->saverjoinable = 0;
+	pthread_mutex_unlock( &fs->savemutex );
+	if( joinable ) {
+		pthread_join( saver, NULL );
+	}
+	pthread_mutex_lock( &fs->savemutex );
+	ret = fs->savestatus.result;
+	pthread_mutex_unlock( &fs->savemutex );
+	return ret;
+}
+
 #if 0
 static struct fuse_operations ar_oper = {
 	.getattr	= ar_getattr,
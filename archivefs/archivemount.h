@@ -17,16 +17,61 @@
 /* data structures */
 /*******************/
 
+/* the part of a header needed to answer stat() and readlink() */
+typedef struct nodestat {
+	int64_t size;
+	int64_t ino;
+	time_t atime;
+	time_t mtime;
+	time_t ctime;
+	long atimensec;
+	long mtimensec;
+	long ctimensec;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	unsigned int nlink;
+	dev_t dev;
+	dev_t rdev;
+	const char *hardlink; /* interned, or NULL */
+	const char *symlink; /* interned, or NULL */
+} nodestat_t;
+
+struct overlay;
+struct writebuf;
+
 typedef struct node {
 	struct node *parent;
-	struct node *prev; /* previous in same directory */
-	struct node *next; /* next in same directory */
-	struct node *child; /* first child for directories */
-	char *name; /* fully qualified with prepended '/' */
+	struct node **children; /* for directories, sorted by name */
+	size_t nchildren; /* number of nodes in children */
+	size_t childsize; /* number of nodes allocated in children */
+	const char *name; /* last component of the path, interned; see
+			     node_path() for the full path */
 	char *location; /* location on disk for new/modified files, else NULL */
+	struct overlay *overlay; /* the ranges written to location when it holds
+				    only those, else NULL */
 	int namechanged; /* true when file was renamed */
-	struct archive_entry *entry; /* libarchive header data */
+	struct archive_entry *entry; /* libarchive header data, NULL on
+					read-only mounts */
+	nodestat_t st; /* header data used when entry is NULL */
 	int modified; /* true when node was modified */
+	off_t dataoffset; /* offset of the file data in an uncompressed
+			     archive, -1 if the data has to be decoded */
+	off_t cacheoffset; /* offset of the file data in the cache file,
+			      -1 if it was not decoded at mount time */
+	struct node *hashnext; /* next node in the same path hash bucket */
+	unsigned int hash; /* hash of the full path, see node_hash() */
+	int busy; /* true while a writer copies the data to location */
+	int opens; /* ar_open() calls not released yet */
+	int fd; /* location, kept open from the first write until the last
+		   release, else -1 */
+	struct writebuf *writebuf; /* small writes not in location yet, only
+				      while fd is open */
+	int written; /* true once a running save has written the node */
+	struct node *target; /* node a hardlink or symlink points to, NULL
+				while the name does not lead to one */
+	struct node *referrers; /* links whose target is this node */
+	struct node *refnext; /* next link with the same target */
 } NODE;
 
 
@@ -37,8 +82,49 @@ typedef struct node {
 typedef struct {
 	int nobackup;
 	int readonly;
+	int streamcache; /* number of open decoders kept for sequential reads */
+	size_t streamcachemem; /* memory the kept decoders may use, in bytes */
+	off_t gzindexspan; /* distance of checkpoints in gzip archives, 0 for
+			      no checkpoint index */
+	int materialize; /* decode all member data into a local cache file
+			    while mounting a compressed archive */
+	int background; /* read the headers in a background thread, only
+			   for read-only mounts */
+	int savethreads; /* threads compressing gzip and bzip2 archives on
+			    save, 0 for one per processor, 1 to let
+			    libarchive compress */
+	int readahead; /* members read sequentially that get a thread decoding
+			  ahead of the reader, 0 for no read-ahead */
+	size_t readaheadsize; /* bytes decoded ahead of each of them */
+	int snapshot; /* keep a snapshot of the tree of read-only mounts next
+			 to the archive and mount from it while the archive
+			 is unchanged */
 } archive_fs_options;
 
+/* progress of a save, see ar_save_progress() */
+typedef struct {
+	int running; /* true while ar_save_start() is writing the archive */
+	int result; /* 0 or 0-errno of the last save that finished */
+	off_t bytes; /* bytes of the new archive written, before compression */
+	size_t members; /* members written */
+	size_t total; /* members expected, from the number of nodes */
+} ar_save_status;
+
+struct ar_stream;
+struct ar_readahead;
+struct gzindex;
+struct snapshot;
+struct nodeslab;
+struct namechunk;
+
+#define NODE_LOCKS 64 /* number of locks the NODEs are spread over */
+
+/* guards location, modified, busy and entry of the NODEs hashed to it */
+struct nodelock {
+	pthread_mutex_t mutex;
+	pthread_cond_t released; /* signalled when a NODE stops being busy */
+};
+
 typedef struct {
 	
 	int archiveFd; /* file descriptor of archive file, just to keep the
@@ -47,16 +133,68 @@ typedef struct {
 	int archiveModified;
 	int archiveWriteable;
 	NODE *root;
+	NODE **nodehash; /* path hash index of all nodes in the tree */
+	size_t nodehashsize; /* number of buckets in nodehash */
+	size_t nodecount; /* number of nodes in nodehash */
+	struct nodeslab *nodeslabs; /* blocks NODEs are allocated from */
+	size_t slabused; /* NODEs handed out from the newest slab */
+	NODE *freenodes; /* released NODEs, chained through hashnext */
+	struct namechunk *namechunks; /* blocks holding the interned names */
+	const char **names; /* hash set of the interned names */
+	size_t namessize; /* number of slots in names */
+	size_t namecount; /* number of names in names */
 	char *mtpt;
 	char *archiveFile;
-	pthread_rwlock_t lock; /* global node tree lock */
+	pthread_rwlock_t lock; /* global node tree lock, held shared while
+				  writing into a file */
+	struct nodelock nodelocks[NODE_LOCKS]; /* per NODE state */
+	struct ar_stream *streams; /* open decoders, most recently used first */
+	int nstreams; /* number of decoders in streams */
+	size_t streammem; /* estimated memory used by streams */
+	pthread_mutex_t streamlock; /* protects streams */
+	struct ar_readahead *readaheads; /* members watched for sequential
+					    reads, most recently read first */
+	pthread_mutex_t ralock; /* protects readaheads */
+	struct gzindex *gzindex; /* checkpoints of a gzip archive, or NULL */
+	struct snapshot *snapshot; /* the tree was loaded from, its names
+				      point into it; or NULL */
+	struct stat archivestat; /* identity of the archive file in the block
+				    cache, st_ino is 0 if it is unknown */
+	int cacheFd; /* unlinked file with member data decoded at mount time,
+			-1 if the archive is not materialized */
+	off_t cachesize; /* end of the data in cacheFd */
+	int cachestopped; /* true once materializing failed, later members
+			     are read from the archive; protected by
+			     indexlock */
+	int background; /* true if the tree is built by the indexer thread */
+	pthread_t indexer; /* thread reading the headers */
+	int indexing; /* true until the indexer has reached the end */
+	int indexstop; /* asks the indexer to quit early */
+	int indexwaiters; /* threads waiting on indexcond */
+	pthread_mutex_t indexlock; /* protects indexing, indexstop and
+				      indexwaiters */
+	pthread_cond_t indexcond; /* signalled when nodes were added */
+	pthread_rwlock_t changelock; /* held shared by calls changing the tree
+					or file data, exclusively by a save */
+	pthread_t saver; /* thread started by ar_save_start() */
+	int saverjoinable; /* true until saver has been joined */
+	pthread_mutex_t savemutex; /* protects savestatus and saverjoinable */
+	ar_save_status savestatus;
 	archive_fs_options options;
 	
 } archive_fs_t;
 
-typedef int (^fill_dir_t) (const char* name, struct stat* st);
+/* offset is the cookie to pass to ar_readdir() to continue after name;
+   returning non-zero stops the listing before name */
+typedef int (^fill_dir_t) (const char* name, struct stat* st, off_t offset);
 
+void ar_default_options( archive_fs_options *options );
+/* sets up the block cache shared by all mounts of the process, see
+   blockcache.h; memory 0 turns it off */
+int ar_block_cache( size_t memory, const char *spilldir, off_t spillsize );
 int ar_init( archive_fs_t* fs, const char *archiveFile, const char* mtpt );
+int ar_init_with_options( archive_fs_t* fs, const char *archiveFile,
+			 const char* mtpt, const archive_fs_options *options );
 int ar_free( archive_fs_t *fs );
 int ar_read( archive_fs_t* fs, const char *path, char *buf, size_t size, off_t offset );
 int ar_getattr( archive_fs_t* fs, const char *path, struct stat *stbuf );
@@ -80,4 +218,14 @@ int ar_open( archive_fs_t* fs, const char *path, int flags );
 int ar_release( archive_fs_t* fs, const char *path );
 int ar_readdir( archive_fs_t* fs, const char *path, void *buf, fill_dir_t filler,
 			   off_t offset );
+/* like ar_readdir(), but st holds the full attributes of every entry, or is
+   NULL for a hardlink whose target cannot be found */
+int ar_readdir_plus( archive_fs_t* fs, const char *path, void *buf,
+		    fill_dir_t filler, off_t offset );
 int ar_create( archive_fs_t* fs, const char *path, mode_t mode );
+/* write the changes into the archive file; the mount stays readable while
+   the new archive is written, changes wait until it is in place */
+int ar_save( archive_fs_t* fs );
+int ar_save_start( archive_fs_t* fs );
+void ar_save_progress( archive_fs_t* fs, ar_save_status *status );
+int ar_save_wait( archive_fs_t* fs );
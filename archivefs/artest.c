@@ -0,0 +1,1093 @@
+/*
+ *  artest.c
+ *  ArchiveFS
+ *
+ *  Command-line check of the archive file system, run by "make check":
+ *  mounts an archive read-only and compares every file and directory
+ *  below a source directory with what the mount returns for it. With -w
+ *  the archive is mounted writable first, changed through the mount while
+ *  the source directory gets the same changes, saved, and then compared
+ *  with the changed directory; -t sets the threads compressing the saved
+ *  gzip or bzip2 archive and -c turns on the block cache. -b saves on the
+ *  saver thread while the tree is read, and -n adds members to a tar
+ *  without a backup afterwards, which appends them to the archive file.
+ *  -l checks the links of the tree "make check" packs: a symlink read
+ *  through, and a cycle of symlinks. -S mounts read-only with snapshots:
+ *  once writing the snapshot of the tree next to the archive, once loading
+ *  it, and with a damaged one that has to be ignored. -p pages through a
+ *  large directory made in a writable mount while it changes, without
+ *  saving it.
+ *
+ */
+
+#include "archivemount.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define CHUNK 65536
+/* the member truncated by make_changes(), compared unchanged through a
+   second mount of the archive */
+#define TRUNCATED "/d/lines"
+
+static const char *srcroot;
+static int background; /* save with ar_save_start() while reading */
+static int links; /* the tree has the links check_links() looks at */
+static size_t readsize = CHUNK; /* bytes per ar_read(), up to CHUNK */
+static int failures;
+
+static void
+fail( const char *path, const char *what )
+{
+	fprintf( stderr, "%s: %s\n", path, what );
+	failures++;
+}
+
+/* fails for a negative result of an ar_* call on path */
+static int
+check( const char *path, int ret )
+{
+	if( ret < 0 ) {
+		fail( path, strerror( 0 - ret ) );
+	}
+	return ret;
+}
+
+/* compares the data of the regular file srcpath with path in fs */
+static void
+compare_data( archive_fs_t *fs, const char *path, const char *srcpath )
+{
+	static char want[CHUNK];
+	static char got[CHUNK];
+	FILE *fh;
+	off_t offset = 0;
+	size_t len;
+	int ret;
+
+	if( ( fh = fopen( srcpath, "rb" ) ) == NULL ) {
+		fail( srcpath, strerror( errno ) );
+		return;
+	}
+	do {
+		len = fread( want, 1, readsize, fh );
+		if( ( ret = ar_read( fs, path, got, readsize,
+						offset ) ) < 0 ) {
+			fail( path, strerror( 0 - ret ) );
+			break;
+		}
+		if( ( size_t )ret != len || memcmp( want, got, len ) != 0 ) {
+			fail( path, "data differs" );
+			break;
+		}
+		offset += len;
+	} while( len == readsize );
+	fclose( fh );
+}
+
+/* compares path in fs with the size bytes of data */
+static void
+compare_buffer( archive_fs_t *fs, const char *path, const char *data,
+		size_t size )
+{
+	static char got[CHUNK];
+	size_t offset = 0;
+	int ret;
+
+	do {
+		if( ( ret = ar_read( fs, path, got, CHUNK, offset ) ) < 0 ) {
+			fail( path, strerror( 0 - ret ) );
+			return;
+		}
+		if( ( size_t )ret > size - offset
+				|| memcmp( data + offset, got, ret ) != 0 ) {
+			fail( path, "data differs" );
+			return;
+		}
+		offset += ret;
+	} while( ret > 0 );
+	if( offset != size ) {
+		fail( path, "size differs" );
+	}
+}
+
+/* compares the target of the symlink srcpath with path in fs */
+static void
+compare_link( archive_fs_t *fs, const char *path, const char *srcpath )
+{
+	char want[PATH_MAX];
+	char got[PATH_MAX];
+	ssize_t len;
+	int ret;
+
+	if( ( len = readlink( srcpath, want, sizeof( want ) - 1 ) ) == -1 ) {
+		fail( srcpath, strerror( errno ) );
+		return;
+	}
+	want[len] = '\0';
+	if( ( ret = ar_readlink( fs, path, got, sizeof( got ) ) ) != 0 ) {
+		fail( path, strerror( 0 - ret ) );
+	} else if( strcmp( want, got ) != 0 ) {
+		fail( path, "link target differs" );
+	}
+}
+
+/* compares everything below srcdir with the directory path in fs */
+static void
+compare_tree( archive_fs_t *fs, const char *path, const char *srcdir )
+{
+	DIR *dir;
+	struct dirent *de;
+	size_t want = 0;
+	__block size_t got = 0;
+	int ret;
+
+	if( ( dir = opendir( srcdir ) ) == NULL ) {
+		fail( srcdir, strerror( errno ) );
+		return;
+	}
+	while( ( de = readdir( dir ) ) != NULL ) {
+		char mountpath[PATH_MAX];
+		char srcpath[PATH_MAX];
+		struct stat wantst;
+		struct stat gotst;
+
+		if( strcmp( de->d_name, "." ) == 0
+				|| strcmp( de->d_name, ".." ) == 0 ) {
+			continue;
+		}
+		want++;
+		snprintf( mountpath, sizeof( mountpath ), "%s/%s",
+				strcmp( path, "/" ) == 0 ? "" : path,
+				de->d_name );
+		snprintf( srcpath, sizeof( srcpath ), "%s/%s", srcdir,
+				de->d_name );
+		if( lstat( srcpath, &wantst ) == -1 ) {
+			fail( srcpath, strerror( errno ) );
+			continue;
+		}
+		if( ( ret = ar_getattr( fs, mountpath, &gotst ) ) != 0 ) {
+			fail( mountpath, strerror( 0 - ret ) );
+			continue;
+		}
+		if( ( gotst.st_mode & S_IFMT ) != ( wantst.st_mode & S_IFMT ) ) {
+			fail( mountpath, "type differs" );
+		} else if( S_ISDIR( wantst.st_mode ) ) {
+			compare_tree( fs, mountpath, srcpath );
+		} else if( S_ISREG( wantst.st_mode ) ) {
+			if( gotst.st_size != wantst.st_size ) {
+				fail( mountpath, "size differs" );
+			} else {
+				compare_data( fs, mountpath, srcpath );
+			}
+		} else if( S_ISLNK( wantst.st_mode ) ) {
+			compare_link( fs, mountpath, srcpath );
+		}
+	}
+	closedir( dir );
+	/* nothing more in the mount, removed members included */
+	ret = ar_readdir( fs, path, NULL,
+			^ int ( const char *name, struct stat *st, off_t offset ) {
+				if( strcmp( name, "." ) != 0
+						&& strcmp( name, ".." ) != 0 ) {
+					got++;
+				}
+				return 0;
+			}, 0 );
+	if( ret != 0 ) {
+		fail( path, strerror( 0 - ret ) );
+	} else if( got != want ) {
+		fail( path, "number of entries differs" );
+	}
+}
+
+  /***********/
+ /* changes */
+/***********/
+
+/* the file below srcroot that stands for path in the mount */
+static void
+src_path( char *buf, size_t size, const char *path )
+{
+	snprintf( buf, size, "%s%s", srcroot, path );
+}
+
+/* fills buf with bytes that differ from those of other seeds */
+static void
+pattern( char *buf, size_t size, int seed )
+{
+	size_t i;
+
+	for( i = 0; i < size; i++ ) {
+		buf[i] = ( char )( i * 7 + seed * 13 + i / 251 );
+	}
+}
+
+/* @return the contents of the file path, *size bytes, or NULL */
+static char *
+read_file( const char *path, size_t *size )
+{
+	struct stat st;
+	char *data = NULL;
+	FILE *fh;
+
+	if( ( fh = fopen( path, "rb" ) ) == NULL
+			|| fstat( fileno( fh ), &st ) == -1
+			|| ( data = malloc( st.st_size + 1 ) ) == NULL
+			|| fread( data, 1, st.st_size, fh )
+				!= ( size_t )st.st_size ) {
+		fail( path, errno ? strerror( errno ) : "could not be read" );
+		free( data );
+		data = NULL;
+	} else {
+		*size = st.st_size;
+	}
+	if( fh ) {
+		fclose( fh );
+	}
+	return data;
+}
+
+static void
+change_create( archive_fs_t *fs, const char *path )
+{
+	char srcpath[PATH_MAX];
+	int fh;
+
+	src_path( srcpath, sizeof( srcpath ), path );
+	if( ( fh = creat( srcpath, 0644 ) ) == -1 ) {
+		fail( srcpath, strerror( errno ) );
+	} else {
+		close( fh );
+	}
+	check( path, ar_create( fs, path, 0644 ) );
+}
+
+/* writes size bytes of buf at offset into path through an open file */
+static void
+change_write( archive_fs_t *fs, const char *path, const char *buf,
+		size_t size, off_t offset )
+{
+	char srcpath[PATH_MAX];
+	int fh;
+	int ret;
+
+	src_path( srcpath, sizeof( srcpath ), path );
+	if( ( fh = open( srcpath, O_WRONLY ) ) == -1
+			|| pwrite( fh, buf, size, offset ) != ( ssize_t )size ) {
+		fail( srcpath, strerror( errno ) );
+	}
+	if( fh != -1 ) {
+		close( fh );
+	}
+	if( check( path, ar_open( fs, path, O_WRONLY ) ) != 0 ) {
+		return;
+	}
+	if( ( ret = check( path, ar_write( fs, path, buf, size,
+						offset ) ) ) >= 0
+			&& ( size_t )ret != size ) {
+		fail( path, "short write" );
+	}
+	check( path, ar_release( fs, path ) );
+}
+
+static void
+change_mkdir( archive_fs_t *fs, const char *path )
+{
+	char srcpath[PATH_MAX];
+
+	src_path( srcpath, sizeof( srcpath ), path );
+	if( mkdir( srcpath, 0755 ) == -1 ) {
+		fail( srcpath, strerror( errno ) );
+	}
+	check( path, ar_mkdir( fs, path, 0755 ) );
+}
+
+static void
+change_truncate( archive_fs_t *fs, const char *path, off_t size )
+{
+	char srcpath[PATH_MAX];
+
+	src_path( srcpath, sizeof( srcpath ), path );
+	if( truncate( srcpath, size ) == -1 ) {
+		fail( srcpath, strerror( errno ) );
+	}
+	check( path, ar_truncate( fs, path, size ) );
+}
+
+static void
+change_unlink( archive_fs_t *fs, const char *path )
+{
+	char srcpath[PATH_MAX];
+
+	src_path( srcpath, sizeof( srcpath ), path );
+	if( unlink( srcpath ) == -1 ) {
+		fail( srcpath, strerror( errno ) );
+	}
+	check( path, ar_unlink( fs, path ) );
+}
+
+static void
+change_rename( archive_fs_t *fs, const char *from, const char *to )
+{
+	char srcfrom[PATH_MAX];
+	char srcto[PATH_MAX];
+
+	src_path( srcfrom, sizeof( srcfrom ), from );
+	src_path( srcto, sizeof( srcto ), to );
+	if( rename( srcfrom, srcto ) == -1 ) {
+		fail( srcfrom, strerror( errno ) );
+	}
+	check( from, ar_rename( fs, from, to ) );
+}
+
+/*
+ * writes count pieces of SMALL bytes one after the other from offset into
+ * path, which is open, as an editor saving line by line does
+ */
+#define SMALL 100
+static void
+small_writes( archive_fs_t *fs, const char *path, off_t offset, int count )
+{
+	char srcpath[PATH_MAX];
+	char buf[SMALL];
+	int fh;
+	int i;
+
+	src_path( srcpath, sizeof( srcpath ), path );
+	if( ( fh = open( srcpath, O_WRONLY ) ) == -1 ) {
+		fail( srcpath, strerror( errno ) );
+		return;
+	}
+	for( i = 0; i < count; i++, offset += SMALL ) {
+		pattern( buf, SMALL, i );
+		if( pwrite( fh, buf, SMALL, offset ) != SMALL ) {
+			fail( srcpath, strerror( errno ) );
+			break;
+		}
+		if( check( path, ar_write( fs, path, buf, SMALL,
+						offset ) ) != SMALL ) {
+			break;
+		}
+	}
+	close( fh );
+}
+
+/* compares the file path in fs, open or not, with its source */
+static void
+compare_file( archive_fs_t *fs, const char *path )
+{
+	char srcpath[PATH_MAX];
+	struct stat wantst;
+	struct stat gotst;
+
+	src_path( srcpath, sizeof( srcpath ), path );
+	if( stat( srcpath, &wantst ) == -1 ) {
+		fail( srcpath, strerror( errno ) );
+	} else if( check( path, ar_getattr( fs, path, &gotst ) ) == 0 ) {
+		if( gotst.st_size != wantst.st_size ) {
+			fail( path, "size differs" );
+		} else {
+			compare_data( fs, path, srcpath );
+		}
+	}
+}
+
+/*
+ * creates, modifies, truncates, unlinks and renames members; the tree
+ * "make check" packs has them all
+ */
+static void
+make_changes( archive_fs_t *fs )
+{
+	static char buf[20000];
+
+	pattern( buf, sizeof( buf ), 1 );
+	change_create( fs, "/new" );
+	change_write( fs, "/new", buf, sizeof( buf ), 0 );
+	pattern( buf, sizeof( buf ), 2 );
+	change_write( fs, "/d/five", buf, 100, 2000 );
+	change_truncate( fs, TRUNCATED, 1234 );
+	change_unlink( fs, "/one" );
+	change_rename( fs, "/hundred", "/d/e/hundred" );
+	/* the member holding the data of a hardlink, which keeps it */
+	change_unlink( fs, "/d/hard1" );
+
+	/* the overlays of members in the archive: ranges in the middle,
+	   apart, touching and overlapping, a written range truncated away
+	   and files extended past their truncated end */
+	pattern( buf, sizeof( buf ), 3 );
+	change_write( fs, "/d/e/big", buf, 1000, 150000 );
+	change_write( fs, "/d/e/big", buf + 1, 1000, 10000 );
+	change_write( fs, "/d/e/big", buf + 2, 1000, 151000 );
+	change_write( fs, "/d/e/big", buf + 3, 1000, 150500 );
+	change_truncate( fs, "/d/five", 1000 );
+	change_write( fs, "/d/five", buf, 100, 3000 );
+	change_truncate( fs, TRUNCATED, 70000 );
+
+	/* small writes collected while the files are open, more than fit
+	   into one write buffer, read back before they are released and
+	   after an fsync; into a new file and into a member's overlay */
+	change_create( fs, "/small" );
+	if( check( "/small", ar_open( fs, "/small", O_WRONLY ) ) == 0 ) {
+		small_writes( fs, "/small", 0, 3000 );
+		compare_file( fs, "/small" );
+		check( "/small", ar_fsync( fs, "/small", 0 ) );
+		small_writes( fs, "/small", 100050, 50 );
+		small_writes( fs, "/small", 300000, 50 );
+		compare_file( fs, "/small" );
+		check( "/small", ar_release( fs, "/small" ) );
+	}
+	if( check( "/d/e/large", ar_open( fs, "/d/e/large",
+					O_WRONLY ) ) == 0 ) {
+		small_writes( fs, "/d/e/large", 1000000, 3000 );
+		compare_file( fs, "/d/e/large" );
+		check( "/d/e/large", ar_release( fs, "/d/e/large" ) );
+	}
+}
+
+/*
+ * symlinks are followed by their path from the top of the archive: reads
+ * give the data of the target, getattr the link itself, and a cycle ELOOP
+ */
+static void
+check_links( archive_fs_t *fs )
+{
+	char srcpath[PATH_MAX];
+	struct stat st;
+	char buf[16];
+	int ret;
+
+	src_path( srcpath, sizeof( srcpath ), "/d/e/big" );
+	compare_data( fs, "/sym", srcpath );
+	if( check( "/sym", ar_getattr( fs, "/sym", &st ) ) == 0
+			&& ! S_ISLNK( st.st_mode ) ) {
+		fail( "/sym", "not a symlink" );
+	}
+	if( check( "/loop1", ar_getattr( fs, "/loop1", &st ) ) == 0
+			&& ! S_ISLNK( st.st_mode ) ) {
+		fail( "/loop1", "not a symlink" );
+	}
+	if( ( ret = ar_read( fs, "/loop1", buf, sizeof( buf ), 0 ) )
+			!= -ELOOP ) {
+		fail( "/loop1", ret < 0 ? strerror( 0 - ret ) :
+				"read through a cycle of symlinks" );
+	}
+}
+
+/*
+ * mounts archive and compares it with srcroot; snapshot says if the tree
+ * has to come from a snapshot or from the headers of the archive
+ */
+static void
+mount_compare( const char *archive, const archive_fs_options *options,
+		int snapshot )
+{
+	archive_fs_t fs;
+
+	memset( &fs, 0, sizeof( archive_fs_t ) );
+	if( ar_init_with_options( &fs, archive, "/", options ) != 0 ) {
+		fail( archive, "could not be mounted" );
+		return;
+	}
+	if( snapshot && ! fs.snapshot ) {
+		fail( archive, "snapshot not loaded" );
+	} else if( ! snapshot && fs.snapshot ) {
+		fail( archive, "snapshot loaded" );
+	}
+	compare_tree( &fs, "/", srcroot );
+	if( links ) {
+		check_links( &fs );
+	}
+	ar_free( &fs );
+}
+
+static void
+write_file( const char *path, const char *data, size_t size )
+{
+	FILE *fh;
+
+	if( ( fh = fopen( path, "wb" ) ) == NULL
+			|| fwrite( data, 1, size, fh ) != size ) {
+		fail( path, strerror( errno ) );
+	}
+	if( fh && fclose( fh ) != 0 ) {
+		fail( path, strerror( errno ) );
+	}
+}
+
+/*
+ * the first read-only mount saves a snapshot of the tree, the next loads
+ * it; a snapshot that is cut short or damaged is not loaded, and is
+ * replaced by the next mount
+ */
+static void
+check_snapshot( const char *archive, const archive_fs_options *options )
+{
+	char snapfile[PATH_MAX];
+	char *good;
+	size_t size;
+	char c;
+
+	snprintf( snapfile, sizeof( snapfile ), "%s.snapshot", archive );
+	if( unlink( snapfile ) == -1 && errno != ENOENT ) {
+		fail( snapfile, strerror( errno ) );
+	}
+	mount_compare( archive, options, 0 );
+	mount_compare( archive, options, 1 );
+	if( ( good = read_file( snapfile, &size ) ) == NULL ) {
+		return;
+	}
+	write_file( snapfile, good, size / 2 );
+	mount_compare( archive, options, 0 );
+	write_file( snapfile, good, size - 1 );
+	mount_compare( archive, options, 0 );
+	/* the string table at the end is not terminated any more */
+	c = good[size - 1];
+	good[size - 1] = 'x';
+	write_file( snapfile, good, size );
+	mount_compare( archive, options, 0 );
+	good[size - 1] = c;
+	/* nor is this a snapshot file */
+	good[0] ^= 0xff;
+	write_file( snapfile, good, size );
+	mount_compare( archive, options, 0 );
+	mount_compare( archive, options, 1 );
+	free( good );
+}
+
+  /**********/
+ /* paging */
+/**********/
+
+#define PAGED "/paged"
+#define PAGED_FILES 3000 /* names f0 to f5999, every other one at first */
+#define PAGE 7 /* entries listed per ar_readdir() call */
+#define PAGED_NAMES ( 2 * PAGED_FILES )
+
+/* the path hash of archivemount.c: FNV-1a of the full path */
+static unsigned int
+path_hash( const char *path )
+{
+	unsigned int hash = 2166136261U;
+
+	while( *path ) {
+		hash ^= ( unsigned char )*path++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+struct named_hash {
+	unsigned int hash;
+	int n;
+};
+
+static int
+named_hash_cmp( const void *a, const void *b )
+{
+	unsigned int x = ( ( const struct named_hash * )a )->hash;
+	unsigned int y = ( ( const struct named_hash * )b )->hash;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * finds names PAGED/c<n> and PAGED/x<m> with the same path hash, which sort
+ * before and after all the f names; 0 if there are none
+ */
+static int
+find_collision( int *n, int *m )
+{
+	const int tries = 1 << 19;
+	struct named_hash *hashes;
+	struct named_hash key;
+	struct named_hash *found;
+	char path[64];
+	int i;
+
+	if( ( hashes = malloc( tries * sizeof( *hashes ) ) ) == NULL ) {
+		return 0;
+	}
+	for( i = 0; i < tries; i++ ) {
+		snprintf( path, sizeof( path ), PAGED "/c%d", i );
+		hashes[i].hash = path_hash( path );
+		hashes[i].n = i;
+	}
+	qsort( hashes, tries, sizeof( *hashes ), named_hash_cmp );
+	for( i = 0; i < tries; i++ ) {
+		snprintf( path, sizeof( path ), PAGED "/x%d", i );
+		key.hash = path_hash( path );
+		if( ( found = bsearch( &key, hashes, tries, sizeof( *hashes ),
+						named_hash_cmp ) ) != NULL ) {
+			*n = found->n;
+			*m = i;
+			free( hashes );
+			return 1;
+		}
+	}
+	free( hashes );
+	return 0;
+}
+
+static void
+paged_create( archive_fs_t *fs, const char *name )
+{
+	char path[PATH_MAX];
+
+	snprintf( path, sizeof( path ), PAGED "/%s", name );
+	check( path, ar_create( fs, path, 0644 ) );
+}
+
+static void
+paged_unlink( archive_fs_t *fs, const char *name )
+{
+	char path[PATH_MAX];
+
+	snprintf( path, sizeof( path ), PAGED "/%s", name );
+	check( path, ar_unlink( fs, path ) );
+}
+
+/*
+ * lists up to PAGE entries of PAGED after the cookie at *offset, counting
+ * the f names in seen and leaving the last one listed in last
+ * @return 1 if the listing went on after the page
+ */
+static int
+list_page( archive_fs_t *fs, off_t *offset, int *seen, char *last,
+		size_t lastsize )
+{
+	__block int listed = 0;
+	__block int more = 0;
+	__block off_t cookie = *offset;
+
+	check( PAGED, ar_readdir( fs, PAGED, NULL,
+			^ int ( const char *name, struct stat *st, off_t next ) {
+				int n;
+				if( listed == PAGE ) {
+					more = 1;
+					return 1;
+				}
+				listed++;
+				cookie = next;
+				if( name[0] == 'f' && ( n = atoi( name + 1 ) ) >= 0
+						&& n < PAGED_NAMES ) {
+					seen[n]++;
+				}
+				snprintf( last, lastsize, "%s", name );
+				return 0;
+			}, *offset ) );
+	*offset = cookie;
+	return more;
+}
+
+/*
+ * pages through PAGED while siblings are created and unlinked in front of
+ * and behind the cursor, or the entry last listed is unlinked; every f name there from start to end has to be listed exactly once, the
+ * others at most once
+ */
+static void
+page_changing( archive_fs_t *fs )
+{
+	static int present[PAGED_NAMES];
+	static int changed[PAGED_NAMES];
+	static int seen[PAGED_NAMES];
+	char name[32];
+	char last[NAME_MAX + 1] = "";
+	unsigned int random = 1;
+	off_t offset = 0;
+	int pages = 0;
+	int i, j;
+
+	for( i = 0; i < PAGED_NAMES; i += 2 ) {
+		snprintf( name, sizeof( name ), "f%d", i );
+		paged_create( fs, name );
+		present[i] = 1;
+	}
+	while( list_page( fs, &offset, seen, last, sizeof( last ) ) ) {
+		if( ++pages % 5 == 0 && last[0] == 'f' ) {
+			/* on its own, the entries behind it move up */
+			i = atoi( last + 1 );
+			paged_unlink( fs, last );
+			present[i] = 0;
+			changed[i] = 1;
+			continue;
+		}
+		for( j = 0; j < 2; j++ ) {
+			random = random * 1103515245U + 12345U;
+			i = ( random >> 8 ) % PAGED_NAMES;
+			snprintf( name, sizeof( name ), "f%d", i );
+			if( strcmp( name, last ) == 0 ) {
+				/* the cookie has to find it */
+				continue;
+			}
+			if( present[i] ) {
+				paged_unlink( fs, name );
+			} else {
+				paged_create( fs, name );
+			}
+			present[i] = ! present[i];
+			changed[i] = 1;
+		}
+	}
+	for( i = 0; i < PAGED_NAMES; i++ ) {
+		snprintf( name, sizeof( name ), PAGED "/f%d", i );
+		if( seen[i] > 1 ) {
+			fail( name, "listed twice" );
+		} else if( present[i] && ! changed[i] && seen[i] != 1 ) {
+			fail( name, "not listed" );
+		}
+	}
+}
+
+/*
+ * lists PAGED up to the entry named stop, runs change and lists the rest;
+ * the f names, and the names stop and other, have to come exactly once
+ */
+static void
+page_resumed( archive_fs_t *fs, const char *stop, const char *other,
+		void ( *change )( archive_fs_t *fs ) )
+{
+	__block int *seen;
+	__block int stops = 0;
+	__block int others = 0;
+	__block off_t offset = 0;
+	char name[32];
+	int i;
+
+	if( ( seen = calloc( PAGED_NAMES, sizeof( int ) ) ) == NULL ) {
+		fail( PAGED, strerror( ENOMEM ) );
+		return;
+	}
+	/* stop is rejected, its cookie continues after it */
+	check( PAGED, ar_readdir( fs, PAGED, NULL,
+			^ int ( const char *name, struct stat *st, off_t next ) {
+				if( strcmp( name, stop ) == 0 ) {
+					stops++;
+				} else if( name[0] == 'f' ) {
+					seen[atoi( name + 1 )]++;
+				}
+				offset = next;
+				return stops;
+			}, 0 ) );
+	change( fs );
+	check( PAGED, ar_readdir( fs, PAGED, NULL,
+			^ int ( const char *name, struct stat *st, off_t next ) {
+				if( strcmp( name, stop ) == 0 ) {
+					stops++;
+				} else if( strcmp( name, other ) == 0 ) {
+					others++;
+				} else if( name[0] == 'f' ) {
+					seen[atoi( name + 1 )]++;
+				}
+				return 0;
+			}, offset ) );
+	if( stops != 1 || others != 1 ) {
+		fail( stop, "resumed at the wrong entry" );
+	}
+	for( i = 0; i < PAGED_NAMES; i++ ) {
+		snprintf( name, sizeof( name ), PAGED "/f%d", i );
+		if( seen[i] > 1 ) {
+			fail( name, "listed twice" );
+		}
+	}
+	free( seen );
+}
+
+/* the entry last listed is gone, and one behind it */
+static void
+unlink_listed( archive_fs_t *fs )
+{
+	paged_unlink( fs, "g" );
+	paged_unlink( fs, "h" );
+}
+
+/* the entry last listed moves back */
+static void
+create_in_front( archive_fs_t *fs )
+{
+	paged_create( fs, "b0" );
+	paged_create( fs, "b1" );
+}
+
+static void
+check_paging( const char *archive, const archive_fs_options *defaults )
+{
+	archive_fs_options options = *defaults;
+	archive_fs_t fs;
+	char first[32];
+	char second[32];
+	int n, m;
+
+	options.readonly = 0;
+	memset( &fs, 0, sizeof( archive_fs_t ) );
+	if( ar_init_with_options( &fs, archive, "/", &options ) != 0 ) {
+		fail( archive, "could not be mounted" );
+		return;
+	}
+	check( PAGED, ar_mkdir( &fs, PAGED, 0755 ) );
+	page_changing( &fs );
+
+	paged_create( &fs, "g" );
+	paged_create( &fs, "h" );
+	paged_create( &fs, "i" );
+	page_resumed( &fs, "g", "i", unlink_listed );
+
+	/* two entries with the same path hash, the cookie of the first
+	   when entries were added in front of it */
+	if( ! find_collision( &n, &m ) ) {
+		fail( PAGED, "no names with the same path hash" );
+	} else {
+		snprintf( first, sizeof( first ), "c%d", n );
+		snprintf( second, sizeof( second ), "x%d", m );
+		paged_create( &fs, first );
+		paged_create( &fs, second );
+		page_resumed( &fs, first, second, create_in_front );
+	}
+	ar_free( &fs );
+}
+
+/*
+ * saves the changes of fs, with -b on the saver thread while the tree is
+ * compared again and again, as readers of the mount go on meanwhile
+ */
+static int
+save_changes( archive_fs_t *fs )
+{
+	ar_save_status status;
+	int ret;
+
+	if( ! background ) {
+		return ar_save( fs );
+	}
+	if( ( ret = ar_save_start( fs ) ) != 0 ) {
+		return ret;
+	}
+	do {
+		compare_tree( fs, "/", srcroot );
+		ar_save_progress( fs, &status );
+	} while( status.running );
+	return ar_save_wait( fs );
+}
+
+/*
+ * changes a writable mount of archive and srcroot alike, saves, and
+ * compares the archive mounted again with srcroot
+ */
+static void
+round_trip( const char *archive, const archive_fs_options *defaults )
+{
+	archive_fs_options options = *defaults;
+	archive_fs_t fs;
+	archive_fs_t other;
+	ar_save_status status;
+	char srcpath[PATH_MAX];
+	char *original;
+	size_t size;
+	int ret;
+
+	src_path( srcpath, sizeof( srcpath ), TRUNCATED );
+	if( ( original = read_file( srcpath, &size ) ) == NULL ) {
+		return;
+	}
+	options.readonly = 0;
+	memset( &fs, 0, sizeof( archive_fs_t ) );
+	memset( &other, 0, sizeof( archive_fs_t ) );
+	if( ar_init_with_options( &fs, archive, "/", &options ) != 0
+			|| ar_init_with_options( &other, archive, "/",
+				&options ) != 0 ) {
+		fail( archive, "could not be mounted writable" );
+		free( original );
+		return;
+	}
+	make_changes( &fs );
+	/* the changes as read through the mount before they are saved, in
+	   chunks that do not line up with the written ranges as well */
+	compare_tree( &fs, "/", srcroot );
+	readsize = 4093;
+	compare_tree( &fs, "/", srcroot );
+	readsize = CHUNK;
+	/* what the block cache shares has to be the data in the archive,
+	   not what is left of it in the first mount */
+	compare_buffer( &other, TRUNCATED, original, size );
+	ar_free( &other );
+	free( original );
+	/* a file still open, its last writes only in the write buffer, is
+	   saved as it reads */
+	change_create( &fs, "/open" );
+	if( check( "/open", ar_open( &fs, "/open", O_WRONLY ) ) == 0 ) {
+		small_writes( &fs, "/open", 0, 20 );
+	}
+	if( ( ret = save_changes( &fs ) ) != 0 ) {
+		fail( archive, ret < 0 ? strerror( 0 - ret ) : "save failed" );
+	}
+	ar_release( &fs, "/open" );
+	/* a file written since, released while a save runs on its own
+	   thread: the release waits for the save, which has the data */
+	change_create( &fs, "/released" );
+	if( check( "/released", ar_open( &fs, "/released",
+					O_WRONLY ) ) == 0 ) {
+		small_writes( &fs, "/released", 0, 20 );
+		if( check( archive, ar_save_start( &fs ) ) == 0 ) {
+			/* once it writes members the save holds the tree */
+			do {
+				usleep( 100 );
+				ar_save_progress( &fs, &status );
+			} while( status.running && ! status.members );
+			ar_release( &fs, "/released" );
+			ar_save_progress( &fs, &status );
+			if( status.running ) {
+				fail( "/released", "released during the save" );
+			}
+			if( ( ret = ar_save_wait( &fs ) ) != 0 ) {
+				fail( archive, strerror( 0 - ret ) );
+			}
+		} else {
+			ar_release( &fs, "/released" );
+		}
+	}
+	ar_free( &fs );
+	memset( &fs, 0, sizeof( archive_fs_t ) );
+	if( ar_init_with_options( &fs, archive, "/", defaults ) != 0 ) {
+		fail( archive, "could not be mounted after saving" );
+		return;
+	}
+	compare_tree( &fs, "/", srcroot );
+	if( links ) {
+		check_links( &fs );
+	}
+	ar_free( &fs );
+}
+
+/*
+ * adds new members only, to a mount without backup, so the save appends
+ * them to the tar archive in place; compares it mounted again
+ */
+static void
+append( const char *archive, const archive_fs_options *defaults )
+{
+	static char buf[30000];
+	archive_fs_options options = *defaults;
+	archive_fs_t fs;
+	struct stat before;
+	struct stat after;
+	int ret;
+
+	options.readonly = 0;
+	options.nobackup = 1;
+	memset( &fs, 0, sizeof( archive_fs_t ) );
+	if( stat( archive, &before ) == -1
+			|| ar_init_with_options( &fs, archive, "/",
+				&options ) != 0 ) {
+		fail( archive, "could not be mounted writable" );
+		return;
+	}
+	pattern( buf, sizeof( buf ), 4 );
+	change_mkdir( &fs, "/appended" );
+	change_create( &fs, "/appended/a" );
+	change_write( &fs, "/appended/a", buf, sizeof( buf ), 0 );
+	change_create( &fs, "/appended/empty" );
+	change_create( &fs, "/b" );
+	change_write( &fs, "/b", buf + 1, 777, 0 );
+	if( ( ret = save_changes( &fs ) ) != 0 ) {
+		fail( archive, ret < 0 ? strerror( 0 - ret ) : "save failed" );
+	}
+	ar_free( &fs );
+	if( stat( archive, &after ) == -1 ) {
+		fail( archive, strerror( errno ) );
+	} else if( after.st_ino != before.st_ino
+			|| after.st_size <= before.st_size ) {
+		fail( archive, "members not appended in place" );
+	}
+	memset( &fs, 0, sizeof( archive_fs_t ) );
+	if( ar_init_with_options( &fs, archive, "/", defaults ) != 0 ) {
+		fail( archive, "could not be mounted after appending" );
+		return;
+	}
+	compare_tree( &fs, "/", srcroot );
+	ar_free( &fs );
+}
+
+int
+main( int argc, char **argv )
+{
+	archive_fs_options options;
+	int writable = 0;
+	int appending = 0;
+	int snapshots = 0;
+	int paging = 0;
+	int opt;
+
+	ar_default_options( &options );
+	while( ( opt = getopt( argc, argv, "wt:c:bnlSp" ) ) != -1 ) {
+		switch( opt ) {
+		case 'w':
+			writable = 1;
+			break;
+		case 't':
+			options.savethreads = atoi( optarg );
+			break;
+		case 'c':
+			ar_block_cache( strtoul( optarg, NULL, 0 ), NULL, 0 );
+			break;
+		case 'b':
+			background = 1;
+			break;
+		case 'n':
+			appending = 1;
+			break;
+		case 'l':
+			links = 1;
+			break;
+		case 'S':
+			snapshots = 1;
+			break;
+		case 'p':
+			paging = 1;
+			break;
+		default:
+			argc = 0;
+		}
+	}
+	if( argc - optind != 2 ) {
+		fprintf( stderr, "usage: %s [-w] [-b] [-n] [-l] [-S] [-p] "
+				"[-t savethreads] "
+				"[-c blockcache] archive srcdir\n"
+				"  -w  change, save and compare again; "
+				"srcdir is changed too\n"
+				"  -b  save in the background while reading\n"
+				"  -n  append new members to a tar, no backup\n"
+				"  -l  check the symlinks of the test tree\n"
+				"  -S  write a snapshot of the tree, load it and "
+				"damage it\n"
+				"  -p  page through a changing directory, "
+				"not saved\n",
+				argv[0] );
+		return 2;
+	}
+	srcroot = argv[optind + 1];
+	/* the tree as read from the archive, not from an older snapshot */
+	options.snapshot = 0;
+	if( paging ) {
+		check_paging( argv[optind], &options );
+	} else if( snapshots ) {
+		options.snapshot = 1;
+		check_snapshot( argv[optind], &options );
+	} else if( writable || appending ) {
+		if( writable ) {
+			round_trip( argv[optind], &options );
+		}
+		if( appending ) {
+			append( argv[optind], &options );
+		}
+	} else {
+		mount_compare( argv[optind], &options, 0 );
+	}
+	printf( "%s: %s\n", argv[optind], failures ? "FAILED" : "ok" );
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,440 @@
+/*
+ *  blockcache.c
+ *  ArchiveFS
+ *
+ *  Process-wide cache of decoded member data, see blockcache.h.
+ *
+ */
+
+#include "blockcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define BC_HASH_INITIAL 1024
+
+struct bcblock {
+	dev_t dev; /* the archive file */
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	char *member;
+	off_t block; /* number of the block in the member */
+	unsigned int hash; /* hash of all of the above */
+	size_t len; /* bytes of data */
+	char *data; /* the data, NULL when it is in the spill file */
+	off_t slot; /* where the data is in the spill file, or -1 */
+	struct bcblock *hashnext; /* next block in the same bucket */
+	struct bcblock *prev; /* more recently used block */
+	struct bcblock *next; /* less recently used block */
+};
+
+/* blocks by last use, most recent first */
+struct bclist {
+	struct bcblock *head;
+	struct bcblock *tail;
+};
+
+/* everything below is protected by cachelock */
+static pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+static struct bcblock **buckets; /* hash index of all blocks */
+static size_t nbuckets;
+static size_t nblocks;
+static struct bclist memlru; /* blocks in memory */
+static struct bclist spilllru; /* blocks in the spill file */
+static size_t memlimit; /* 0 while the cache is off */
+static size_t memused; /* bytes of data in memory */
+static char *spilldirname; /* directory of the spill file, or NULL */
+static int spillfd = -1; /* unlinked spill file, or -1 */
+static off_t spillslots; /* blocks the spill file may hold */
+static off_t spillused; /* slots handed out so far */
+static off_t *freeslots; /* slots given up by dropped blocks */
+static off_t nfree;
+static off_t freesize; /* number of slots allocated in freeslots */
+
+  /**********************/
+ /* internal functions */
+/**********************/
+
+static unsigned int
+key_hash( const struct stat *archive, const char *member, off_t block )
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261U;
+	const unsigned char *p;
+	unsigned long long words[4];
+	size_t i;
+
+	words[0] = archive->st_ino;
+	words[1] = archive->st_size;
+	words[2] = archive->st_mtime ^ ( ( unsigned long long )archive->st_dev
+			<< 32 );
+	words[3] = block;
+	p = ( const unsigned char * )words;
+	for( i = 0; i < sizeof( words ); i++ ) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	for( p = ( const unsigned char * )member; *p; p++ ) {
+		hash ^= *p;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static struct bcblock *
+find_block( const struct stat *archive, const char *member, off_t block )
+{
+	unsigned int hash;
+	struct bcblock *b;
+
+	if( ! nbuckets ) {
+		return NULL;
+	}
+	hash = key_hash( archive, member, block );
+	for( b = buckets[hash % nbuckets]; b; b = b->hashnext ) {
+		if( b->hash == hash && b->block == block
+				&& b->ino == archive->st_ino
+				&& b->dev == archive->st_dev
+				&& b->size == archive->st_size
+				&& b->mtime == archive->st_mtime
+				&& strcmp( b->member, member ) == 0 ) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static int
+hash_add( struct bcblock *b )
+{
+	size_t bucket;
+
+	if( nblocks >= nbuckets ) {
+		size_t size = nbuckets ? nbuckets * 2 : BC_HASH_INITIAL;
+		struct bcblock **newbuckets = calloc( size,
+				sizeof( struct bcblock * ) );
+		size_t i;
+		if( newbuckets == NULL ) {
+			if( ! nbuckets ) {
+				return -ENOMEM;
+			}
+		} else {
+			for( i = 0; i < nbuckets; i++ ) {
+				while( buckets[i] ) {
+					struct bcblock *next = buckets[i]->hashnext;
+					bucket = buckets[i]->hash % size;
+					buckets[i]->hashnext = newbuckets[bucket];
+					newbuckets[bucket] = buckets[i];
+					buckets[i] = next;
+				}
+			}
+			free( buckets );
+			buckets = newbuckets;
+			nbuckets = size;
+		}
+	}
+	bucket = b->hash % nbuckets;
+	b->hashnext = buckets[bucket];
+	buckets[bucket] = b;
+	nblocks++;
+	return 0;
+}
+
+static void
+hash_remove( struct bcblock *b )
+{
+	struct bcblock **link = &buckets[b->hash % nbuckets];
+
+	while( *link ) {
+		if( *link == b ) {
+			*link = b->hashnext;
+			nblocks--;
+			return;
+		}
+		link = &( *link )->hashnext;
+	}
+}
+
+static void
+list_remove( struct bclist *list, struct bcblock *b )
+{
+	if( b->prev ) {
+		b->prev->next = b->next;
+	} else {
+		list->head = b->next;
+	}
+	if( b->next ) {
+		b->next->prev = b->prev;
+	} else {
+		list->tail = b->prev;
+	}
+	b->prev = b->next = NULL;
+}
+
+static void
+list_push( struct bclist *list, struct bcblock *b )
+{
+	b->prev = NULL;
+	b->next = list->head;
+	if( list->head ) {
+		list->head->prev = b;
+	} else {
+		list->tail = b;
+	}
+	list->head = b;
+}
+
+/* forgets block b, wherever its data is */
+static void
+drop_block( struct bcblock *b )
+{
+	hash_remove( b );
+	if( b->data ) {
+		list_remove( &memlru, b );
+		memused -= b->len;
+		free( b->data );
+	} else {
+		list_remove( &spilllru, b );
+		if( nfree < freesize ) {
+			freeslots[nfree++] = b->slot;
+		}
+	}
+	free( b->member );
+	free( b );
+}
+
+/*
+ * a free place in the spill file, made by dropping the least recently
+ * spilled block if needed
+ * @return the slot, -1 if there is none
+ */
+static off_t
+spill_slot( void )
+{
+	if( ! nfree ) {
+		if( spillused < spillslots ) {
+			if( spillused == freesize ) {
+				/* room to give the slot back later */
+				off_t size = freesize ? freesize * 2 : 256;
+				off_t *slots;
+				if( size > spillslots ) {
+					size = spillslots;
+				}
+				if( ( slots = realloc( freeslots,
+						size * sizeof( off_t ) ) ) == NULL ) {
+					return -1;
+				}
+				freeslots = slots;
+				freesize = size;
+			}
+			return spillused++;
+		}
+		if( ! spilllru.tail ) {
+			return -1;
+		}
+		drop_block( spilllru.tail );
+	}
+	return freeslots[--nfree];
+}
+
+/* moves the data of b from memory to the spill file, or drops b */
+static void
+spill_block( struct bcblock *b )
+{
+	off_t slot;
+
+	if( spillfd == -1 || ( slot = spill_slot() ) == -1
+			|| pwrite( spillfd, b->data, b->len,
+				slot * ( off_t )BLOCKCACHE_BLOCK )
+				!= ( ssize_t )b->len ) {
+		drop_block( b );
+		return;
+	}
+	list_remove( &memlru, b );
+	memused -= b->len;
+	free( b->data );
+	b->data = NULL;
+	b->slot = slot;
+	list_push( &spilllru, b );
+}
+
+/* evicts the least recently used blocks until memory use is in limits */
+static void
+shrink( void )
+{
+	while( memused > memlimit && memlru.tail ) {
+		spill_block( memlru.tail );
+	}
+}
+
+/* drops the spill file and the blocks in it */
+static void
+close_spill( void )
+{
+	while( spilllru.head ) {
+		drop_block( spilllru.head );
+	}
+	if( spillfd != -1 ) {
+		close( spillfd );
+		spillfd = -1;
+	}
+	free( spilldirname );
+	spilldirname = NULL;
+	free( freeslots );
+	freeslots = NULL;
+	freesize = nfree = spillused = spillslots = 0;
+}
+
+static int
+open_spill( const char *dir, off_t size )
+{
+	char *path;
+	int ret;
+
+	if( ( spilldirname = strdup( dir ) ) == NULL
+			|| ( path = malloc( strlen( dir ) +
+					sizeof( "/archivefs-blocks-XXXXXX" ) ) )
+				== NULL ) {
+		close_spill();
+		return -ENOMEM;
+	}
+	sprintf( path, "%s/archivefs-blocks-XXXXXX", dir );
+	if( ( spillfd = mkstemp( path ) ) == -1 ) {
+		ret = 0 - errno;
+		free( path );
+		close_spill();
+		return ret;
+	}
+	/* only needed while open */
+	unlink( path );
+	free( path );
+	spillslots = size / BLOCKCACHE_BLOCK;
+	return 0;
+}
+
+  /*****************/
+ /* API functions */
+/*****************/
+
+int
+blockcache_configure( size_t memory, const char *spilldir, off_t spillsize )
+{
+	int ret = 0;
+
+	pthread_mutex_lock( &cachelock );
+	if( ! memory || ! spilldir || spillsize < BLOCKCACHE_BLOCK
+			|| ! spilldirname || strcmp( spilldir, spilldirname ) != 0
+			|| spillsize / BLOCKCACHE_BLOCK != spillslots ) {
+		close_spill();
+	}
+	memlimit = memory;
+	if( memory && spilldir && spillsize >= BLOCKCACHE_BLOCK
+			&& spillfd == -1 ) {
+		ret = open_spill( spilldir, spillsize );
+	}
+	shrink();
+	if( ! memory ) {
+		free( buckets );
+		buckets = NULL;
+		nbuckets = 0;
+	}
+	pthread_mutex_unlock( &cachelock );
+	return ret;
+}
+
+int
+blockcache_enabled( void )
+{
+	int enabled;
+
+	pthread_mutex_lock( &cachelock );
+	enabled = memlimit != 0;
+	pthread_mutex_unlock( &cachelock );
+	return enabled;
+}
+
+ssize_t
+blockcache_read( const struct stat *archive, const char *member,
+		off_t block, size_t offset, void *buf, size_t len )
+{
+	struct bcblock *b;
+	ssize_t ret = -1;
+
+	pthread_mutex_lock( &cachelock );
+	if( ( b = find_block( archive, member, block ) ) != NULL ) {
+		if( offset >= b->len ) {
+			len = 0;
+		} else if( len > b->len - offset ) {
+			len = b->len - offset;
+		}
+		if( b->data ) {
+			memcpy( buf, b->data + offset, len );
+			list_remove( &memlru, b );
+			list_push( &memlru, b );
+			ret = len;
+		} else if( pread( spillfd, buf, len, b->slot *
+					( off_t )BLOCKCACHE_BLOCK + offset )
+				== ( ssize_t )len ) {
+			list_remove( &spilllru, b );
+			list_push( &spilllru, b );
+			ret = len;
+		} else {
+			drop_block( b );
+		}
+	}
+	pthread_mutex_unlock( &cachelock );
+	return ret;
+}
+
+void
+blockcache_put( const struct stat *archive, const char *member,
+		off_t block, const void *data, size_t len )
+{
+	struct bcblock *b;
+
+	pthread_mutex_lock( &cachelock );
+	if( ! memlimit || len > BLOCKCACHE_BLOCK
+			|| find_block( archive, member, block ) ) {
+		/* another reader may have decoded it as well */
+		pthread_mutex_unlock( &cachelock );
+		return;
+	}
+	if( ( b = malloc( sizeof( struct bcblock ) ) ) == NULL ) {
+		pthread_mutex_unlock( &cachelock );
+		return;
+	}
+	b->member = strdup( member );
+	b->data = malloc( len ? len : 1 );
+	if( ! b->member || ! b->data ) {
+		free( b->member );
+		free( b->data );
+		free( b );
+		pthread_mutex_unlock( &cachelock );
+		return;
+	}
+	memcpy( b->data, data, len );
+	b->dev = archive->st_dev;
+	b->ino = archive->st_ino;
+	b->size = archive->st_size;
+	b->mtime = archive->st_mtime;
+	b->block = block;
+	b->hash = key_hash( archive, member, block );
+	b->len = len;
+	b->slot = -1;
+	if( hash_add( b ) != 0 ) {
+		free( b->member );
+		free( b->data );
+		free( b );
+		pthread_mutex_unlock( &cachelock );
+		return;
+	}
+	list_push( &memlru, b );
+	memused += len;
+	shrink();
+	pthread_mutex_unlock( &cachelock );
+}
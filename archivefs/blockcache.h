@@ -0,0 +1,37 @@
+/*
+ *  blockcache.h
+ *  ArchiveFS
+ *
+ *  Decoded member data shared by all mounts of the process. The data is
+ *  kept in blocks of BLOCKCACHE_BLOCK bytes, keyed by the identity of the
+ *  archive file (device, inode, size and modification time), the member
+ *  name and the block number, so a mount finds what another mount of the
+ *  same archive has decoded. The least recently used blocks are dropped
+ *  when the memory limit is reached, or moved to a file in a spill
+ *  directory if one is set.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define BLOCKCACHE_BLOCK ( 64 * 1024 )
+
+/*************/
+/* functions */
+/*************/
+
+/* memory 0 turns the cache off and drops its blocks; spilldir NULL or
+   spillsize 0 keeps it in memory only */
+int blockcache_configure( size_t memory, const char *spilldir,
+		off_t spillsize );
+int blockcache_enabled( void );
+
+/* copies up to len bytes from offset into block number "block" of member
+   @return the bytes copied, fewer at the end of the member, or -1 if the
+   block is not cached */
+ssize_t blockcache_read( const struct stat *archive, const char *member,
+		off_t block, size_t offset, void *buf, size_t len );
+/* adds a block, len is less than BLOCKCACHE_BLOCK only for the last one */
+void blockcache_put( const struct stat *archive, const char *member,
+		off_t block, const void *data, size_t len );
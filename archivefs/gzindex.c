@@ -0,0 +1,536 @@
+/*
+ *  gzindex.c
+ *  ArchiveFS
+ *
+ *  Checkpoint index for random access into gzip files, see gzindex.h.
+ *
+ */
+
+#include "gzindex.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define GZ_CHUNK 16384 /* size of the compressed input buffer */
+#define GZ_MAGIC "AVGZIX01" /* sidecar file format identifier */
+/* sizes in the sidecar file: magic, the header and the number of
+   checkpoints, then offsets, bits and window of each checkpoint */
+#define GZ_FILEHEAD ( 8 + 3 * sizeof( int64_t ) + sizeof( int32_t ) )
+#define GZ_FILEPOINT ( 2 * sizeof( int64_t ) + sizeof( int32_t ) + GZ_WINSIZE )
+
+struct gzreader {
+	int fd; /* the gzip file, read with pread() */
+	gzindex_t *index;
+	z_stream strm;
+	int initialized; /* true when strm needs inflateEnd() */
+	int raw; /* true when inflating raw deflate data of a checkpoint */
+	int extending; /* true when new checkpoints may be appended to index */
+	int eof; /* true when the end of the file has been reached */
+	off_t inpos; /* file offset of the next byte to read into inbuf */
+	off_t out; /* amount of uncompressed data produced */
+	off_t pos; /* uncompressed offset of the next byte returned */
+	unsigned char inbuf[GZ_CHUNK];
+	unsigned char window[GZ_WINSIZE]; /* circular, ends at out */
+};
+
+  /**********************/
+ /* internal functions */
+/**********************/
+
+static int
+add_point( gzreader_t *reader )
+{
+	gzindex_t *index = reader->index;
+	gzpoint_t *point;
+	size_t wpos = reader->out % GZ_WINSIZE;
+
+	if( index->have == index->size ) {
+		int size = index->size ? index->size * 2 : 16;
+		gzpoint_t *list = realloc( index->list, size * sizeof( gzpoint_t ) );
+		if( list == NULL ) {
+			return -ENOMEM;
+		}
+		index->list = list;
+		index->size = size;
+	}
+	point = index->list + index->have;
+	point->out = reader->out;
+	point->in = reader->inpos - reader->strm.avail_in;
+	point->bits = reader->strm.data_type & 7;
+	/* unwrap the circular window so it ends at "out" */
+	memcpy( point->window, reader->window + wpos, GZ_WINSIZE - wpos );
+	memcpy( point->window + GZ_WINSIZE - wpos, reader->window, wpos );
+	index->have++;
+	return 0;
+}
+
+/*
+ * restarts decompression at point, or at the beginning of the file if point
+ * is NULL
+ */
+static int
+restart( gzreader_t *reader, const gzpoint_t *point )
+{
+	gzindex_t *index = reader->index;
+	int ret;
+
+	if( reader->initialized ) {
+		inflateEnd( &reader->strm );
+		reader->initialized = 0;
+	}
+	memset( &reader->strm, 0, sizeof( z_stream ) );
+	reader->eof = 0;
+	if( point == NULL ) {
+		reader->raw = 0;
+		reader->inpos = 0;
+		reader->out = reader->pos = 0;
+		reader->extending = ! index->complete && index->have == 0;
+		if( inflateInit2( &reader->strm, 15 + 16 ) != Z_OK ) {
+			return -ENOMEM;
+		}
+		reader->initialized = 1;
+		return 0;
+	}
+	reader->raw = 1;
+	reader->inpos = point->in - ( point->bits ? 1 : 0 );
+	reader->out = reader->pos = point->out;
+	reader->extending = ! index->complete &&
+		point == index->list + index->have - 1;
+	if( inflateInit2( &reader->strm, -15 ) != Z_OK ) {
+		return -ENOMEM;
+	}
+	reader->initialized = 1;
+	if( point->bits ) {
+		unsigned char c;
+		if( ( ret = pread( reader->fd, &c, 1, reader->inpos ) ) != 1 ) {
+			return ret == -1 ? 0 - errno : -EIO;
+		}
+		reader->inpos++;
+		inflatePrime( &reader->strm, point->bits, c >> ( 8 - point->bits ) );
+	}
+	inflateSetDictionary( &reader->strm, point->window, GZ_WINSIZE );
+	/* rebuild the circular window, later checkpoints copy it */
+	{
+		size_t wpos = reader->out % GZ_WINSIZE;
+		memcpy( reader->window + wpos, point->window, GZ_WINSIZE - wpos );
+		memcpy( reader->window, point->window + GZ_WINSIZE - wpos, wpos );
+	}
+	return 0;
+}
+
+static int
+fill_input( gzreader_t *reader )
+{
+	ssize_t len = pread( reader->fd, reader->inbuf, GZ_CHUNK, reader->inpos );
+
+	if( len == -1 ) {
+		return 0 - errno;
+	}
+	reader->inpos += len;
+	reader->strm.next_in = reader->inbuf;
+	reader->strm.avail_in = len;
+	return len;
+}
+
+/*
+ * handles the end of a gzip member: skips the trailer of raw data and
+ * starts over for a following member, if any
+ */
+static int
+next_member( gzreader_t *reader )
+{
+	int ret;
+
+	if( reader->raw ) {
+		/* skip crc and length */
+		int trailer = 8;
+		while( trailer ) {
+			int len;
+			if( reader->strm.avail_in == 0 ) {
+				if( ( ret = fill_input( reader ) ) <= 0 ) {
+					return ret;
+				}
+			}
+			len = reader->strm.avail_in < ( unsigned )trailer ?
+				( int )reader->strm.avail_in : trailer;
+			reader->strm.next_in += len;
+			reader->strm.avail_in -= len;
+			trailer -= len;
+		}
+	}
+	if( reader->strm.avail_in == 0 ) {
+		if( ( ret = fill_input( reader ) ) <= 0 ) {
+			return ret;
+		}
+	}
+	/* another member follows */
+	{
+		Bytef *next_in = reader->strm.next_in;
+		uInt avail_in = reader->strm.avail_in;
+		inflateEnd( &reader->strm );
+		memset( &reader->strm, 0, sizeof( z_stream ) );
+		reader->initialized = 0;
+		if( inflateInit2( &reader->strm, 15 + 16 ) != Z_OK ) {
+			return -ENOMEM;
+		}
+		reader->initialized = 1;
+		reader->raw = 0;
+		reader->strm.next_in = next_in;
+		reader->strm.avail_in = avail_in;
+	}
+	return 1;
+}
+
+/*
+ * inflates more data into the window, recording checkpoints on the way
+ * @return number of bytes produced, 0 at the end of the file, 0-errno else
+ */
+static ssize_t
+inflate_more( gzreader_t *reader )
+{
+	gzindex_t *index = reader->index;
+
+	while( ! reader->eof ) {
+		size_t wpos = reader->out % GZ_WINSIZE;
+		size_t produced;
+		int ret;
+
+		if( reader->strm.avail_in == 0 ) {
+			if( ( ret = fill_input( reader ) ) < 0 ) {
+				return ret;
+			}
+			if( ret == 0 ) {
+				/* truncated file */
+				reader->eof = 1;
+				break;
+			}
+		}
+		reader->strm.next_out = reader->window + wpos;
+		reader->strm.avail_out = GZ_WINSIZE - wpos;
+		ret = inflate( &reader->strm, Z_BLOCK );
+		produced = GZ_WINSIZE - wpos - reader->strm.avail_out;
+		reader->out += produced;
+		if( ret == Z_NEED_DICT || ret == Z_DATA_ERROR ) {
+			return -EIO;
+		}
+		if( ret == Z_MEM_ERROR ) {
+			return -ENOMEM;
+		}
+		/* checkpoints go at block boundaries, but not after the last
+		   block of a member */
+		if( reader->extending
+				&& ( reader->strm.data_type & 128 )
+				&& ! ( reader->strm.data_type & 64 )
+				&& ( index->have == 0 ? reader->out == 0 :
+					reader->out - index->list[index->have - 1].out
+					>= index->span ) )
+		{
+			if( add_point( reader ) != 0 ) {
+				return -ENOMEM;
+			}
+		}
+		if( ret == Z_STREAM_END ) {
+			if( ( ret = next_member( reader ) ) < 0 ) {
+				return ret;
+			}
+			if( ret == 0 ) {
+				reader->eof = 1;
+				if( reader->extending ) {
+					index->complete = 1;
+				}
+			}
+		}
+		if( produced ) {
+			return produced;
+		}
+	}
+	return 0;
+}
+
+/*
+ * @return the last checkpoint at or before offset, NULL if there is none
+ */
+static const gzpoint_t *
+find_point( const gzindex_t *index, off_t offset )
+{
+	int lo = 0;
+	int hi = index->have;
+
+	while( lo < hi ) {
+		int mid = ( lo + hi ) / 2;
+		if( index->list[mid].out <= offset ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo ? index->list + lo - 1 : NULL;
+}
+
+  /*****************/
+ /* API functions */
+/*****************/
+
+gzindex_t *
+gzindex_new( off_t span )
+{
+	gzindex_t *index;
+
+	if( ( index = malloc( sizeof( gzindex_t ) ) ) == NULL ) {
+		return NULL;
+	}
+	index->span = span;
+	index->have = 0;
+	index->size = 0;
+	index->complete = 0;
+	index->list = NULL;
+	return index;
+}
+
+void
+gzindex_free( gzindex_t *index )
+{
+	if( index ) {
+		free( index->list );
+		free( index );
+	}
+}
+
+/*
+ * loads an index saved by gzindex_save() for a file of the given size and
+ * modification time
+ * @return the index, NULL if there is no matching index at path
+ */
+gzindex_t *
+gzindex_load( const char *path, off_t size, time_t mtime )
+{
+	FILE *fh;
+	struct stat st;
+	char magic[8];
+	int64_t header[3];
+	int32_t have;
+	gzindex_t *index = NULL;
+	int i;
+
+	if( ( fh = fopen( path, "rb" ) ) == NULL ) {
+		return NULL;
+	}
+	/* the number of checkpoints has to match the file size before it is
+	   trusted with an allocation */
+	if( fstat( fileno( fh ), &st ) != 0
+			|| fread( magic, sizeof( magic ), 1, fh ) != 1
+			|| memcmp( magic, GZ_MAGIC, sizeof( magic ) ) != 0
+			|| fread( header, sizeof( header ), 1, fh ) != 1
+			|| fread( &have, sizeof( have ), 1, fh ) != 1
+			|| header[0] != size || header[1] != mtime
+			|| header[2] <= 0 || have < 0
+			|| st.st_size != ( off_t )GZ_FILEHEAD
+				+ ( off_t )have * ( off_t )GZ_FILEPOINT )
+	{
+		fclose( fh );
+		return NULL;
+	}
+	if( ( index = gzindex_new( header[2] ) ) == NULL
+			|| ( have && ( index->list =
+				malloc( have * sizeof( gzpoint_t ) ) ) == NULL ) )
+	{
+		gzindex_free( index );
+		fclose( fh );
+		return NULL;
+	}
+	index->size = have;
+	for( i = 0; i < have; i++ ) {
+		gzpoint_t *point = index->list + i;
+		int64_t offsets[2];
+		int32_t bits;
+		if( fread( offsets, sizeof( offsets ), 1, fh ) != 1
+				|| fread( &bits, sizeof( bits ), 1, fh ) != 1
+				|| fread( point->window, GZ_WINSIZE, 1, fh ) != 1 )
+		{
+			gzindex_free( index );
+			fclose( fh );
+			return NULL;
+		}
+		point->out = offsets[0];
+		point->in = offsets[1];
+		point->bits = bits;
+	}
+	index->have = have;
+	index->complete = 1;
+	fclose( fh );
+	return index;
+}
+
+/*
+ * saves a complete index to path, tagged with the size and modification
+ * time of the indexed file; the file is written in host byte order
+ * @return 0 on success, 0-errno else
+ */
+int
+gzindex_save( const gzindex_t *index, const char *path, off_t size,
+		time_t mtime )
+{
+	FILE *fh;
+	char *tmppath;
+	int64_t header[3];
+	int32_t have = index->have;
+	int i;
+	int ret = 0;
+
+	if( ! index->complete ) {
+		return -EINVAL;
+	}
+	if( ( tmppath = malloc( strlen( path ) + 5 ) ) == NULL ) {
+		return -ENOMEM;
+	}
+	sprintf( tmppath, "%s.tmp", path );
+	if( ( fh = fopen( tmppath, "wb" ) ) == NULL ) {
+		ret = 0 - errno;
+		free( tmppath );
+		return ret;
+	}
+	header[0] = size;
+	header[1] = mtime;
+	header[2] = index->span;
+	if( fwrite( GZ_MAGIC, 8, 1, fh ) != 1
+			|| fwrite( header, sizeof( header ), 1, fh ) != 1
+			|| fwrite( &have, sizeof( have ), 1, fh ) != 1 )
+	{
+		ret = -EIO;
+	}
+	for( i = 0; i < have && ret == 0; i++ ) {
+		const gzpoint_t *point = index->list + i;
+		int64_t offsets[2];
+		int32_t bits = point->bits;
+		offsets[0] = point->out;
+		offsets[1] = point->in;
+		if( fwrite( offsets, sizeof( offsets ), 1, fh ) != 1
+				|| fwrite( &bits, sizeof( bits ), 1, fh ) != 1
+				|| fwrite( point->window, GZ_WINSIZE, 1, fh ) != 1 )
+		{
+			ret = -EIO;
+		}
+	}
+	if( fclose( fh ) != 0 && ret == 0 ) {
+		ret = 0 - errno;
+	}
+	if( ret == 0 && rename( tmppath, path ) != 0 ) {
+		ret = 0 - errno;
+	}
+	if( ret != 0 ) {
+		unlink( tmppath );
+	}
+	free( tmppath );
+	return ret;
+}
+
+gzreader_t *
+gzreader_new( int fd, gzindex_t *index )
+{
+	gzreader_t *reader;
+
+	if( ( reader = malloc( sizeof( gzreader_t ) ) ) == NULL ) {
+		return NULL;
+	}
+	reader->fd = fd;
+	reader->index = index;
+	reader->initialized = 0;
+	memset( reader->window, 0, GZ_WINSIZE );
+	if( restart( reader, NULL ) != 0 ) {
+		gzreader_free( reader );
+		return NULL;
+	}
+	return reader;
+}
+
+void
+gzreader_free( gzreader_t *reader )
+{
+	if( reader->initialized ) {
+		inflateEnd( &reader->strm );
+	}
+	free( reader );
+}
+
+/*
+ * reads up to len bytes of uncompressed data
+ * @return number of bytes read, 0 at the end of the file, 0-errno else
+ */
+ssize_t
+gzreader_read( gzreader_t *reader, void *buf, size_t len )
+{
+	size_t done = 0;
+
+	while( done < len ) {
+		if( reader->pos < reader->out ) {
+			size_t wpos = reader->pos % GZ_WINSIZE;
+			size_t n = len - done;
+			if( n > ( size_t )( reader->out - reader->pos ) ) {
+				n = reader->out - reader->pos;
+			}
+			if( n > GZ_WINSIZE - wpos ) {
+				n = GZ_WINSIZE - wpos;
+			}
+			memcpy( ( char * )buf + done, reader->window + wpos, n );
+			reader->pos += n;
+			done += n;
+		} else {
+			ssize_t ret = inflate_more( reader );
+			if( ret < 0 ) {
+				return done ? ( ssize_t )done : ret;
+			}
+			if( ret == 0 ) {
+				break;
+			}
+		}
+	}
+	return done;
+}
+
+/*
+ * positions the reader at offset of the uncompressed data, restarting from
+ * the nearest checkpoint when that is closer than the current position
+ * @return 0 on success (also when offset is beyond the end), 0-errno else
+ */
+int
+gzreader_seek( gzreader_t *reader, off_t offset )
+{
+	const gzpoint_t *point = find_point( reader->index, offset );
+	int ret;
+
+	if( offset < reader->pos
+			|| ( point && point->out > reader->out ) )
+	{
+		if( ( ret = restart( reader, point ) ) != 0 ) {
+			return ret;
+		}
+	}
+	while( reader->pos < offset ) {
+		if( reader->pos < reader->out ) {
+			off_t n = reader->out - reader->pos;
+			reader->pos += n < offset - reader->pos ?
+				n : offset - reader->pos;
+		} else {
+			ssize_t len = inflate_more( reader );
+			if( len < 0 ) {
+				return len;
+			}
+			if( len == 0 ) {
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+off_t
+gzreader_tell( const gzreader_t *reader )
+{
+	return reader->pos;
+}
@@ -0,0 +1,55 @@
+/*
+ *  gzindex.h
+ *  ArchiveFS
+ *
+ *  Random access into gzip compressed archives. While the archive is read
+ *  for the first time the inflate state is saved every "span" bytes of
+ *  uncompressed output; later reads resume decompression from the nearest
+ *  of these checkpoints instead of from the start of the file. Follows
+ *  the approach of zran.c from the zlib distribution.
+ *
+ */
+
+#include <sys/types.h>
+
+#define GZ_WINSIZE 32768 /* deflate window size */
+
+/*******************/
+/* data structures */
+/*******************/
+
+typedef struct gzpoint {
+	off_t out; /* offset in the uncompressed data */
+	off_t in; /* offset in the compressed file of the first full byte */
+	int bits; /* number of bits (1-7) of the byte before "in" to use */
+	unsigned char window[GZ_WINSIZE]; /* uncompressed data before "out" */
+} gzpoint_t;
+
+typedef struct gzindex {
+	off_t span; /* minimum uncompressed distance between checkpoints */
+	int have; /* number of checkpoints in list */
+	int size; /* number of checkpoints allocated in list */
+	int complete; /* true once indexing has finished, no checkpoints are
+			 added to a complete index */
+	gzpoint_t *list; /* checkpoints, ordered by out */
+} gzindex_t;
+
+typedef struct gzreader gzreader_t;
+
+/*************/
+/* functions */
+/*************/
+
+/* index handling */
+gzindex_t *gzindex_new( off_t span );
+void gzindex_free( gzindex_t *index );
+gzindex_t *gzindex_load( const char *path, off_t size, time_t mtime );
+int gzindex_save( const gzindex_t *index, const char *path, off_t size,
+		time_t mtime );
+
+/* decompression; a reader on an incomplete index extends it as it goes */
+gzreader_t *gzreader_new( int fd, gzindex_t *index );
+void gzreader_free( gzreader_t *reader );
+ssize_t gzreader_read( gzreader_t *reader, void *buf, size_t len );
+int gzreader_seek( gzreader_t *reader, off_t offset );
+off_t gzreader_tell( const gzreader_t *reader );
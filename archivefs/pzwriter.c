@@ -0,0 +1,438 @@
+/*
+ *  pzwriter.c
+ *  ArchiveFS
+ *
+ *  Parallel gzip and bzip2 compression, see pzwriter.h.
+ *
+ */
+
+#include "pzwriter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <bzlib.h>
+
+#define PZ_GZIP_BLOCK ( 128 * 1024 ) /* input per block, as pigz */
+#define PZ_BZIP2_BLOCK 900000 /* input per stream, one bzip2 -9 block */
+#define PZ_DICT 32768 /* deflate window carried into the next block */
+#define PZ_QUEUE 2 /* blocks in flight per worker */
+
+/* one block of input and its compressed form */
+struct pzjob {
+	struct pzjob *next; /* next job waiting for a worker */
+	struct pzjob *after; /* next job to be written */
+	unsigned char *in;
+	size_t inlen;
+	unsigned char dict[PZ_DICT]; /* input before this block, gzip only */
+	size_t dictlen;
+	int last; /* true for the block ending the gzip member */
+	unsigned char *out;
+	size_t outlen;
+	unsigned long crc; /* crc32 of in, gzip only */
+	int done; /* true once a worker has compressed the block */
+	int error; /* 0-errno if compression failed */
+};
+
+struct pzwriter {
+	int fd;
+	int type; /* PZ_GZIP or PZ_BZIP2 */
+	size_t blocksize;
+	int error; /* first error, reported by all later calls */
+	pthread_t *threads;
+	int nthreads; /* workers running, 0 compresses in the caller */
+	pthread_mutex_t lock; /* protects queue, stop and done of all jobs */
+	pthread_cond_t work; /* signalled when a job was queued */
+	pthread_cond_t done; /* signalled when a job was compressed */
+	int stop; /* asks the workers to quit */
+	struct pzjob *queue; /* jobs waiting for a worker */
+	struct pzjob *queuetail;
+	struct pzjob *pending; /* jobs not written yet, in input order */
+	struct pzjob *pendingtail;
+	int inflight; /* number of jobs in pending */
+	struct pzjob *cur; /* block being filled by pzwriter_write() */
+	unsigned char tail[PZ_DICT]; /* end of the input submitted so far */
+	size_t taillen;
+	unsigned long crc; /* crc32 of the input written out */
+	off_t total; /* amount of input written out */
+};
+
+  /**********************/
+ /* internal functions */
+/**********************/
+
+static int
+write_all( int fd, const unsigned char *buf, size_t len )
+{
+	while( len ) {
+		ssize_t n = write( fd, buf, len );
+		if( n == -1 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			return 0 - errno;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void
+compress_gzip( struct pzjob *job )
+{
+	z_stream strm;
+	size_t bound;
+	int ret;
+
+	memset( &strm, 0, sizeof( strm ) );
+	if( deflateInit2( &strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+				Z_DEFAULT_STRATEGY ) != Z_OK ) {
+		job->error = -ENOMEM;
+		return;
+	}
+	if( job->dictlen ) {
+		deflateSetDictionary( &strm, job->dict, job->dictlen );
+	}
+	/* room for the empty stored block of the sync flush */
+	bound = deflateBound( &strm, job->inlen ) + 16;
+	if( ( job->out = malloc( bound ) ) == NULL ) {
+		deflateEnd( &strm );
+		job->error = -ENOMEM;
+		return;
+	}
+	strm.next_in = job->in;
+	strm.avail_in = job->inlen;
+	strm.next_out = job->out;
+	strm.avail_out = bound;
+	/* a sync flush ends the block on a byte boundary, so the next one
+	   can simply be appended */
+	ret = deflate( &strm, job->last ? Z_FINISH : Z_SYNC_FLUSH );
+	if( ret != ( job->last ? Z_STREAM_END : Z_OK ) || strm.avail_in ) {
+		job->error = -EIO;
+	}
+	job->outlen = bound - strm.avail_out;
+	deflateEnd( &strm );
+	job->crc = crc32( crc32( 0L, Z_NULL, 0 ), job->in, job->inlen );
+}
+
+static void
+compress_bzip2( struct pzjob *job )
+{
+	unsigned int bound = job->inlen + job->inlen / 100 + 600;
+
+	if( ( job->out = malloc( bound ) ) == NULL ) {
+		job->error = -ENOMEM;
+		return;
+	}
+	if( BZ2_bzBuffToBuffCompress( ( char * )job->out, &bound,
+				( char * )job->in, job->inlen, 9, 0, 30 ) != BZ_OK ) {
+		job->error = -EIO;
+		return;
+	}
+	job->outlen = bound;
+}
+
+static void
+compress_job( pzwriter_t *writer, struct pzjob *job )
+{
+	if( writer->type == PZ_GZIP ) {
+		compress_gzip( job );
+	} else {
+		compress_bzip2( job );
+	}
+}
+
+static void *
+worker_thread( void *arg )
+{
+	pzwriter_t *writer = arg;
+	struct pzjob *job;
+
+	for( ;; ) {
+		pthread_mutex_lock( &writer->lock );
+		while( ! writer->queue && ! writer->stop ) {
+			pthread_cond_wait( &writer->work, &writer->lock );
+		}
+		if( ! writer->queue ) {
+			pthread_mutex_unlock( &writer->lock );
+			return NULL;
+		}
+		job = writer->queue;
+		if( ( writer->queue = job->next ) == NULL ) {
+			writer->queuetail = NULL;
+		}
+		pthread_mutex_unlock( &writer->lock );
+
+		compress_job( writer, job );
+
+		pthread_mutex_lock( &writer->lock );
+		job->done = 1;
+		pthread_cond_broadcast( &writer->done );
+		pthread_mutex_unlock( &writer->lock );
+	}
+}
+
+static void
+free_job( struct pzjob *job )
+{
+	free( job->in );
+	free( job->out );
+	free( job );
+}
+
+static struct pzjob *
+new_job( pzwriter_t *writer )
+{
+	struct pzjob *job;
+
+	if( ( job = calloc( 1, sizeof( struct pzjob ) ) ) == NULL ) {
+		return NULL;
+	}
+	if( ( job->in = malloc( writer->blocksize ) ) == NULL ) {
+		free( job );
+		return NULL;
+	}
+	return job;
+}
+
+/*
+ * writes the compressed jobs at the head of pending, waiting for more while
+ * over keep jobs are in flight
+ */
+static int
+write_jobs( pzwriter_t *writer, int keep )
+{
+	struct pzjob *job;
+	int ret;
+
+	for( ;; ) {
+		pthread_mutex_lock( &writer->lock );
+		job = writer->pending;
+		if( ! job || ( ! job->done && writer->inflight <= keep ) ) {
+			pthread_mutex_unlock( &writer->lock );
+			return writer->error;
+		}
+		while( ! job->done ) {
+			pthread_cond_wait( &writer->done, &writer->lock );
+		}
+		if( ( writer->pending = job->after ) == NULL ) {
+			writer->pendingtail = NULL;
+		}
+		writer->inflight--;
+		pthread_mutex_unlock( &writer->lock );
+
+		if( writer->error == 0 ) {
+			if( job->error ) {
+				writer->error = job->error;
+			} else if( ( ret = write_all( writer->fd, job->out,
+						job->outlen ) ) != 0 ) {
+				writer->error = ret;
+			} else if( writer->type == PZ_GZIP ) {
+				writer->crc = crc32_combine( writer->crc, job->crc,
+						job->inlen );
+			}
+			writer->total += job->inlen;
+		}
+		free_job( job );
+	}
+}
+
+/* hands the current block to the workers */
+static int
+submit( pzwriter_t *writer, int last )
+{
+	struct pzjob *job = writer->cur;
+
+	writer->cur = NULL;
+	job->last = last;
+	if( writer->type == PZ_GZIP ) {
+		/* prime the block with the input before it */
+		memcpy( job->dict, writer->tail, writer->taillen );
+		job->dictlen = writer->taillen;
+		if( job->inlen >= PZ_DICT ) {
+			memcpy( writer->tail, job->in + job->inlen - PZ_DICT,
+					PZ_DICT );
+			writer->taillen = PZ_DICT;
+		} else {
+			size_t keep = PZ_DICT - job->inlen;
+			if( keep > writer->taillen ) {
+				keep = writer->taillen;
+			}
+			memmove( writer->tail, writer->tail + writer->taillen - keep,
+					keep );
+			memcpy( writer->tail + keep, job->in, job->inlen );
+			writer->taillen = keep + job->inlen;
+		}
+	}
+	pthread_mutex_lock( &writer->lock );
+	if( writer->pendingtail ) {
+		writer->pendingtail->after = job;
+	} else {
+		writer->pending = job;
+	}
+	writer->pendingtail = job;
+	writer->inflight++;
+	if( writer->nthreads ) {
+		if( writer->queuetail ) {
+			writer->queuetail->next = job;
+		} else {
+			writer->queue = job;
+		}
+		writer->queuetail = job;
+		pthread_cond_signal( &writer->work );
+	}
+	pthread_mutex_unlock( &writer->lock );
+	if( ! writer->nthreads ) {
+		compress_job( writer, job );
+		job->done = 1;
+	}
+	/* bound the memory held by blocks in flight */
+	return write_jobs( writer, PZ_QUEUE * ( writer->nthreads + 1 ) );
+}
+
+static void
+stop_workers( pzwriter_t *writer )
+{
+	int i;
+
+	pthread_mutex_lock( &writer->lock );
+	writer->stop = 1;
+	pthread_cond_broadcast( &writer->work );
+	pthread_mutex_unlock( &writer->lock );
+	for( i = 0; i < writer->nthreads; i++ ) {
+		pthread_join( writer->threads[i], NULL );
+	}
+}
+
+  /*****************/
+ /* API functions */
+/*****************/
+
+pzwriter_t *
+pzwriter_new( int fd, int type, int threads )
+{
+	static const unsigned char header[10] = {
+		0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 /* unix */
+	};
+	pzwriter_t *writer;
+
+	if( ( writer = calloc( 1, sizeof( pzwriter_t ) ) ) == NULL ) {
+		return NULL;
+	}
+	writer->fd = fd;
+	writer->type = type;
+	writer->blocksize = type == PZ_GZIP ? PZ_GZIP_BLOCK : PZ_BZIP2_BLOCK;
+	writer->crc = crc32( 0L, Z_NULL, 0 );
+	if( threads <= 0 ) {
+		threads = sysconf( _SC_NPROCESSORS_ONLN );
+		if( threads <= 0 ) {
+			threads = 1;
+		}
+	}
+	if( ( writer->cur = new_job( writer ) ) == NULL
+			|| ( writer->threads = malloc( threads *
+					sizeof( pthread_t ) ) ) == NULL ) {
+		if( writer->cur ) {
+			free_job( writer->cur );
+		}
+		free( writer );
+		return NULL;
+	}
+	if( type == PZ_GZIP
+			&& ( writer->error = write_all( fd, header,
+					sizeof( header ) ) ) != 0 ) {
+		free_job( writer->cur );
+		free( writer->threads );
+		free( writer );
+		return NULL;
+	}
+	pthread_mutex_init( &writer->lock, NULL );
+	pthread_cond_init( &writer->work, NULL );
+	pthread_cond_init( &writer->done, NULL );
+	/* if no worker can be started, the caller compresses */
+	while( writer->nthreads < threads
+			&& pthread_create( &writer->threads[writer->nthreads], NULL,
+				worker_thread, writer ) == 0 ) {
+		writer->nthreads++;
+	}
+	return writer;
+}
+
+/*
+ * @return len, or 0-errno if compressing or writing failed
+ */
+ssize_t
+pzwriter_write( pzwriter_t *writer, const void *buf, size_t len )
+{
+	const unsigned char *in = buf;
+	size_t left = len;
+
+	while( left && writer->error == 0 ) {
+		size_t n;
+		if( writer->cur == NULL
+				&& ( writer->cur = new_job( writer ) ) == NULL ) {
+			writer->error = -ENOMEM;
+			break;
+		}
+		n = writer->blocksize - writer->cur->inlen;
+		if( n > left ) {
+			n = left;
+		}
+		memcpy( writer->cur->in + writer->cur->inlen, in, n );
+		writer->cur->inlen += n;
+		in += n;
+		left -= n;
+		if( writer->cur->inlen == writer->blocksize ) {
+			submit( writer, 0 );
+		}
+	}
+	return writer->error ? writer->error : ( ssize_t )len;
+}
+
+/*
+ * compresses what is left, writes the gzip trailer and frees writer
+ * @return 0, or 0-errno if anything failed since pzwriter_new()
+ */
+int
+pzwriter_close( pzwriter_t *writer )
+{
+	unsigned char trailer[8];
+	int ret;
+	int i;
+
+	if( writer->cur == NULL && writer->error == 0
+			&& ( writer->cur = new_job( writer ) ) == NULL ) {
+		writer->error = -ENOMEM;
+	}
+	/* gzip always ends with a final block, bzip2 needs one stream */
+	if( writer->cur && writer->error == 0
+			&& ( writer->type == PZ_GZIP || writer->cur->inlen
+				|| writer->total + writer->inflight == 0 ) ) {
+		submit( writer, 1 );
+	}
+	write_jobs( writer, -1 );
+	stop_workers( writer );
+	if( writer->type == PZ_GZIP && writer->error == 0 ) {
+		for( i = 0; i < 4; i++ ) {
+			trailer[i] = ( writer->crc >> ( 8 * i ) ) & 0xff;
+			trailer[4 + i] = ( writer->total >> ( 8 * i ) ) & 0xff;
+		}
+		writer->error = write_all( writer->fd, trailer,
+				sizeof( trailer ) );
+	}
+	ret = writer->error;
+	if( writer->cur ) {
+		free_job( writer->cur );
+	}
+	pthread_mutex_destroy( &writer->lock );
+	pthread_cond_destroy( &writer->work );
+	pthread_cond_destroy( &writer->done );
+	free( writer->threads );
+	free( writer );
+	return ret;
+}
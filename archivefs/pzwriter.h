@@ -0,0 +1,28 @@
+/*
+ *  pzwriter.h
+ *  ArchiveFS
+ *
+ *  Compresses a stream on several threads, in the manner of pigz and
+ *  pbzip2. The input is cut into blocks which a pool of workers compresses
+ *  independently; the results are written in order. gzip output is a single
+ *  member, each block primed with the last 32K of the one before, bzip2
+ *  output is a sequence of complete streams. Both are read by the standard
+ *  decompressors.
+ *
+ */
+
+#include <sys/types.h>
+
+#define PZ_GZIP 1
+#define PZ_BZIP2 2
+
+typedef struct pzwriter pzwriter_t;
+
+/*************/
+/* functions */
+/*************/
+
+/* threads 0 means one per processor */
+pzwriter_t *pzwriter_new( int fd, int type, int threads );
+ssize_t pzwriter_write( pzwriter_t *writer, const void *buf, size_t len );
+int pzwriter_close( pzwriter_t *writer );
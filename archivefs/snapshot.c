@@ -0,0 +1,323 @@
+/*
+ *  snapshot.c
+ *  ArchiveFS
+ *
+ *  Tree snapshots of mounted archives, see snapshot.h.
+ *
+ */
+
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#define SNAP_MAGIC "AVSNAP01" /* sidecar file format identifier */
+
+/* the start of the file; records and strings follow */
+struct snapheader {
+	char magic[8];
+	int64_t dev; /* the archive */
+	int64_t ino;
+	int64_t size;
+	int64_t mtime;
+	int64_t flags; /* the caller's, must match on load */
+	int64_t recordsize; /* sizeof( snapnode_t ) */
+	int64_t count; /* number of records */
+	int64_t stringsize; /* bytes in the string table */
+};
+
+/* a string added to a writer */
+struct snapstring {
+	const char *s;
+	int64_t offset;
+};
+
+struct snapwriter {
+	snapnode_t *nodes;
+	int64_t count;
+	int64_t size; /* number of records allocated in nodes */
+	char *strings;
+	int64_t stringsize;
+	int64_t stringalloc; /* bytes allocated in strings */
+	struct snapstring *added; /* hash set of the added pointers */
+	size_t addedsize; /* number of slots in added */
+	size_t addedcount;
+	int error; /* 0-errno of the first failed add, else 0 */
+};
+
+  /**********************/
+ /* internal functions */
+/**********************/
+
+static size_t
+pointer_hash( const char *s )
+{
+	size_t h = ( size_t )s;
+
+	/* the low bits of heap pointers vary little */
+	h ^= h >> 17;
+	h *= 0x9E3779B1U;
+	return h ^ ( h >> 15 );
+}
+
+static int
+added_grow( snapwriter_t *writer )
+{
+	size_t size = writer->addedsize ? writer->addedsize * 2 : 4096;
+	struct snapstring *added = calloc( size, sizeof( struct snapstring ) );
+	size_t i;
+
+	if( added == NULL ) {
+		return -ENOMEM;
+	}
+	for( i = 0; i < writer->addedsize; i++ ) {
+		if( writer->added[i].s ) {
+			size_t slot = pointer_hash( writer->added[i].s ) &
+				( size - 1 );
+			while( added[slot].s ) {
+				slot = ( slot + 1 ) & ( size - 1 );
+			}
+			added[slot] = writer->added[i];
+		}
+	}
+	free( writer->added );
+	writer->added = added;
+	writer->addedsize = size;
+	return 0;
+}
+
+/*
+ * checks that all records of snapshot refer to earlier records and to
+ * strings inside the table
+ */
+static int
+snapshot_valid( const snapshot_t *snapshot )
+{
+	int64_t i;
+
+	if( snapshot->stringsize > 0
+			&& snapshot->strings[snapshot->stringsize - 1] != '\0' ) {
+		return 0;
+	}
+	for( i = 0; i < snapshot->count; i++ ) {
+		const snapnode_t *node = snapshot->nodes + i;
+		if( node->parent < -1 || node->parent >= i
+				|| node->name < 0
+				|| node->name >= snapshot->stringsize
+				|| node->hardlink < -1
+				|| node->hardlink >= snapshot->stringsize
+				|| node->symlink < -1
+				|| node->symlink >= snapshot->stringsize ) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+  /*****************/
+ /* API functions */
+/*****************/
+
+snapshot_t *
+snapshot_load( const char *path, const struct stat *archive, int64_t flags )
+{
+	struct snapheader header;
+	struct stat st;
+	snapshot_t *snapshot;
+	void *map;
+	int fd;
+
+	if( ( fd = open( path, O_RDONLY ) ) == -1 ) {
+		return NULL;
+	}
+	if( fstat( fd, &st ) == -1
+			|| st.st_size < ( off_t )sizeof( header )
+			|| pread( fd, &header, sizeof( header ), 0 )
+				!= sizeof( header )
+			|| memcmp( header.magic, SNAP_MAGIC, 8 ) != 0
+			|| header.dev != ( int64_t )archive->st_dev
+			|| header.ino != ( int64_t )archive->st_ino
+			|| header.size != ( int64_t )archive->st_size
+			|| header.mtime != ( int64_t )archive->st_mtime
+			|| header.flags != flags
+			|| header.recordsize != sizeof( snapnode_t )
+			|| header.count < 0 || header.stringsize < 0
+			|| header.count > ( st.st_size - ( off_t )sizeof( header ) )
+				/ ( off_t )sizeof( snapnode_t )
+			|| ( off_t )sizeof( header ) + header.count *
+				( off_t )sizeof( snapnode_t ) + header.stringsize
+				!= st.st_size ) {
+		close( fd );
+		return NULL;
+	}
+	map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	/* the mapping keeps the data */
+	close( fd );
+	if( map == MAP_FAILED ) {
+		return NULL;
+	}
+	if( ( snapshot = malloc( sizeof( snapshot_t ) ) ) == NULL ) {
+		munmap( map, st.st_size );
+		return NULL;
+	}
+	snapshot->map = map;
+	snapshot->maplen = st.st_size;
+	snapshot->nodes = ( const snapnode_t * )( ( char * )map +
+			sizeof( header ) );
+	snapshot->count = header.count;
+	snapshot->strings = ( const char * )( snapshot->nodes + header.count );
+	snapshot->stringsize = header.stringsize;
+	if( ! snapshot_valid( snapshot ) ) {
+		snapshot_free( snapshot );
+		return NULL;
+	}
+	return snapshot;
+}
+
+void
+snapshot_free( snapshot_t *snapshot )
+{
+	if( snapshot ) {
+		munmap( snapshot->map, snapshot->maplen );
+		free( snapshot );
+	}
+}
+
+snapwriter_t *
+snapshot_writer_new( void )
+{
+	return calloc( 1, sizeof( snapwriter_t ) );
+}
+
+void
+snapshot_writer_free( snapwriter_t *writer )
+{
+	if( writer ) {
+		free( writer->nodes );
+		free( writer->strings );
+		free( writer->added );
+		free( writer );
+	}
+}
+
+int64_t
+snapshot_add_string( snapwriter_t *writer, const char *s )
+{
+	size_t len;
+	size_t slot;
+
+	if( ! s || writer->error ) {
+		return -1;
+	}
+	if( writer->addedcount * 2 >= writer->addedsize
+			&& ( writer->error = added_grow( writer ) ) != 0 ) {
+		return -1;
+	}
+	slot = pointer_hash( s ) & ( writer->addedsize - 1 );
+	while( writer->added[slot].s ) {
+		if( writer->added[slot].s == s ) {
+			return writer->added[slot].offset;
+		}
+		slot = ( slot + 1 ) & ( writer->addedsize - 1 );
+	}
+	len = strlen( s ) + 1;
+	if( writer->stringsize + ( int64_t )len > writer->stringalloc ) {
+		int64_t size = writer->stringalloc ? writer->stringalloc * 2 :
+			65536;
+		char *strings;
+		while( size < writer->stringsize + ( int64_t )len ) {
+			size *= 2;
+		}
+		if( ( strings = realloc( writer->strings, size ) ) == NULL ) {
+			writer->error = -ENOMEM;
+			return -1;
+		}
+		writer->strings = strings;
+		writer->stringalloc = size;
+	}
+	memcpy( writer->strings + writer->stringsize, s, len );
+	writer->added[slot].s = s;
+	writer->added[slot].offset = writer->stringsize;
+	writer->addedcount++;
+	writer->stringsize += len;
+	return writer->added[slot].offset;
+}
+
+int64_t
+snapshot_add_node( snapwriter_t *writer, const snapnode_t *node )
+{
+	if( writer->error ) {
+		return -1;
+	}
+	if( writer->count == writer->size ) {
+		int64_t size = writer->size ? writer->size * 2 : 1024;
+		snapnode_t *nodes = realloc( writer->nodes,
+				size * sizeof( snapnode_t ) );
+		if( nodes == NULL ) {
+			writer->error = -ENOMEM;
+			return -1;
+		}
+		writer->nodes = nodes;
+		writer->size = size;
+	}
+	writer->nodes[writer->count] = *node;
+	return writer->count++;
+}
+
+int
+snapshot_save( snapwriter_t *writer, const char *path,
+		const struct stat *archive, int64_t flags )
+{
+	struct snapheader header;
+	FILE *fh;
+	char *tmppath;
+	int ret = 0;
+
+	if( writer->error ) {
+		return writer->error;
+	}
+	if( ( tmppath = malloc( strlen( path ) + 5 ) ) == NULL ) {
+		return -ENOMEM;
+	}
+	sprintf( tmppath, "%s.tmp", path );
+	if( ( fh = fopen( tmppath, "wb" ) ) == NULL ) {
+		ret = 0 - errno;
+		free( tmppath );
+		return ret;
+	}
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, SNAP_MAGIC, 8 );
+	header.dev = archive->st_dev;
+	header.ino = archive->st_ino;
+	header.size = archive->st_size;
+	header.mtime = archive->st_mtime;
+	header.flags = flags;
+	header.recordsize = sizeof( snapnode_t );
+	header.count = writer->count;
+	header.stringsize = writer->stringsize;
+	if( fwrite( &header, sizeof( header ), 1, fh ) != 1
+			|| ( writer->count && fwrite( writer->nodes,
+					sizeof( snapnode_t ), writer->count,
+					fh ) != ( size_t )writer->count )
+			|| ( writer->stringsize && fwrite( writer->strings,
+					writer->stringsize, 1, fh ) != 1 ) )
+	{
+		ret = -EIO;
+	}
+	if( fclose( fh ) != 0 && ret == 0 ) {
+		ret = 0 - errno;
+	}
+	if( ret == 0 && rename( tmppath, path ) != 0 ) {
+		ret = 0 - errno;
+	}
+	if( ret != 0 ) {
+		unlink( tmppath );
+	}
+	free( tmppath );
+	return ret;
+}
@@ -0,0 +1,80 @@
+/*
+ *  snapshot.h
+ *  ArchiveFS
+ *
+ *  Snapshot of the node tree of a mounted archive, saved next to it so the
+ *  next mount of the unchanged archive does not have to read all of its
+ *  headers again. The file holds a flat array of node records, parents
+ *  before their children, followed by a table of the strings they refer
+ *  to. It is tagged with the device, inode, size and modification time of
+ *  the archive and is mapped into memory as a whole when loaded.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+/*******************/
+/* data structures */
+/*******************/
+
+/* one node, in host byte order; strings are offsets into the string
+   table, -1 for none */
+typedef struct snapnode {
+	int64_t parent; /* index of the parent record, -1 for the root */
+	int64_t name;
+	int64_t hardlink;
+	int64_t symlink;
+	int64_t size;
+	int64_t ino;
+	int64_t atime;
+	int64_t mtime;
+	int64_t ctime;
+	int64_t atimensec;
+	int64_t mtimensec;
+	int64_t ctimensec;
+	int64_t dev;
+	int64_t rdev;
+	int64_t dataoffset;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t nlink;
+} snapnode_t;
+
+typedef struct snapshot {
+	void *map; /* the mapped file */
+	size_t maplen;
+	const snapnode_t *nodes; /* parents come before their children */
+	int64_t count; /* number of records in nodes */
+	const char *strings; /* NUL terminated strings, valid while mapped */
+	int64_t stringsize;
+} snapshot_t;
+
+typedef struct snapwriter snapwriter_t;
+
+/*************/
+/* functions */
+/*************/
+
+/* maps the snapshot at path if it was taken of the archive with the given
+   stat and with the same flags
+   @return the snapshot, NULL if there is no matching one at path */
+snapshot_t *snapshot_load( const char *path, const struct stat *archive,
+		int64_t flags );
+/* unmaps the snapshot, the strings in it become invalid */
+void snapshot_free( snapshot_t *snapshot );
+
+/* writing; the adds record failures, which snapshot_save() reports */
+snapwriter_t *snapshot_writer_new( void );
+void snapshot_writer_free( snapwriter_t *writer );
+/* adds s unless the same pointer was added before, so interned strings
+   are stored once
+   @return the offset of s in the string table, -1 for NULL or on errors */
+int64_t snapshot_add_string( snapwriter_t *writer, const char *s );
+/* @return the index of the record, -1 on errors */
+int64_t snapshot_add_node( snapwriter_t *writer, const snapnode_t *node );
+/* @return 0 on success, 0-errno else */
+int snapshot_save( snapwriter_t *writer, const char *path,
+		const struct stat *archive, int64_t flags );